@@ -0,0 +1,70 @@
+#pragma once
+
+#include <stdint.h>
+
+// Атомарные операции для обмена данными между потоками процессоров (ядер)
+// get - чтение с захватом (acquire), set - запись с освобождением (release),
+// cas - сравнение с обменом, возвращает 1, если значение было равно old и заменено,
+// fence - полный барьер памяти (для обмена с гостем через общую память)
+
+#if defined(__GNUC__)
+
+#define atomic_get(p)				__atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define atomic_set(p, v)			__atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#define atomic_fence()				__atomic_thread_fence(__ATOMIC_SEQ_CST)
+
+static int atomic_cas(volatile int* p, int old, int value)
+{
+	return __atomic_compare_exchange_n(p, &old, value, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+}
+
+// Операции инструкций AMO: возвращают прежнее значение в памяти.
+// В *old возвращается текущее значение, если сравнение с обменом не удалось
+#define ATOMIC_OPS(bits) \
+static int##bits##_t atomic_add##bits(volatile int##bits##_t* p, int##bits##_t v) { return __atomic_fetch_add(p, v, __ATOMIC_SEQ_CST); } \
+static int##bits##_t atomic_and##bits(volatile int##bits##_t* p, int##bits##_t v) { return __atomic_fetch_and(p, v, __ATOMIC_SEQ_CST); } \
+static int##bits##_t atomic_or##bits(volatile int##bits##_t* p, int##bits##_t v) { return __atomic_fetch_or(p, v, __ATOMIC_SEQ_CST); } \
+static int##bits##_t atomic_xor##bits(volatile int##bits##_t* p, int##bits##_t v) { return __atomic_fetch_xor(p, v, __ATOMIC_SEQ_CST); } \
+static int##bits##_t atomic_swap##bits(volatile int##bits##_t* p, int##bits##_t v) { return __atomic_exchange_n(p, v, __ATOMIC_SEQ_CST); } \
+static int atomic_cas##bits(volatile int##bits##_t* p, int##bits##_t* old, int##bits##_t v) \
+{ return __atomic_compare_exchange_n(p, old, v, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST); }
+
+#elif defined(_MSC_VER)
+
+#include <intrin.h>
+
+// На x86 обычные чтение и запись volatile переменной уже имеют нужный порядок
+#define atomic_get(p)				(*(volatile int*)(p))
+#define atomic_set(p, v)			(_ReadWriteBarrier(), *(volatile int*)(p) = (v))
+#define atomic_fence()				_mm_mfence()
+
+static int atomic_cas(volatile int* p, int old, int value)
+{
+	return _InterlockedCompareExchange((volatile long*)p, value, old) == old;
+}
+
+// Операции инструкций AMO: возвращают прежнее значение в памяти.
+// В *old возвращается текущее значение, если сравнение с обменом не удалось
+#define ATOMIC_OPS_MSVC(bits, type, sfx) \
+static int##bits##_t atomic_add##bits(volatile int##bits##_t* p, int##bits##_t v) { return _InterlockedExchangeAdd##sfx((volatile type*)p, v); } \
+static int##bits##_t atomic_and##bits(volatile int##bits##_t* p, int##bits##_t v) { return _InterlockedAnd##sfx((volatile type*)p, v); } \
+static int##bits##_t atomic_or##bits(volatile int##bits##_t* p, int##bits##_t v) { return _InterlockedOr##sfx((volatile type*)p, v); } \
+static int##bits##_t atomic_xor##bits(volatile int##bits##_t* p, int##bits##_t v) { return _InterlockedXor##sfx((volatile type*)p, v); } \
+static int##bits##_t atomic_swap##bits(volatile int##bits##_t* p, int##bits##_t v) { return _InterlockedExchange##sfx((volatile type*)p, v); } \
+static int atomic_cas##bits(volatile int##bits##_t* p, int##bits##_t* old, int##bits##_t v) \
+{ \
+	int##bits##_t cur = _InterlockedCompareExchange##sfx((volatile type*)p, v, *old); \
+	if (cur == *old) \
+		return 1; \
+	*old = cur; \
+	return 0; \
+}
+
+#define ATOMIC_OPS(bits)			ATOMIC_OPS_##bits
+#define ATOMIC_OPS_32				ATOMIC_OPS_MSVC(32, long, )
+#define ATOMIC_OPS_64				ATOMIC_OPS_MSVC(64, __int64, 64)
+
+#endif
+
+ATOMIC_OPS(32)
+ATOMIC_OPS(64)
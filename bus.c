@@ -1,141 +1,246 @@
 #include <stdio.h>
 #include "riscv.h"
+#include "tlb.h"
 
-// Чтение 1 байта
-int read8(riscv_t* cpu, ui addr, si* result)
+// Системная шина
+//
+// Обращения к ОЗУ выполняются через TLB: при попадании - одно сравнение и обращение
+// к памяти хоста. Всё остальное адресное пространство обслуживают устройства (MMIO),
+// их области хранятся в таблице, отсортированной по адресу. Устройство ищется
+// только после промаха TLB, когда tlb_fill сообщил физический адрес вне ОЗУ.
+// Таблица заполняется до запуска процессоров и при работе не меняется.
+
+// Максимальное количество областей устройств
+#define BUS_MAX_REGIONS				32
+
+typedef struct
+{
+	ui base;
+	ui size;
+	mmio_read_t read;
+	mmio_write_t write;
+	void* opaque;
+} bus_region_t;
+
+static bus_region_t regions[BUS_MAX_REGIONS];
+static int region_count;
+
+// Подключение устройства к шине: область [base, base + size)
+int bus_map(ui base, ui size, mmio_read_t read, mmio_write_t write, void* opaque)
 {
-	ui phys;
+	// Сравниваются последние адреса областей, т.к. область может заканчиваться
+	// в конце адресного пространства
+	ui last = base + size - 1;
+	int i, n;
 
-	// Преобразовать виртуальный адрес в физический
-	if (!virt2phys(cpu, &phys, addr, MMU_R, MMU_ACCESSED, EX_LOAD_ACCESS, EX_LOAD_PAGE_FAULT))
+	if (size == 0 || last < base || region_count >= BUS_MAX_REGIONS)
+	{
+		printf("Bus: unable to map device at 0x%llx\n", (unsigned long long)base);
 		return 0;
+	}
 
-	// Проверить, не выходим ли за границы ОЗУ
-	if ((phys - RAM_START) < RAM_SIZE)
+	// Область не должна пересекаться с ОЗУ и другими устройствами
+	if (base <= RAM_START + ram_size - 1 && last >= RAM_START)
 	{
-		// Всё ок, вернуть результат
-		*result = *((int8_t*)&cpu->ram[phys - RAM_START]);
-		return 1;
+		printf("Bus: device at 0x%llx overlaps RAM\n", (unsigned long long)base);
+		return 0;
+	}
+	for (n = 0; n < region_count && regions[n].base < base; n++)
+		;
+	if ((n > 0 && regions[n - 1].base + regions[n - 1].size - 1 >= base) ||
+		(n < region_count && last >= regions[n].base))
+	{
+		printf("Bus: device at 0x%llx overlaps another device\n", (unsigned long long)base);
+		return 0;
 	}
 
-	// Вышли за границы ОЗУ. Сюда можно добавить обращение к другим устройствам на шине
+	// Вставить с сохранением порядка
+	for (i = region_count; i > n; i--)
+		regions[i] = regions[i - 1];
+	regions[n].base = base;
+	regions[n].size = size;
+	regions[n].read = read;
+	regions[n].write = write;
+	regions[n].opaque = opaque;
+	region_count++;
+
+	return 1;
+}
+
+// Отключение всех устройств
+void bus_reset(void)
+{
+	region_count = 0;
+}
+
+// Поиск области устройства по физическому адресу (двоичный поиск)
+static bus_region_t* bus_find(ui phys)
+{
+	int lo = 0, hi = region_count - 1, mid;
+
+	while (lo <= hi)
+	{
+		mid = (lo + hi) / 2;
+		if (phys < regions[mid].base)
+			hi = mid - 1;
+		else if (phys - regions[mid].base >= regions[mid].size)
+			lo = mid + 1;
+		else
+			return &regions[mid];
+	}
+
+	return NULL;
+}
+
+// Чтение регистра устройства после промаха TLB
+static int bus_read(riscv_t* cpu, int size, si* result)
+{
+	bus_region_t* r;
+	uint64_t value = 0;
 
-	// Ни одно из устройств не обработало запрос, вернуть ошибку чтения
 	*result = 0;
-	return 0;
+
+	// Ошибка трансляции, исключение уже сгенерировано
+	if (cpu->mmio_addr == MMIO_NONE)
+		return 0;
+
+	r = bus_find(cpu->mmio_addr);
+	if (r == NULL || r->read == NULL || !r->read(cpu, r->opaque, cpu->mmio_addr - r->base, size, &value))
+		return 0;
+
+	*result = (si)value;
+	return 1;
 }
 
-int read16(riscv_t* cpu, ui addr, si* result)
+// Запись в регистр устройства после промаха TLB
+static int bus_write(riscv_t* cpu, int size, uint64_t value)
 {
-	ui phys;
+	bus_region_t* r;
 
-	if (!virt2phys(cpu, &phys, addr, MMU_R, MMU_ACCESSED, EX_LOAD_ACCESS, EX_LOAD_PAGE_FAULT))
+	if (cpu->mmio_addr == MMIO_NONE)
 		return 0;
 
-	if ((phys - RAM_START) < RAM_SIZE)
+	r = bus_find(cpu->mmio_addr);
+	if (r == NULL || r->write == NULL)
+		return 0;
+
+	return r->write(cpu, r->opaque, cpu->mmio_addr - r->base, size, value);
+}
+
+// Чтение 1 байта
+int read8(riscv_t* cpu, ui addr, si* result)
+{
+	uint8_t* p;
+
+	// Найти страницу в TLB, при промахе - преобразовать виртуальный адрес в физический
+	// Запись в TLB появляется только для страниц ОЗУ
+	p = tlb_translate(cpu, addr, TLB_READ);
+	if (p != NULL)
 	{
-		*result = *((int16_t*)&cpu->ram[phys - RAM_START]);
+		// Всё ок, вернуть результат
+		*result = *((int8_t*)p);
 		return 1;
 	}
 
-	*result = 0;
-	return 0;
+	// Ошибка трансляции или адрес вне ОЗУ: обратиться к устройству на шине.
+	// Если ни одно из устройств не обработало запрос, вернуть ошибку чтения
+	return bus_read(cpu, 1, result);
 }
 
-int read32(riscv_t* cpu, ui addr, si* result)
+int read16(riscv_t* cpu, ui addr, si* result)
 {
-	ui phys;
+	uint8_t* p;
 
-	if (!virt2phys(cpu, &phys, addr, MMU_R, MMU_ACCESSED, EX_LOAD_ACCESS, EX_LOAD_PAGE_FAULT))
-		return 0;
+	p = tlb_translate(cpu, addr, TLB_READ);
+	if (p != NULL)
+	{
+		*result = *((int16_t*)p);
+		return 1;
+	}
+
+	return bus_read(cpu, 2, result);
+}
+
+int read32(riscv_t* cpu, ui addr, si* result)
+{
+	uint8_t* p;
 
-	if ((phys - RAM_START) < RAM_SIZE)
+	p = tlb_translate(cpu, addr, TLB_READ);
+	if (p != NULL)
 	{
-		*result = *((int32_t*)&cpu->ram[phys - RAM_START]);
+		*result = *((int32_t*)p);
 		return 1;
 	}
 
-	*result = 0;
-	return 0;
+	return bus_read(cpu, 4, result);
 }
 
 int read64(riscv_t* cpu, ui addr, si* result)
 {
-	ui phys;
-
-	if (!virt2phys(cpu, &phys, addr, MMU_R, MMU_ACCESSED, EX_LOAD_ACCESS, EX_LOAD_PAGE_FAULT))
-		return 0;
+	uint8_t* p;
 
-	if ((phys - RAM_START) < RAM_SIZE)
+	p = tlb_translate(cpu, addr, TLB_READ);
+	if (p != NULL)
 	{
-		*result = *((int64_t*)&cpu->ram[phys - RAM_START]);
+		*result = *((int64_t*)p);
 		return 1;
 	}
 
-	*result = 0;
-	return 0;
+	return bus_read(cpu, 8, result);
 }
 
 int write8(riscv_t* cpu, ui addr, int8_t value)
 {
-	ui phys;
+	uint8_t* p;
 
-	if (!virt2phys(cpu, &phys, addr, MMU_W, MMU_ACCESSED | MMU_DIRTY, EX_STORE_ACCESS, EX_STORE_PAGE_FAULT))
-		return 0;
-
-	if ((phys - RAM_START) < RAM_SIZE)
+	p = tlb_translate(cpu, addr, TLB_WRITE);
+	if (p != NULL)
 	{
-		*((int8_t*)&cpu->ram[phys - RAM_START]) = value;
+		*((int8_t*)p) = value;
 		return 1;
 	}
 
-	return 0;
+	return bus_write(cpu, 1, (uint8_t)value);
 }
 
 int write16(riscv_t* cpu, ui addr, int16_t value)
 {
-	ui phys;
-
-	if (!virt2phys(cpu, &phys, addr, MMU_W, MMU_ACCESSED | MMU_DIRTY, EX_STORE_ACCESS, EX_STORE_PAGE_FAULT))
-		return 0;
+	uint8_t* p;
 
-	if ((phys - RAM_START) < RAM_SIZE)
+	p = tlb_translate(cpu, addr, TLB_WRITE);
+	if (p != NULL)
 	{
-		*((int16_t*)&cpu->ram[phys - RAM_START]) = value;
+		*((int16_t*)p) = value;
 		return 1;
 	}
 
-	return 0;
+	return bus_write(cpu, 2, (uint16_t)value);
 }
 
 int write32(riscv_t* cpu, ui addr, int32_t value)
 {
-	ui phys;
+	uint8_t* p;
 
-	if (!virt2phys(cpu, &phys, addr, MMU_W, MMU_ACCESSED | MMU_DIRTY, EX_STORE_ACCESS, EX_STORE_PAGE_FAULT))
-		return 0;
-
-	if ((phys - RAM_START) < RAM_SIZE)
+	p = tlb_translate(cpu, addr, TLB_WRITE);
+	if (p != NULL)
 	{
-		*((int32_t*)&cpu->ram[phys - RAM_START]) = value;
+		*((int32_t*)p) = value;
 		return 1;
 	}
 
-	return 0;
+	return bus_write(cpu, 4, (uint32_t)value);
 }
 
 int write64(riscv_t* cpu, ui addr, int64_t value)
 {
-	ui phys;
-
-	if (!virt2phys(cpu, &phys, addr, MMU_W, MMU_ACCESSED | MMU_DIRTY, EX_STORE_ACCESS, EX_STORE_PAGE_FAULT))
-		return 0;
+	uint8_t* p;
 
-	if ((phys - RAM_START) < RAM_SIZE)
+	p = tlb_translate(cpu, addr, TLB_WRITE);
+	if (p != NULL)
 	{
-		*((int64_t*)&cpu->ram[phys - RAM_START]) = value;
+		*((int64_t*)p) = value;
 		return 1;
 	}
 
-	return 0;
+	return bus_write(cpu, 8, (uint64_t)value);
 }
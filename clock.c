@@ -0,0 +1,151 @@
+#include "riscv.h"
+#include "platform.h"
+
+// Источник времени для счётчика mtime
+//
+// В обычном режиме mtime идёт по часам хоста (CLOCK_MONOTONIC) с частотой TIMEBASE_FREQ,
+// а количество инструкций на отрезок выполнения рассчитывается по измеренной скорости
+// эмуляции. В воспроизводимом режиме (deterministic) время считается по количеству
+// выполненных инструкций: каждый запуск даёт одинаковый результат.
+
+// Минимальная длительность отрезка для измерения скорости, нс
+#define MEASURE_MIN_NS				20000
+
+// Максимальное время ожидания в простое в тактах mtime (100 мс)
+#define IDLE_MAX					(TIMEBASE_FREQ / 10)
+
+// Время хоста, соответствующее mtime = 0 (общее для всех процессоров)
+static int64_t clock_origin;
+
+// Перевод времени хоста в такты mtime
+static int64_t host_ticks(int64_t ns)
+{
+	return ns / 1000000000ll * TIMEBASE_FREQ + ns % 1000000000ll * TIMEBASE_FREQ / 1000000000ll;
+}
+
+// Перевод тактов mtime во время хоста (с округлением вверх)
+static int64_t ticks_ns(int64_t ticks)
+{
+	return ticks / TIMEBASE_FREQ * 1000000000ll + (ticks % TIMEBASE_FREQ * 1000000000ll + TIMEBASE_FREQ - 1) / TIMEBASE_FREQ;
+}
+
+// Начало отсчёта времени машины (перед сбросом процессоров)
+void clock_init(void)
+{
+	clock_origin = host_time_ns();
+}
+
+// Сброс источника времени процессора: mtime отсчитывается от clock_init,
+// поэтому у всех процессоров время одинаковое
+void clock_reset(riscv_t* cpu)
+{
+	cpu->insn_frac = 0;
+	cpu->ips = INSTR_IN_1US * 1000000ll;
+	cpu->slice_start = host_time_ns();
+	cpu->time_offset = cpu->mtime - host_ticks(clock_origin);
+}
+
+// Гость записал новое значение mtime
+void clock_set(riscv_t* cpu)
+{
+	cpu->insn_frac = 0;
+	if (!cpu->deterministic)
+		cpu->time_offset = cpu->mtime - host_ticks(host_time_ns());
+}
+
+// Перевести mtime на текущее время хоста
+void clock_update(riscv_t* cpu)
+{
+	int64_t now;
+
+	if (cpu->deterministic)
+		return;
+
+	// Время не должно идти назад, даже если гость записал mtime
+	now = host_ticks(host_time_ns()) + cpu->time_offset;
+	if (now > cpu->mtime)
+		cpu->mtime = now;
+}
+
+// Количество инструкций, которое будет выполнено за ticks тактов mtime
+int64_t clock_budget(riscv_t* cpu, int64_t ticks)
+{
+	if (cpu->deterministic)
+		return ticks * INSTR_PER_TICK - cpu->insn_frac;
+
+	cpu->slice_start = host_time_ns();
+
+	// Не менее одного такта, чтобы не выполнять отрезки из единичных инструкций
+	if (ticks < 1)
+		ticks = 1;
+
+	return ticks * cpu->ips / TIMEBASE_FREQ;
+}
+
+// Учесть выполненные инструкции
+void clock_account(riscv_t* cpu, int executed)
+{
+	int64_t ns;
+
+	if (cpu->deterministic)
+	{
+		cpu->insn_frac += executed;
+		cpu->mtime += cpu->insn_frac / INSTR_PER_TICK;
+		cpu->insn_frac %= INSTR_PER_TICK;
+		return;
+	}
+
+	// Уточнить скорость эмуляции (скользящее среднее)
+	ns = host_time_ns() - cpu->slice_start;
+	if (ns >= MEASURE_MIN_NS && executed > 0)
+	{
+		cpu->ips += (executed * 1000000000ll / ns - cpu->ips) / 8;
+		if (cpu->ips < 1000000)
+			cpu->ips = 1000000;
+	}
+
+	clock_update(cpu);
+}
+
+// Количество тактов mtime до ближайшего события, но не больше IDLE_MAX
+static int64_t idle_ticks(riscv_t* cpu)
+{
+	int64_t next = event_next(cpu);
+
+	if (next == EVENT_NEVER || next - cpu->mtime > IDLE_MAX)
+		return IDLE_MAX;
+	return next - cpu->mtime;
+}
+
+// Процессор ждёт прерывания
+void clock_idle(riscv_t* cpu)
+{
+	int64_t ticks;
+	int64_t next;
+
+	if (cpu->deterministic)
+	{
+		next = event_next(cpu);
+		if (next == EVENT_NEVER)
+		{
+			// Событий нет: время идёт, пока хост ждёт прерывания от устройства
+			host_wait(cpu->wait, host_time_ns() + ticks_ns(IDLE_MAX), 0);
+			cpu->mtime += IDLE_MAX;
+		}
+		else if (next > cpu->mtime)
+		{
+			// Перейти сразу к ближайшему событию, не дожидаясь его
+			cpu->mtime = next;
+		}
+		cpu->insn_frac = 0;
+		return;
+	}
+
+	// Заснуть до ближайшего события или сигнала от другого процессора или устройства
+	// (ввод с консоли читает поток консоли), затем учесть точное прошедшее время
+	clock_update(cpu);
+	ticks = idle_ticks(cpu);
+	if (ticks > 0)
+		host_wait(cpu->wait, host_time_ns() + ticks_ns(ticks), 0);
+	clock_update(cpu);
+}
@@ -5,21 +5,21 @@
 // Разрядность процессора: 32 или 64 бит
 #define XLEN			64
 
-// Размер физической памяти в мегабайтах
-// В этой версии до 1 ГБ в 32 и 64 бит режимах
+// Размер физической памяти в мегабайтах по умолчанию, фактический задаётся параметром -m
 #define RAM_SIZE_MB		256
 
 // Адрес начала физической памяти (в адресном пространстве CPU)
 #define RAM_START		0x40000000u
 
+// Максимальное количество процессоров (ядер), фактическое задаётся параметром -smp
+#define MAX_HARTS		32
+
 
 // Имена файлов
 #if XLEN == 64
 #define IMAGE_FILE		"linux/Image64"
-#define DTB_FILE		"linux/64.dtb"
 #else
 #define IMAGE_FILE		"linux/Image"
-#define DTB_FILE		"linux/32.dtb"
 #endif
 
 
@@ -28,7 +28,20 @@
 
 #include <stdint.h>
 
-#define RAM_SIZE		(RAM_SIZE_MB * 1048576)
+// Максимальный размер физической памяти в мегабайтах:
+// в 32-битном режиме ОЗУ должно уместиться в 4 ГБ адресного пространства после RAM_START
+#if XLEN == 64
+#define RAM_MAX_MB		65536
+#else
+#define RAM_MAX_MB		((0x100000000ull - RAM_START) / 1048576)
+#endif
 
 // Быстродействие процессора - примерное количество инструкций за 1 мкс
+// (начальная оценка и скорость в воспроизводимом режиме)
 #define INSTR_IN_1US	100
+
+// Частота счётчика mtime, должна совпадать с timebase-frequency в linux/*.dts
+#define TIMEBASE_FREQ	1000000
+
+// Количество инструкций за один такт mtime в воспроизводимом режиме
+#define INSTR_PER_TICK	(INSTR_IN_1US * 1000000ll / TIMEBASE_FREQ)
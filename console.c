@@ -0,0 +1,373 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "platform.h"
+#include "console.h"
+
+// Размер буфера вывода
+#define CONSOLE_OUT_SIZE			4096
+// Размер кольцевого буфера ввода (степень двойки)
+#define CONSOLE_IN_SIZE				4096
+// Задержка вывода незаконченной строки, нс
+#define CONSOLE_FLUSH_NS			10000000ll
+// Интервал пробуждения потока консоли без событий, нс
+#define CONSOLE_IDLE_NS				1000000000ll
+// Префикс команд эмулятору (Ctrl-A), повторённый дважды - сам символ
+#define CONSOLE_ESCAPE				0x01
+// Строка вывода гостя с кодом завершения команды -run
+#define CONSOLE_STATUS				"DIMMU-STATUS-"
+// Сколько символов от начала строки вывода запоминается для поиска CONSOLE_STATUS
+#define CONSOLE_LINE_SIZE			32
+// Ввод после команды -run: вывести её код завершения и выключить машину
+#define CONSOLE_RUN_TAIL			"\n__status=$?; sync; echo " CONSOLE_STATUS "$__status; poweroff -f\n"
+
+static struct
+{
+	host_mutex_t* lock;
+	host_wait_t* wait;
+
+	// Вывод, ещё не переданный на терминал, и время появления первого символа в нём
+	char out[CONSOLE_OUT_SIZE];
+	int out_len;
+	int64_t out_time;
+
+	// Ввод: символы с in_tail по in_head
+	uint8_t in[CONSOLE_IN_SIZE];
+	unsigned in_head;
+	unsigned in_tail;
+
+	// Получатель ввода (virtio-console), вызывается потоком консоли при появлении символов
+	void (*input)(void*);
+	void* input_arg;
+
+	// Обработчик команд после Ctrl-A (NULL - Ctrl-A передаётся гостю) и признак,
+	// что предыдущий символ - Ctrl-A
+	void (*escape)(int);
+	int escaped;
+
+	// Команда -run, которая будет введена после первого приглашения оболочки (NULL - нет
+	// или уже введена), начало текущей строки вывода и её длина, два последних выведенных
+	// символа, признак, что вывод остановился на приглашении, время последнего вывода
+	// и код завершения команды (-1 - ещё не выведен, без команды - 0)
+	char* command;
+	char line[CONSOLE_LINE_SIZE];
+	int line_len;
+	unsigned last;
+	int prompt;
+	int64_t prompt_time;
+	int status;
+} con;
+
+// Выделение команд эмулятору из ввода, возвращает количество оставшихся символов
+static int console_escape(uint8_t* buf, int n)
+{
+	int i, out = 0;
+
+	if (con.escape == NULL)
+		return n;
+
+	for (i = 0; i < n; i++)
+	{
+		if (con.escaped)
+		{
+			con.escaped = 0;
+			if (buf[i] != CONSOLE_ESCAPE)
+			{
+				con.escape(buf[i]);
+				continue;
+			}
+		}
+		else if (buf[i] == CONSOLE_ESCAPE)
+		{
+			con.escaped = 1;
+			continue;
+		}
+		buf[out++] = buf[i];
+	}
+
+	return out;
+}
+
+// Передать накопленный вывод на терминал (вызывается под блокировкой)
+static void console_output_flush(void)
+{
+	if (con.out_len == 0)
+		return;
+	console_output(con.out, con.out_len);
+	con.out_len = 0;
+}
+
+// Разбор вывода гостя для команды -run (вызывается под блокировкой). Возвращает 1,
+// если вывод закончился приглашением оболочки
+static int console_scan(const char* p, int size)
+{
+	int i, n = (int)strlen(CONSOLE_STATUS);
+
+	for (i = 0; i < size; i++)
+	{
+		con.last = (con.last << 8) | (uint8_t)p[i];
+		if (p[i] != '\n' && p[i] != '\r')
+		{
+			// Длина считается до конца строки, запоминается только начало
+			if (con.line_len < CONSOLE_LINE_SIZE - 1)
+				con.line[con.line_len] = p[i];
+			con.line_len++;
+			continue;
+		}
+
+		// Строка закончена: эхо введённой команды начинается с приглашения, поэтому
+		// совпадает только вывод самой echo
+		con.line[con.line_len < CONSOLE_LINE_SIZE ? con.line_len : CONSOLE_LINE_SIZE - 1] = 0;
+		if (con.line_len > n && memcmp(con.line, CONSOLE_STATUS, n) == 0 && con.line[n] >= '0' && con.line[n] <= '9')
+			con.status = atoi(&con.line[n]);
+		con.line_len = 0;
+	}
+
+	// Незаконченная строка оканчивается приглашением оболочки ("# " или "$ "). Вывод по
+	// одному символу (SBI) останавливается на любом символе, поэтому команда вводится
+	// потоком консоли, только если после приглашения нет вывода CONSOLE_FLUSH_NS
+	con.prompt = con.command != NULL && con.line_len >= 2 &&
+		((con.last & 0xFFFF) == ('#' << 8 | ' ') || (con.last & 0xFFFF) == ('$' << 8 | ' '));
+	con.prompt_time = host_time_ns();
+
+	return con.prompt;
+}
+
+// Ввод команды -run в буфер ввода, если вывод давно остановился на приглашении
+// (вызывается под блокировкой). Возвращает 1, если команда введена
+static int console_type(void)
+{
+	unsigned head;
+	char* c;
+
+	if (!con.prompt || host_time_ns() < con.prompt_time + CONSOLE_FLUSH_NS)
+		return 0;
+
+	head = con.in_head;
+	for (c = con.command; *c && head - con.in_tail < CONSOLE_IN_SIZE; c++)
+		con.in[head++ % CONSOLE_IN_SIZE] = (uint8_t)*c;
+	con.in_head = head;
+	free(con.command);
+	con.command = NULL;
+	con.prompt = 0;
+
+	return 1;
+}
+
+// Поток консоли: вывод незаконченных строк по таймеру и чтение ввода
+static void console_thread(void* arg)
+{
+	uint8_t buf[256];
+	unsigned space, head;
+	int64_t deadline;
+	int n, i, typed;
+
+	for (;;)
+	{
+		host_mutex_lock(con.lock);
+		deadline = con.out_len > 0 ? con.out_time + CONSOLE_FLUSH_NS : host_time_ns() + CONSOLE_IDLE_NS;
+		if (con.prompt && con.prompt_time + CONSOLE_FLUSH_NS < deadline)
+			deadline = con.prompt_time + CONSOLE_FLUSH_NS;
+		space = CONSOLE_IN_SIZE - (con.in_head - con.in_tail);
+		host_mutex_unlock(con.lock);
+
+		// Пока буфер ввода полон, терминал не опрашивается: поток разбудит чтение из буфера
+		host_wait(con.wait, deadline, space > 0);
+
+		if (space > sizeof(buf))
+			space = sizeof(buf);
+		n = space > 0 ? console_input(buf, space) : 0;
+		n = console_escape(buf, n);
+
+		host_mutex_lock(con.lock);
+		if (con.out_len > 0 && host_time_ns() >= con.out_time + CONSOLE_FLUSH_NS)
+			console_output_flush();
+		head = con.in_head;
+		for (i = 0; i < n; i++)
+			con.in[head++ % CONSOLE_IN_SIZE] = buf[i];
+		con.in_head = head;
+		typed = console_type();
+		host_mutex_unlock(con.lock);
+
+		if ((n > 0 || typed) && con.input != NULL)
+			con.input(con.input_arg);
+	}
+}
+
+// Запуск потока консоли
+void console_start(void)
+{
+	con.lock = host_mutex_create();
+	con.wait = host_wait_create();
+	if (con.lock == NULL || con.wait == NULL || !host_thread_start(console_thread, NULL))
+	{
+		printf("Console: unable to create thread\n");
+		exit(1);
+	}
+
+	// Не потерять вывод при выходе
+	atexit(console_flush);
+}
+
+// Остановка консоли перед fork: вывод и ввод не меняются, пока блокировка захвачена
+void console_pause(void)
+{
+	host_mutex_lock(con.lock);
+	console_output_flush();
+}
+
+// Продолжение работы в процессе, порождённом fork: поток консоли запускается заново
+// (блокировка захвачена console_pause)
+int console_fork(void)
+{
+	con.out_len = 0;
+	con.in_head = con.in_tail = 0;
+	con.escaped = 0;
+	host_mutex_unlock(con.lock);
+
+	return host_thread_start(console_thread, NULL);
+}
+
+// Вывод size байт из buf. Вывод передаётся на терминал после перевода строки,
+// при заполнении буфера или по таймеру
+void console_write(const void* buf, int size)
+{
+	const char* p = (const char*)buf;
+	int n, wake = 0;
+
+	// Поток консоли ещё не запущен
+	if (con.lock == NULL)
+	{
+		console_output(buf, size);
+		return;
+	}
+
+	host_mutex_lock(con.lock);
+
+	// Поток консоли введёт команду -run, если вывод не продолжится
+	if (con.status < 0 && console_scan(p, size))
+		wake = 1;
+
+	// Большой блок выводится прямо из памяти гостя, без копирования в буфер
+	if (size >= CONSOLE_OUT_SIZE)
+	{
+		console_output_flush();
+		console_output(buf, size);
+		host_mutex_unlock(con.lock);
+		if (wake)
+			host_wake(con.wait);
+		return;
+	}
+
+	while (size > 0)
+	{
+		if (con.out_len == 0)
+		{
+			con.out_time = host_time_ns();
+			wake = 1;
+		}
+		n = CONSOLE_OUT_SIZE - con.out_len;
+		if (n > size)
+			n = size;
+		memcpy(&con.out[con.out_len], p, n);
+		con.out_len += n;
+		p += n;
+		size -= n;
+		if (con.out_len == CONSOLE_OUT_SIZE)
+			console_output_flush();
+	}
+	if (con.out_len > 0 && memchr(con.out, '\n', con.out_len) != NULL)
+		console_output_flush();
+	wake = wake && (con.out_len > 0 || con.prompt);
+	host_mutex_unlock(con.lock);
+
+	// Незаконченную строку выведет поток консоли
+	if (wake)
+		host_wake(con.wait);
+}
+
+void console_putchar(int ch)
+{
+	char c = (char)ch;
+	console_write(&c, 1);
+}
+
+void console_flush(void)
+{
+	if (con.lock == NULL)
+		return;
+	host_mutex_lock(con.lock);
+	console_output_flush();
+	host_mutex_unlock(con.lock);
+}
+
+// Чтение до size символов из буфера ввода без ожидания, возвращает количество
+int console_read(void* buf, int size)
+{
+	uint8_t* p = (uint8_t*)buf;
+	int n = 0, full;
+
+	if (con.lock == NULL)
+		return 0;
+	host_mutex_lock(con.lock);
+	full = con.in_head - con.in_tail == CONSOLE_IN_SIZE;
+	while (n < size && con.in_tail != con.in_head)
+		p[n++] = con.in[con.in_tail++ % CONSOLE_IN_SIZE];
+	host_mutex_unlock(con.lock);
+
+	// Поток консоли перестал читать терминал - в буфере снова есть место
+	if (full && n > 0)
+		host_wake(con.wait);
+
+	return n;
+}
+
+// Количество символов в буфере ввода
+int console_pending(void)
+{
+	return (int)(con.in_head - con.in_tail);
+}
+
+// Чтение символа из буфера ввода, -1 - символов нет
+int console_getchar(void)
+{
+	uint8_t c;
+	return console_read(&c, 1) == 1 ? c : -1;
+}
+
+// Установка получателя ввода
+void console_set_input(void (*func)(void*), void* arg)
+{
+	con.input_arg = arg;
+	con.input = func;
+}
+
+// Установка обработчика команд эмулятору: символ после Ctrl-A
+void console_set_escape(void (*func)(int))
+{
+	con.escape = func;
+}
+
+// Ввод команды после первого приглашения оболочки гостя. После неё вводится вывод кода
+// завершения и выключение машины. Возвращает 0, если команда не помещается в буфер ввода
+int console_run(const char* command)
+{
+	size_t size = strlen(command) + sizeof(CONSOLE_RUN_TAIL);
+
+	if (size > CONSOLE_IN_SIZE)
+		return 0;
+	con.command = (char*)malloc(size);
+	if (con.command == NULL)
+		return 0;
+	strcpy(con.command, command);
+	strcat(con.command, CONSOLE_RUN_TAIL);
+	con.status = -1;
+
+	return 1;
+}
+
+// Код завершения команды console_run (-1 - гость его ещё не вывел, без команды - 0)
+int console_status(void)
+{
+	return con.status;
+}
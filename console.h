@@ -0,0 +1,28 @@
+#pragma once
+
+// Консоль гостя
+//
+// Вывод накапливается в буфере и передаётся на терминал хоста целыми строками: при
+// переводе строки, при заполнении буфера или, если строка не закончена (приглашение
+// командной строки), через CONSOLE_FLUSH_NS. Ввод читает поток консоли: он ждёт
+// готовности терминала и переносит все пришедшие символы в кольцевой буфер, откуда их
+// забирают SBI и virtio-console без системных вызовов. Если установлен обработчик команд,
+// символ после Ctrl-A передаётся ему, а не гостю (Ctrl-A Ctrl-A - сам символ Ctrl-A).
+//
+// Команда console_run вводится, когда вывод гостя останавливается на приглашении оболочки
+// ("# " или "$ "). За ней вводятся echo кода завершения и poweroff -f: консоль запоминает
+// код из вывода, и SBI возвращает его как код завершения эмулятора.
+
+void console_start(void);
+void console_write(const void* buf, int size);
+void console_putchar(int ch);
+void console_flush(void);
+int  console_read(void* buf, int size);
+int  console_pending(void);
+int  console_getchar(void);
+void console_set_input(void (*func)(void*), void* arg);
+void console_set_escape(void (*func)(int));
+void console_pause(void);
+int  console_fork(void);
+int  console_run(const char* command);
+int  console_status(void);
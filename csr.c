@@ -10,6 +10,8 @@
 #define CSR_STVAL			0x143
 #define CSR_SIP				0x144
 #define CSR_SATP			0x180
+#define CSR_STIMECMP		0x14D // Расширение Sstc
+#define CSR_STIMECMPH		0x15D
 
 #define CSR_TIMECMP			0x800
 #define CSR_TIMECMPH		0x801
@@ -32,13 +34,16 @@ ui csr_read(riscv_t* cpu, uint32_t number)
 		case CSR_SATP: return cpu->satp;
 
 #if XLEN == 64
-		case CSR_TIME: return cpu->mtime;
-		case CSR_TIMECMP: return cpu->mtimecmp;
+		case CSR_TIME: clock_update(cpu); return cpu->mtime;
+		case CSR_TIMECMP:
+		case CSR_STIMECMP: return cpu->mtimecmp;
 #else
-		case CSR_TIME: return cpu->mtime & 0xFFFFFFFF;
+		case CSR_TIME: clock_update(cpu); return cpu->mtime & 0xFFFFFFFF;
 		case CSR_TIMEH: return cpu->mtime >> 32;
-		case CSR_TIMECMP: return cpu->mtimecmp & 0xFFFFFFFF;
-		case CSR_TIMECMPH: return cpu->mtimecmp >> 32;
+		case CSR_TIMECMP:
+		case CSR_STIMECMP: return cpu->mtimecmp & 0xFFFFFFFF;
+		case CSR_TIMECMPH:
+		case CSR_STIMECMPH: return cpu->mtimecmp >> 32;
 #endif
 	}
 	return 0;
@@ -49,26 +54,42 @@ void csr_write(riscv_t* cpu, uint32_t number, ui value)
 {
 	switch (number)
 	{
-		case CSR_SSTATUS: cpu->sstatus = value; break;
-		case CSR_SIE: cpu->sie = value; break;
+		case CSR_SSTATUS:
+			// Изменение флага разрешения прерываний требует их проверки
+			if ((cpu->sstatus ^ value) & SSTATUS_SIE)
+				cpu->irq_check = 1;
+			cpu->sstatus = value;
+			break;
+		case CSR_SIE:
+			if (cpu->sie != value)
+				cpu->irq_check = 1;
+			cpu->sie = value;
+			break;
 		case CSR_STVEC: cpu->stvec = value; break;
 		case CSR_SSCRATCH: cpu->sscratch = value; break;
 		case CSR_SEPC: cpu->sepc = value; break;
 		case CSR_SCAUSE: cpu->scause = value; break;
 		case CSR_STVAL: cpu->stval = value; break;
-		case CSR_SIP: cpu->sip = value; break;
+		case CSR_SIP:
+			if (cpu->sip != value)
+				cpu->irq_check = 1;
+			cpu->sip = value;
+			break;
 		case CSR_SATP: // Установка режима MMU и адреса каталога страниц
 			cpu->satp = set_atp(cpu, value);
 			break;
 
 #if XLEN == 64
 		case CSR_TIME: set_mtime64(cpu, value); break;
-		case CSR_TIMECMP: set_mtimecmp64(cpu, value); break;
+		case CSR_TIMECMP:
+		case CSR_STIMECMP: set_mtimecmp64(cpu, value); break;
 #else
 		case CSR_TIME: set_mtime(cpu, cpu->mtime >> 32, value); break;
 		case CSR_TIMEH: set_mtime(cpu, value, cpu->mtime & 0xFFFFFFFF); break;
-		case CSR_TIMECMP: set_mtimecmp(cpu, cpu->mtimecmp >> 32, value); break;
-		case CSR_TIMECMPH: set_mtimecmp(cpu, value, cpu->mtimecmp & 0xFFFFFFFF); break;
+		case CSR_TIMECMP:
+		case CSR_STIMECMP: set_mtimecmp(cpu, cpu->mtimecmp >> 32, value); break;
+		case CSR_TIMECMPH:
+		case CSR_STIMECMPH: set_mtimecmp(cpu, value, cpu->mtimecmp & 0xFFFFFFFF); break;
 #endif
 	}
 }
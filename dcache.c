@@ -0,0 +1,151 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include "riscv.h"
+#include "atomic.h"
+
+// Кэш декодированных инструкций
+// Для каждой физической страницы ОЗУ, из которой выполняется код, хранится массив
+// уже декодированных инструкций. Запись в такую страницу сбрасывает её кэш.
+
+// Номер страницы ОЗУ по физическому адресу
+#define DCACHE_INDEX(phys)			(((phys) - RAM_START) >> 12)
+
+int dcache_init(riscv_t* cpu)
+{
+	cpu->dcache = (dcache_page_t**)calloc(ram_size >> 12, sizeof(dcache_page_t*));
+	cpu->dcache_free = NULL;
+	cpu->dcache_live = NULL;
+	cpu->dcache_pages = 0;
+
+	return cpu->dcache != NULL;
+}
+
+// Получить декодированную страницу по физическому адресу, при необходимости создать её
+dcache_page_t* dcache_get(riscv_t* cpu, ui phys)
+{
+	ui n = DCACHE_INDEX(phys);
+	dcache_page_t* page;
+	int i;
+
+	page = cpu->dcache[n];
+	if (page != NULL)
+		return page;
+
+	// Если кэш переполнен, то очистить его целиком
+	if (cpu->dcache_pages >= DCACHE_MAX_PAGES)
+		dcache_flush(cpu);
+
+	// Выделить новую страницу, если в списке свободных ничего нет
+	if (cpu->dcache_free == NULL)
+	{
+		page = (dcache_page_t*)malloc(sizeof(dcache_page_t));
+		if (page == NULL)
+		{
+			// Не хватает памяти, освободить уже декодированные страницы
+			dcache_flush(cpu);
+			if (cpu->dcache_free == NULL)
+			{
+				printf("Decoded instruction cache: out of memory\n");
+				exit(1);
+			}
+		}
+		else
+		{
+			page->next = NULL;
+			cpu->dcache_free = page;
+		}
+	}
+
+	page = cpu->dcache_free;
+	cpu->dcache_free = page->next;
+
+	// Все ячейки будут декодированы при первом выполнении
+	for (i = 0; i < DCACHE_SLOTS; i++)
+	{
+		page->insn[i].exec = insn_handlers[OP_DECODE];
+		page->insn[i].op = OP_DECODE;
+		page->insn[i].len = 0;
+	}
+
+	page->jit = NULL;
+	page->index = n;
+
+	cpu->dcache[n] = page;
+	cpu->dcache_pages++;
+	page->prev = NULL;
+	page->next = cpu->dcache_live;
+	if (page->next != NULL)
+		page->next->prev = page;
+	cpu->dcache_live = page;
+
+	// Удалить из TLB записи, разрешающие запись в эту страницу.
+	// Тогда любая запись в неё пройдёт через tlb_fill и сбросит декодированные инструкции
+	tlb_flush_page(cpu, TLB_WRITE, &cpu->ram[n << 12]);
+
+	return page;
+}
+
+// Сброс декодированных инструкций страницы (при записи в неё)
+void dcache_invalidate(riscv_t* cpu, ui phys)
+{
+	ui n = DCACHE_INDEX(phys);
+	dcache_page_t* page;
+
+	page = cpu->dcache[n];
+	if (page == NULL)
+		return;
+
+	// Страница не освобождается сразу, т.к. одна из её инструкций может выполняться
+	// прямо сейчас. Она будет заново использована при следующем декодировании
+	cpu->dcache[n] = NULL;
+	if (page->jit != NULL)
+		jit_invalidate(cpu, page);
+	if (page->prev != NULL)
+		page->prev->next = page->next;
+	else
+		cpu->dcache_live = page->next;
+	if (page->next != NULL)
+		page->next->prev = page->prev;
+	page->next = cpu->dcache_free;
+	cpu->dcache_free = page;
+	cpu->dcache_pages--;
+}
+
+// Очистка всего кэша декодированных инструкций
+void dcache_flush(riscv_t* cpu)
+{
+	while (cpu->dcache_live != NULL)
+		dcache_invalidate(cpu, RAM_START + (cpu->dcache_live->index << 12));
+}
+
+// Устройство записало данные в ОЗУ (вызывается из любого потока).
+// Декодированные инструкции сбрасываются при следующей FENCE.I: ОС выполняет её
+// перед тем, как запустить код, прочитанный с диска
+void dcache_dma_write(void)
+{
+	int i;
+
+	for (i = 0; i < hart_count; i++)
+		if (!harts[i]->dma_write)
+			atomic_set(&harts[i]->dma_write, 1);
+}
+
+// Освобождение памяти кэша
+void dcache_done(riscv_t* cpu)
+{
+	dcache_page_t* page;
+
+	if (cpu->dcache == NULL)
+		return;
+
+	dcache_flush(cpu);
+	while (cpu->dcache_free != NULL)
+	{
+		page = cpu->dcache_free;
+		cpu->dcache_free = page->next;
+		free(page);
+	}
+
+	free(cpu->dcache);
+	cpu->dcache = NULL;
+}
@@ -0,0 +1,314 @@
+#include <stdio.h>
+#include <string.h>
+#include "riscv.h"
+#include "virtio.h"
+
+// Построение описания оборудования (devicetree) для ядра Linux
+//
+// Описание создаётся при запуске, т.к. зависит от параметров машины (количества процессоров
+// и подключённых устройств).
+// Формат - flattened devicetree (FDT): заголовок, блок структуры (узлы и свойства)
+// и блок строк (имена свойств). Все числа - 32-битные big-endian.
+
+#define FDT_MAGIC					0xD00DFEED
+#define FDT_BEGIN_NODE				1
+#define FDT_END_NODE				2
+#define FDT_PROP					3
+#define FDT_END						9
+
+// Размер заголовка и пустой таблицы резервирования памяти
+#define FDT_HEADER_SIZE				40
+#define FDT_RSVMAP_SIZE				16
+
+// Максимальные размеры блоков
+#define FDT_STRUCT_MAX				16384
+#define FDT_STRINGS_MAX				1024
+
+typedef struct
+{
+	uint8_t data[FDT_STRUCT_MAX];
+	int size;
+	char strings[FDT_STRINGS_MAX];
+	int strings_size;
+	int overflow;
+} fdt_t;
+
+static void put32(uint8_t* p, uint32_t value)
+{
+	p[0] = value >> 24;
+	p[1] = value >> 16;
+	p[2] = value >> 8;
+	p[3] = value;
+}
+
+// Добавить данные в блок структуры с выравниванием до 4 байт
+static void fdt_data(fdt_t* f, const void* data, int size)
+{
+	int aligned = (size + 3) & ~3;
+
+	if (f->size + aligned > FDT_STRUCT_MAX)
+	{
+		f->overflow = 1;
+		return;
+	}
+
+	if (size > 0)
+		memcpy(&f->data[f->size], data, size);
+	memset(&f->data[f->size + size], 0, aligned - size);
+	f->size += aligned;
+}
+
+static void fdt_u32(fdt_t* f, uint32_t value)
+{
+	uint8_t b[4];
+	put32(b, value);
+	fdt_data(f, b, 4);
+}
+
+// Смещение имени свойства в блоке строк (одинаковые имена хранятся один раз)
+static int fdt_string(fdt_t* f, const char* name)
+{
+	int offset = 0;
+	int len = (int)strlen(name) + 1;
+
+	while (offset < f->strings_size)
+	{
+		if (strcmp(&f->strings[offset], name) == 0)
+			return offset;
+		offset += (int)strlen(&f->strings[offset]) + 1;
+	}
+
+	if (f->strings_size + len > FDT_STRINGS_MAX)
+	{
+		f->overflow = 1;
+		return 0;
+	}
+
+	memcpy(&f->strings[offset], name, len);
+	f->strings_size += len;
+
+	return offset;
+}
+
+static void fdt_begin(fdt_t* f, const char* name)
+{
+	fdt_u32(f, FDT_BEGIN_NODE);
+	fdt_data(f, name, (int)strlen(name) + 1);
+}
+
+static void fdt_end(fdt_t* f)
+{
+	fdt_u32(f, FDT_END_NODE);
+}
+
+static void fdt_prop(fdt_t* f, const char* name, const void* data, int size)
+{
+	fdt_u32(f, FDT_PROP);
+	fdt_u32(f, size);
+	fdt_u32(f, fdt_string(f, name));
+	fdt_data(f, data, size);
+}
+
+static void fdt_prop_str(fdt_t* f, const char* name, const char* value)
+{
+	fdt_prop(f, name, value, (int)strlen(value) + 1);
+}
+
+static void fdt_prop_u32(fdt_t* f, const char* name, uint32_t value)
+{
+	uint8_t b[4];
+	put32(b, value);
+	fdt_prop(f, name, b, 4);
+}
+
+// Свойство из count 32-битных чисел (не больше двух на процессор)
+static void fdt_prop_cells(fdt_t* f, const char* name, const uint32_t* cells, int count)
+{
+	uint8_t b[MAX_HARTS * 8];
+	int i;
+
+	for (i = 0; i < count; i++)
+		put32(&b[i * 4], cells[i]);
+	fdt_prop(f, name, b, count * 4);
+}
+
+// Номера (phandle) узлов процессора и его контроллера прерываний,
+// контроллер PLIC - следующий после всех процессоров
+#define PHANDLE_CPU(n)				(1 + (n) * 2)
+#define PHANDLE_INTC(n)				(2 + (n) * 2)
+#define PHANDLE_PLIC(harts)			(1 + (harts) * 2)
+
+static void devtree_cpus(fdt_t* f, int harts)
+{
+	char name[32];
+	int i;
+
+	fdt_begin(f, "cpus");
+	fdt_prop_u32(f, "#address-cells", 1);
+	fdt_prop_u32(f, "#size-cells", 0);
+	fdt_prop_u32(f, "timebase-frequency", TIMEBASE_FREQ);
+
+	for (i = 0; i < harts; i++)
+	{
+		sprintf(name, "cpu@%x", i);
+		fdt_begin(f, name);
+		fdt_prop_str(f, "device_type", "cpu");
+		fdt_prop_u32(f, "reg", i);
+		fdt_prop_str(f, "compatible", "riscv");
+#if XLEN == 64
+		fdt_prop_str(f, "riscv,isa", "rv64imac_sstc");
+		fdt_prop_str(f, "mmu-type", "riscv,rv64");
+#else
+		fdt_prop_str(f, "riscv,isa", "rv32imac_sstc");
+		fdt_prop_str(f, "mmu-type", "riscv,rv32");
+#endif
+		fdt_prop_str(f, "status", "okay");
+		fdt_prop_u32(f, "phandle", PHANDLE_CPU(i));
+
+		fdt_begin(f, "interrupt-controller");
+		fdt_prop_u32(f, "#interrupt-cells", 1);
+		fdt_prop(f, "interrupt-controller", NULL, 0);
+		fdt_prop_str(f, "compatible", "riscv,cpu-intc");
+		fdt_prop_u32(f, "phandle", PHANDLE_INTC(i));
+		fdt_end(f);
+
+		fdt_end(f);
+	}
+
+	// Все процессоры в одном кластере
+	fdt_begin(f, "cpu-map");
+	fdt_begin(f, "cluster0");
+	for (i = 0; i < harts; i++)
+	{
+		sprintf(name, "core%d", i);
+		fdt_begin(f, name);
+		fdt_prop_u32(f, "cpu", PHANDLE_CPU(i));
+		fdt_end(f);
+	}
+	fdt_end(f);
+	fdt_end(f);
+
+	fdt_end(f);
+}
+
+// Устройства на шине: контроллер прерываний и подключённые устройства virtio
+static void devtree_soc(fdt_t* f, int harts)
+{
+	static const char plic_compatible[] = "sifive,plic-1.0.0\0riscv,plic0";
+	uint32_t cells[MAX_HARTS * 2];
+	char name[32];
+	int i;
+
+	fdt_begin(f, "soc");
+	fdt_prop_u32(f, "#address-cells", 2);
+	fdt_prop_u32(f, "#size-cells", 2);
+	fdt_prop_str(f, "compatible", "simple-bus");
+	fdt_prop(f, "ranges", NULL, 0);
+
+	// Внешние прерывания супервизора (9) всех процессоров
+	sprintf(name, "plic@%x", PLIC_BASE);
+	fdt_begin(f, name);
+	fdt_prop_u32(f, "#address-cells", 0);
+	fdt_prop_u32(f, "#interrupt-cells", 1);
+	fdt_prop(f, "compatible", plic_compatible, sizeof(plic_compatible));
+	cells[0] = 0;
+	cells[1] = PLIC_BASE;
+	cells[2] = 0;
+	cells[3] = PLIC_SIZE;
+	fdt_prop_cells(f, "reg", cells, 4);
+	fdt_prop(f, "interrupt-controller", NULL, 0);
+	for (i = 0; i < harts; i++)
+	{
+		cells[i * 2] = PHANDLE_INTC(i);
+		cells[i * 2 + 1] = 9;
+	}
+	fdt_prop_cells(f, "interrupts-extended", cells, harts * 2);
+	fdt_prop_u32(f, "riscv,ndev", PLIC_SOURCES - 1);
+	fdt_prop_u32(f, "phandle", PHANDLE_PLIC(harts));
+	fdt_end(f);
+
+	for (i = 0; i < VIRTIO_SLOTS; i++)
+	{
+		if (!virtio_present(i))
+			continue;
+		sprintf(name, "virtio_mmio@%x", VIRTIO_BASE + i * VIRTIO_SIZE);
+		fdt_begin(f, name);
+		fdt_prop_str(f, "compatible", "virtio,mmio");
+		cells[0] = 0;
+		cells[1] = VIRTIO_BASE + i * VIRTIO_SIZE;
+		cells[2] = 0;
+		cells[3] = VIRTIO_SIZE;
+		fdt_prop_cells(f, "reg", cells, 4);
+		fdt_prop_u32(f, "interrupts", VIRTIO_IRQ + i);
+		fdt_prop_u32(f, "interrupt-parent", PHANDLE_PLIC(harts));
+		fdt_end(f);
+	}
+
+	fdt_end(f);
+}
+
+// Построение описания в буфере buf, возвращает его размер или 0, если не хватило места
+int devtree_build(uint8_t* buf, int size, int harts, const char* bootargs)
+{
+	static fdt_t fdt;
+	fdt_t* f = &fdt;
+	uint32_t reg[4];
+	char name[32];
+	int total;
+
+	memset(f, 0, sizeof(fdt_t));
+
+	fdt_begin(f, "");
+	fdt_prop_u32(f, "#address-cells", 2);
+	fdt_prop_u32(f, "#size-cells", 2);
+	fdt_prop_str(f, "compatible", "riscv");
+#if XLEN == 64
+	fdt_prop_str(f, "model", "riscv64");
+#else
+	fdt_prop_str(f, "model", "riscv32");
+#endif
+
+	fdt_begin(f, "chosen");
+	fdt_prop_str(f, "bootargs", bootargs);
+	fdt_end(f);
+
+	sprintf(name, "memory@%x", RAM_START);
+	fdt_begin(f, name);
+	fdt_prop_str(f, "device_type", "memory");
+	reg[0] = 0;
+	reg[1] = RAM_START;
+	reg[2] = (uint32_t)((uint64_t)ram_size >> 32);
+	reg[3] = (uint32_t)ram_size;
+	fdt_prop_cells(f, "reg", reg, 4);
+	fdt_end(f);
+
+	devtree_cpus(f, harts);
+
+	devtree_soc(f, harts);
+
+	fdt_end(f);
+	fdt_u32(f, FDT_END);
+
+	total = FDT_HEADER_SIZE + FDT_RSVMAP_SIZE + f->size + f->strings_size;
+	if (f->overflow || total > size)
+		return 0;
+
+	// Заголовок
+	put32(&buf[0], FDT_MAGIC);
+	put32(&buf[4], total);
+	put32(&buf[8], FDT_HEADER_SIZE + FDT_RSVMAP_SIZE);
+	put32(&buf[12], FDT_HEADER_SIZE + FDT_RSVMAP_SIZE + f->size);
+	put32(&buf[16], FDT_HEADER_SIZE);
+	put32(&buf[20], 17); // Версия формата
+	put32(&buf[24], 16); // Совместимая версия
+	put32(&buf[28], 0);  // Загрузочный процессор
+	put32(&buf[32], f->strings_size);
+	put32(&buf[36], f->size);
+
+	// Пустая таблица резервирования, структура и строки
+	memset(&buf[FDT_HEADER_SIZE], 0, FDT_RSVMAP_SIZE);
+	memcpy(&buf[FDT_HEADER_SIZE + FDT_RSVMAP_SIZE], f->data, f->size);
+	memcpy(&buf[FDT_HEADER_SIZE + FDT_RSVMAP_SIZE + f->size], f->strings, f->strings_size);
+
+	return total;
+}
@@ -0,0 +1,349 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "disk.h"
+
+#define DISK_MAGIC					"DIMMUCOW"
+#define DISK_VERSION				1
+// Размер заголовка оверлея, с него начинается таблица
+#define DISK_HEADER_SIZE			4096
+// Смещение пути к базовому образу в заголовке
+#define DISK_PATH_OFFSET			64
+// Размер кластера новых оверлеев (64 КБ) и допустимые размеры
+#define DISK_CLUSTER_BITS			16
+#define DISK_CLUSTER_BITS_MIN		12
+#define DISK_CLUSTER_BITS_MAX		24
+
+struct disk_s
+{
+	// Файл образа или файл изменений
+	host_file_t* file;
+	uint64_t size;
+	int overlay;
+
+	// Базовый образ, отображённый в память (NULL - отобразить не удалось, читать из файла)
+	host_file_t* base;
+	const uint8_t* base_map;
+	uint64_t base_size;
+
+	// Таблица кластеров
+	uint32_t cluster_bits;
+	uint32_t clusters;
+	uint32_t* table;
+	uint64_t table_offset;
+	// Смещение в файле изменений, куда будет записан следующий новый кластер
+	uint64_t next;
+	// Кластер, собираемый при частичной записи
+	uint8_t* buf;
+};
+
+// Чтение из базового образа. Всё, что за концом базы, - нули
+static int disk_base_read(disk_t* d, uint8_t* p, uint64_t size, uint64_t offset)
+{
+	host_iov_t iov;
+	uint64_t n = offset < d->base_size ? d->base_size - offset : 0;
+
+	if (n > size)
+		n = size;
+
+	if (d->base_map != NULL)
+		memcpy(p, d->base_map + offset, (size_t)n);
+	else if (n > 0)
+	{
+		iov.base = p;
+		iov.size = (size_t)n;
+		if (!host_file_read(d->base, &iov, 1, offset))
+			return 0;
+	}
+	memset(p + n, 0, (size_t)(size - n));
+
+	return 1;
+}
+
+// Чтение или запись части одного кластера
+static int disk_cluster_io(disk_t* d, uint8_t* p, uint32_t size, uint64_t offset, int write)
+{
+	uint64_t cluster_size = 1ull << d->cluster_bits;
+	uint32_t c = (uint32_t)(offset >> d->cluster_bits);
+	uint32_t skip = (uint32_t)(offset & (cluster_size - 1));
+	uint64_t pos;
+	uint8_t entry[4];
+	host_iov_t iov;
+
+	// Изменённый кластер - в файле изменений
+	if (d->table[c] != 0)
+	{
+		iov.base = p;
+		iov.size = size;
+		pos = ((uint64_t)d->table[c] << d->cluster_bits) + skip;
+		return write ? host_file_write(d->file, &iov, 1, pos) : host_file_read(d->file, &iov, 1, pos);
+	}
+
+	if (!write)
+		return disk_base_read(d, p, size, offset);
+
+	// Первая запись в кластер: дополнить данными из базы и записать целиком в конец файла
+	if (size < cluster_size)
+	{
+		if (!disk_base_read(d, d->buf, cluster_size, offset - skip))
+			return 0;
+		memcpy(d->buf + skip, p, size);
+		p = d->buf;
+	}
+	iov.base = p;
+	iov.size = (size_t)cluster_size;
+	if (!host_file_write(d->file, &iov, 1, d->next))
+		return 0;
+
+	// Запись в таблицу - после данных, чтобы таблица не указывала на незаписанный кластер
+	d->table[c] = (uint32_t)(d->next >> d->cluster_bits);
+	memcpy(entry, &d->table[c], 4);
+	iov.base = entry;
+	iov.size = 4;
+	if (!host_file_write(d->file, &iov, 1, d->table_offset + 4ull * c))
+	{
+		d->table[c] = 0;
+		return 0;
+	}
+	d->next += cluster_size;
+
+	return 1;
+}
+
+// Чтение или запись вразброс с разбиением по кластерам оверлея
+static int disk_overlay_io(disk_t* d, const host_iov_t* iov, int count, uint64_t offset, int write)
+{
+	uint64_t cluster_size = 1ull << d->cluster_bits;
+	uint8_t* p;
+	size_t left;
+	uint32_t n;
+	int i;
+
+	for (i = 0; i < count; i++)
+	{
+		p = (uint8_t*)iov[i].base;
+		left = iov[i].size;
+		while (left > 0)
+		{
+			n = (uint32_t)(cluster_size - (offset & (cluster_size - 1)));
+			if (n > left)
+				n = (uint32_t)left;
+			if (!disk_cluster_io(d, p, n, offset, write))
+				return 0;
+			p += n;
+			offset += n;
+			left -= n;
+		}
+	}
+
+	return 1;
+}
+
+// Создание пустого оверлея над базовым образом base
+static int disk_create(host_file_t* f, const char* base, uint64_t size)
+{
+	uint8_t header[DISK_HEADER_SIZE];
+	uint32_t version = DISK_VERSION, bits = DISK_CLUSTER_BITS;
+	uint64_t table = DISK_HEADER_SIZE, data, clusters;
+	host_iov_t iov;
+
+	if (strlen(base) >= DISK_HEADER_SIZE - DISK_PATH_OFFSET)
+		return 0;
+
+	clusters = (size + (1ull << bits) - 1) >> bits;
+	data = (table + clusters * 4 + (1ull << bits) - 1) & ~((1ull << bits) - 1);
+
+	memset(header, 0, sizeof(header));
+	memcpy(&header[0], DISK_MAGIC, 8);
+	memcpy(&header[8], &version, 4);
+	memcpy(&header[12], &bits, 4);
+	memcpy(&header[16], &size, 8);
+	memcpy(&header[24], &table, 8);
+	memcpy(&header[32], &data, 8);
+	strcpy((char*)&header[DISK_PATH_OFFSET], base);
+
+	iov.base = header;
+	iov.size = sizeof(header);
+
+	return host_file_write(f, &iov, 1, 0) && host_file_flush(f);
+}
+
+// Разбор заголовка оверлея и загрузка таблицы. base - базовый образ вместо указанного в заголовке
+static int disk_open_overlay(disk_t* d, const char* name, const uint8_t* header, const char* base)
+{
+	uint32_t version, bits;
+	uint64_t data, cluster_size;
+	int64_t size;
+	host_iov_t iov;
+
+	memcpy(&version, &header[8], 4);
+	memcpy(&bits, &header[12], 4);
+	memcpy(&d->size, &header[16], 8);
+	memcpy(&d->table_offset, &header[24], 8);
+	memcpy(&data, &header[32], 8);
+	if (version != DISK_VERSION || bits < DISK_CLUSTER_BITS_MIN || bits > DISK_CLUSTER_BITS_MAX ||
+		(d->size >> bits) >= 0xFFFFFFFFull || d->table_offset < DISK_HEADER_SIZE || header[DISK_HEADER_SIZE - 1] != 0)
+	{
+		printf("\"%s\": unsupported overlay image\n", name);
+		return 0;
+	}
+	d->overlay = 1;
+	d->cluster_bits = bits;
+	cluster_size = 1ull << bits;
+	d->clusters = (uint32_t)((d->size + cluster_size - 1) >> bits);
+	if (data < d->table_offset + 4ull * d->clusters)
+	{
+		printf("\"%s\": unsupported overlay image\n", name);
+		return 0;
+	}
+
+	// Базовый образ общий для всех машин, поэтому открывается только для чтения
+	if (base == NULL)
+		base = (const char*)&header[DISK_PATH_OFFSET];
+	d->base = host_file_open(base, HOST_FILE_READ);
+	if (d->base == NULL)
+	{
+		printf("\"%s\": unable to open base image \"%s\"\n", name, base);
+		return 0;
+	}
+	size = host_file_size(d->base);
+	d->base_size = size > 0 ? (uint64_t)size : 0;
+	d->base_map = (const uint8_t*)host_file_map(d->base, d->base_size);
+
+	d->table = (uint32_t*)calloc(d->clusters + 1, 4);
+	d->buf = (uint8_t*)malloc((size_t)cluster_size);
+	if (d->table == NULL || d->buf == NULL)
+	{
+		printf("\"%s\": out of memory\n", name);
+		return 0;
+	}
+	iov.base = d->table;
+	iov.size = 4ull * d->clusters;
+	if (!host_file_read(d->file, &iov, 1, d->table_offset))
+	{
+		printf("\"%s\": unable to read overlay table\n", name);
+		return 0;
+	}
+
+	// Новые кластеры - в конец файла, но не раньше начала области данных
+	size = host_file_size(d->file);
+	d->next = ((uint64_t)(size > 0 ? size : 0) + cluster_size - 1) & ~(cluster_size - 1);
+	if (d->next < data)
+		d->next = data;
+
+	return 1;
+}
+
+// Открытие образа диска. Если задан base, то file - оверлей над base (создаётся, если
+// файла нет). Оверлей без base использует базовый образ, записанный при создании
+disk_t* disk_open(const char* file, const char* base, int readonly)
+{
+	disk_t* d = (disk_t*)calloc(1, sizeof(disk_t));
+	uint8_t header[DISK_HEADER_SIZE];
+	host_file_t* b;
+	host_iov_t iov;
+	int64_t size;
+
+	if (d == NULL)
+	{
+		printf("Disk: out of memory\n");
+		return NULL;
+	}
+
+	if (base != NULL)
+	{
+		d->file = host_file_open(file, HOST_FILE_CREATE);
+		if (d->file != NULL)
+		{
+			b = host_file_open(base, HOST_FILE_READ);
+			size = b != NULL ? host_file_size(b) : -1;
+			host_file_close(b);
+			if (size < 0 || !disk_create(d->file, base, (uint64_t)size))
+			{
+				printf("\"%s\": unable to create overlay of \"%s\"\n", file, base);
+				disk_close(d);
+				return NULL;
+			}
+			host_file_close(d->file);
+		}
+	}
+
+	d->file = host_file_open(file, readonly ? HOST_FILE_READ : HOST_FILE_WRITE);
+	if (d->file == NULL)
+	{
+		printf("\"%s\": unable to open disk image\n", file);
+		disk_close(d);
+		return NULL;
+	}
+
+	iov.base = header;
+	iov.size = sizeof(header);
+	if (!host_file_read(d->file, &iov, 1, 0))
+	{
+		printf("\"%s\": unable to read disk image\n", file);
+		disk_close(d);
+		return NULL;
+	}
+
+	if (memcmp(header, DISK_MAGIC, 8) == 0)
+	{
+		if (!disk_open_overlay(d, file, header, base))
+		{
+			disk_close(d);
+			return NULL;
+		}
+	}
+	else if (base != NULL)
+	{
+		printf("\"%s\": not an overlay image\n", file);
+		disk_close(d);
+		return NULL;
+	}
+	else
+	{
+		size = host_file_size(d->file);
+		d->size = size > 0 ? (uint64_t)size : 0;
+	}
+
+	return d;
+}
+
+void disk_close(disk_t* d)
+{
+	if (d == NULL)
+		return;
+	host_file_unmap(d->base_map, d->base_size);
+	host_file_close(d->base);
+	host_file_close(d->file);
+	free(d->table);
+	free(d->buf);
+	free(d);
+}
+
+uint64_t disk_size(disk_t* d)
+{
+	return d->size;
+}
+
+// Чтение вразброс со смещения offset, возвращает 1 при успехе
+int disk_read(disk_t* d, const host_iov_t* iov, int count, uint64_t offset)
+{
+	if (!d->overlay)
+		return host_file_read(d->file, iov, count, offset);
+
+	return disk_overlay_io(d, iov, count, offset, 0);
+}
+
+// Запись вразброс со смещения offset, возвращает 1 при успехе
+int disk_write(disk_t* d, const host_iov_t* iov, int count, uint64_t offset)
+{
+	if (!d->overlay)
+		return host_file_write(d->file, iov, count, offset);
+
+	return disk_overlay_io(d, iov, count, offset, 1);
+}
+
+int disk_flush(disk_t* d)
+{
+	return host_file_flush(d->file);
+}
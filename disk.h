@@ -0,0 +1,33 @@
+#pragma once
+
+#include <stdint.h>
+#include "platform.h"
+
+// Образ диска для блочного устройства
+//
+// Диск - либо обычный файл образа, либо файл изменений (оверлей) поверх общего базового
+// образа, который только читается. Оверлей делит диск на кластеры и хранит таблицу,
+// в которой для каждого кластера записан его номер в файле изменений (0 - кластер не
+// изменялся). Чтение неизменённых кластеров идёт из отображённого в память базового
+// образа, поэтому страничный кеш хоста хранит одну копию базы на все машины, а первая
+// запись в кластер копирует его в конец файла изменений.
+//
+// Формат файла изменений (числа little-endian):
+//   0    "DIMMUCOW"
+//   8    версия (4 байта, 1)
+//   12   log2 размера кластера (4 байта)
+//   16   размер диска в байтах (8 байт)
+//   24   смещение таблицы (8 байт)
+//   32   смещение первого кластера данных (8 байт)
+//   64   путь к базовому образу, заканчивается нулём
+// Таблица - по 4 байта на кластер. Новый файл содержит только заголовок: таблица
+// за концом файла читается как нули, поэтому создание оверлея не зависит от размера диска.
+
+typedef struct disk_s disk_t;
+
+disk_t* disk_open(const char* file, const char* base, int readonly);
+void disk_close(disk_t* d);
+uint64_t disk_size(disk_t* d);
+int disk_read(disk_t* d, const host_iov_t* iov, int count, uint64_t offset);
+int disk_write(disk_t* d, const host_iov_t* iov, int count, uint64_t offset);
+int disk_flush(disk_t* d);
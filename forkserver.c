@@ -0,0 +1,81 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include "riscv.h"
+#include "sbi.h"
+#include "platform.h"
+#include "console.h"
+#include "virtio.h"
+#include "forkserver.h"
+
+// Сокет сервера заданий (NULL - сервер не запускается)
+static const char* fork_path;
+// Способ выполнения инструкций процессора 0 до остановки на адресе запуска
+static int fork_core;
+// Сервер запущен вызовом SBI (номер задания возвращается в a1)
+static int fork_ecall;
+// Номер задания в порождённом процессе (0 - сервер ещё не запущен)
+static int fork_job;
+
+// Включение сервера заданий на сокете path. Если pc не ~0, сервер запускается, когда
+// процессор 0 дойдёт до этого адреса: до этого он выполняется интерпретатором CORE_STEP,
+// который проверяет адрес перед каждой инструкцией
+void fork_server_enable(const char* path, ui pc)
+{
+	fork_path = path;
+
+	if (pc != ~(ui)0)
+	{
+		fork_core = harts[0]->core;
+		harts[0]->core = CORE_STEP;
+		harts[0]->break_pc = pc;
+	}
+}
+
+// Вызов SBI_DIMMU_FORK. Возвращает номер задания; без сервера заданий - 0
+void fork_server_ecall(riscv_t* cpu)
+{
+	cpu->r[10] = SBI_SUCCESS;
+	cpu->r[11] = fork_job;
+
+	if (fork_path == NULL || fork_job != 0 || fork_ecall)
+		return;
+
+	// Сервер запускается между отрезками выполнения, отрезок завершается сразу после вызова
+	fork_ecall = 1;
+	hart_signal(cpu, MAIL_FORK);
+	cpu->irq_check = 1;
+}
+
+// Процессор дошёл до адреса запуска
+void fork_server_break(riscv_t* cpu)
+{
+	cpu->break_pc = ~(ui)0;
+	cpu->core = fork_core;
+	hart_signal(cpu, MAIL_FORK);
+}
+
+// Запуск сервера заданий по запросу MAIL_FORK. В исходном процессе не возвращается,
+// в порождённом - машина продолжает работу с точки запуска
+void fork_server_run(riscv_t* cpu)
+{
+	int job;
+
+	smp_pause(cpu);
+	virtio_pause();
+	console_pause();
+	printf("Fork server: waiting for jobs on \"%s\"\n", fork_path);
+
+	job = host_fork_server(fork_path);
+	if (job == 0)
+	{
+		printf("\"%s\": unable to start fork server\n", fork_path);
+		exit(1);
+	}
+
+	// Порождённый процесс: запустить потоки консоли, устройств и остальных процессоров
+	fork_job = job;
+	if (fork_ecall)
+		cpu->r[11] = job;
+	if (!console_fork() || !virtio_fork() || !smp_fork(cpu))
+		exit(1);
+}
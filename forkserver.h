@@ -0,0 +1,18 @@
+#pragma once
+
+#include "riscv.h"
+
+// Сервер заданий (fork-server)
+//
+// Для пакетных запусков одна машина загружается один раз до точки запуска: вызова SBI
+// SBI_EXT_DIMMU/SBI_DIMMU_FORK или адреса инструкции, заданного параметром. В этой точке
+// процессоры и устройства останавливаются, и процесс ждёт подключений к локальному сокету.
+// На каждое подключение порождается копия процесса (fork): ОЗУ гостя достаётся ей через
+// копирование при записи, а подключение становится консолью гостя. Копия продолжает работу
+// с точки запуска (вызов SBI возвращает в a1 номер задания, начиная с 1) до выключения
+// машины гостем, после чего клиент получает байт 0 и код завершения числом с переводом строки.
+
+void fork_server_enable(const char* path, ui pc);
+void fork_server_ecall(riscv_t* cpu);
+void fork_server_break(riscv_t* cpu);
+void fork_server_run(riscv_t* cpu);
@@ -1,264 +1,195 @@
 #include <stdint.h>
 #include "riscv.h"
+#include "tlb.h"
+#include "atomic.h"
 
 // Расширение "A": Атомарные инструкции
-void do_atomic(riscv_t* cpu, uint32_t instr, int rs1, int rs2, int rd, int func3, int func7)
+//
+// Процессоры выполняются в разных потоках хоста, поэтому инструкции AMO выполняются
+// атомарными операциями хоста прямо над словом в памяти. Все операции хоста упорядочены
+// полностью (seq_cst), поэтому флаги aq/rl не проверяются.
+//
+// LR запоминает адрес и прочитанное значение, а SC записывает новое значение сравнением
+// с обменом: запись удаётся, только если слово всё ещё содержит прочитанное LR значение.
+// Запись другого процессора, изменившая слово, приводит к неудаче SC без каких-либо
+// блокировок и таблиц резервирования. Запись, вернувшая то же самое значение, не
+// обнаруживается, но для алгоритмов на LR/SC это неотличимо от отсутствия записи.
+
+// Коды операций (биты 31..27 инструкции)
+#define AMO_ADD						0x00
+#define AMO_SWAP					0x01
+#define AMO_LR						0x02
+#define AMO_SC						0x03
+#define AMO_XOR						0x04
+#define AMO_OR						0x08
+#define AMO_AND						0x0C
+#define AMO_MIN						0x10
+#define AMO_MAX						0x14
+#define AMO_MINU					0x18
+#define AMO_MAXU					0x1C
+
+// Операция над 32-битным словом, возвращает прежнее значение
+static int32_t amo32(volatile int32_t* p, int op, int32_t b)
 {
-	ui addr;
-	si value;
-	int32_t a32, b32, res32;
+	int32_t old, res;
 
-	addr = cpu->r[rs1];
-	if (func3 == 2)
+	switch (op)
 	{
-		// 32-битные атомарные инструкции
-		// Здесь всего 1 ядро, и эмулятор не меняет порядок выполнения инструкций,
-		// поэтому, чтобы было попроще, не будем проверять aq/rl флаги
-		switch (func7 >> 2)
+		case AMO_ADD: return atomic_add32(p, b);
+		case AMO_SWAP: return atomic_swap32(p, b);
+		case AMO_XOR: return atomic_xor32(p, b);
+		case AMO_OR: return atomic_or32(p, b);
+		case AMO_AND: return atomic_and32(p, b);
+	}
+
+	// Для минимума и максимума атомарных операций хоста нет, повторять сравнение с обменом,
+	// пока значение в памяти не перестанет меняться другими процессорами
+	old = *p;
+	do
+	{
+		switch (op)
 		{
-			case 0x00: // AMOADD.W
-				// Атомарное сложение
-				// Прочитать значение по адресу из регистра rs1
-				if (!read32(cpu, addr, &value))
-					return;
-				// Если успешно (нет сбоя чтения/page fault), то сложить
-				// полученное значение со значением регистра rs2
-				a32 = (int32_t)value;
-				b32 = (int32_t)cpu->r[rs2];
-				res32 = a32 + b32;
-				// Записать значение по адресу из регистра rs1
-				// Если успешно, то записать в регистр rd прочитанное ранее из памяти значение
-				if (write32(cpu, addr, res32))
-					cpu->r[rd] = a32;
-				return;
-			case 0x01: // AMOSWAP.W
-				// Атомарный обмен
-				if (!read32(cpu, addr, &value))
-					return;
-				a32 = (int32_t)value;
-				b32 = (int32_t)cpu->r[rs2];
-				res32 = b32;
-				if (write32(cpu, addr, res32))
-					cpu->r[rd] = a32;
-				return;
-			case 0x02: // LR.W
-				// Чтение с резервированием адреса
-				// Инструкция считывает слово по адресу, находящемуся в регистре rs1
-				// и добавляет резервирование этого адреса для последующей инструкции SC.
-				// Здесь всего 1 адрес используется, но в спецификации разрешено 1 ядру
-				// иметь набор активных адресов
-				if (addr & 3u)
-				{
-					// Слово должно быть выровнено в памяти
-					trap(cpu, EX_STORE_MISALIGNED, addr);
-					return;
-				}
-				// Попробовать прочитать значение
-				if (!read32(cpu, addr, &value))
-					return;
-				// Если успешно, то записать результат в rd и добавить резервирование
-				cpu->r[rd] = (int32_t)value;
-				cpu->res_addr = addr;
-				return;
-			case 0x03: // SC.W
-				// Запись по совпадению зарезервированного адреса
-				// Инструкция работает в паре с LR
-				if (addr & 3u)
-				{
-					// Слово должно быть выровнено в памяти
-					trap(cpu, EX_STORE_MISALIGNED, addr);
-					return;
-				}
+			case AMO_MIN: res = old < b ? old : b; break;
+			case AMO_MAX: res = old > b ? old : b; break;
+			case AMO_MINU: res = (uint32_t)old < (uint32_t)b ? old : b; break;
+			default: res = (uint32_t)old > (uint32_t)b ? old : b; break;
+		}
+	} while (!atomic_cas32(p, &old, res));
+
+	return old;
+}
 
-				// Проверить, совпал ли ранее зарезервированный адрес
-				if (addr != cpu->res_addr)
-				{
-					// Если нет, то вернуть ненулевое значение
-					cpu->r[rd] = 1;
-					return;
-				}
+// Операция над 64-битным словом, возвращает прежнее значение
+static int64_t amo64(volatile int64_t* p, int op, int64_t b)
+{
+	int64_t old, res;
 
-				// Попытаться записать
-				if (write32(cpu, addr, (int32_t)cpu->r[rs2]))
-					cpu->r[rd] = 0; // ноль - успешно
-				else
-					cpu->r[rd] = 1; // ненулевое значение - ошибка
+	switch (op)
+	{
+		case AMO_ADD: return atomic_add64(p, b);
+		case AMO_SWAP: return atomic_swap64(p, b);
+		case AMO_XOR: return atomic_xor64(p, b);
+		case AMO_OR: return atomic_or64(p, b);
+		case AMO_AND: return atomic_and64(p, b);
+	}
 
-				cpu->res_addr = ~0u; // Сбросить резервирование адреса
-				return;
-			case 0x04: // AMOXOR.W
-				// Атомарная операция "исключающее ИЛИ"
-				if (!read32(cpu, addr, &value))
-					return;
-				a32 = (int32_t)value;
-				b32 = (int32_t)cpu->r[rs2];
-				res32 = a32 ^ b32;
-				if (write32(cpu, addr, res32))
-					cpu->r[rd] = a32;
-				return;
-			case 0x08: // AMOOR.W
-				// Атомарная операция "ИЛИ"
-				if (!read32(cpu, addr, &value))
-					return;
-				a32 = (int32_t)value;
-				b32 = (int32_t)cpu->r[rs2];
-				res32 = a32 | b32;
-				if (write32(cpu, addr, res32))
-					cpu->r[rd] = a32;
-				return;
-			case 0x0C: // AMOAND.W
-				// Атомарная операция "И"
-				if (!read32(cpu, addr, &value))
-					return;
-				a32 = (int32_t)value;
-				b32 = (int32_t)cpu->r[rs2];
-				res32 = a32 & b32;
-				if (write32(cpu, addr, res32))
-					cpu->r[rd] = a32;
-				return;
-			case 0x10: // AMOMIN.W
-				// Атомарная запись минимального значения со знаком
-				if (!read32(cpu, addr, &value))
-					return;
-				a32 = (int32_t)value;
-				b32 = (int32_t)cpu->r[rs2];
-				res32 = a32 < b32 ? a32 : b32;
-				if (write32(cpu, addr, res32))
-					cpu->r[rd] = a32;
-				return;
-			case 0x14: // AMOMAX.W
-				// Атомарная запись максимального значения со знаком
-				if (!read32(cpu, addr, &value))
-					return;
-				a32 = (int32_t)value;
-				b32 = (int32_t)cpu->r[rs2];
-				res32 = a32 > b32 ? a32 : b32;
-				if (write32(cpu, addr, res32))
-					cpu->r[rd] = a32;
-				return;
-			case 0x18: // AMOMINU.W
-				// Атомарная запись минимального значения без знака
-				if (!read32(cpu, addr, &value))
-					return;
-				a32 = (int32_t)value;
-				b32 = (int32_t)cpu->r[rs2];
-				res32 = ((uint32_t)a32) < (uint32_t)b32 ? a32 : b32;
-				if (write32(cpu, addr, res32))
-					cpu->r[rd] = a32;
-				return;
-			case 0x1C: // AMOMAXU.W
-				// Атомарная запись максимального значения без знака
-				if (!read32(cpu, addr, &value))
-					return;
-				a32 = (int32_t)value;
-				b32 = (int32_t)cpu->r[rs2];
-				res32 = ((uint32_t)a32) > (uint32_t)b32 ? a32 : b32;
-				if (write32(cpu, addr, res32))
-					cpu->r[rd] = a32;
-				return;
+	old = *p;
+	do
+	{
+		switch (op)
+		{
+			case AMO_MIN: res = old < b ? old : b; break;
+			case AMO_MAX: res = old > b ? old : b; break;
+			case AMO_MINU: res = (uint64_t)old < (uint64_t)b ? old : b; break;
+			default: res = (uint64_t)old > (uint64_t)b ? old : b; break;
 		}
+	} while (!atomic_cas64(p, &old, res));
+
+	return old;
+}
+
+void do_atomic(riscv_t* cpu, uint32_t instr, int rs1, int rs2, int rd, int func3, int func7)
+{
+	ui addr;
+	uint8_t* p;
+	int op = func7 >> 2;
+	int size;
+	int reserved = 0;
+	int32_t old32;
+	int64_t old64;
+
+	// Ширина: 2 - 32 бита (.W), 3 - 64 бита (.D, только в 64-битном режиме)
+#if XLEN == 64
+	if (func3 != 2 && func3 != 3)
+#else
+	if (func3 != 2)
+#endif
+	{
+		trap(cpu, EX_INSTR_ILLEGAL, cpu->instr_pc);
+		return;
 	}
-	else if (func3 == 3)
+	size = func3 == 2 ? 4 : 8;
+
+	switch (op)
 	{
-		// 64-битные атомарные инструкции, выполняются аналогично 32-битным
-		switch (func7 >> 2)
+		case AMO_ADD: case AMO_SWAP: case AMO_LR: case AMO_SC: case AMO_XOR: case AMO_OR:
+		case AMO_AND: case AMO_MIN: case AMO_MAX: case AMO_MINU: case AMO_MAXU:
+			break;
+		default:
+			trap(cpu, EX_INSTR_ILLEGAL, cpu->instr_pc);
+			return;
+	}
+
+	// Слово должно быть выровнено в памяти, тогда оно не пересекает границу страницы
+	addr = cpu->r[rs1];
+	if (addr & (size - 1))
+	{
+		trap(cpu, op == AMO_LR ? EX_LOAD_MISALIGNED : EX_STORE_MISALIGNED, addr);
+		return;
+	}
+
+	if (op == AMO_LR)
+	{
+		// Чтение с резервированием адреса
+		p = tlb_translate(cpu, addr, TLB_READ);
+		if (p == NULL)
 		{
-			case 0x00: // AMOADD.D
-				if (!read64(cpu, addr, &value))
-					return;
-				if (!write64(cpu, addr, value + cpu->r[rs2]))
-					return;
-				cpu->r[rd] = value;
-				return;
-			case 0x01: // AMOSWAP.D
-				if (!read64(cpu, addr, &value))
-					return;
-				if (!write64(cpu, addr, cpu->r[rs2]))
-					return;
-				cpu->r[rd] = value;
-				return;
-			case 0x02: // LR.D
-				if (addr & 7u)
-				{
-					trap(cpu, EX_STORE_MISALIGNED, addr);
-					return;
-				}
-				if (!read64(cpu, addr, &value))
-					return;
-				cpu->r[rd] = value;
-				cpu->res_addr = addr;
-				return;
-			case 0x03: // SC.D
-				if (addr & 7u)
-				{
-					trap(cpu, EX_STORE_MISALIGNED, addr);
-					return;
-				}
+			// Атомарные операции возможны только с ОЗУ
+			if (cpu->mmio_addr != MMIO_NONE)
+				trap(cpu, EX_LOAD_ACCESS, addr);
+			return;
+		}
+		if (size == 4)
+			cpu->res_value = *(volatile int32_t*)p;
+		else
+			cpu->res_value = (si)*(volatile int64_t*)p;
+		cpu->res_addr = addr;
+		cpu->r[rd] = cpu->res_value;
+		return;
+	}
 
-				if (addr != cpu->res_addr)
-				{
-					cpu->r[rd] = 1;
-					return;
-				}
+	// Резервирование сбрасывается любой инструкцией SC, даже неудачной: ядро пользуется
+	// этим при выходе из исключения, чтобы прервать LR/SC прерванного кода
+	if (op == AMO_SC)
+	{
+		reserved = addr == cpu->res_addr;
+		cpu->res_addr = ~(ui)0;
+	}
 
-				if (write64(cpu, addr, cpu->r[rs2]))
-					cpu->r[rd] = 0;
-				else
-					cpu->r[rd] = 1;
+	// Остальные инструкции записывают в память, нужно право записи
+	p = tlb_translate(cpu, addr, TLB_WRITE);
+	if (p == NULL)
+	{
+		if (cpu->mmio_addr != MMIO_NONE)
+			trap(cpu, EX_STORE_ACCESS, addr);
+		return;
+	}
 
-				cpu->res_addr = ~0u;
-				return;
-			case 0x04: // AMOXOR.D
-				if (!read64(cpu, addr, &value))
-					return;
-				if (!write64(cpu, addr, value ^ cpu->r[rs2]))
-					return;
-				cpu->r[rd] = value;
-				return;
-			case 0x08: // AMOOR.D
-				if (!read64(cpu, addr, &value))
-					return;
-				if (!write64(cpu, addr, value | cpu->r[rs2]))
-					return;
-				cpu->r[rd] = value;
-				return;
-			case 0x0C: // AMOAND.D
-				if (!read64(cpu, addr, &value))
-					return;
-				if (!write64(cpu, addr, value & cpu->r[rs2]))
-					return;
-				cpu->r[rd] = value;
-				return;
-			case 0x10: // AMOMIN.D
-				if (!read64(cpu, addr, &value))
-					return;
-				if (!write64(cpu, addr, value < cpu->r[rs2] ? value : cpu->r[rs2]))
-					return;
-				cpu->r[rd] = value;
-				return;
-			case 0x14: // AMOMAX.D
-				if (!read64(cpu, addr, &value))
-					return;
-				if (!write64(cpu, addr, value > cpu->r[rs2] ? value : cpu->r[rs2]))
-					return;
-				cpu->r[rd] = value;
-				return;
-			case 0x18: // AMOMINU.D
-				if (!read64(cpu, addr, &value))
-					return;
-				if (!write64(cpu, addr, ((uint64_t)value) < (uint64_t)cpu->r[rs2] ? value : cpu->r[rs2]))
-					return;
-				cpu->r[rd] = value;
-				return;
-			case 0x1C: // AMOMAXU.D
-				if (!read64(cpu, addr, &value))
-					return;
-				if (!write64(cpu, addr, ((uint64_t)value) > (uint64_t)cpu->r[rs2] ? value : cpu->r[rs2]))
-					return;
-				cpu->r[rd] = value;
-				return;
+	if (op == AMO_SC)
+	{
+		if (!reserved)
+		{
+			// Адрес не резервировался, вернуть ненулевое значение
+			cpu->r[rd] = 1;
+			return;
+		}
+		// Запись по совпадению зарезервированного адреса и значения
+		if (size == 4)
+		{
+			old32 = (int32_t)cpu->res_value;
+			cpu->r[rd] = atomic_cas32((volatile int32_t*)p, &old32, (int32_t)cpu->r[rs2]) ? 0 : 1;
+		}
+		else
+		{
+			old64 = (int64_t)cpu->res_value;
+			cpu->r[rd] = atomic_cas64((volatile int64_t*)p, &old64, (int64_t)cpu->r[rs2]) ? 0 : 1;
 		}
+		return;
 	}
 
-	trap(cpu, EX_INSTR_ILLEGAL, cpu->instr_pc);
+	// AMO: в rd записывается прежнее значение из памяти (32-битное - с расширением знака)
+	if (size == 4)
+		cpu->r[rd] = amo32((volatile int32_t*)p, op, (int32_t)cpu->r[rs2]);
+	else
+		cpu->r[rd] = (si)amo64((volatile int64_t*)p, op, (int64_t)cpu->r[rs2]);
 }
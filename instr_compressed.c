@@ -2,6 +2,11 @@
 #include "decode.h"
 
 // Упакованные (16-битные) инструкции
+// Каждая 16-битная инструкция равносильна одной 32-битной. Таблица соответствия
+// заполняется при запуске, после чего 16-битные инструкции декодируются и выполняются
+// так же, как обычные. Недопустимым кодам соответствует 0.
+
+uint32_t rvc_table[65536];
 
 static int32_t signext(int32_t value, int sign, int bits)
 {
@@ -10,27 +15,74 @@ static int32_t signext(int32_t value, int sign, int bits)
 	return value;
 }
 
-ui get_reg(riscv_t* cpu, int reg)
+// Сборка 32-битных инструкций разных форматов
+
+static uint32_t enc_r(int opcode, int rd, int func3, int rs1, int rs2, int func7)
+{
+	return (func7 << 25) | (rs2 << 20) | (rs1 << 15) | (func3 << 12) | (rd << 7) | opcode;
+}
+
+static uint32_t enc_i(int opcode, int rd, int func3, int rs1, int32_t imm)
+{
+	return ((uint32_t)imm << 20) | (rs1 << 15) | (func3 << 12) | (rd << 7) | opcode;
+}
+
+static uint32_t enc_s(int func3, int rs1, int rs2, int32_t imm)
+{
+	return (bits(imm, 11, 5) << 25) | (rs2 << 20) | (rs1 << 15) | (func3 << 12) | (bits(imm, 4, 0) << 7) | 0x23;
+}
+
+static uint32_t enc_b(int func3, int rs1, int rs2, int32_t imm)
 {
-	return cpu->r[reg];
+	return ((uint32_t)bit(imm, 12) << 31) | (bits(imm, 10, 5) << 25) | (rs2 << 20) | (rs1 << 15) | (func3 << 12) |
+		(bits(imm, 4, 1) << 8) | (bit(imm, 11) << 7) | 0x63;
 }
 
-si get_regi(riscv_t* cpu, int reg)
+static uint32_t enc_u(int opcode, int rd, int32_t imm)
 {
-	return cpu->r[reg];
+	return ((uint32_t)imm & 0xFFFFF000u) | (rd << 7) | opcode;
 }
 
-void set_reg(riscv_t* cpu, int reg, si value)
+static uint32_t enc_j(int rd, int32_t imm)
 {
-	if (reg > 0)
-		cpu->r[reg] = value;
+	return ((uint32_t)bit(imm, 20) << 31) | (bits(imm, 10, 1) << 21) | (bit(imm, 11) << 20) | (bits(imm, 19, 12) << 12) |
+		(rd << 7) | 0x6F;
 }
 
-static void quadrant0(riscv_t* cpu, uint32_t op)
+// Смещение для C.J и C.JAL
+static int32_t cj_imm(uint32_t op)
+{
+	int32_t imm;
+
+	imm = bit(op, 2) << 5;
+	imm |= bits(op, 5, 3) << 1;
+	imm |= bit(op, 6) << 7;
+	imm |= bit(op, 7) << 6;
+	imm |= bit(op, 8) << 10;
+	imm |= bits(op, 10, 9) << 8;
+	imm |= bit(op, 11) << 4;
+	return signext(imm, bit(op, 12), 11);
+}
+
+// Смещение для C.BEQZ и C.BNEZ
+static int32_t cb_imm(uint32_t op)
+{
+	int32_t imm;
+
+	imm = bit(op, 2) << 5;
+	imm |= bits(op, 4, 3) << 1;
+	imm |= bits(op, 6, 5) << 6;
+	imm |= bits(op, 11, 10) << 3;
+	return signext(imm, bit(op, 12), 8);
+}
+
+static uint32_t quadrant0(uint32_t op)
 {
 	int rs1, rs2, rd, uimm;
-	ui addr;
-	si value;
+
+	// Код из одних нулей никогда не является инструкцией
+	if (op == 0)
+		return 0;
 
 	rs2 = rd = bits(op, 4, 2) + 8;
 	rs1 = bits(op, 9, 7) + 8;
@@ -41,86 +93,55 @@ static void quadrant0(riscv_t* cpu, uint32_t op)
 			uimm |= bit(op, 6) << 2;
 			uimm |= bits(op, 10, 7) << 6;
 			uimm |= bits(op, 12, 11) << 4;
-			cpu->r[rd] = cpu->r[2] + uimm;
-			return;
+			return enc_i(0x13, rd, 0, 2, uimm);
 		case 2: // LW
 			uimm = bit(op, 5) << 6;
 			uimm |= bit(op, 6) << 2;
 			uimm |= bits(op, 12, 10) << 3;
-			addr = cpu->r[rs1] + uimm;
-			if (read32(cpu, addr, &value))
-				cpu->r[rd] = (int32_t)value;
-			return;
+			return enc_i(0x03, rd, 2, rs1, uimm);
 		case 3: // LD
 			uimm = bits(op, 6, 5) << 6;
 			uimm |= bits(op, 12, 10) << 3;
-			addr = cpu->r[rs1] + uimm;
-			if (read64(cpu, addr, &value))
-				cpu->r[rd] = value;
-			return;
+			return enc_i(0x03, rd, 3, rs1, uimm);
 		case 6: // SW
 			uimm = bit(op, 5) << 6;
 			uimm |= bit(op, 6) << 2;
 			uimm |= bits(op, 12, 10) << 3;
-			addr = cpu->r[rs1] + uimm;
-			write32(cpu, addr, (si)cpu->r[rs2]);
-			return;
+			return enc_s(2, rs1, rs2, uimm);
 		case 7: // SD
 			uimm = bits(op, 6, 5) << 6;
 			uimm |= bits(op, 12, 10) << 3;
-			addr = cpu->r[rs1] + uimm;
-			write64(cpu, addr, cpu->r[rs2]);
-			return;
+			return enc_s(3, rs1, rs2, uimm);
 	}
 
-	trap(cpu, EX_INSTR_ILLEGAL, cpu->instr_pc);
+	return 0;
 }
 
-static void quadrant1(riscv_t* cpu, uint32_t op)
+static uint32_t quadrant1(uint32_t op)
 {
-	unsigned int rs1, rs2, rd;
-	int32_t uimm;
+	int rs1, rs2, rd;
 	int32_t imm;
-	int32_t a32, b32, res32;
 
 	switch (bits(op, 15, 13))
 	{
 		case 0: // ADDI
-			imm = bits(op, 6, 2);
-			imm = signext(imm, bit(op, 12), 5);
+			imm = signext(bits(op, 6, 2), bit(op, 12), 5);
 			rd = bits(op, 11, 7);
-			cpu->r[rd] += imm;
-			return;
+			return enc_i(0x13, rd, 0, rd, imm);
 		case 1:
 #if XLEN == 32
 			// JAL
-			imm = bit(op, 2) << 5;
-			imm |= bits(op, 5, 3) << 1;
-			imm |= bit(op, 6) << 7;
-			imm |= bit(op, 7) << 6;
-			imm |= bit(op, 8) << 10;
-			imm |= bits(op, 10, 9) << 8;
-			imm |= bit(op, 11) << 4;
-			imm = signext(imm, bit(op, 12), 11);
-			cpu->r[1] = cpu->pc;
-			cpu->pc += imm - 2;
+			return enc_j(1, cj_imm(op));
 #else
 			// ADDIW
-			imm = bits(op, 6, 2);
-			imm = signext(imm, bit(op, 12), 5);
+			imm = signext(bits(op, 6, 2), bit(op, 12), 5);
 			rd = bits(op, 11, 7);
-			a32 = (int32_t)get_regi(cpu, rd);
-			b32 = (int32_t)imm;
-			res32 = a32 + b32;
-			set_reg(cpu, rd, res32);
+			return enc_i(0x1B, rd, 0, rd, imm);
 #endif
-			return;
 		case 2: // LI
-			imm = bits(op, 6, 2);
-			imm = signext(imm, bit(op, 12), 5);
+			imm = signext(bits(op, 6, 2), bit(op, 12), 5);
 			rd = bits(op, 11, 7);
-			set_reg(cpu, rd, imm);
-			return;
+			return enc_i(0x13, rd, 0, 0, imm);
 		case 3: // LUI / ADDI16SP
 			rd = bits(op, 11, 7);
 			if (rd == 2)
@@ -131,16 +152,12 @@ static void quadrant1(riscv_t* cpu, uint32_t op)
 				imm |= bit(op, 5) << 6;
 				imm |= bit(op, 6) << 4;
 				imm = signext(imm, bit(op, 12), 9);
-				set_reg(cpu, 2, get_reg(cpu, 2) + imm);
-			}
-			else
-			{
-				// LUI
-				imm = bits(op, 6, 2) << 12;
-				imm = signext(imm, bit(op, 12), 17);
-				set_reg(cpu, rd, imm);
+				return enc_i(0x13, 2, 0, 2, imm);
 			}
-			return;
+			// LUI
+			imm = bits(op, 6, 2) << 12;
+			imm = signext(imm, bit(op, 12), 17);
+			return enc_u(0x37, rd, imm);
 		case 4:
 			rs2 = bits(op, 4, 2) + 8;
 			rs1 = rd = bits(op, 9, 7) + 8;
@@ -148,100 +165,49 @@ static void quadrant1(riscv_t* cpu, uint32_t op)
 			{
 				case 0:
 				case 4: // SRLI
-					uimm = bits(op, 6, 2);
-					uimm |= bit(op, 12) << 5;
-					set_reg(cpu, rd, get_reg(cpu, rd) >> uimm);
-					return;
+					imm = bits(op, 6, 2) | (bit(op, 12) << 5);
+					return enc_i(0x13, rd, 5, rs1, imm);
 				case 1:
 				case 5: // SRAI
-					uimm = bits(op, 6, 2);
-					uimm |= bit(op, 12) << 5;
-					set_reg(cpu, rd, get_regi(cpu, rd) >> uimm);
-					return;
+					imm = bits(op, 6, 2) | (bit(op, 12) << 5);
+					return enc_i(0x13, rd, 5, rs1, imm | 0x400);
 				case 2:
 				case 6: // ANDI
-					uimm = bits(op, 6, 2);
-					uimm = signext(uimm, bit(op, 12), 5);
-					set_reg(cpu, rd, get_reg(cpu, rd) & uimm);
-					return;
+					imm = signext(bits(op, 6, 2), bit(op, 12), 5);
+					return enc_i(0x13, rd, 7, rs1, imm);
 				case 3:
 					switch (bits(op, 6, 5))
 					{
-						case 0: // SUB
-							set_reg(cpu, rd, get_reg(cpu, rs1) - get_reg(cpu, rs2));
-							return;
-						case 1: // XOR
-							set_reg(cpu, rd, get_reg(cpu, rs1) ^ get_reg(cpu, rs2));
-							return;
-						case 2: // OR
-							set_reg(cpu, rd, get_reg(cpu, rs1) | get_reg(cpu, rs2));
-							return;
-						case 3: // AND
-							set_reg(cpu, rd, get_reg(cpu, rs1) & get_reg(cpu, rs2));
-							return;
+						case 0: return enc_r(0x33, rd, 0, rs1, rs2, 0x20); // SUB
+						case 1: return enc_r(0x33, rd, 4, rs1, rs2, 0x00); // XOR
+						case 2: return enc_r(0x33, rd, 6, rs1, rs2, 0x00); // OR
+						case 3: return enc_r(0x33, rd, 7, rs1, rs2, 0x00); // AND
 					}
 					break;
 				case 7:
 					switch (bits(op, 6, 5))
 					{
-						case 0: // SUBW
-							a32 = (int32_t)get_regi(cpu, rs1);
-							b32 = (int32_t)get_regi(cpu, rs2);
-							res32 = a32 - b32;
-							set_reg(cpu, rd, res32);
-							return;
-						case 1: // ADDW
-							a32 = (int32_t)get_regi(cpu, rs1);
-							b32 = (int32_t)get_regi(cpu, rs2);
-							res32 = a32 + b32;
-							set_reg(cpu, rd, res32);
-							return;
+						case 0: return enc_r(0x3B, rd, 0, rs1, rs2, 0x20); // SUBW
+						case 1: return enc_r(0x3B, rd, 0, rs1, rs2, 0x00); // ADDW
 					}
 					break;
 			}
 			break;
 		case 5: // J
-			imm = bit(op, 2) << 5;
-			imm |= bits(op, 5, 3) << 1;
-			imm |= bit(op, 6) << 7;
-			imm |= bit(op, 7) << 6;
-			imm |= bit(op, 8) << 10;
-			imm |= bits(op, 10, 9) << 8;
-			imm |= bit(op, 11) << 4;
-			imm = signext(imm, bit(op, 12), 11);
-			cpu->pc += imm - 2;
-			return;
+			return enc_j(0, cj_imm(op));
 		case 6: // BEQZ
-			rs1 = bits(op, 9, 7) + 8;
-			imm = bit(op, 2) << 5;
-			imm |= bits(op, 4, 3) << 1;
-			imm |= bits(op, 6, 5) << 6;
-			imm |= bits(op, 11, 10) << 3;
-			imm = signext(imm, bit(op, 12), 8);
-			if (cpu->r[rs1] == 0)
-				cpu->pc += imm - 2;
-			return;
+			return enc_b(0, bits(op, 9, 7) + 8, 0, cb_imm(op));
 		case 7: // BNEZ
-			rs1 = bits(op, 9, 7) + 8;
-			imm = bit(op, 2) << 5;
-			imm |= bits(op, 4, 3) << 1;
-			imm |= bits(op, 6, 5) << 6;
-			imm |= bits(op, 11, 10) << 3;
-			imm = signext(imm, bit(op, 12), 8);
-			if (cpu->r[rs1] != 0)
-				cpu->pc += imm - 2;
-			return;
+			return enc_b(1, bits(op, 9, 7) + 8, 0, cb_imm(op));
 	}
 
-	trap(cpu, EX_INSTR_ILLEGAL, cpu->instr_pc);
+	return 0;
 }
 
-static void quadrant2(riscv_t* cpu, uint32_t op)
+static uint32_t quadrant2(uint32_t op)
 {
-	unsigned int rs1, rs2, rd;
-	si uimm;
-	ui addr;
-	si value;
+	int rs1, rs2, rd;
+	int32_t uimm;
 
 	switch (bits(op, 15, 13))
 	{
@@ -249,94 +215,73 @@ static void quadrant2(riscv_t* cpu, uint32_t op)
 			rd = bits(op, 11, 7);
 			uimm = bits(op, 6, 2);
 			uimm |= bit(op, 12) << 5;
-			set_reg(cpu, rd, get_reg(cpu, rd) << uimm);
-			return;
+			return enc_i(0x13, rd, 1, rd, uimm);
 		case 2: // LWSP
 			rd = bits(op, 11, 7);
 			uimm = bits(op, 3, 2) << 6;
 			uimm |= bits(op, 6, 4) << 2;
 			uimm |= bit(op, 12) << 5;
-			addr = cpu->r[2] + uimm;
-			if (read32(cpu, addr, &value))
-				set_reg(cpu, rd, value);
-			return;
+			return enc_i(0x03, rd, 2, 2, uimm);
 		case 3: // LDSP
 			rd = bits(op, 11, 7);
 			uimm = bits(op, 4, 2) << 6;
 			uimm |= bits(op, 6, 5) << 3;
 			uimm |= bit(op, 12) << 5;
-			addr = cpu->r[2] + uimm;
-			if (read64(cpu, addr, &value))
-				set_reg(cpu, rd, value);
-			return;
+			return enc_i(0x03, rd, 3, 2, uimm);
 		case 4:
 			rs1 = rd = bits(op, 11, 7);
 			rs2 = bits(op, 6, 2);
-			switch (bit(op, 12))
+			if (!bit(op, 12))
 			{
-				case 0:
-					if (rs2 == 0)
-					{
-						cpu->pc = get_reg(cpu, rs1); // JR
-					}
-					else
-					{
-						set_reg(cpu, rd, get_reg(cpu, rs2));
-					}
-					return;
-				case 1:
-					if (rd == 0 && rs2 == 0)
-					{
-						// EBREAK
-						trap(cpu, EX_BREAKPOINT, 0);
-					}
-					else if (rs2 == 0)
-					{
-						set_reg(cpu, 1, cpu->pc);
-						cpu->pc = get_reg(cpu, rs1);
-					}
-					else
-					{
-						set_reg(cpu, rd, get_reg(cpu, rd) + get_reg(cpu, rs2));
-					}
-					return;
+				if (rs2 == 0)
+					return enc_i(0x67, 0, 0, rs1, 0); // JR
+				return enc_r(0x33, rd, 0, 0, rs2, 0); // MV
 			}
-			break;
+			if (rd == 0 && rs2 == 0)
+				return 0x00100073; // EBREAK
+			if (rs2 == 0)
+				return enc_i(0x67, 1, 0, rs1, 0); // JALR
+			return enc_r(0x33, rd, 0, rd, rs2, 0); // ADD
 		case 6: // SWSP
 			rs2 = bits(op, 6, 2);
 			uimm = bits(op, 8, 7) << 6;
 			uimm |= bits(op, 12, 9) << 2;
-			addr = cpu->r[2] + uimm;
-			write32(cpu, addr, (int32_t)get_reg(cpu, rs2));
-			return;
+			return enc_s(2, 2, rs2, uimm);
 		case 7: // SDSP
 			rs2 = bits(op, 6, 2);
 			uimm = bits(op, 9, 7) << 6;
 			uimm |= bits(op, 12, 10) << 3;
-			addr = cpu->r[2] + uimm;
-			write64(cpu, addr, get_regi(cpu, rs2));
-			return;
+			return enc_s(3, 2, rs2, uimm);
 	}
 
-	trap(cpu, EX_INSTR_ILLEGAL, cpu->instr_pc);
+	return 0;
 }
 
-// 16-битные инструкции
-void do_step_compressed(riscv_t* cpu, uint16_t instr)
+// Заполнение таблицы 16-битных инструкций
+void rvc_init(void)
 {
+	uint32_t op;
+
 	// В зависимости от значений битов 0 и 1 кода инструкции,
-	// выполнить из соответствующего квадранта.
+	// декодировать из соответствующего квадранта.
 	// В каждом квадранте по-разному декодируются номера регистров
-	switch (instr & 0x03)
+	for (op = 0; op < 65536; op++)
 	{
-		case 0:
-			quadrant0(cpu, instr);
-			break;
-		case 1:
-			quadrant1(cpu, instr);
-			break;
-		case 2:
-			quadrant2(cpu, instr);
-			break;
+		switch (op & 0x03)
+		{
+			case 0:
+				rvc_table[op] = quadrant0(op);
+				break;
+			case 1:
+				rvc_table[op] = quadrant1(op);
+				break;
+			case 2:
+				rvc_table[op] = quadrant2(op);
+				break;
+			default:
+				// Это младшие 16 бит 32-битной инструкции
+				rvc_table[op] = 0;
+				break;
+		}
 	}
 }
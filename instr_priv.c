@@ -13,9 +13,30 @@ void do_priv(riscv_t* cpu, uint32_t instr, int rs1, int rs2, int rd, int func3,
 	// Беззнаковая константа для CSRR*I
 	zimm = bits(instr, 19, 15);
 
+	if ((instr & 0x7F) == 0x0F)
+	{
+		// FENCE.I - синхронизация кэша инструкций.
+		// Запись в память этим же процессором и так сбрасывает декодированные инструкции,
+		// а записи других процессоров и устройств становятся видны только после FENCE.I
+		if (hart_count > 1 || cpu->dma_write)
+		{
+			cpu->dma_write = 0;
+			dcache_flush(cpu);
+		}
+		return;
+	}
+
 	switch (func3)
 	{
 		case 0:
+			if (func7 == 0x09)
+			{
+				// SFENCE.VMA - очистка кэша трансляции адресов
+				// rs1 задаёт адрес, rs2 - ASID. Если регистр x0, то очищаются
+				// записи для всех адресов или для всех адресных пространств
+				tlb_flush_vma(cpu, rs1 != 0, cpu->r[rs1], rs2 != 0, (uint32_t)(cpu->r[rs2] & SATP_ASID_MASK));
+				return;
+			}
 			switch (csr)
 			{
 				case 0x000:
@@ -38,9 +59,7 @@ void do_priv(riscv_t* cpu, uint32_t instr, int rs1, int rs2, int rd, int func3,
 				case 0x105:
 					// WFI - спящий режим до появления прерывания
 					cpu->wfi = 1;
-					return;
-				case 0x120:
-					// SFENCE.VMA - очистка кэша трансляции адресов (здесь не используется)
+					cpu->irq_check = 1;
 					return;
 			}
 			break;
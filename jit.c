@@ -0,0 +1,954 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include "riscv.h"
+#include "tlb.h"
+#include "platform.h"
+
+// Динамическая трансляция базовых блоков RISC-V в код x86-64
+//
+// Блок - это последовательность инструкций внутри одной физической страницы,
+// заканчивающаяся переходом. Блоки ищутся по физическому адресу, виртуальному адресу
+// и режиму процессора. Целочисленные операции, загрузки/записи и переходы (в том числе
+// 16-битные) транслируются в машинный код, умножение/деление вызывают обработчики
+// интерпретатора, а CSR, атомарные и привилегированные инструкции выполняются
+// через do_step() в диспетчере.
+//
+// Прямые переходы внутри той же страницы связываются напрямую (jmp на код следующего блока),
+// переходы JALR ищут следующий блок в таблице. Запись в страницу с транслированным кодом
+// удаляет все её блоки (через сброс кэша декодированных инструкций).
+
+#if defined(__GNUC__) && defined(__x86_64__)
+
+// Размер буфера для кода
+#define JIT_CODE_SIZE				(64 * 1048576)
+// Запас места в буфере на 1 блок
+#define JIT_BLOCK_RESERVE			(64 * 1024)
+// Максимальное количество инструкций в блоке
+#define JIT_MAX_INSNS				64
+// Максимальное количество блоков
+#define JIT_MAX_BLOCKS				65536
+// Размер хэш-таблицы блоков (степень двойки)
+#define JIT_HASH_SIZE				16384
+
+// Регистры x86-64
+#define RAX							0
+#define RCX							1
+#define RDX							2
+#define RBX							3
+#define RSI							6
+#define RDI							7
+
+// Транслированный блок
+typedef struct jit_block_s
+{
+	// Физический адрес (смещение в ОЗУ) и виртуальный адрес первой инструкции
+	ui phys;
+	ui vpc;
+	// Режим процессора, для которого транслирован блок
+	int s_mode;
+	// Машинный код или NULL, если первую инструкцию нужно выполнить в интерпретаторе
+	uint8_t* code;
+	// Следующий блок в цепочке хэш-таблицы
+	struct jit_block_s* hash_next;
+	// Следующий блок той же страницы
+	struct jit_block_s* page_next;
+} jit_block_t;
+
+// Состояние транслятора
+typedef struct jit_s
+{
+	// Буфер для кода и текущая позиция в нём
+	uint8_t* code;
+	uint8_t* ptr;
+	// Вход в транслированный код и выход из него
+	void (*enter)(riscv_t* cpu, uint8_t* code);
+	uint8_t* exit;
+	// Блоки
+	jit_block_t blocks[JIT_MAX_BLOCKS];
+	int num_blocks;
+	jit_block_t* hash[JIT_HASH_SIZE];
+	// Счётчик полных очисток (связывать блоки можно, только если очистки не было)
+	uint32_t flushes;
+} jit_t;
+
+// Смещения полей ядра для адресации относительно RBX
+#define OFF_R(n)					((int32_t)(offsetof(riscv_t, r) + (n) * sizeof(si)))
+#define OFF_PC						((int32_t)offsetof(riscv_t, pc))
+#define OFF_INSTR_PC				((int32_t)offsetof(riscv_t, instr_pc))
+#define OFF_ASID					((int32_t)offsetof(riscv_t, asid))
+#define OFF_BUDGET					((int32_t)offsetof(riscv_t, jit_budget))
+#define OFF_CHAIN					((int32_t)offsetof(riscv_t, jit_chain))
+#define OFF_TLB(mode, type)			((int32_t)offsetof(riscv_t, tlb[mode][type]))
+
+// Генерация кода
+
+static void emit1(jit_t* j, uint8_t value)
+{
+	*j->ptr++ = value;
+}
+
+static void emit4(jit_t* j, uint32_t value)
+{
+	memcpy(j->ptr, &value, 4);
+	j->ptr += 4;
+}
+
+static void emit8(jit_t* j, uint64_t value)
+{
+	memcpy(j->ptr, &value, 8);
+	j->ptr += 8;
+}
+
+// Размер операнда: 32 бита, XLEN или 64 бита (для указателей хоста)
+#define W32							0
+#define WX							1
+#define W64							2
+
+// Префикс REX.W для 64-битных операций
+static void emit_rex(jit_t* j, int w)
+{
+	if (w == W64 || (w == WX && XLEN == 64))
+		emit1(j, 0x48);
+}
+
+// Операция reg, [rbx + disp32]
+static void emit_rm(jit_t* j, int w, uint8_t opcode, int reg, int32_t disp)
+{
+	emit_rex(j, w);
+	emit1(j, opcode);
+	emit1(j, 0x80 | (reg << 3) | RBX);
+	emit4(j, disp);
+}
+
+// Чтение регистра процессора в регистр хоста
+static void emit_get(jit_t* j, int reg, int n)
+{
+	if (n == 0)
+	{
+		// xor reg, reg
+		emit1(j, 0x31);
+		emit1(j, 0xC0 | (reg << 3) | reg);
+	}
+	else
+		emit_rm(j, WX, 0x8B, reg, OFF_R(n));
+}
+
+// Запись регистра хоста в регистр процессора (запись в x0 игнорируется)
+static void emit_put(jit_t* j, int reg, int n)
+{
+	if (n != 0)
+		emit_rm(j, WX, 0x89, reg, OFF_R(n));
+}
+
+// Операция dst, src (add, sub, and, or, xor, cmp)
+static void emit_alu(jit_t* j, int w, uint8_t opcode, int dst, int src)
+{
+	emit_rex(j, w);
+	emit1(j, opcode);
+	emit1(j, 0xC0 | (src << 3) | dst);
+}
+
+// Операция reg, imm32 (ext: 0 - add, 1 - or, 4 - and, 6 - xor, 7 - cmp)
+static void emit_alu_imm(jit_t* j, int w, int ext, int reg, int32_t imm)
+{
+	emit_rex(j, w);
+	emit1(j, 0x81);
+	emit1(j, 0xC0 | (ext << 3) | reg);
+	emit4(j, imm);
+}
+
+// Сдвиг на константу (ext: 4 - shl, 5 - shr, 7 - sar)
+static void emit_shift_imm(jit_t* j, int w, int ext, int reg, int count)
+{
+	emit_rex(j, w);
+	emit1(j, 0xC1);
+	emit1(j, 0xC0 | (ext << 3) | reg);
+	emit1(j, count);
+}
+
+// Сдвиг на CL
+static void emit_shift_cl(jit_t* j, int w, int ext, int reg)
+{
+	emit_rex(j, w);
+	emit1(j, 0xD3);
+	emit1(j, 0xC0 | (ext << 3) | reg);
+}
+
+// movsxd rax, eax - расширение знака 32-битного результата
+static void emit_sext32(jit_t* j)
+{
+	if (XLEN == 64)
+	{
+		emit1(j, 0x48);
+		emit1(j, 0x63);
+		emit1(j, 0xC0);
+	}
+}
+
+// setcc al; movzx eax, al
+static void emit_setcc(jit_t* j, uint8_t cc)
+{
+	emit1(j, 0x0F);
+	emit1(j, 0x90 | cc);
+	emit1(j, 0xC0);
+	emit1(j, 0x0F);
+	emit1(j, 0xB6);
+	emit1(j, 0xC0);
+}
+
+// Загрузка 64-битной константы в регистр хоста
+static void emit_mov_imm64(jit_t* j, int reg, uint64_t value)
+{
+	emit1(j, 0x48);
+	emit1(j, 0xB8 | reg);
+	emit8(j, value);
+}
+
+// Загрузка константы размером XLEN (со знаком) в регистр хоста
+static void emit_mov_imm(jit_t* j, int reg, si value)
+{
+	if (XLEN == 64 && (value < INT32_MIN || value > INT32_MAX))
+	{
+		emit_mov_imm64(j, reg, (uint64_t)value);
+		return;
+	}
+	// mov reg, imm32 (для 64 бит - с расширением знака)
+	emit_rex(j, WX);
+	emit1(j, 0xC7);
+	emit1(j, 0xC0 | reg);
+	emit4(j, (uint32_t)value);
+}
+
+// Запись константы в поле ядра размером XLEN
+static void emit_store_imm(jit_t* j, int32_t disp, ui value)
+{
+	emit_mov_imm(j, RAX, (si)value);
+	emit_rm(j, WX, 0x89, RAX, disp);
+}
+
+// Переход с 32-битным смещением, возвращает адрес смещения для исправления
+static uint8_t* emit_jmp(jit_t* j)
+{
+	emit1(j, 0xE9);
+	emit4(j, 0);
+	return j->ptr - 4;
+}
+
+static uint8_t* emit_jcc(jit_t* j, uint8_t cc)
+{
+	emit1(j, 0x0F);
+	emit1(j, 0x80 | cc);
+	emit4(j, 0);
+	return j->ptr - 4;
+}
+
+// Установить цель перехода
+static void patch(uint8_t* at, uint8_t* target)
+{
+	int32_t rel = (int32_t)(target - (at + 4));
+	memcpy(at, &rel, 4);
+}
+
+// Переход на выход из транслированного кода
+static void emit_exit(jit_t* j)
+{
+	patch(emit_jmp(j), j->exit);
+}
+
+// Вызов функции: mov rdi, rbx; [mov rsi, arg]; mov rax, func; call rax
+static void emit_call(jit_t* j, void* func, const void* arg)
+{
+	emit1(j, 0x48);
+	emit1(j, 0x89);
+	emit1(j, 0xDF);
+	if (arg != NULL)
+		emit_mov_imm64(j, RSI, (uint64_t)(uintptr_t)arg);
+	emit_mov_imm64(j, RAX, (uint64_t)(uintptr_t)func);
+	emit1(j, 0xFF);
+	emit1(j, 0xD0);
+}
+
+// Выход из блока с переходом на адрес target.
+// Если переход внутри той же страницы, то выход можно связать с блоком назначения:
+// первая инструкция jmp указывает на следующую, а после связывания - на код блока
+static void emit_goto(jit_t* j, ui target, int chainable)
+{
+	uint8_t* site;
+
+	if (chainable)
+	{
+		site = emit_jmp(j);
+		patch(site, j->ptr);
+		emit_store_imm(j, OFF_PC, target);
+		emit_mov_imm64(j, RAX, (uint64_t)(uintptr_t)site);
+		emit_rm(j, W64, 0x89, RAX, OFF_CHAIN);
+	}
+	else
+		emit_store_imm(j, OFF_PC, target);
+
+	emit_exit(j);
+}
+
+// Функции, которые вызываются из транслированного кода
+
+// Выполнить инструкцию обработчиком интерпретатора.
+// Возвращает 0, если блок нужно покинуть (переход, исключение, запись в код)
+static int jit_call(riscv_t* cpu, const insn_t* in)
+{
+	ui next = cpu->pc;
+
+	cpu->r[0] = 0;
+	in->exec(cpu, in);
+
+	return cpu->pc == next && !cpu->jit_stale;
+}
+
+static jit_block_t* jit_lookup_block(riscv_t* cpu, ui phys, ui vpc);
+
+// Поиск блока для косвенного перехода (JALR). Новые блоки здесь не транслируются
+static uint8_t* jit_lookup(riscv_t* cpu)
+{
+	uint8_t* p;
+	jit_block_t* b;
+
+	if (cpu->jit_budget <= 0)
+		return NULL;
+
+	p = tlb_lookup(cpu, cpu->pc, TLB_EXEC);
+	if (p == NULL)
+		return NULL;
+
+	b = jit_lookup_block(cpu, (ui)(p - cpu->ram), cpu->pc);
+	if (b == NULL)
+		return NULL;
+
+	cpu->r[0] = 0;
+	return b->code;
+}
+
+// Выполнение инструкции обработчиком интерпретатора,
+// выход из блока, если он вернул 0
+static void emit_interp(jit_t* j, const insn_t* in, insn_t* copy, ui pc)
+{
+	*copy = *in;
+	emit_store_imm(j, OFF_INSTR_PC, pc);
+	emit_store_imm(j, OFF_PC, pc + in->len);
+	emit_call(j, (void*)jit_call, copy);
+	// test eax, eax; jz exit
+	emit1(j, 0x85);
+	emit1(j, 0xC0);
+	patch(emit_jcc(j, 0x4), j->exit);
+}
+
+// Трансляция загрузки/записи: поиск в TLB прямо в коде,
+// при промахе - вызов обработчика интерпретатора
+static void emit_mem(jit_t* j, const insn_t* in, insn_t* copy, ui pc, int s_mode)
+{
+	int store = in->op >= OP_SB && in->op <= OP_SD;
+	int32_t tlb = OFF_TLB(s_mode, store ? TLB_WRITE : TLB_READ);
+	uint8_t *miss1, *miss2, *hit, *done;
+
+	// rax = адрес
+	emit_get(j, RAX, in->rs1);
+	emit_alu_imm(j, WX, 0, RAX, in->imm);
+
+	// rcx = номер страницы, rdx = адрес записи TLB
+	emit_alu(j, WX, 0x89, RCX, RAX);
+	emit_shift_imm(j, WX, 5, RCX, 12);
+	emit_alu(j, W32, 0x89, RDX, RCX);
+	emit_alu_imm(j, W32, 4, RDX, TLB_SIZE - 1);
+	// imul rdx, rdx, sizeof(tlb_entry_t)
+	emit1(j, 0x48);
+	emit1(j, 0x69);
+	emit1(j, 0xD2);
+	emit4(j, sizeof(tlb_entry_t));
+	emit_alu(j, W64, 0x01, RDX, RBX);
+
+	// cmp rcx, [rdx + tlb + vpn]
+	emit_rex(j, WX);
+	emit1(j, 0x3B);
+	emit1(j, 0x8A);
+	emit4(j, tlb + offsetof(tlb_entry_t, vpn));
+	miss1 = emit_jcc(j, 0x5);
+	// mov ecx, [rdx + tlb + asid]; cmp ecx, [rbx + asid]
+	emit1(j, 0x8B);
+	emit1(j, 0x8A);
+	emit4(j, tlb + offsetof(tlb_entry_t, asid));
+	emit_rm(j, W32, 0x3B, RCX, OFF_ASID);
+	hit = emit_jcc(j, 0x4);
+	// cmp ecx, TLB_ASID_GLOBAL
+	emit_alu_imm(j, W32, 7, RCX, (int32_t)TLB_ASID_GLOBAL);
+	miss2 = emit_jcc(j, 0x5);
+	patch(hit, j->ptr);
+
+	// rax = указатель на данные: (addr & 0xFFF) + page
+	emit1(j, 0x25);
+	emit4(j, 0xFFF);
+	emit1(j, 0x48);
+	emit1(j, 0x03);
+	emit1(j, 0x82);
+	emit4(j, tlb + offsetof(tlb_entry_t, page));
+
+	if (store)
+	{
+		emit_get(j, RCX, in->rs2);
+		switch (in->op)
+		{
+			case OP_SB: emit1(j, 0x88); break;
+			case OP_SH: emit1(j, 0x66); emit1(j, 0x89); break;
+			case OP_SW: emit1(j, 0x89); break;
+			case OP_SD: emit1(j, 0x48); emit1(j, 0x89); break;
+		}
+		emit1(j, 0x08);
+	}
+	else
+	{
+		switch (in->op)
+		{
+			case OP_LB: emit_rex(j, WX); emit1(j, 0x0F); emit1(j, 0xBE); break;
+			case OP_LH: emit_rex(j, WX); emit1(j, 0x0F); emit1(j, 0xBF); break;
+			case OP_LW:
+				if (XLEN == 64)
+				{
+					emit1(j, 0x48);
+					emit1(j, 0x63);
+				}
+				else
+					emit1(j, 0x8B);
+				break;
+			case OP_LD: emit1(j, 0x48); emit1(j, 0x8B); break;
+			case OP_LBU: emit1(j, 0x0F); emit1(j, 0xB6); break;
+			case OP_LHU: emit1(j, 0x0F); emit1(j, 0xB7); break;
+			case OP_LWU: emit1(j, 0x8B); break;
+		}
+		emit1(j, 0x00);
+		emit_put(j, RAX, in->rd);
+	}
+	done = emit_jmp(j);
+
+	// Промах TLB: выполнить инструкцию в интерпретаторе
+	patch(miss1, j->ptr);
+	patch(miss2, j->ptr);
+	emit_interp(j, in, copy, pc);
+
+	patch(done, j->ptr);
+}
+
+// Можно ли транслировать инструкцию в машинный код
+static int jit_native(int op)
+{
+	switch (op)
+	{
+		case OP_LD:
+		case OP_LWU:
+		case OP_SD:
+		case OP_ADDIW:
+		case OP_SLLIW:
+		case OP_SRLIW:
+		case OP_SRAIW:
+		case OP_ADDW:
+		case OP_SUBW:
+		case OP_SLLW:
+		case OP_SRLW:
+		case OP_SRAW:
+			// 64-битные операции транслируются только для RV64
+			return XLEN == 64;
+		case OP_MULDIV:
+		case OP_MULDIVW:
+		case OP_SYSTEM:
+		case OP_ATOMIC:
+		case OP_ILLEGAL:
+		case OP_DECODE:
+			return 0;
+	}
+	return 1;
+}
+
+// Может ли инструкция выполняться внутри блока через обработчик интерпретатора
+static int jit_callable(int op)
+{
+	switch (op)
+	{
+		case OP_SYSTEM:
+		case OP_ATOMIC:
+		case OP_ILLEGAL:
+		case OP_DECODE:
+			return 0;
+	}
+	return 1;
+}
+
+// Трансляция одной инструкции, не являющейся переходом
+static void emit_insn(jit_t* j, const insn_t* in, insn_t* copy, ui pc, int s_mode)
+{
+	int w = WX;
+
+	if (!jit_native(in->op))
+	{
+		emit_interp(j, in, copy, pc);
+		return;
+	}
+
+	if (in->op >= OP_LB && in->op <= OP_SD)
+	{
+		emit_mem(j, in, copy, pc, s_mode);
+		return;
+	}
+
+	// Результат остальных операций в x0 не нужен
+	if (in->rd == 0)
+		return;
+
+	switch (in->op)
+	{
+		case OP_ADDIW:
+		case OP_SLLIW:
+		case OP_SRLIW:
+		case OP_SRAIW:
+		case OP_ADDW:
+		case OP_SUBW:
+		case OP_SLLW:
+		case OP_SRLW:
+		case OP_SRAW:
+			w = W32;
+			break;
+	}
+
+	switch (in->op)
+	{
+		case OP_LUI:
+			emit_mov_imm(j, RAX, in->imm);
+			break;
+		case OP_AUIPC:
+			emit_mov_imm(j, RAX, (si)(ui)(pc + in->imm));
+			break;
+		case OP_ADDI:
+		case OP_ADDIW:
+			emit_get(j, RAX, in->rs1);
+			emit_alu_imm(j, w, 0, RAX, in->imm);
+			break;
+		case OP_XORI:
+			emit_get(j, RAX, in->rs1);
+			emit_alu_imm(j, WX, 6, RAX, in->imm);
+			break;
+		case OP_ORI:
+			emit_get(j, RAX, in->rs1);
+			emit_alu_imm(j, WX, 1, RAX, in->imm);
+			break;
+		case OP_ANDI:
+			emit_get(j, RAX, in->rs1);
+			emit_alu_imm(j, WX, 4, RAX, in->imm);
+			break;
+		case OP_SLTI:
+		case OP_SLTIU:
+			emit_get(j, RCX, in->rs1);
+			emit1(j, 0x31);
+			emit1(j, 0xC0);
+			emit_alu_imm(j, WX, 7, RCX, in->imm);
+			emit_setcc(j, in->op == OP_SLTI ? 0xC : 0x2);
+			break;
+		case OP_SLLI:
+		case OP_SLLIW:
+			emit_get(j, RAX, in->rs1);
+			emit_shift_imm(j, w, 4, RAX, in->imm);
+			break;
+		case OP_SRLI:
+		case OP_SRLIW:
+			emit_get(j, RAX, in->rs1);
+			emit_shift_imm(j, w, 5, RAX, in->imm);
+			break;
+		case OP_SRAI:
+		case OP_SRAIW:
+			emit_get(j, RAX, in->rs1);
+			emit_shift_imm(j, w, 7, RAX, in->imm);
+			break;
+		case OP_ADD:
+		case OP_ADDW:
+			emit_get(j, RAX, in->rs1);
+			emit_get(j, RCX, in->rs2);
+			emit_alu(j, w, 0x01, RAX, RCX);
+			break;
+		case OP_SUB:
+		case OP_SUBW:
+			emit_get(j, RAX, in->rs1);
+			emit_get(j, RCX, in->rs2);
+			emit_alu(j, w, 0x29, RAX, RCX);
+			break;
+		case OP_XOR:
+			emit_get(j, RAX, in->rs1);
+			emit_get(j, RCX, in->rs2);
+			emit_alu(j, WX, 0x31, RAX, RCX);
+			break;
+		case OP_OR:
+			emit_get(j, RAX, in->rs1);
+			emit_get(j, RCX, in->rs2);
+			emit_alu(j, WX, 0x09, RAX, RCX);
+			break;
+		case OP_AND:
+			emit_get(j, RAX, in->rs1);
+			emit_get(j, RCX, in->rs2);
+			emit_alu(j, WX, 0x21, RAX, RCX);
+			break;
+		case OP_SLT:
+		case OP_SLTU:
+			emit_get(j, RDX, in->rs1);
+			emit_get(j, RCX, in->rs2);
+			emit1(j, 0x31);
+			emit1(j, 0xC0);
+			emit_alu(j, WX, 0x39, RDX, RCX);
+			emit_setcc(j, in->op == OP_SLT ? 0xC : 0x2);
+			break;
+		case OP_SLL:
+		case OP_SLLW:
+			emit_get(j, RAX, in->rs1);
+			emit_get(j, RCX, in->rs2);
+			emit_shift_cl(j, w, 4, RAX);
+			break;
+		case OP_SRL:
+		case OP_SRLW:
+			emit_get(j, RAX, in->rs1);
+			emit_get(j, RCX, in->rs2);
+			emit_shift_cl(j, w, 5, RAX);
+			break;
+		case OP_SRA:
+		case OP_SRAW:
+			emit_get(j, RAX, in->rs1);
+			emit_get(j, RCX, in->rs2);
+			emit_shift_cl(j, w, 7, RAX);
+			break;
+		case OP_FENCE:
+			return;
+	}
+
+	// Как и в интерпретаторе, SRLW/SRLIW дают результат без расширения знака
+	if (w == W32 && in->op != OP_SRLW && in->op != OP_SRLIW)
+		emit_sext32(j);
+
+	emit_put(j, RAX, in->rd);
+}
+
+// Трансляция перехода, завершающего блок
+static void emit_branch(jit_t* j, const insn_t* in, ui pc, ui page)
+{
+	ui next = pc + in->len;
+	ui target = pc + in->imm;
+	uint8_t* taken;
+	uint8_t* miss;
+	uint8_t cc = 0;
+
+	switch (in->op)
+	{
+		case OP_JAL:
+			if (in->rd != 0)
+				emit_store_imm(j, OFF_R(in->rd), next);
+			emit_goto(j, target, (target >> 12) == page);
+			return;
+		case OP_JALR:
+			// rax = адрес перехода, затем запись адреса возврата
+			emit_get(j, RAX, in->rs1);
+			emit_alu_imm(j, WX, 0, RAX, in->imm);
+			emit_rm(j, WX, 0x89, RAX, OFF_PC);
+			if (in->rd != 0)
+			{
+				emit_mov_imm(j, RCX, (si)next);
+				emit_put(j, RCX, in->rd);
+			}
+			// Поиск следующего блока
+			emit_call(j, (void*)jit_lookup, NULL);
+			emit1(j, 0x48);
+			emit1(j, 0x85);
+			emit1(j, 0xC0);
+			miss = emit_jcc(j, 0x4);
+			patch(miss, j->exit);
+			// jmp rax
+			emit1(j, 0xFF);
+			emit1(j, 0xE0);
+			return;
+		case OP_BEQ: cc = 0x4; break;
+		case OP_BNE: cc = 0x5; break;
+		case OP_BLT: cc = 0xC; break;
+		case OP_BGE: cc = 0xD; break;
+		case OP_BLTU: cc = 0x2; break;
+		case OP_BGEU: cc = 0x3; break;
+	}
+
+	emit_get(j, RAX, in->rs1);
+	emit_get(j, RCX, in->rs2);
+	emit_alu(j, WX, 0x39, RAX, RCX);
+	taken = emit_jcc(j, cc);
+	emit_goto(j, next, (next >> 12) == page);
+	patch(taken, j->ptr);
+	emit_goto(j, target, (target >> 12) == page);
+}
+
+static int is_branch(int op)
+{
+	return (op >= OP_BEQ && op <= OP_JALR);
+}
+
+// Хэш для поиска блока
+static unsigned jit_hash(ui phys, ui vpc)
+{
+	return (unsigned)((phys >> 1) ^ (vpc >> 12) ^ (phys >> 13)) & (JIT_HASH_SIZE - 1);
+}
+
+static jit_block_t* jit_lookup_block(riscv_t* cpu, ui phys, ui vpc)
+{
+	jit_block_t* b;
+
+	for (b = cpu->jit->hash[jit_hash(phys, vpc)]; b != NULL; b = b->hash_next)
+		if (b->phys == phys && b->vpc == vpc && b->s_mode == cpu->s_mode)
+			return b;
+
+	return NULL;
+}
+
+// Полная очистка транслированного кода
+static void jit_flush(riscv_t* cpu)
+{
+	jit_t* j = cpu->jit;
+	dcache_page_t* page;
+
+	for (page = cpu->dcache_live; page != NULL; page = page->next)
+		page->jit = NULL;
+
+	memset(j->hash, 0, sizeof(j->hash));
+	j->num_blocks = 0;
+	j->ptr = j->code;
+	j->flushes++;
+}
+
+// Трансляция блока, начинающегося с адреса vpc (смещение phys в ОЗУ)
+static jit_block_t* jit_translate(riscv_t* cpu, ui phys, ui vpc, uint8_t* host)
+{
+	jit_t* j = cpu->jit;
+	insn_t insns[JIT_MAX_INSNS];
+	insn_t* copies;
+	dcache_page_t* page;
+	jit_block_t* b;
+	uint32_t instr;
+	uint8_t* budget_exit;
+	ui pc = vpc;
+	int n = 0, i;
+	unsigned h;
+
+	if (j->num_blocks >= JIT_MAX_BLOCKS || j->ptr + JIT_BLOCK_RESERVE > j->code + JIT_CODE_SIZE)
+		jit_flush(cpu);
+
+	// Блоки привязаны к декодированной странице: запись в неё удаляет их
+	page = dcache_get(cpu, RAM_START + phys);
+
+	// Собрать инструкции блока (не выходя за пределы страницы)
+	while (n < JIT_MAX_INSNS)
+	{
+		instr = *((uint16_t*)host);
+		if ((instr & 3) == 3)
+		{
+			if ((pc & 0xFFF) == 0xFFE)
+				break;
+			instr |= ((uint32_t)*((uint16_t*)(host + 2))) << 16;
+		}
+		decode(instr, &insns[n]);
+		if (!jit_callable(insns[n].op))
+			break;
+		pc += insns[n].len;
+		host += insns[n].len;
+		if (is_branch(insns[n++].op) || (pc & 0xFFF) == 0)
+			break;
+	}
+
+	b = &j->blocks[j->num_blocks++];
+	b->phys = phys;
+	b->vpc = vpc;
+	b->s_mode = cpu->s_mode;
+	b->code = NULL;
+	h = jit_hash(phys, vpc);
+	b->hash_next = j->hash[h];
+	j->hash[h] = b;
+	b->page_next = page->jit;
+	page->jit = b;
+
+	// Первую инструкцию нельзя транслировать - её выполнит интерпретатор
+	if (n == 0)
+		return b;
+
+	// Копии инструкций для вызова обработчиков интерпретатора
+	j->ptr = (uint8_t*)(((uintptr_t)j->ptr + 15) & ~(uintptr_t)15);
+	copies = (insn_t*)j->ptr;
+	j->ptr += n * sizeof(insn_t);
+	b->code = j->ptr;
+
+	// Проверка оставшегося количества инструкций
+	// cmp dword [rbx + budget], 0; jle budget_exit
+	emit1(j, 0x83);
+	emit1(j, 0xBB);
+	emit4(j, OFF_BUDGET);
+	emit1(j, 0x00);
+	budget_exit = emit_jcc(j, 0xE);
+	// sub dword [rbx + budget], n
+	emit1(j, 0x81);
+	emit1(j, 0xAB);
+	emit4(j, OFF_BUDGET);
+	emit4(j, n);
+
+	pc = vpc;
+	for (i = 0; i < n; i++)
+	{
+		if (is_branch(insns[i].op))
+			emit_branch(j, &insns[i], pc, vpc >> 12);
+		else
+			emit_insn(j, &insns[i], &copies[i], pc, cpu->s_mode);
+		pc += insns[i].len;
+	}
+
+	// Блок закончился не переходом
+	if (!is_branch(insns[n - 1].op))
+		emit_goto(j, pc, (pc >> 12) == (vpc >> 12));
+
+	patch(budget_exit, j->ptr);
+	emit_store_imm(j, OFF_PC, vpc);
+	emit_exit(j);
+
+	return b;
+}
+
+// Найти или транслировать блок для текущего PC
+static jit_block_t* jit_find(riscv_t* cpu)
+{
+	uint8_t* p;
+	jit_block_t* b;
+	ui phys;
+
+	p = tlb_lookup(cpu, cpu->pc, TLB_EXEC);
+	if (p == NULL)
+		return NULL;
+
+	phys = (ui)(p - cpu->ram);
+	b = jit_lookup_block(cpu, phys, cpu->pc);
+	if (b == NULL)
+		b = jit_translate(cpu, phys, cpu->pc, p);
+
+	return b;
+}
+
+int jit_init(riscv_t* cpu)
+{
+	jit_t* j;
+
+	j = (jit_t*)calloc(1, sizeof(jit_t));
+	if (j == NULL)
+		return 0;
+
+	j->code = (uint8_t*)exec_alloc(JIT_CODE_SIZE);
+	if (j->code == NULL)
+	{
+		free(j);
+		return 0;
+	}
+	j->ptr = j->code;
+
+	// Вход: push rbx; mov rbx, rdi; jmp rsi
+	j->enter = (void (*)(riscv_t*, uint8_t*))j->ptr;
+	emit1(j, 0x53);
+	emit1(j, 0x48);
+	emit1(j, 0x89);
+	emit1(j, 0xFB);
+	emit1(j, 0xFF);
+	emit1(j, 0xE6);
+	// Выход: pop rbx; ret
+	j->exit = j->ptr;
+	emit1(j, 0x5B);
+	emit1(j, 0xC3);
+
+	// Этот код не очищается никогда
+	j->code = j->ptr;
+
+	cpu->jit = j;
+	return 1;
+}
+
+// Выполнить примерно count инструкций транслированным кодом,
+// возвращает количество выполненных
+int jit_run(riscv_t* cpu, int count)
+{
+	jit_block_t* b;
+	uint32_t flushes;
+
+	cpu->jit_budget = count;
+	cpu->jit_chain = NULL;
+	flushes = cpu->jit->flushes;
+
+	while (cpu->jit_budget > 0 && !cpu->wfi && !cpu->irq_check && !cpu->mail)
+	{
+		b = jit_find(cpu);
+
+		// Связать выход предыдущего блока с найденным блоком
+		if (cpu->jit_chain != NULL)
+		{
+			if (b != NULL && b->code != NULL && flushes == cpu->jit->flushes && !cpu->jit_stale)
+				patch(cpu->jit_chain, b->code);
+			cpu->jit_chain = NULL;
+		}
+		flushes = cpu->jit->flushes;
+
+		if (b == NULL || b->code == NULL)
+		{
+			// Инструкцию нельзя транслировать, или страница ещё не в TLB
+			do_step(cpu);
+			cpu->jit_budget--;
+			continue;
+		}
+
+		cpu->jit_stale = 0;
+		cpu->r[0] = 0;
+		cpu->jit->enter(cpu, b->code);
+	}
+
+	return count - cpu->jit_budget;
+}
+
+// Удаление блоков страницы (при записи в неё)
+void jit_invalidate(riscv_t* cpu, dcache_page_t* page)
+{
+	jit_t* j = cpu->jit;
+	jit_block_t* b;
+	jit_block_t** pp;
+
+	for (b = page->jit; b != NULL; b = b->page_next)
+	{
+		for (pp = &j->hash[jit_hash(b->phys, b->vpc)]; *pp != NULL; pp = &(*pp)->hash_next)
+		{
+			if (*pp == b)
+			{
+				*pp = b->hash_next;
+				break;
+			}
+		}
+	}
+	page->jit = NULL;
+
+	// Если сейчас выполняется блок из этой страницы, то он должен завершиться
+	cpu->jit_stale = 1;
+}
+
+#else
+
+// Трансляция поддерживается только для x86-64
+
+int jit_init(riscv_t* cpu)
+{
+	return 0;
+}
+
+int jit_run(riscv_t* cpu, int count)
+{
+	return 0;
+}
+
+void jit_invalidate(riscv_t* cpu, dcache_page_t* page)
+{
+}
+
+#endif
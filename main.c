@@ -2,23 +2,54 @@
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
+#include <time.h>
 #include "config.h"
 #include "riscv.h"
 #include "platform.h"
+#include "virtio.h"
+#include "console.h"
+#include "snapshot.h"
+#include "forkserver.h"
+#include "profile.h"
 
 #define KERNEL_LOAD_OFFSET	0
-#define DTB_LOAD_OFFSET		(sizeof(ram) - 65536)
+#define DTB_LOAD_OFFSET		(ram_size - 65536)
 
-uint8_t ram[RAM_SIZE];
+// Параметры командной строки ядра Linux
+#define BOOTARGS			"earlycon=sbi console=hvc0"
 
-riscv_t cpu;
+// Параметры машины
+typedef struct
+{
+	int core;              // Способ выполнения инструкций (CORE_*)
+	int deterministic;     // Время по количеству инструкций
+	int harts;             // Количество процессоров
+	int ram_mb;            // Размер ОЗУ в мегабайтах
+	int pages;             // Способ выделения ОЗУ (HOST_PAGES_*)
+	const char* dtb_file;  // Файл devicetree (NULL - создать описание)
+	const char* disk_file; // Файл образа диска (NULL - без диска)
+	const char* disk_base; // Базовый образ, если диск - оверлей
+	int disk_readonly;     // Диск только для чтения
+	const char* net;       // Сетевой интерфейс хоста (NULL - без сети)
+	const char* save_file;    // Файл снимка, сохраняемого по Ctrl-A s (NULL - не сохранять)
+	const char* restore_file; // Снимок, из которого восстанавливается машина (NULL - загрузка)
+	const char* fork_socket;  // Сокет сервера заданий (NULL - без сервера)
+	ui fork_pc;               // Адрес запуска сервера заданий (~0 - по вызову SBI)
+} machine_config_t;
+
+// Физическая память, общая для всех процессоров
+uint8_t* ram;
+ui ram_size;
+uint8_t* ram_dirty;
+// ОЗУ отображено из файла снимка
+static int ram_mapped;
 
 // Загрузка файла в физическую память процессора
-static int load_file(const char* name, int ram_offset)
+static int load_file(const char* name, ui ram_offset)
 {
 	FILE* f;
 
-	if (ram_offset < 0 || ram_offset >= sizeof(ram))
+	if (ram_offset >= ram_size)
 	{
 		printf("\"%s\": load offset is out of range\n", name);
 		return 0;
@@ -31,33 +62,359 @@ static int load_file(const char* name, int ram_offset)
 		return 0;
 	}
 
-	fread(&ram[ram_offset], 1, sizeof(ram) - ram_offset, f);
+	fread(&ram[ram_offset], 1, ram_size - ram_offset, f);
 
 	fclose(f);
 
 	return 1;
 }
 
-int main()
+// Освобождение процессоров предыдущего запуска
+static void machine_done(void)
 {
-	// Инициализировать и сбросить ядро процессора
-	memset(&cpu, 0, sizeof(cpu));
-	cpu.ram = ram;
-	reset(&cpu);
+	int i;
+
+	for (i = 0; i < hart_count; i++)
+	{
+		dcache_done(harts[i]);
+		if (harts[i]->wait != NULL)
+			host_wait_free(harts[i]->wait);
+		free(harts[i]);
+		harts[i] = NULL;
+	}
+	hart_count = 0;
+
+	virtio_done();
+	plic_done();
+	bus_reset();
+
+	if (ram != NULL && ram_mapped)
+		host_file_unmap(ram, ram_size);
+	else if (ram != NULL)
+		host_ram_free(ram, ram_size);
+	ram = NULL;
+	ram_mapped = 0;
+	free(ram_dirty);
+	ram_dirty = NULL;
+}
+
+// Подготовка машины к запуску: выделение памяти, сброс процессоров,
+// подключение устройств и загрузка файлов
+static int machine_init(const machine_config_t* config)
+{
+	riscv_t* cpu;
+	char bootargs[128];
+	int i, count = config->harts;
+
+	machine_done();
+
+	if (config->restore_file != NULL)
+	{
+		// ОЗУ, количество процессоров и размер ОЗУ - из снимка
+		ram = snapshot_ram(config->restore_file, &count, &ram_size);
+		if (ram == NULL)
+			return 0;
+		ram_mapped = 1;
+	}
+	else
+	{
+		// Выделить ОЗУ. Память хоста занимают только страницы, к которым обращался гость,
+		// поэтому новая память всегда заполнена нулями
+		ram_size = (ui)config->ram_mb * 1048576;
+		ram = (uint8_t*)host_ram_alloc(ram_size, config->pages);
+		if (ram == NULL)
+		{
+			printf("Unable to allocate %d MB of RAM%s\n", config->ram_mb, config->pages == HOST_PAGES_HUGE ? " in huge pages" : "");
+			return 0;
+		}
+	}
+	ram_dirty = (uint8_t*)calloc(ram_size >> 12, 1);
+	if (ram_dirty == NULL)
+	{
+		printf("Out of memory\n");
+		return 0;
+	}
+
+	// Подготовить таблицу 16-битных инструкций
+	rvc_init();
+
+	// Время у всех процессоров отсчитывается от одного момента
+	clock_init();
+
+	// Инициализировать и сбросить процессоры
+	for (i = 0; i < count; i++)
+	{
+		cpu = (riscv_t*)calloc(1, sizeof(riscv_t));
+		if (cpu == NULL)
+		{
+			printf("Hart %d: out of memory\n", i);
+			return 0;
+		}
+		harts[i] = cpu;
+		hart_count = i + 1;
+
+		cpu->hartid = i;
+		cpu->ram = ram;
+		cpu->core = config->core;
+		cpu->deterministic = config->deterministic;
+		cpu->wait = host_wait_create();
+		if (cpu->wait == NULL)
+		{
+			printf("Hart %d: unable to create wait object\n", i);
+			return 0;
+		}
+		if (!dcache_init(cpu))
+		{
+			printf("Decoded instruction cache: out of memory\n");
+			return 0;
+		}
+		reset(cpu);
+
+		// Процессор 0 начинает работу сразу, остальные ждут запуска через SBI HSM
+		cpu->hsm_state = i == 0 ? HSM_STARTED : HSM_STOPPED;
+
+		// Включить динамическую трансляцию
+		if (config->core == CORE_JIT && !jit_init(cpu))
+		{
+			if (i == 0)
+				printf("JIT is not supported on this host, using interpreter\n");
+			cpu->core = CORE_THREADED;
+		}
+	}
+
+	// Подключить устройства
+	if (!plic_init(count))
+		return 0;
+	if (config->disk_file != NULL && !virtio_blk_init(config->disk_file, config->disk_base, config->disk_readonly))
+		return 0;
+	if (config->net != NULL && !virtio_net_init(config->net))
+		return 0;
+	if (!virtio_console_init())
+		return 0;
+	if (!virtio_map_empty())
+		return 0;
+
+	// Продолжить работу сохранённой машины
+	if (config->restore_file != NULL)
+		return snapshot_restore(config->restore_file);
 
 	// Загрузить ядро
 	if (!load_file(IMAGE_FILE, KERNEL_LOAD_OFFSET))
-		return 1;
+		return 0;
 
-	// Загрузить devicetree файл
-	if (!load_file(DTB_FILE, DTB_LOAD_OFFSET))
-		return 1;
+	// Загрузить или создать devicetree. С диском корневая файловая система - на нём
+	// (если в ядре нет initramfs)
+	strcpy(bootargs, BOOTARGS);
+	if (config->disk_file != NULL)
+		strcat(bootargs, config->disk_readonly ? " root=/dev/vda ro" : " root=/dev/vda rw");
+	if (config->dtb_file != NULL)
+	{
+		if (!load_file(config->dtb_file, DTB_LOAD_OFFSET))
+			return 0;
+	}
+	else if (!devtree_build(&ram[DTB_LOAD_OFFSET], ram_size - DTB_LOAD_OFFSET, count, bootargs))
+	{
+		printf("Devicetree is too large\n");
+		return 0;
+	}
 
 	// Передать параметры ядру
-	cpu.r[10] = 0; // Идентификатор ядра
-	cpu.r[11] = RAM_START + DTB_LOAD_OFFSET; // Адрес devicetree
+	cpu = harts[0];
+	cpu->r[10] = 0; // Идентификатор ядра
+	cpu->r[11] = RAM_START + DTB_LOAD_OFFSET; // Адрес devicetree
 	// Точка входа
-	cpu.pc = RAM_START + KERNEL_LOAD_OFFSET;
+	cpu->pc = RAM_START + KERNEL_LOAD_OFFSET;
+
+	return 1;
+}
+
+// Сравнение скорости интерпретаторов: каждый выполняет одинаковое количество
+// инструкций с самого начала загрузки системы
+static int bench(long long count, const machine_config_t* config)
+{
+	static const int cores[] = { CORE_STEP, CORE_THREADED };
+	static const char* names[] = { "step", "threaded" };
+	machine_config_t c = *config;
+	double mips[2];
+	long long done;
+	clock_t t;
+	int i;
+
+	for (i = 0; i < 2; i++)
+	{
+		// Время считается по инструкциям, чтобы все интерпретаторы выполняли один и тот же код.
+		// Память выделяется заново, поэтому она в том же состоянии, что и при первом запуске
+		c.core = cores[i];
+		c.deterministic = 1;
+		c.harts = 1;
+		c.dtb_file = NULL;
+		c.disk_file = NULL;
+		c.net = NULL;
+		c.save_file = NULL;
+		c.restore_file = NULL;
+		if (!machine_init(&c))
+			return 1;
+
+		// Время ожидания в WFI не учитывается, т.к. измеряется время процессора
+		t = clock();
+		for (done = 0; done < count; )
+			done += run_slice(harts[0]);
+		t = clock() - t;
+
+		mips[i] = done / ((double)(t > 0 ? t : 1) / CLOCKS_PER_SEC) / 1000000.0;
+	}
+
+	printf("\n");
+	for (i = 0; i < 2; i++)
+		printf("%-10s %8.2f MIPS\n", names[i], mips[i]);
+
+	return 0;
+}
+
+static void usage(const char* name)
+{
+	printf("Usage: %s [-step | -jit] [-deterministic] [-smp harts] [-m megabytes] [-hugepages thp | huge]\n", name);
+	printf("          [-disk file [-base image] [-readonly]] [-net tap:name | unix:local:peer]\n");
+	printf("          [-save file] [-restore file] [-fork-server socket [-fork-pc address]]\n");
+	printf("          [-run command] [-profile file [-profile-hz n]] [-dtb file] [-bench millions]\n");
+	printf("  -step           simple interpreter (one handler call per instruction)\n");
+	printf("  -jit            translate guest code to host machine code\n");
+	printf("  -deterministic  count time by executed instructions instead of host clock\n");
+	printf("                  (reproducible runs, idle time is skipped)\n");
+	printf("  -smp harts      number of processors, each runs in its own host thread\n");
+	printf("  -m megabytes    RAM size (default %d, maximum %d)\n", RAM_SIZE_MB, (int)RAM_MAX_MB);
+	printf("  -hugepages thp  back RAM with transparent huge pages\n");
+	printf("  -hugepages huge back RAM with huge pages reserved in the host OS\n");
+	printf("  -disk file      attach disk image file as virtio block device (/dev/vda)\n");
+	printf("  -base image     disk file is a copy-on-write overlay of image (created if missing)\n");
+	printf("  -readonly       do not allow the guest to write to the disk image\n");
+	printf("  -net tap:name   connect virtio network adapter to host tap interface\n");
+	printf("  -net unix:local:peer\n");
+	printf("                  exchange frames with another emulator through datagram sockets\n");
+	printf("  -save file      save snapshot of the running machine to file on Ctrl-A s\n");
+	printf("                  (only pages changed since the restored or last full snapshot\n");
+	printf("                  if file is not that snapshot)\n");
+	printf("  -restore file   resume the machine saved in snapshot file instead of booting\n");
+	printf("                  (attach the same disk and network, -smp and -m are ignored);\n");
+	printf("                  Ctrl-A r returns to the last saved or restored snapshot\n");
+	printf("  -fork-server socket\n");
+	printf("                  when the guest reaches the fork point, fork a copy of the machine\n");
+	printf("                  for each connection to unix socket (the connection is its console)\n");
+	printf("  -fork-pc address\n");
+	printf("                  fork point is the guest instruction at address instead of SBI call\n");
+	printf("  -run command    type command at the first shell prompt, then power off the machine\n");
+	printf("                  and exit with the command's exit status\n");
+	printf("  -profile file   sample guest pc and call stack of each processor into file\n");
+	printf("                  (fold with tools/profile.py for flamegraph.pl)\n");
+	printf("  -profile-hz n   samples per second of guest time (default %d)\n", PROFILE_HZ);
+	printf("  -dtb file       load devicetree from file instead of generating it\n");
+	printf("  -bench millions run the given number of instructions (in millions)\n");
+	printf("                  with each interpreter and print their speed\n");
+}
+
+int main(int argc, char** argv)
+{
+	machine_config_t config;
+	long long bench_count = 0;
+	const char* command = NULL;
+	const char* profile_file = NULL;
+	int profile_hz = PROFILE_HZ;
+	int i;
+
+	memset(&config, 0, sizeof(config));
+	config.core = CORE_THREADED;
+	config.harts = 1;
+	config.ram_mb = RAM_SIZE_MB;
+	config.pages = HOST_PAGES_NORMAL;
+	config.fork_pc = ~(ui)0;
+
+	// Разобрать параметры командной строки
+	for (i = 1; i < argc; i++)
+	{
+		if (strcmp(argv[i], "-step") == 0)
+			config.core = CORE_STEP;
+		else if (strcmp(argv[i], "-jit") == 0)
+			config.core = CORE_JIT;
+		else if (strcmp(argv[i], "-deterministic") == 0)
+			config.deterministic = 1;
+		else if (strcmp(argv[i], "-smp") == 0 && i + 1 < argc && atoi(argv[i + 1]) > 0 && atoi(argv[i + 1]) <= MAX_HARTS)
+			config.harts = atoi(argv[++i]);
+		else if (strcmp(argv[i], "-m") == 0 && i + 1 < argc && atoi(argv[i + 1]) > 0 && atoi(argv[i + 1]) <= RAM_MAX_MB)
+			config.ram_mb = atoi(argv[++i]);
+		else if (strcmp(argv[i], "-hugepages") == 0 && i + 1 < argc && strcmp(argv[i + 1], "thp") == 0)
+		{
+			config.pages = HOST_PAGES_TRANSPARENT;
+			i++;
+		}
+		else if (strcmp(argv[i], "-hugepages") == 0 && i + 1 < argc && strcmp(argv[i + 1], "huge") == 0)
+		{
+			config.pages = HOST_PAGES_HUGE;
+			i++;
+		}
+		else if (strcmp(argv[i], "-disk") == 0 && i + 1 < argc)
+			config.disk_file = argv[++i];
+		else if (strcmp(argv[i], "-base") == 0 && i + 1 < argc)
+			config.disk_base = argv[++i];
+		else if (strcmp(argv[i], "-readonly") == 0)
+			config.disk_readonly = 1;
+		else if (strcmp(argv[i], "-net") == 0 && i + 1 < argc)
+			config.net = argv[++i];
+		else if (strcmp(argv[i], "-save") == 0 && i + 1 < argc)
+			config.save_file = argv[++i];
+		else if (strcmp(argv[i], "-restore") == 0 && i + 1 < argc)
+			config.restore_file = argv[++i];
+		else if (strcmp(argv[i], "-fork-server") == 0 && i + 1 < argc)
+			config.fork_socket = argv[++i];
+		else if (strcmp(argv[i], "-fork-pc") == 0 && i + 1 < argc)
+			config.fork_pc = (ui)strtoull(argv[++i], NULL, 0);
+		else if (strcmp(argv[i], "-run") == 0 && i + 1 < argc)
+			command = argv[++i];
+		else if (strcmp(argv[i], "-profile") == 0 && i + 1 < argc)
+			profile_file = argv[++i];
+		else if (strcmp(argv[i], "-profile-hz") == 0 && i + 1 < argc && atoi(argv[i + 1]) > 0)
+			profile_hz = atoi(argv[++i]);
+		else if (strcmp(argv[i], "-dtb") == 0 && i + 1 < argc)
+			config.dtb_file = argv[++i];
+		else if (strcmp(argv[i], "-bench") == 0 && i + 1 < argc && atoi(argv[i + 1]) > 0)
+			bench_count = atoi(argv[++i]) * 1000000ll;
+		else
+		{
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	// Копии машины, порождённые сервером заданий, работают с одними файлами
+	if (config.fork_socket != NULL && (config.net != NULL || (config.disk_file != NULL && !config.disk_readonly)))
+	{
+		printf("Fork server requires a read-only disk and no network\n");
+		return 1;
+	}
+	if (config.fork_socket != NULL && profile_file != NULL)
+	{
+		printf("Fork server cannot be profiled\n");
+		return 1;
+	}
+
+	// Запустить поток консольного ввода/вывода
+	console_start();
+	if (command != NULL && !console_run(command))
+	{
+		printf("Command is too long\n");
+		return 1;
+	}
+
+	if (bench_count > 0)
+		return bench(bench_count, &config);
+
+	if (!machine_init(&config))
+		return 1;
+	if (config.save_file != NULL || config.restore_file != NULL)
+		snapshot_enable(config.save_file);
+	if (config.fork_socket != NULL)
+		fork_server_enable(config.fork_socket, config.fork_pc);
+	if (profile_file != NULL && !profile_enable(profile_file, profile_hz))
+		return 1;
 
 	// Инициализировать консольный ввод/вывод
 	console_init();
@@ -65,9 +422,10 @@ int main()
 	// Запланировать восстановление консольного ввода/вывода при выходе
 	atexit(console_restore);
 
-	// Запустить эмуляцию
-	for (;;)
-		step1us(&cpu);
+	// Запустить эмуляцию: процессоры, кроме 0, в отдельных потоках, процессор 0 - в этом
+	if (!smp_start())
+		return 1;
+	hart_run(harts[0]);
 
 	return 0;
 }
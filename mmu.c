@@ -1,12 +1,33 @@
+#include <string.h>
 #include "riscv.h"
+#include "atomic.h"
+
+// Сравнение с обменом записи таблицы страниц: при неудаче в *old - текущее значение
+static int pte_cas(ui* p, ui* old, ui value)
+{
+#if XLEN == 64
+	return atomic_cas64((volatile int64_t*)p, (int64_t*)old, (int64_t)value);
+#else
+	return atomic_cas32((volatile int32_t*)p, (int32_t*)old, (int32_t)value);
+#endif
+}
 
 // Установка режима MMU и адреса каталога страниц
 ui set_atp(riscv_t* cpu, ui value)
 {
+	int mmu_was_on = cpu->mmu_on;
+	uint64_t root;
+
 	cpu->mmu_on = 0;
+	cpu->asid = 0;
 
 	if ((value & SATP_MODE_ENABLE) == 0)
+	{
+		// MMU выключается, трансляции адресов больше не действительны
+		if (mmu_was_on)
+			tlb_flush(cpu);
 		return value;
+	}
 
 	// ОС пытается включить MMU
 
@@ -34,14 +55,34 @@ ui set_atp(riscv_t* cpu, ui value)
 
 	// Избавиться от всех режимов, кроме sv32 или sv39
 	if ((value & SATP_MODE_MASK) != SATP_MODE_ENABLE)
+	{
+		if (mmu_was_on)
+			tlb_flush(cpu);
 		return 0;
+	}
 
-	// Здесь можно сделать дополнительные проверки
+	// Главный каталог страниц должен быть в ОЗУ.
+	// В 32-битном режиме физический адрес 34-битный, поэтому считается в 64 битах
+	root = ((uint64_t)(value & SATP_PPN_MASK) << 12) - RAM_START;
+	if (root >= ram_size)
+	{
+		if (mmu_was_on)
+			tlb_flush(cpu);
+		return 0;
+	}
 
 	// Сохранить адрес главного каталога страниц
-	cpu->atp = (ui*)&cpu->ram[(value & 0x3FFFFu) << 12];
+	cpu->atp = (ui*)&cpu->ram[root];
+
+	// При переключении адресного пространства TLB не очищается: записи помечены ASID,
+	// а глобальные страницы ядра действительны во всех адресных пространствах.
+	// ОС сама выполняет SFENCE.VMA, когда повторно использует ASID.
+	// Очистить нужно только записи, созданные при выключенном MMU
+	if (!mmu_was_on)
+		tlb_flush(cpu);
 
-	// Включить MMU
+	// Запомнить ASID и включить MMU
+	cpu->asid = (value >> SATP_ASID_SHIFT) & SATP_ASID_MASK;
 	cpu->mmu_on = 1;
 
 	return value;
@@ -55,20 +96,30 @@ ui set_atp(riscv_t* cpu, ui value)
  * set - битовая маска для установки битов страницы (например, отметить, как модифицированную)
  * cause1 - код исключения по доступу к памяти
  * cause2 - код исключения page fault, когда страница не существует или нет прав доступа
+ * flags - флаги найденной страницы (результат, может быть NULL)
+ * pagemask_out - маска смещения внутри найденной страницы (результат, может быть NULL)
  */ 
-int virt2phys(riscv_t* cpu, ui* res, ui virt, ui test, ui set, ui cause1, ui cause2)
+int virt2phys(riscv_t* cpu, ui* res, ui virt, ui test, ui set, ui cause1, ui cause2, ui* flags, ui* pagemask_out)
 {
 	ui pte;
 	ui vpn[MMU_LEVELS];
 	ui* table;
 	ui addr;
 	ui pagemask;
+	ui global = 0;
 	int i;
 
 	// Если не включен блок MMU, то виртуальный адрес всегда соответствует физическому
 	*res = virt;
 	if (!cpu->mmu_on)
+	{
+		// Без трансляции доступ к памяти разрешён всегда и одинаково для любого ASID
+		if (flags != NULL)
+			*flags = MMU_V | MMU_R | MMU_W | MMU_X | MMU_GLOBAL;
+		if (pagemask_out != NULL)
+			*pagemask_out = 0xFFF;
 		return 1;
+	}
 
 	// Извлечь номера страниц для виртуального адреса
 	// Каждая страница состоит из 1024 или 512 записей
@@ -97,6 +148,9 @@ int virt2phys(riscv_t* cpu, ui* res, ui virt, ui test, ui set, ui cause1, ui cau
 			return 0;
 		}
 
+		// Флаг G у каталога распространяется на все страницы, описанные в нём
+		global |= pte & MMU_GLOBAL;
+
 		// Если хотя бы 1 из битов R, W, X установлен, то это указатель на страницу с данными
 		if (pte & 0x0E)
 		{
@@ -120,8 +174,34 @@ int virt2phys(riscv_t* cpu, ui* res, ui virt, ui test, ui set, ui cause1, ui cau
 
 			// Установить необходимые флаги в таблице. Здесь обычно страница помечается, как
 			// accessed, т.е., к ней был доступ, либо dirty, если в неё была запись.
-			// ОС таким образом сможет узнать, к каким сраницам обращалось приложение
-			table[vpn[i]] |= set;
+			// ОС таким образом сможет узнать, к каким сраницам обращалось приложение.
+			// Другие процессоры могут одновременно менять запись атомарными операциями
+			// (ОС сбрасывает флаг A или саму запись), поэтому флаги добавляются сравнением
+			// с обменом, и только если их ещё нет
+			while ((pte & set) != set)
+			{
+				if (pte_cas(&table[vpn[i]], &pte, pte | set))
+				{
+					// Страница таблицы изменена (для разностных снимков)
+					ram_dirty[((uint8_t*)&table[vpn[i]] - cpu->ram) >> 12] = 1;
+					pte |= set;
+					break;
+				}
+				// Запись изменилась: повторить, пока она действительна и разрешает доступ
+				if (!(pte & MMU_V) || (pte & test) != test)
+				{
+					if (cause2 != 0)
+						trap(cpu, cause2, virt);
+					return 0;
+				}
+				if (!cpu->s_mode && !(pte & MMU_USER))
+				{
+					if (cause1 != 0)
+						trap(cpu, cause1, virt);
+					return 0;
+				}
+			}
+			addr = (pte >> 10) << 12u;
 
 			// Старшие биты физического адреса берутся из каталога,
 			// а младшие из запрошенного виртуального адреса.
@@ -129,13 +209,18 @@ int virt2phys(riscv_t* cpu, ui* res, ui virt, ui test, ui set, ui cause1, ui cau
 			// и 4 КБ или 2 МБ или 1 ГБ для 64-битного процессора, в зависимости от кол-ва уровней
 			*res = addr + (virt & pagemask);
 
+			if (flags != NULL)
+				*flags = (pte & 0x3FF) | global;
+			if (pagemask_out != NULL)
+				*pagemask_out = pagemask;
+
 			return 1;
 		}
 
 		// Это указатель на каталог страниц нижнего уровня
 		// Получить физический адрес каталога
 		addr -= RAM_START;
-		if (addr >= RAM_SIZE)
+		if (addr >= ram_size)
 		{
 			if (cause1 != 0)
 				trap(cpu, cause1, virt);
@@ -153,3 +238,139 @@ int virt2phys(riscv_t* cpu, ui* res, ui virt, ui test, ui set, ui cause1, ui cau
 
 	return 0;
 }
+
+// Очистка TLB
+void tlb_flush(riscv_t* cpu)
+{
+	memset(cpu->tlb, 0xFF, sizeof(cpu->tlb));
+}
+
+/* Заполнение записи TLB (вызывается при промахе)
+ * cpu - ядро risc-v
+ * virt - виртуальный адрес
+ * type - тип доступа: TLB_READ, TLB_WRITE или TLB_EXEC
+ * Возвращает указатель на байт в памяти хоста или NULL в случае ошибки
+ */
+uint8_t* tlb_fill(riscv_t* cpu, ui virt, int type)
+{
+	static const ui test[3] = { MMU_R, MMU_W, MMU_X };
+	static const ui set[3] = { MMU_ACCESSED, MMU_ACCESSED | MMU_DIRTY, MMU_ACCESSED };
+	static const ui cause1[3] = { EX_LOAD_ACCESS, EX_STORE_ACCESS, EX_INSTR_ACCESS };
+	static const ui cause2[3] = { EX_LOAD_PAGE_FAULT, EX_STORE_PAGE_FAULT, EX_INSTR_PAGE_FAULT };
+	tlb_entry_t* e;
+	ui phys;
+	ui flags;
+	ui pagemask;
+
+	// Полный обход каталогов страниц. Биты A/D устанавливаются здесь,
+	// один раз при заполнении записи, а не при каждом обращении
+	if (!virt2phys(cpu, &phys, virt, test[type], set[type], cause1[type], cause2[type], &flags, &pagemask))
+	{
+		cpu->mmio_addr = MMIO_NONE;
+		return NULL;
+	}
+
+	// В TLB попадают только страницы ОЗУ
+	if (phys - RAM_START >= ram_size)
+	{
+		// Чтение/запись вне ОЗУ обрабатывает шина (см. bus.c),
+		// а выполнение кода возможно только из ОЗУ
+		cpu->mmio_addr = phys;
+		if (type == TLB_EXEC)
+		{
+			cpu->mmio_addr = MMIO_NONE;
+			trap(cpu, EX_INSTR_ACCESS, virt);
+		}
+		return NULL;
+	}
+	phys -= RAM_START;
+
+	// Запись в страницу с декодированными инструкциями сбрасывает их.
+	// Пока запись в TLB есть, страница считается изменённой
+	if (type == TLB_WRITE)
+	{
+		dcache_invalidate(cpu, RAM_START + phys);
+		ram_dirty[phys >> 12] = 1;
+	}
+
+	e = &cpu->tlb[cpu->s_mode][type][(virt >> 12) & (TLB_SIZE - 1)];
+	e->vpn = virt >> 12;
+	e->vpn_span = pagemask >> 12;
+	e->asid = (flags & MMU_GLOBAL) ? TLB_ASID_GLOBAL : cpu->asid;
+	e->page = &cpu->ram[phys & ~(ui)0xFFF];
+
+	return e->page + (virt & 0xFFF);
+}
+
+/* Выборочная очистка TLB (SFENCE.VMA)
+ * use_addr - очистить только записи, относящиеся к адресу addr
+ * use_asid - очистить только записи адресного пространства asid (кроме глобальных)
+ * Если не задано ни то, ни другое, то очищается весь TLB
+ */
+void tlb_flush_vma(riscv_t* cpu, int use_addr, ui addr, int use_asid, uint32_t asid)
+{
+	tlb_entry_t* e;
+	ui vpn = addr >> 12;
+	int i;
+
+	if (!use_addr && !use_asid)
+	{
+		tlb_flush(cpu);
+		return;
+	}
+
+	e = &cpu->tlb[0][0][0];
+	for (i = 0; i < 2 * 3 * TLB_SIZE; i++, e++)
+	{
+		if (e->vpn == TLB_INVALID)
+			continue;
+		// Большая страница может занимать несколько записей, все они относятся к адресу
+		if (use_addr && ((e->vpn ^ vpn) & ~e->vpn_span) != 0)
+			continue;
+		if (use_asid && e->asid != asid)
+			continue;
+		e->vpn = TLB_INVALID;
+	}
+}
+
+// Очистка записей TLB, пересекающихся с диапазоном адресов [start, end] (удалённый SFENCE.VMA).
+// use_asid - очистить только записи адресного пространства asid (кроме глобальных)
+void tlb_flush_range(riscv_t* cpu, ui start, ui end, int use_asid, uint32_t asid)
+{
+	tlb_entry_t* e;
+	ui first = start >> 12;
+	ui last = end >> 12;
+	ui base;
+	int i;
+
+	if (first == 0 && last == (~(ui)0 >> 12) && !use_asid)
+	{
+		tlb_flush(cpu);
+		return;
+	}
+
+	e = &cpu->tlb[0][0][0];
+	for (i = 0; i < 2 * 3 * TLB_SIZE; i++, e++)
+	{
+		if (e->vpn == TLB_INVALID)
+			continue;
+		// Страница (или большая страница) занимает номера [base, base + vpn_span]
+		base = e->vpn & ~e->vpn_span;
+		if (base > last || base + e->vpn_span < first)
+			continue;
+		if (use_asid && e->asid != asid)
+			continue;
+		e->vpn = TLB_INVALID;
+	}
+}
+
+// Удаление из TLB всех записей заданного типа, указывающих на страницу памяти хоста
+void tlb_flush_page(riscv_t* cpu, int type, uint8_t* page)
+{
+	int mode, i;
+
+	for (mode = 0; mode < 2; mode++)
+		for (i = 0; i < TLB_SIZE; i++)
+			if (cpu->tlb[mode][type][i].page == page)
+				cpu->tlb[mode][type][i].vpn = TLB_INVALID;
+}
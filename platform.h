@@ -1,13 +1,68 @@
 #ifndef PLATFORM_H
 #define PLATFORM_H
 
+#include <stddef.h>
+#include <stdint.h>
+
 // Платформенные функции для облегчения портирования
 
-int  sleep1ms();
+typedef struct host_wait_s host_wait_t;
+typedef struct host_mutex_s host_mutex_t;
+typedef struct host_file_s host_file_t;
+typedef struct host_net_s host_net_t;
+
+// Часть буфера для чтения/записи файла вразброс
+typedef struct
+{
+	void* base;
+	size_t size;
+} host_iov_t;
+
+int64_t host_time_ns(void);
+host_wait_t* host_wait_create(void);
+void host_wait_free(host_wait_t* w);
+void host_wait(host_wait_t* w, int64_t deadline_ns, int console);
+void host_wake(host_wait_t* w);
+int  host_thread_start(void (*func)(void*), void* arg);
+host_mutex_t* host_mutex_create(void);
+void host_mutex_free(host_mutex_t* m);
+void host_mutex_lock(host_mutex_t* m);
+void host_mutex_unlock(host_mutex_t* m);
+host_file_t* host_file_open(const char* name, int mode);
+int64_t host_file_size(host_file_t* f);
+int  host_file_read(host_file_t* f, const host_iov_t* iov, int count, uint64_t offset);
+int  host_file_write(host_file_t* f, const host_iov_t* iov, int count, uint64_t offset);
+int  host_file_flush(host_file_t* f);
+void host_file_close(host_file_t* f);
+const void* host_file_map(host_file_t* f, uint64_t size);
+void host_file_unmap(const void* p, uint64_t size);
+void* host_file_map_copy(host_file_t* f, uint64_t offset, uint64_t size);
+int  host_file_resize(host_file_t* f, uint64_t size);
+host_net_t* host_net_open(const char* spec);
+void host_net_close(host_net_t* n);
+int  host_net_send(host_net_t* n, const host_iov_t* iov, int count);
+int  host_net_recv(host_net_t* n, void* buf, size_t size);
+void host_net_wait(host_net_t* n, int rx);
+void host_net_wake(host_net_t* n);
+int  host_fork_server(const char* path);
 void console_init(void);
 void console_restore(void);
 int  console_kbhit(void);
-int  console_getchar(void);
-void console_putchar(int ch);
+int  console_input(void* buf, int size);
+void console_output(const void* buf, int size);
+void* exec_alloc(size_t size);
+
+// Способ выделения физической памяти гостя
+#define HOST_PAGES_NORMAL			0 // Обычные страницы
+#define HOST_PAGES_TRANSPARENT		1 // Прозрачные большие страницы (THP), если ОС их поддерживает
+#define HOST_PAGES_HUGE				2 // Зарезервированные в ОС большие страницы
+
+void* host_ram_alloc(size_t size, int pages);
+
+// Режим открытия файла
+#define HOST_FILE_READ				0 // Только чтение
+#define HOST_FILE_WRITE				1 // Чтение и запись
+#define HOST_FILE_CREATE			2 // Создать новый файл для чтения и записи (ошибка, если файл есть)
+void host_ram_free(void* p, size_t size);
 
 #endif
@@ -4,19 +4,702 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/ioctl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/timerfd.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+#include <sys/un.h>
+#include <linux/if.h>
+#include <linux/if_tun.h>
+#include <errno.h>
 #include <termios.h>
+#include <time.h>
 #include <unistd.h>
 #include "riscv.h"
+#include "platform.h"
 
 // Функции в этом файле относятся к хост-платформе Linux
 
-// Отправить поток в сон на 1 мс
-int sleep1ms(void)
+// Монотонное время хоста в наносекундах
+int64_t host_time_ns(void)
 {
-	usleep(1000);
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ll + ts.tv_nsec;
+}
+
+// Объект ожидания процессора: таймер и событие для пробуждения из других потоков
+struct host_wait_s
+{
+	int timer;
+	int event;
+	// Следующий объект в списке всех объектов (см. host_fork_server)
+	struct host_wait_s* next;
+};
+
+// Все объекты ожидания: после fork их дескрипторы общие с исходным процессом,
+// поэтому порождённый процесс создаёт их заново
+static host_wait_t* wait_list;
+static pthread_mutex_t wait_list_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Стандартный ввод закрыт или не может быть источником событий (например, /dev/null)
+static int stdin_eof;
+
+host_wait_t* host_wait_create(void)
+{
+	host_wait_t* w = (host_wait_t*)malloc(sizeof(host_wait_t));
+
+	if (w == NULL)
+		return NULL;
+
+	w->timer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	w->event = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (w->timer < 0 || w->event < 0)
+	{
+		if (w->timer >= 0)
+			close(w->timer);
+		if (w->event >= 0)
+			close(w->event);
+		free(w);
+		return NULL;
+	}
+
+	pthread_mutex_lock(&wait_list_lock);
+	w->next = wait_list;
+	wait_list = w;
+	pthread_mutex_unlock(&wait_list_lock);
+
+	return w;
+}
+
+void host_wait_free(host_wait_t* w)
+{
+	host_wait_t** p;
+
+	if (w == NULL)
+		return;
+
+	pthread_mutex_lock(&wait_list_lock);
+	for (p = &wait_list; *p != NULL; p = &(*p)->next)
+	{
+		if (*p == w)
+		{
+			*p = w->next;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&wait_list_lock);
+
+	close(w->timer);
+	close(w->event);
+	free(w);
+}
+
+// Ожидание до момента deadline_ns (по host_time_ns), вызова host_wake
+// или появления ввода с консоли (если console не 0)
+void host_wait(host_wait_t* w, int64_t deadline_ns, int console)
+{
+	struct itimerspec its;
+	struct pollfd fds[3];
+	uint64_t value;
+	int n = 0;
+
+	// Абсолютное время срабатывания, чтобы не накапливалась погрешность
+	memset(&its, 0, sizeof(its));
+	its.it_value.tv_sec = deadline_ns / 1000000000ll;
+	its.it_value.tv_nsec = deadline_ns % 1000000000ll;
+	if (its.it_value.tv_sec == 0 && its.it_value.tv_nsec == 0)
+		its.it_value.tv_nsec = 1;
+	timerfd_settime(w->timer, TFD_TIMER_ABSTIME, &its, NULL);
+
+	fds[n].fd = w->timer;
+	fds[n].events = POLLIN;
+	fds[n].revents = 0;
+	n++;
+	fds[n].fd = w->event;
+	fds[n].events = POLLIN;
+	fds[n].revents = 0;
+	n++;
+
+	// Ждать ввода, только если ещё нет непрочитанных символов,
+	// иначе ожидание будет сразу прерываться до тех пор, пока гость их не прочитает
+	if (console && !stdin_eof && !console_kbhit())
+	{
+		fds[n].fd = 0;
+		fds[n].events = POLLIN;
+		fds[n].revents = 0;
+		n++;
+	}
+
+	poll(fds, n, -1);
+
+	// Ввод "готов", но читать нечего - это конец файла
+	if (n > 2 && ((fds[2].revents & (POLLHUP | POLLERR | POLLNVAL)) ||
+		((fds[2].revents & POLLIN) && !console_kbhit())))
+		stdin_eof = 1;
+
+	read(w->timer, &value, sizeof(value));
+	read(w->event, &value, sizeof(value));
+}
+
+// Прервать ожидание host_wait (из любого потока)
+void host_wake(host_wait_t* w)
+{
+	uint64_t value = 1;
+	write(w->event, &value, sizeof(value));
+}
+
+// Функция потока и её параметр
+typedef struct
+{
+	void (*func)(void*);
+	void* arg;
+} thread_start_t;
+
+static void* thread_entry(void* p)
+{
+	thread_start_t start = *(thread_start_t*)p;
+
+	free(p);
+	start.func(start.arg);
+
+	return NULL;
+}
+
+// Запуск функции в новом потоке
+int host_thread_start(void (*func)(void*), void* arg)
+{
+	thread_start_t* start = (thread_start_t*)malloc(sizeof(thread_start_t));
+	pthread_t thread;
+
+	if (start == NULL)
+		return 0;
+	start->func = func;
+	start->arg = arg;
+
+	if (pthread_create(&thread, NULL, thread_entry, start) != 0)
+	{
+		free(start);
+		return 0;
+	}
+	pthread_detach(thread);
+
 	return 1;
 }
 
+// Блокировка для данных, общих для нескольких потоков
+struct host_mutex_s
+{
+	pthread_mutex_t mutex;
+};
+
+host_mutex_t* host_mutex_create(void)
+{
+	host_mutex_t* m = (host_mutex_t*)malloc(sizeof(host_mutex_t));
+
+	if (m == NULL)
+		return NULL;
+	if (pthread_mutex_init(&m->mutex, NULL) != 0)
+	{
+		free(m);
+		return NULL;
+	}
+
+	return m;
+}
+
+void host_mutex_free(host_mutex_t* m)
+{
+	if (m == NULL)
+		return;
+	pthread_mutex_destroy(&m->mutex);
+	free(m);
+}
+
+void host_mutex_lock(host_mutex_t* m)
+{
+	pthread_mutex_lock(&m->mutex);
+}
+
+void host_mutex_unlock(host_mutex_t* m)
+{
+	pthread_mutex_unlock(&m->mutex);
+}
+
+// Файл образа диска
+struct host_file_s
+{
+	int fd;
+};
+
+host_file_t* host_file_open(const char* name, int mode)
+{
+	host_file_t* f = (host_file_t*)malloc(sizeof(host_file_t));
+	int flags = O_CLOEXEC;
+
+	if (f == NULL)
+		return NULL;
+	if (mode == HOST_FILE_CREATE)
+		flags |= O_RDWR | O_CREAT | O_EXCL;
+	else
+		flags |= mode == HOST_FILE_WRITE ? O_RDWR : O_RDONLY;
+	f->fd = open(name, flags, 0644);
+	if (f->fd < 0)
+	{
+		free(f);
+		return NULL;
+	}
+
+	return f;
+}
+
+int64_t host_file_size(host_file_t* f)
+{
+	struct stat st;
+
+	if (fstat(f->fd, &st) != 0)
+		return -1;
+
+	return st.st_size;
+}
+
+// Наибольшее количество частей в одном вызове preadv/pwritev (UIO_MAXIOV)
+#define HOST_IOV_MAX				1024
+
+// Чтение или запись вразброс со смещения offset одним системным вызовом.
+// Если передано меньше, чем запрошено (конец файла, сигнал), то остаток
+// передаётся по частям. Возвращает 1, если передано всё
+static int host_file_io(host_file_t* f, const host_iov_t* iov, int count, uint64_t offset, int write)
+{
+	struct iovec v[HOST_IOV_MAX];
+	ssize_t done, n;
+	size_t skip;
+	int i;
+
+	if (count > HOST_IOV_MAX)
+		return 0;
+	for (i = 0; i < count; i++)
+	{
+		v[i].iov_base = iov[i].base;
+		v[i].iov_len = iov[i].size;
+	}
+
+	done = write ? pwritev(f->fd, v, count, offset) : preadv(f->fd, v, count, offset);
+	if (done < 0)
+		return 0;
+
+	for (i = 0; i < count; i++)
+	{
+		if ((size_t)done >= iov[i].size)
+		{
+			done -= iov[i].size;
+			offset += iov[i].size;
+			continue;
+		}
+
+		// Неполная передача: продолжить с середины части
+		skip = (size_t)done;
+		offset += skip;
+		done = 0;
+		while (skip < iov[i].size)
+		{
+			n = write ?
+				pwrite(f->fd, (uint8_t*)iov[i].base + skip, iov[i].size - skip, offset) :
+				pread(f->fd, (uint8_t*)iov[i].base + skip, iov[i].size - skip, offset);
+			if (n < 0)
+				return 0;
+			if (n == 0)
+			{
+				// Чтение за концом файла даёт нули
+				if (write)
+					return 0;
+				memset((uint8_t*)iov[i].base + skip, 0, iov[i].size - skip);
+				n = iov[i].size - skip;
+			}
+			skip += n;
+			offset += n;
+		}
+	}
+
+	return 1;
+}
+
+int host_file_read(host_file_t* f, const host_iov_t* iov, int count, uint64_t offset)
+{
+	return host_file_io(f, iov, count, offset, 0);
+}
+
+int host_file_write(host_file_t* f, const host_iov_t* iov, int count, uint64_t offset)
+{
+	return host_file_io(f, iov, count, offset, 1);
+}
+
+// Запись данных файла на диск хоста
+int host_file_flush(host_file_t* f)
+{
+	return fdatasync(f->fd) == 0;
+}
+
+void host_file_close(host_file_t* f)
+{
+	if (f == NULL)
+		return;
+	close(f->fd);
+	free(f);
+}
+
+// Отображение первых size байт файла в память только для чтения. Страницы общие
+// со страничным кешем ОС, поэтому все процессы, отобразившие файл, используют одну копию
+const void* host_file_map(host_file_t* f, uint64_t size)
+{
+	void* p;
+
+	if (size == 0 || size != (size_t)size)
+		return NULL;
+	p = mmap(NULL, (size_t)size, PROT_READ, MAP_SHARED, f->fd, 0);
+
+	return p == MAP_FAILED ? NULL : p;
+}
+
+void host_file_unmap(const void* p, uint64_t size)
+{
+	if (p != NULL)
+		munmap((void*)p, (size_t)size);
+}
+
+// Отображение size байт файла со смещения offset для чтения и записи без изменения
+// файла (MAP_PRIVATE): страницы читаются из страничного кеша при первом обращении,
+// а при первой записи страница копируется. Смещение кратно размеру страницы
+void* host_file_map_copy(host_file_t* f, uint64_t offset, uint64_t size)
+{
+	void* p;
+
+	if (size == 0 || size != (size_t)size)
+		return NULL;
+	p = mmap(NULL, (size_t)size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_NORESERVE, f->fd, (off_t)offset);
+
+	return p == MAP_FAILED ? NULL : p;
+}
+
+// Изменение размера файла (дописанная часть читается как нули и не занимает место на диске)
+int host_file_resize(host_file_t* f, uint64_t size)
+{
+	return ftruncate(f->fd, (off_t)size) == 0;
+}
+
+// Сетевой интерфейс: кадры Ethernet передаются через интерфейс tap
+// или дейтаграммами через локальный сокет
+struct host_net_s
+{
+	int fd;
+	int event;
+	// Адрес сокета другой стороны (для сокета)
+	struct sockaddr_un peer;
+	int socket;
+};
+
+// Открытие интерфейса tap ("tap:имя"), он должен быть создан заранее
+// (ip tuntap add имя mode tap user пользователь)
+static int host_net_tap(host_net_t* n, const char* name)
+{
+	struct ifreq ifr;
+
+	if (strlen(name) >= IFNAMSIZ)
+		return 0;
+	n->fd = open("/dev/net/tun", O_RDWR | O_NONBLOCK | O_CLOEXEC);
+	if (n->fd < 0)
+		return 0;
+
+	memset(&ifr, 0, sizeof(ifr));
+	ifr.ifr_flags = IFF_TAP | IFF_NO_PI;
+	strcpy(ifr.ifr_name, name);
+
+	return ioctl(n->fd, TUNSETIFF, &ifr) == 0;
+}
+
+// Открытие дейтаграммного сокета ("unix:свой_путь:путь_другой_стороны").
+// Две машины соединяются сокетами с переставленными путями
+static int host_net_unix(host_net_t* n, const char* spec)
+{
+	struct sockaddr_un local;
+	const char* sep = strchr(spec, ':');
+
+	if (sep == NULL || (size_t)(sep - spec) >= sizeof(local.sun_path) || strlen(sep + 1) >= sizeof(n->peer.sun_path))
+		return 0;
+
+	memset(&local, 0, sizeof(local));
+	local.sun_family = AF_UNIX;
+	memcpy(local.sun_path, spec, sep - spec);
+	n->peer.sun_family = AF_UNIX;
+	strcpy(n->peer.sun_path, sep + 1);
+	n->socket = 1;
+
+	n->fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+	if (n->fd < 0)
+		return 0;
+	fcntl(n->fd, F_SETFL, O_NONBLOCK);
+
+	// Сокет мог остаться от предыдущего запуска
+	unlink(local.sun_path);
+
+	return bind(n->fd, (struct sockaddr*)&local, sizeof(local)) == 0;
+}
+
+host_net_t* host_net_open(const char* spec)
+{
+	host_net_t* n = (host_net_t*)calloc(1, sizeof(host_net_t));
+	int ok = 0;
+
+	if (n == NULL)
+		return NULL;
+	n->fd = -1;
+	n->event = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+	if (strncmp(spec, "tap:", 4) == 0)
+		ok = host_net_tap(n, spec + 4);
+	else if (strncmp(spec, "unix:", 5) == 0)
+		ok = host_net_unix(n, spec + 5);
+
+	if (!ok || n->event < 0)
+	{
+		host_net_close(n);
+		return NULL;
+	}
+
+	return n;
+}
+
+void host_net_close(host_net_t* n)
+{
+	if (n == NULL)
+		return;
+	if (n->fd >= 0)
+		close(n->fd);
+	if (n->event >= 0)
+		close(n->event);
+	free(n);
+}
+
+// Отправка кадра, собранного из частей. Если очередь хоста переполнена или другой
+// стороны нет, то кадр теряется, как в настоящей сети. Возвращает 1, если кадр отправлен
+int host_net_send(host_net_t* n, const host_iov_t* iov, int count)
+{
+	struct msghdr msg;
+
+	memset(&msg, 0, sizeof(msg));
+	if (n->socket)
+	{
+		msg.msg_name = &n->peer;
+		msg.msg_namelen = sizeof(n->peer);
+	}
+	// host_iov_t совпадает по устройству с struct iovec
+	msg.msg_iov = (struct iovec*)iov;
+	msg.msg_iovlen = count;
+
+	if (n->socket)
+		return sendmsg(n->fd, &msg, 0) >= 0;
+
+	return writev(n->fd, msg.msg_iov, count) >= 0;
+}
+
+// Приём кадра без ожидания. Возвращает длину кадра или 0, если кадров нет
+int host_net_recv(host_net_t* n, void* buf, size_t size)
+{
+	ssize_t len;
+
+	do
+	{
+		len = read(n->fd, buf, size);
+	} while (len < 0 && errno == EINTR);
+
+	return len > 0 ? (int)len : 0;
+}
+
+// Ожидание кадра (если rx не 0) или вызова host_net_wake
+void host_net_wait(host_net_t* n, int rx)
+{
+	struct pollfd fds[2];
+	uint64_t value;
+
+	fds[0].fd = n->event;
+	fds[0].events = POLLIN;
+	fds[0].revents = 0;
+	fds[1].fd = n->fd;
+	fds[1].events = POLLIN;
+	fds[1].revents = 0;
+
+	poll(fds, rx ? 2 : 1, -1);
+
+	read(n->event, &value, sizeof(value));
+}
+
+// Прервать ожидание host_net_wait (из любого потока)
+void host_net_wake(host_net_t* n)
+{
+	uint64_t value = 1;
+	write(n->event, &value, sizeof(value));
+}
+
+// Сервер заданий: процесс порождает свою копию на каждое подключение к локальному сокету
+
+// Задание: подключение клиента и процесс, который его выполняет
+typedef struct host_job_s
+{
+	int fd;
+	pid_t pid;
+	struct host_job_s* next;
+} host_job_t;
+
+// Выполняющиеся задания
+static host_job_t* job_list;
+static pthread_mutex_t job_list_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Поток ожидания завершения задания: сообщает клиенту код завершения процесса
+// (байт 0, затем код числом и перевод строки) и закрывает подключение
+static void host_job_wait(void* arg)
+{
+	host_job_t* j = (host_job_t*)arg;
+	host_job_t** p;
+	char buf[32];
+	int status = 0, code, n;
+
+	while (waitpid(j->pid, &status, 0) < 0 && errno == EINTR)
+		;
+	code = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+
+	buf[0] = 0;
+	n = 1 + sprintf(&buf[1], "%d\n", code);
+	send(j->fd, buf, n, MSG_NOSIGNAL);
+
+	pthread_mutex_lock(&job_list_lock);
+	for (p = &job_list; *p != NULL; p = &(*p)->next)
+	{
+		if (*p == j)
+		{
+			*p = j->next;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&job_list_lock);
+
+	close(j->fd);
+	free(j);
+}
+
+// Порождённый процесс: подключение становится консолью, объекты ожидания создаются заново
+static void host_job_start(int fd)
+{
+	host_wait_t* w;
+	host_job_t* j;
+
+	for (j = job_list; j != NULL; j = j->next)
+		close(j->fd);
+	job_list = NULL;
+
+	dup2(fd, 0);
+	dup2(fd, 1);
+	close(fd);
+	stdin_eof = 0;
+
+	for (w = wait_list; w != NULL; w = w->next)
+	{
+		close(w->timer);
+		close(w->event);
+		w->timer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+		w->event = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		if (w->timer < 0 || w->event < 0)
+		{
+			fprintf(stderr, "Fork server: unable to create wait object\n");
+			_exit(1);
+		}
+	}
+}
+
+// Ожидание подключений к сокету path и порождение копии процесса на каждое. В порождённом
+// процессе возвращает номер задания (с 1), подключение - его стандартные ввод и вывод.
+// В исходном процессе возвращает 0 только при ошибке. Вызывающий поток должен быть
+// единственным, который работает: остальные потоки в копии не существуют
+int host_fork_server(const char* path)
+{
+	struct sockaddr_un addr;
+	host_job_t* j;
+	pid_t pid;
+	int s, fd, job = 0;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(addr.sun_path))
+		return 0;
+	strcpy(addr.sun_path, path);
+
+	s = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (s < 0)
+		return 0;
+	unlink(path);
+	if (bind(s, (struct sockaddr*)&addr, sizeof(addr)) != 0 || listen(s, 64) != 0)
+	{
+		close(s);
+		return 0;
+	}
+
+	for (;;)
+	{
+		fd = accept(s, NULL, NULL);
+		if (fd < 0)
+		{
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			close(s);
+			return 0;
+		}
+
+		j = (host_job_t*)malloc(sizeof(host_job_t));
+		if (j == NULL)
+		{
+			close(fd);
+			continue;
+		}
+
+		// Списки не должны изменяться во время fork
+		pthread_mutex_lock(&wait_list_lock);
+		pthread_mutex_lock(&job_list_lock);
+		pid = fork();
+		if (pid == 0)
+		{
+			close(s);
+			free(j);
+			host_job_start(fd);
+			pthread_mutex_unlock(&job_list_lock);
+			pthread_mutex_unlock(&wait_list_lock);
+			return ++job;
+		}
+		if (pid > 0)
+		{
+			job++;
+			j->fd = fd;
+			j->pid = pid;
+			j->next = job_list;
+			job_list = j;
+		}
+		pthread_mutex_unlock(&job_list_lock);
+		pthread_mutex_unlock(&wait_list_lock);
+
+		if (pid < 0)
+		{
+			close(fd);
+			free(j);
+		}
+		else if (!host_thread_start(host_job_wait, j))
+			fprintf(stderr, "Fork server: unable to create thread\n");
+	}
+}
+
 // Захват клавиатуры, чтобы символы доходили правильно
 void capture_keyb(int capture)
 {
@@ -30,7 +713,7 @@ void capture_keyb(int capture)
 
 void console_init(void)
 {
-	// Нужен немедленный небуферизированный вывод
+	// Сообщения эмулятора выводятся сразу, вывод гостя буферизирует console.c
 	setvbuf(stdout, NULL, _IONBF, 0);
 
 	capture_keyb(1);
@@ -45,23 +728,97 @@ void console_restore(void)
 // Проверка нажатия клавиш
 int console_kbhit(void)
 {
-	int br;
+	int br = 0;
 	ioctl(0, FIONREAD, &br);
 	return br > 0;
 }
 
-// Чтение кода нажатой клавиши
-int console_getchar(void)
+// Чтение всех пришедших символов (до size) без ожидания, возвращает их количество
+int console_input(void* buf, int size)
+{
+	struct pollfd fd;
+	ssize_t n;
+
+	fd.fd = 0;
+	fd.events = POLLIN;
+	fd.revents = 0;
+	if (poll(&fd, 1, 0) <= 0 || !(fd.revents & POLLIN))
+		return 0;
+
+	n = read(0, buf, size);
+
+	return n > 0 ? (int)n : 0;
+}
+
+// Вывод в TTY одним системным вызовом
+void console_output(const void* buf, int size)
+{
+	const char* p = (const char*)buf;
+	ssize_t n;
+
+	while (size > 0)
+	{
+		n = write(1, p, size);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			break;
+		p += n;
+		size -= (int)n;
+	}
+}
+
+// Выделение памяти для исполняемого кода
+void* exec_alloc(size_t size)
 {
-	char ch;
-	read(0, &ch, 1);
-	return ch;
+	void* p = mmap(NULL, size, PROT_READ | PROT_WRITE | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	return p == MAP_FAILED ? NULL : p;
+}
+
+// Размер большой страницы, до него округляется размер ОЗУ
+#define HUGE_PAGE_SIZE				(2 * 1048576)
+
+// Выделение физической памяти гостя. Страницы без резервирования (MAP_NORESERVE)
+// получают физическую память хоста только при первом обращении к ним, поэтому
+// занимаемая память зависит от того, сколько гость использовал, а не от размера ОЗУ
+void* host_ram_alloc(size_t size, int pages)
+{
+	int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+	void* p;
+
+	size = (size + HUGE_PAGE_SIZE - 1) & ~(size_t)(HUGE_PAGE_SIZE - 1);
+
+	if (pages == HOST_PAGES_HUGE)
+	{
+		// Большие страницы резервируются при выделении: если их не хватает в пуле ОС
+		// (vm.nr_hugepages), то выделение не удастся сразу, а не при обращении гостя
+#ifdef MAP_HUGETLB
+		flags |= MAP_HUGETLB;
+#else
+		return NULL;
+#endif
+	}
+#ifdef MAP_NORESERVE
+	else
+		flags |= MAP_NORESERVE;
+#endif
+
+	p = mmap(NULL, size, PROT_READ | PROT_WRITE, flags, -1, 0);
+	if (p == MAP_FAILED)
+		return NULL;
+
+#ifdef MADV_HUGEPAGE
+	if (pages == HOST_PAGES_TRANSPARENT)
+		madvise(p, size, MADV_HUGEPAGE);
+#endif
+
+	return p;
 }
 
-// Вывод в TTY
-void console_putchar(int ch)
+void host_ram_free(void* p, size_t size)
 {
-	putchar(ch);
+	size = (size + HUGE_PAGE_SIZE - 1) & ~(size_t)(HUGE_PAGE_SIZE - 1);
+	munmap(p, size);
 }
 
 #endif
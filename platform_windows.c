@@ -6,16 +6,339 @@
 #include <string.h>
 #include <windows.h>
 #include "riscv.h"
+#include "platform.h"
 
 // Функции в этом файле относятся к хост-платформе Windows
 
-// Отправить поток в сон на 1 мс
-int sleep1ms(void)
+// Монотонное время хоста в наносекундах
+int64_t host_time_ns(void)
 {
-	// В Windows сон будет от 1 до 16 мс, вернуть количество пропущенных мс
-	int t = (int)GetTickCount();
-	Sleep(1);
-	return ((int)GetTickCount()) - t;
+	static LARGE_INTEGER freq;
+	LARGE_INTEGER t;
+
+	if (freq.QuadPart == 0)
+		QueryPerformanceFrequency(&freq);
+	QueryPerformanceCounter(&t);
+
+	return t.QuadPart / freq.QuadPart * 1000000000ll + t.QuadPart % freq.QuadPart * 1000000000ll / freq.QuadPart;
+}
+
+// Объект ожидания процессора: событие для пробуждения из других потоков
+struct host_wait_s
+{
+	HANDLE event;
+};
+
+host_wait_t* host_wait_create(void)
+{
+	host_wait_t* w = (host_wait_t*)malloc(sizeof(host_wait_t));
+
+	if (w == NULL)
+		return NULL;
+
+	w->event = CreateEvent(NULL, FALSE, FALSE, NULL);
+	if (w->event == NULL)
+	{
+		free(w);
+		return NULL;
+	}
+
+	return w;
+}
+
+void host_wait_free(host_wait_t* w)
+{
+	if (w == NULL)
+		return;
+	CloseHandle(w->event);
+	free(w);
+}
+
+// Ожидание до момента deadline_ns (по host_time_ns), вызова host_wake
+// или появления ввода с консоли (если console не 0)
+void host_wait(host_wait_t* w, int64_t deadline_ns, int console)
+{
+	HANDLE handles[2];
+	int64_t ms = (deadline_ns - host_time_ns() + 999999) / 1000000;
+	DWORD n = 0;
+
+	if (ms <= 0)
+		return;
+	if (ms > 1000)
+		ms = 1000;
+
+	handles[n++] = w->event;
+	// Если уже есть непрочитанные символы, ждать только таймер
+	if (console && !_kbhit())
+		handles[n++] = GetStdHandle(STD_INPUT_HANDLE);
+
+	WaitForMultipleObjects(n, handles, FALSE, (DWORD)ms);
+}
+
+// Прервать ожидание host_wait (из любого потока)
+void host_wake(host_wait_t* w)
+{
+	SetEvent(w->event);
+}
+
+// Функция потока и её параметр
+typedef struct
+{
+	void (*func)(void*);
+	void* arg;
+} thread_start_t;
+
+static DWORD WINAPI thread_entry(LPVOID p)
+{
+	thread_start_t start = *(thread_start_t*)p;
+
+	free(p);
+	start.func(start.arg);
+
+	return 0;
+}
+
+// Запуск функции в новом потоке
+int host_thread_start(void (*func)(void*), void* arg)
+{
+	thread_start_t* start = (thread_start_t*)malloc(sizeof(thread_start_t));
+	HANDLE thread;
+
+	if (start == NULL)
+		return 0;
+	start->func = func;
+	start->arg = arg;
+
+	thread = CreateThread(NULL, 0, thread_entry, start, 0, NULL);
+	if (thread == NULL)
+	{
+		free(start);
+		return 0;
+	}
+	CloseHandle(thread);
+
+	return 1;
+}
+
+// Блокировка для данных, общих для нескольких потоков
+struct host_mutex_s
+{
+	CRITICAL_SECTION cs;
+};
+
+host_mutex_t* host_mutex_create(void)
+{
+	host_mutex_t* m = (host_mutex_t*)malloc(sizeof(host_mutex_t));
+
+	if (m == NULL)
+		return NULL;
+	InitializeCriticalSection(&m->cs);
+
+	return m;
+}
+
+void host_mutex_free(host_mutex_t* m)
+{
+	if (m == NULL)
+		return;
+	DeleteCriticalSection(&m->cs);
+	free(m);
+}
+
+void host_mutex_lock(host_mutex_t* m)
+{
+	EnterCriticalSection(&m->cs);
+}
+
+void host_mutex_unlock(host_mutex_t* m)
+{
+	LeaveCriticalSection(&m->cs);
+}
+
+// Файл образа диска
+struct host_file_s
+{
+	HANDLE handle;
+};
+
+host_file_t* host_file_open(const char* name, int mode)
+{
+	host_file_t* f = (host_file_t*)malloc(sizeof(host_file_t));
+
+	if (f == NULL)
+		return NULL;
+	f->handle = CreateFileA(name, mode != HOST_FILE_READ ? GENERIC_READ | GENERIC_WRITE : GENERIC_READ,
+		FILE_SHARE_READ, NULL, mode == HOST_FILE_CREATE ? CREATE_NEW : OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (f->handle == INVALID_HANDLE_VALUE)
+	{
+		free(f);
+		return NULL;
+	}
+
+	return f;
+}
+
+int64_t host_file_size(host_file_t* f)
+{
+	LARGE_INTEGER size;
+
+	if (!GetFileSizeEx(f->handle, &size))
+		return -1;
+
+	return size.QuadPart;
+}
+
+// Чтение или запись по частям со смещения offset (чтение за концом файла даёт нули)
+static int host_file_io(host_file_t* f, const host_iov_t* iov, int count, uint64_t offset, int write)
+{
+	OVERLAPPED ov;
+	DWORD done;
+	size_t pos, chunk;
+	BOOL ok;
+	int i;
+
+	for (i = 0; i < count; i++)
+	{
+		for (pos = 0; pos < iov[i].size; pos += done)
+		{
+			chunk = iov[i].size - pos;
+			if (chunk > 0x40000000)
+				chunk = 0x40000000;
+			memset(&ov, 0, sizeof(ov));
+			ov.Offset = (DWORD)offset;
+			ov.OffsetHigh = (DWORD)(offset >> 32);
+			ok = write ?
+				WriteFile(f->handle, (uint8_t*)iov[i].base + pos, (DWORD)chunk, &done, &ov) :
+				ReadFile(f->handle, (uint8_t*)iov[i].base + pos, (DWORD)chunk, &done, &ov);
+			if (!ok && GetLastError() != ERROR_HANDLE_EOF)
+				return 0;
+			if (done == 0)
+			{
+				if (write)
+					return 0;
+				memset((uint8_t*)iov[i].base + pos, 0, iov[i].size - pos);
+				done = (DWORD)(iov[i].size - pos);
+			}
+			offset += done;
+		}
+	}
+
+	return 1;
+}
+
+int host_file_read(host_file_t* f, const host_iov_t* iov, int count, uint64_t offset)
+{
+	return host_file_io(f, iov, count, offset, 0);
+}
+
+int host_file_write(host_file_t* f, const host_iov_t* iov, int count, uint64_t offset)
+{
+	return host_file_io(f, iov, count, offset, 1);
+}
+
+// Запись данных файла на диск хоста
+int host_file_flush(host_file_t* f)
+{
+	return FlushFileBuffers(f->handle) != 0;
+}
+
+void host_file_close(host_file_t* f)
+{
+	if (f == NULL)
+		return;
+	CloseHandle(f->handle);
+	free(f);
+}
+
+// Отображение первых size байт файла в память только для чтения
+const void* host_file_map(host_file_t* f, uint64_t size)
+{
+	HANDLE mapping;
+	void* p;
+
+	if (size == 0 || size != (size_t)size)
+		return NULL;
+	mapping = CreateFileMappingA(f->handle, NULL, PAGE_READONLY, 0, 0, NULL);
+	if (mapping == NULL)
+		return NULL;
+	// Отображение остаётся действительным и после закрытия объекта
+	p = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, (size_t)size);
+	CloseHandle(mapping);
+
+	return p;
+}
+
+void host_file_unmap(const void* p, uint64_t size)
+{
+	if (p != NULL)
+		UnmapViewOfFile(p);
+}
+
+// Отображение size байт файла со смещения offset для чтения и записи без изменения
+// файла (FILE_MAP_COPY). Смещение кратно 64 КБ
+void* host_file_map_copy(host_file_t* f, uint64_t offset, uint64_t size)
+{
+	HANDLE mapping;
+	void* p;
+
+	if (size == 0 || size != (size_t)size)
+		return NULL;
+	mapping = CreateFileMappingA(f->handle, NULL, PAGE_WRITECOPY, 0, 0, NULL);
+	if (mapping == NULL)
+		return NULL;
+	p = MapViewOfFile(mapping, FILE_MAP_COPY, (DWORD)(offset >> 32), (DWORD)offset, (size_t)size);
+	CloseHandle(mapping);
+
+	return p;
+}
+
+// Изменение размера файла
+int host_file_resize(host_file_t* f, uint64_t size)
+{
+	LARGE_INTEGER pos;
+
+	pos.QuadPart = (LONGLONG)size;
+	return SetFilePointerEx(f->handle, pos, NULL, FILE_BEGIN) && SetEndOfFile(f->handle);
+}
+
+// Сетевой интерфейс (tap и локальные дейтаграммные сокеты в Windows не поддерживаются)
+struct host_net_s
+{
+	int unused;
+};
+
+host_net_t* host_net_open(const char* spec)
+{
+	printf("Networking is not supported on this host\n");
+	return NULL;
+}
+
+void host_net_close(host_net_t* n)
+{
+}
+
+int host_net_send(host_net_t* n, const host_iov_t* iov, int count)
+{
+	return 0;
+}
+
+int host_net_recv(host_net_t* n, void* buf, size_t size)
+{
+	return 0;
+}
+
+void host_net_wait(host_net_t* n, int rx)
+{
+}
+
+void host_net_wake(host_net_t* n)
+{
+}
+
+// Сервер заданий требует fork и в Windows не поддерживается
+int host_fork_server(const char* path)
+{
+	return 0;
 }
 
 void console_init(void)
@@ -34,16 +357,51 @@ int console_kbhit(void)
 	return _kbhit();
 }
 
-// Чтение кода нажатой клавиши
-int console_getchar(void)
+// Чтение всех пришедших символов (до size) без ожидания, возвращает их количество
+int console_input(void* buf, int size)
 {
-	return _getch();
+	char* p = (char*)buf;
+	int n = 0;
+
+	while (n < size && _kbhit())
+		p[n++] = (char)_getch();
+
+	return n;
 }
 
 // Вывод в TTY
-void console_putchar(int ch)
+void console_output(const void* buf, int size)
+{
+	fwrite(buf, 1, size, stdout);
+	fflush(stdout);
+}
+
+// Выделение памяти для исполняемого кода
+void* exec_alloc(size_t size)
+{
+	return VirtualAlloc(NULL, size, MEM_COMMIT | MEM_RESERVE, PAGE_EXECUTE_READWRITE);
+}
+
+// Выделение физической памяти гостя. Windows выделяет страницы при первом обращении,
+// прозрачных больших страниц нет. Большие страницы (MEM_LARGE_PAGES) требуют права
+// "Блокировка страниц в памяти" и выделяются сразу
+void* host_ram_alloc(size_t size, int pages)
+{
+	size_t large;
+
+	if (pages != HOST_PAGES_HUGE)
+		return VirtualAlloc(NULL, size, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+
+	large = GetLargePageMinimum();
+	if (large == 0)
+		return NULL;
+	size = (size + large - 1) & ~(large - 1);
+	return VirtualAlloc(NULL, size, MEM_COMMIT | MEM_RESERVE | MEM_LARGE_PAGES, PAGE_READWRITE);
+}
+
+void host_ram_free(void* p, size_t size)
 {
-	putchar(ch);
+	VirtualFree(p, 0, MEM_RELEASE);
 }
 
 #endif
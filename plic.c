@@ -1,12 +1,316 @@
+#include <stdio.h>
+#include <string.h>
 #include "riscv.h"
+#include "platform.h"
+#include "snapshot.h"
+
+// Контроллер прерываний
+//
+// Прерывания процессора (программное, таймер, внешнее) доставляются в plic_update.
+// Внешние прерывания устройств собирает PLIC (совместимый с SiFive, "riscv,plic0"):
+// у каждого источника есть приоритет, у каждого контекста (процессора) - маска
+// разрешённых источников и порог. Процессор захватывает (claim) источник с наибольшим
+// приоритетом и по окончании обработки сообщает о завершении (complete).
+//
+// Устройства меняют уровень сигнала из любого потока, поэтому состояние защищено
+// блокировкой. Процессорам изменения линии прерывания передаются через почтовый
+// ящик (MAIL_IRQ), а процессор, сам обратившийся к PLIC, обновляет её сразу.
+
+// Смещения регистров
+#define PLIC_PRIORITY				0x000000
+#define PLIC_PENDING				0x001000
+#define PLIC_ENABLE					0x002000
+#define PLIC_ENABLE_STRIDE			0x80
+#define PLIC_CONTEXT				0x200000
+#define PLIC_CONTEXT_STRIDE			0x1000
+
+// Максимальный приоритет источника
+#define PLIC_PRIORITY_MAX			7
+
+static struct
+{
+	host_mutex_t* lock;
+	int contexts;
+	uint32_t priority[PLIC_SOURCES];
+	uint32_t level;   // Уровень сигнала источников
+	uint32_t pending; // Источники, ожидающие обработки
+	uint32_t claimed; // Источники, обрабатываемые процессорами
+	uint32_t enable[MAX_HARTS];
+	uint32_t threshold[MAX_HARTS];
+	int eip[MAX_HARTS]; // Состояние линии прерывания, переданное процессору
+} plic;
 
 // Обновление состояния контроллера прерываний
 void plic_update(riscv_t* cpu)
 {
+	if (!(cpu->sstatus & SSTATUS_SIE) && !cpu->wfi)
+		return;
+
+	// Внешнее прерывание имеет наибольший приоритет
+	if (cpu->sip & cpu->sie & MIE_SEIE)
+	{
+		cpu->wfi = 0;
+		trap(cpu, INT_S_EXT, 0);
+		return;
+	}
+
+	// Программное прерывание от другого процессора имеет приоритет над таймером
+	if (cpu->sip & cpu->sie & MIE_SSIE)
+	{
+		cpu->wfi = 0;
+		trap(cpu, INT_S_SOFT, 0);
+		return;
+	}
+
 	// Реакция на прерывание таймера
-	if ((cpu->sip & cpu->sie & MIE_MTIE) && ((cpu->sstatus & SSTATUS_SIE) || cpu->wfi))
+	if (cpu->sip & cpu->sie & MIE_MTIE)
 	{
 		cpu->wfi = 0;
 		trap(cpu, INT_S_TIMER, 0);
 	}
 }
+
+// Источник с наибольшим приоритетом, который может захватить контекст ctx (0 - нет)
+static int plic_best(int ctx)
+{
+	uint32_t ready = plic.pending & plic.enable[ctx] & ~plic.claimed;
+	uint32_t best = plic.threshold[ctx];
+	int irq = 0, i;
+
+	for (i = 1; i < PLIC_SOURCES && (ready >> i) != 0; i++)
+	{
+		if (((ready >> i) & 1) && plic.priority[i] > best)
+		{
+			best = plic.priority[i];
+			irq = i;
+		}
+	}
+
+	return irq;
+}
+
+// Сообщить процессорам об изменении их линий прерывания (вызывается под блокировкой).
+// self - процессор, обратившийся к PLIC (или NULL для устройства)
+static void plic_notify(riscv_t* self)
+{
+	int ctx, eip;
+
+	for (ctx = 0; ctx < plic.contexts; ctx++)
+	{
+		eip = plic_best(ctx) != 0;
+		if (eip == plic.eip[ctx])
+			continue;
+		plic.eip[ctx] = eip;
+
+		if (harts[ctx] == self)
+		{
+			if (eip)
+				self->sip |= MIE_SEIE;
+			else
+				self->sip &= ~(ui)MIE_SEIE;
+			self->irq_check = 1;
+		}
+		else
+			hart_signal(harts[ctx], MAIL_IRQ);
+	}
+}
+
+// Обновить бит внешнего прерывания процессора по запросу MAIL_IRQ
+void plic_sync(riscv_t* cpu)
+{
+	host_mutex_lock(plic.lock);
+	if (plic.eip[cpu->hartid])
+		cpu->sip |= MIE_SEIE;
+	else
+		cpu->sip &= ~(ui)MIE_SEIE;
+	host_mutex_unlock(plic.lock);
+
+	cpu->irq_check = 1;
+}
+
+// Установка уровня сигнала прерывания irq (вызывается устройствами из любого потока)
+void plic_set(int irq, int level)
+{
+	uint32_t bit;
+
+	if (irq <= 0 || irq >= PLIC_SOURCES)
+		return;
+	bit = 1u << irq;
+
+	host_mutex_lock(plic.lock);
+	if (level)
+	{
+		plic.level |= bit;
+		plic.pending |= bit;
+	}
+	else
+	{
+		plic.level &= ~bit;
+		plic.pending &= ~bit;
+	}
+	plic_notify(NULL);
+	host_mutex_unlock(plic.lock);
+}
+
+static int plic_read(riscv_t* cpu, void* opaque, ui offset, int size, uint64_t* value)
+{
+	int ctx, irq;
+
+	if (size != 4 || (offset & 3))
+		return 0;
+
+	host_mutex_lock(plic.lock);
+
+	*value = 0;
+	if (offset < PLIC_PENDING)
+	{
+		if (offset / 4 < PLIC_SOURCES)
+			*value = plic.priority[offset / 4];
+	}
+	else if (offset == PLIC_PENDING)
+		*value = plic.pending;
+	else if (offset >= PLIC_ENABLE && offset < PLIC_CONTEXT)
+	{
+		ctx = (offset - PLIC_ENABLE) / PLIC_ENABLE_STRIDE;
+		if (ctx < plic.contexts && (offset - PLIC_ENABLE) % PLIC_ENABLE_STRIDE == 0)
+			*value = plic.enable[ctx];
+	}
+	else if (offset >= PLIC_CONTEXT)
+	{
+		ctx = (offset - PLIC_CONTEXT) / PLIC_CONTEXT_STRIDE;
+		if (ctx < plic.contexts)
+		{
+			switch ((offset - PLIC_CONTEXT) % PLIC_CONTEXT_STRIDE)
+			{
+				case 0:
+					*value = plic.threshold[ctx];
+					break;
+				case 4:
+					// Захват источника с наибольшим приоритетом
+					irq = plic_best(ctx);
+					if (irq != 0)
+					{
+						plic.pending &= ~(1u << irq);
+						plic.claimed |= 1u << irq;
+						plic_notify(cpu);
+					}
+					*value = irq;
+					break;
+			}
+		}
+	}
+
+	host_mutex_unlock(plic.lock);
+
+	return 1;
+}
+
+static int plic_write(riscv_t* cpu, void* opaque, ui offset, int size, uint64_t value)
+{
+	uint32_t bit;
+	int ctx;
+
+	if (size != 4 || (offset & 3))
+		return 0;
+
+	host_mutex_lock(plic.lock);
+
+	if (offset < PLIC_PENDING)
+	{
+		if (offset / 4 > 0 && offset / 4 < PLIC_SOURCES)
+			plic.priority[offset / 4] = (uint32_t)value & PLIC_PRIORITY_MAX;
+	}
+	else if (offset >= PLIC_ENABLE && offset < PLIC_CONTEXT)
+	{
+		ctx = (offset - PLIC_ENABLE) / PLIC_ENABLE_STRIDE;
+		if (ctx < plic.contexts && (offset - PLIC_ENABLE) % PLIC_ENABLE_STRIDE == 0)
+			plic.enable[ctx] = (uint32_t)value & ~1u;
+	}
+	else if (offset >= PLIC_CONTEXT)
+	{
+		ctx = (offset - PLIC_CONTEXT) / PLIC_CONTEXT_STRIDE;
+		if (ctx < plic.contexts)
+		{
+			switch ((offset - PLIC_CONTEXT) % PLIC_CONTEXT_STRIDE)
+			{
+				case 0:
+					plic.threshold[ctx] = (uint32_t)value & PLIC_PRIORITY_MAX;
+					break;
+				case 4:
+					// Завершение обработки: если сигнал ещё есть, то источник снова ожидает
+					if (value > 0 && value < PLIC_SOURCES)
+					{
+						bit = 1u << value;
+						if (plic.claimed & bit)
+						{
+							plic.claimed &= ~bit;
+							if (plic.level & bit)
+								plic.pending |= bit;
+						}
+					}
+					break;
+			}
+		}
+	}
+	plic_notify(cpu);
+
+	host_mutex_unlock(plic.lock);
+
+	return 1;
+}
+
+// Подключение PLIC к шине, по одному контексту на процессор
+int plic_init(int harts)
+{
+	plic_done();
+
+	plic.lock = host_mutex_create();
+	if (plic.lock == NULL)
+	{
+		printf("PLIC: unable to create lock\n");
+		return 0;
+	}
+	plic.contexts = harts;
+
+	return bus_map(PLIC_BASE, PLIC_SIZE, plic_read, plic_write, NULL);
+}
+
+// Сохранение состояния в снимок
+void plic_save(snap_t* s)
+{
+	host_mutex_lock(plic.lock);
+	snap_put(s, plic.priority, sizeof(plic.priority));
+	snap_put(s, &plic.level, sizeof(plic.level));
+	snap_put(s, &plic.pending, sizeof(plic.pending));
+	snap_put(s, &plic.claimed, sizeof(plic.claimed));
+	snap_put(s, plic.enable, sizeof(plic.enable));
+	snap_put(s, plic.threshold, sizeof(plic.threshold));
+	host_mutex_unlock(plic.lock);
+}
+
+// Восстановление состояния из снимка. Линии прерывания всех процессоров обновляются
+// заново по запросу MAIL_IRQ
+int plic_load(snap_t* s)
+{
+	int ctx;
+
+	host_mutex_lock(plic.lock);
+	snap_get(s, plic.priority, sizeof(plic.priority));
+	snap_get(s, &plic.level, sizeof(plic.level));
+	snap_get(s, &plic.pending, sizeof(plic.pending));
+	snap_get(s, &plic.claimed, sizeof(plic.claimed));
+	snap_get(s, plic.enable, sizeof(plic.enable));
+	snap_get(s, plic.threshold, sizeof(plic.threshold));
+	for (ctx = 0; ctx < plic.contexts; ctx++)
+		plic.eip[ctx] = -1;
+	plic_notify(NULL);
+	host_mutex_unlock(plic.lock);
+
+	return !s->error;
+}
+
+void plic_done(void)
+{
+	host_mutex_free(plic.lock);
+	memset(&plic, 0, sizeof(plic));
+}
@@ -0,0 +1,176 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "riscv.h"
+#include "platform.h"
+#include "profile.h"
+
+#define PROFILE_MAGIC				"DIMMUPRF"
+#define PROFILE_VERSION				1
+#define PROFILE_HEADER_SIZE			32
+// Наибольшее количество адресов возврата в выборке
+#define PROFILE_DEPTH				32
+// Наибольший размер кадра стека, больший считается ошибкой цепочки
+#define PROFILE_FRAME_MAX			0x10000
+// Размер буфера выборок процессора
+#define PROFILE_BUFFER_SIZE			8192
+
+// Заголовок выборки
+typedef struct
+{
+	uint64_t pc;
+	uint64_t satp;
+	uint16_t hart;
+	uint8_t flags;
+	uint8_t depth;
+	uint32_t reserved;
+} profile_sample_t;
+
+// Буфер выборок одного процессора
+typedef struct
+{
+	uint8_t data[PROFILE_BUFFER_SIZE];
+	size_t size;
+} profile_buffer_t;
+
+static FILE* profile_file;
+static host_mutex_t* profile_lock;
+static int64_t profile_interval;
+static profile_buffer_t* profile_buffers[MAX_HARTS];
+
+// Дописать буфер в файл
+static void profile_write(profile_buffer_t* b)
+{
+	host_mutex_lock(profile_lock);
+	if (b->size != 0)
+	{
+		fwrite(b->data, 1, b->size, profile_file);
+		fflush(profile_file);
+	}
+	b->size = 0;
+	host_mutex_unlock(profile_lock);
+}
+
+// Записать накопленные выборки при завершении эмулятора
+static void profile_flush(void)
+{
+	int i;
+
+	for (i = 0; i < hart_count; i++)
+		profile_write(profile_buffers[i]);
+}
+
+// Прочитать слово стека гостя без исключений и без изменения флагов таблицы страниц
+static int profile_read(riscv_t* cpu, ui virt, ui* value)
+{
+	ui phys;
+
+	if ((virt & (sizeof(ui) - 1)) != 0 || !virt2phys(cpu, &phys, virt, MMU_R, 0, 0, 0, NULL, NULL))
+		return 0;
+	phys -= RAM_START;
+	if (phys >= ram_size || ram_size - phys < sizeof(ui))
+		return 0;
+
+	memcpy(value, &cpu->ram[phys], sizeof(ui));
+	return 1;
+}
+
+// Пройти цепочку кадров стека от текущего fp, возвращает количество адресов возврата
+static int profile_stack(riscv_t* cpu, uint64_t* stack)
+{
+	ui fp = cpu->r[8];
+	ui ra;
+	ui next;
+	int depth = 0;
+
+	while (depth < PROFILE_DEPTH)
+	{
+		if (fp < 2 * sizeof(ui) || !profile_read(cpu, fp - sizeof(ui), &ra) ||
+			!profile_read(cpu, fp - 2 * sizeof(ui), &next) || ra == 0)
+			break;
+		stack[depth++] = ra;
+		// Стек растёт вниз: кадр вызвавшей функции выше и недалеко
+		if (next <= fp || next - fp > PROFILE_FRAME_MAX)
+			break;
+		fp = next;
+	}
+
+	return depth;
+}
+
+// Записать выборку и запланировать следующую
+void profile_event(riscv_t* cpu)
+{
+	profile_buffer_t* b = profile_buffers[cpu->hartid];
+	uint64_t stack[PROFILE_DEPTH];
+	profile_sample_t sample;
+	size_t size;
+
+	event_set(cpu, EVENT_PROFILE, cpu->mtime + profile_interval);
+
+	sample.pc = cpu->pc;
+	sample.satp = cpu->satp;
+	sample.hart = (uint16_t)cpu->hartid;
+	sample.flags = (cpu->s_mode ? PROFILE_S_MODE : 0) | (cpu->wfi ? PROFILE_WFI : 0);
+	sample.depth = cpu->wfi ? 0 : (uint8_t)profile_stack(cpu, stack);
+	sample.reserved = 0;
+
+	size = sizeof(sample) + sample.depth * sizeof(uint64_t);
+	if (b->size + size > sizeof(b->data))
+		profile_write(b);
+	memcpy(b->data + b->size, &sample, sizeof(sample));
+	memcpy(b->data + b->size + sizeof(sample), stack, sample.depth * sizeof(uint64_t));
+	b->size += size;
+}
+
+// Включить профилировщик с частотой выборки hz (по времени mtime)
+int profile_enable(const char* file, int hz)
+{
+	uint8_t header[PROFILE_HEADER_SIZE];
+	uint32_t version = PROFILE_VERSION;
+	uint32_t xlen = XLEN;
+	uint64_t freq = TIMEBASE_FREQ;
+	int i;
+
+	if (hz <= 0 || hz > TIMEBASE_FREQ)
+	{
+		printf("Profile frequency must be 1..%d Hz\n", TIMEBASE_FREQ);
+		return 0;
+	}
+	profile_interval = TIMEBASE_FREQ / hz;
+
+	profile_file = fopen(file, "wb");
+	if (profile_file == NULL)
+	{
+		printf("\"%s\": unable to create profile\n", file);
+		return 0;
+	}
+
+	memset(header, 0, sizeof(header));
+	memcpy(header, PROFILE_MAGIC, 8);
+	memcpy(header + 8, &version, sizeof(version));
+	memcpy(header + 12, &xlen, sizeof(xlen));
+	memcpy(header + 16, &freq, sizeof(freq));
+	memcpy(header + 24, &profile_interval, sizeof(profile_interval));
+	if (fwrite(header, 1, sizeof(header), profile_file) != sizeof(header) || fflush(profile_file) != 0)
+	{
+		printf("\"%s\": unable to write profile\n", file);
+		fclose(profile_file);
+		return 0;
+	}
+
+	profile_lock = host_mutex_create();
+	for (i = 0; i < hart_count; i++)
+	{
+		profile_buffers[i] = (profile_buffer_t*)calloc(1, sizeof(profile_buffer_t));
+		if (profile_lock == NULL || profile_buffers[i] == NULL)
+		{
+			printf("Profile: out of memory\n");
+			return 0;
+		}
+		event_set(harts[i], EVENT_PROFILE, harts[i]->mtime + profile_interval);
+	}
+	atexit(profile_flush);
+
+	return 1;
+}
@@ -0,0 +1,32 @@
+#pragma once
+
+#include "riscv.h"
+
+// Профилировщик гостя
+//
+// Событие EVENT_PROFILE с заданной частотой записывает выборку: pc, режим процессора, satp
+// и цепочку адресов возврата, пройденную по указателям кадров (s0/fp: адрес возврата по
+// fp-XLEN/8, предыдущий fp по fp-2*XLEN/8). Время событий идёт по mtime, поэтому с
+// -deterministic выборка делается через равное количество инструкций. Выборки копятся в
+// буфере каждого процессора и дописываются в файл по заполнении и при выключении машины.
+// Символы подставляются отдельно (tools/profile.py) по System.map или vmlinux для ядра и
+// по ELF-файлам программ для пользовательского режима (программы различаются по satp).
+//
+// Формат файла (числа в порядке байт хоста):
+//   0    "DIMMUPRF"
+//   8    версия (4 байта)
+//   12   разрядность XLEN (4 байта)
+//   16   частота mtime (8 байт)
+//   24   интервал между выборками в тактах mtime (8 байт)
+// Далее выборки: pc (8 байт), satp (8 байт), номер процессора (2 байта), флаги
+// (PROFILE_S_MODE, PROFILE_WFI, 1 байт), количество адресов возврата (1 байт), 4 байта
+// резерва, адреса возврата по 8 байт от вызвавшей функции к внешним.
+
+// Частота выборок по умолчанию (в секунду времени гостя)
+#define PROFILE_HZ					1000
+
+#define PROFILE_S_MODE				1 // Режим супервизора
+#define PROFILE_WFI					2 // Процессор ждёт прерывания
+
+int  profile_enable(const char* file, int hz);
+void profile_event(riscv_t* cpu);
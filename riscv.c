@@ -2,6 +2,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include "riscv.h"
+#include "tlb.h"
 #include "decode.h"
 #include "sbi.h"
 #include "platform.h"
@@ -9,388 +10,611 @@
 // Чтение кода команды
 int fetch(riscv_t* cpu, uint32_t* instr)
 {
-	ui addr;
-	ui* phys;
+	uint8_t* p;
 
 	// Запомнить в instr_pc адрес текущей инструкции на случай исключения
 	cpu->instr_pc = cpu->pc;
 
-	// Преобразовать виртуальный адрес инструкции в физический
-	// и проверить разрешение на выполнение (X) у страницы памяти
-	if (!virt2phys(cpu, &addr, cpu->pc, MMU_X, MMU_ACCESSED, EX_INSTR_ACCESS, EX_INSTR_PAGE_FAULT))
+	// Найти страницу в TLB, при промахе преобразовать виртуальный адрес инструкции
+	// в физический и проверить разрешение на выполнение (X) у страницы памяти
+	p = tlb_translate(cpu, cpu->pc, TLB_EXEC);
+	if (p == NULL)
 		return 0;
 
-	addr -= RAM_START;
-	// Проверить, не выходит ли адрес за пределы физической памяти
-	if (addr >= RAM_SIZE)
-	{
-		trap(cpu, EX_INSTR_ACCESS, cpu->pc);
-		return 0;
-	}
-
-	// Получить код инструкции
-	phys = (ui*)(&cpu->ram[addr]);
-
-	*instr = (uint32_t)*phys;
+	// Получить код инструкции (сначала младшие 16 бит)
+	*instr = *((uint16_t*)p);
 
 	// и передвинуть PC на начало следующей инструкции (+16 или +32 бит)
 	if ((*instr & 0x03) == 0x03)
 	{
+		// 32-битная инструкция может начинаться в конце страницы,
+		// тогда старшие 16 бит находятся на следующей странице
+		if ((cpu->pc & 0xFFF) == 0xFFE)
+		{
+			p = tlb_translate(cpu, cpu->pc + 2, TLB_EXEC);
+			if (p == NULL)
+				return 0;
+		}
+		else
+			p += 2;
+		*instr |= ((uint32_t)*((uint16_t*)p)) << 16;
 		cpu->pc += 4;
 	}
 	else
 	{
 		cpu->pc += 2;
-		*instr &= 0xFFFF;
 	}
 
 	return 1;
 }
 
-// Выполнить 1 инструкцию
-void do_step(riscv_t* cpu)
+// Обработчики декодированных инструкций
+// К моменту вызова cpu->pc уже указывает на следующую инструкцию,
+// а cpu->instr_pc - на текущую
+
+// Загрузка из памяти
+static void exec_lb(riscv_t* cpu, const insn_t* in)
+{
+	si value;
+	if (read8(cpu, cpu->r[in->rs1] + in->imm, &value))
+		cpu->r[in->rd] = (int8_t)value;
+}
+
+static void exec_lh(riscv_t* cpu, const insn_t* in)
+{
+	si value;
+	if (read16(cpu, cpu->r[in->rs1] + in->imm, &value))
+		cpu->r[in->rd] = (int16_t)value;
+}
+
+static void exec_lw(riscv_t* cpu, const insn_t* in)
+{
+	si value;
+	if (read32(cpu, cpu->r[in->rs1] + in->imm, &value))
+		cpu->r[in->rd] = (int32_t)value;
+}
+
+static void exec_ld(riscv_t* cpu, const insn_t* in)
+{
+	si value;
+	if (read64(cpu, cpu->r[in->rs1] + in->imm, &value))
+		cpu->r[in->rd] = value;
+}
+
+static void exec_lbu(riscv_t* cpu, const insn_t* in)
+{
+	si value;
+	if (read8(cpu, cpu->r[in->rs1] + in->imm, &value))
+		cpu->r[in->rd] = ((uint8_t)value) & 0xFF;
+}
+
+static void exec_lhu(riscv_t* cpu, const insn_t* in)
 {
-	uint32_t instr;
-	int rd, rs1, rs2, shamt;
-	int func3, func7;
-	si imm;
-	ui addr;
 	si value;
-	int32_t a32, b32, res32;
-	uint32_t u32;
-	uint64_t u64;
-	int64_t i64;
+	if (read16(cpu, cpu->r[in->rs1] + in->imm, &value))
+		cpu->r[in->rd] = ((uint16_t)value) & 0xFFFF;
+}
+
+static void exec_lwu(riscv_t* cpu, const insn_t* in)
+{
+	si value;
+	if (read32(cpu, cpu->r[in->rs1] + in->imm, &value))
+		cpu->r[in->rd] = ((uint32_t)value) & 0xFFFFFFFFu;
+}
+
+// Запись в память
+static void exec_sb(riscv_t* cpu, const insn_t* in)
+{
+	write8(cpu, cpu->r[in->rs1] + in->imm, (uint8_t)cpu->r[in->rs2]);
+}
+
+static void exec_sh(riscv_t* cpu, const insn_t* in)
+{
+	write16(cpu, cpu->r[in->rs1] + in->imm, (uint16_t)cpu->r[in->rs2]);
+}
+
+static void exec_sw(riscv_t* cpu, const insn_t* in)
+{
+	write32(cpu, cpu->r[in->rs1] + in->imm, (uint32_t)cpu->r[in->rs2]);
+}
+
+static void exec_sd(riscv_t* cpu, const insn_t* in)
+{
+	write64(cpu, cpu->r[in->rs1] + in->imm, cpu->r[in->rs2]);
+}
+
+// Операции с константой (для сдвигов в imm находится величина сдвига)
+static void exec_addi(riscv_t* cpu, const insn_t* in)
+{
+	cpu->r[in->rd] = cpu->r[in->rs1] + in->imm;
+}
+
+static void exec_slli(riscv_t* cpu, const insn_t* in)
+{
+	cpu->r[in->rd] = cpu->r[in->rs1] << in->imm;
+}
+
+static void exec_slti(riscv_t* cpu, const insn_t* in)
+{
+	cpu->r[in->rd] = cpu->r[in->rs1] < (si)in->imm ? 1 : 0;
+}
+
+static void exec_sltiu(riscv_t* cpu, const insn_t* in)
+{
+	cpu->r[in->rd] = ((ui)cpu->r[in->rs1]) < ((ui)(si)in->imm) ? 1 : 0;
+}
+
+static void exec_xori(riscv_t* cpu, const insn_t* in)
+{
+	cpu->r[in->rd] = cpu->r[in->rs1] ^ in->imm;
+}
+
+static void exec_srli(riscv_t* cpu, const insn_t* in)
+{
+	cpu->r[in->rd] = ((ui)cpu->r[in->rs1]) >> in->imm;
+}
+
+static void exec_srai(riscv_t* cpu, const insn_t* in)
+{
+	cpu->r[in->rd] = cpu->r[in->rs1] >> in->imm;
+}
+
+static void exec_ori(riscv_t* cpu, const insn_t* in)
+{
+	cpu->r[in->rd] = cpu->r[in->rs1] | in->imm;
+}
+
+static void exec_andi(riscv_t* cpu, const insn_t* in)
+{
+	cpu->r[in->rd] = cpu->r[in->rs1] & in->imm;
+}
+
+static void exec_addiw(riscv_t* cpu, const insn_t* in)
+{
+	cpu->r[in->rd] = (int32_t)((int32_t)cpu->r[in->rs1] + in->imm);
+}
+
+static void exec_slliw(riscv_t* cpu, const insn_t* in)
+{
+	cpu->r[in->rd] = (int32_t)((int32_t)cpu->r[in->rs1] << in->imm);
+}
+
+static void exec_srliw(riscv_t* cpu, const insn_t* in)
+{
+	cpu->r[in->rd] = ((uint32_t)cpu->r[in->rs1]) >> in->imm;
+}
+
+static void exec_sraiw(riscv_t* cpu, const insn_t* in)
+{
+	cpu->r[in->rd] = ((int32_t)cpu->r[in->rs1]) >> in->imm;
+}
+
+// Операции с регистрами
+static void exec_add(riscv_t* cpu, const insn_t* in)
+{
+	cpu->r[in->rd] = cpu->r[in->rs1] + cpu->r[in->rs2];
+}
+
+static void exec_sub(riscv_t* cpu, const insn_t* in)
+{
+	cpu->r[in->rd] = cpu->r[in->rs1] - cpu->r[in->rs2];
+}
+
+static void exec_sll(riscv_t* cpu, const insn_t* in)
+{
+	cpu->r[in->rd] = cpu->r[in->rs1] << (cpu->r[in->rs2] & 0x3F);
+}
+
+static void exec_slt(riscv_t* cpu, const insn_t* in)
+{
+	cpu->r[in->rd] = cpu->r[in->rs1] < cpu->r[in->rs2] ? 1 : 0;
+}
+
+static void exec_sltu(riscv_t* cpu, const insn_t* in)
+{
+	cpu->r[in->rd] = ((ui)cpu->r[in->rs1]) < ((ui)cpu->r[in->rs2]) ? 1 : 0;
+}
+
+static void exec_xor(riscv_t* cpu, const insn_t* in)
+{
+	cpu->r[in->rd] = cpu->r[in->rs1] ^ cpu->r[in->rs2];
+}
+
+static void exec_srl(riscv_t* cpu, const insn_t* in)
+{
+	cpu->r[in->rd] = ((ui)cpu->r[in->rs1]) >> (cpu->r[in->rs2] & 0x3F);
+}
+
+static void exec_sra(riscv_t* cpu, const insn_t* in)
+{
+	cpu->r[in->rd] = cpu->r[in->rs1] >> (cpu->r[in->rs2] & 0x3F);
+}
+
+static void exec_or(riscv_t* cpu, const insn_t* in)
+{
+	cpu->r[in->rd] = cpu->r[in->rs1] | cpu->r[in->rs2];
+}
+
+static void exec_and(riscv_t* cpu, const insn_t* in)
+{
+	cpu->r[in->rd] = cpu->r[in->rs1] & cpu->r[in->rs2];
+}
+
+static void exec_addw(riscv_t* cpu, const insn_t* in)
+{
+	cpu->r[in->rd] = (int32_t)((int32_t)cpu->r[in->rs1] + (int32_t)cpu->r[in->rs2]);
+}
+
+static void exec_subw(riscv_t* cpu, const insn_t* in)
+{
+	cpu->r[in->rd] = (int32_t)((int32_t)cpu->r[in->rs1] - (int32_t)cpu->r[in->rs2]);
+}
+
+static void exec_sllw(riscv_t* cpu, const insn_t* in)
+{
+	cpu->r[in->rd] = (int32_t)((int32_t)cpu->r[in->rs1] << (cpu->r[in->rs2] & 0x1F));
+}
+
+static void exec_srlw(riscv_t* cpu, const insn_t* in)
+{
+	cpu->r[in->rd] = ((uint32_t)cpu->r[in->rs1]) >> (cpu->r[in->rs2] & 0x1F);
+}
+
+static void exec_sraw(riscv_t* cpu, const insn_t* in)
+{
+	cpu->r[in->rd] = ((int32_t)cpu->r[in->rs1]) >> (cpu->r[in->rs2] & 0x1F);
+}
+
+static void exec_lui(riscv_t* cpu, const insn_t* in)
+{
+	cpu->r[in->rd] = in->imm;
+}
+
+static void exec_auipc(riscv_t* cpu, const insn_t* in)
+{
+	cpu->r[in->rd] = cpu->instr_pc + in->imm;
+}
+
+// Переходы
+static void exec_beq(riscv_t* cpu, const insn_t* in)
+{
+	if (cpu->r[in->rs1] == cpu->r[in->rs2])
+		cpu->pc = cpu->instr_pc + in->imm;
+}
+
+static void exec_bne(riscv_t* cpu, const insn_t* in)
+{
+	if (cpu->r[in->rs1] != cpu->r[in->rs2])
+		cpu->pc = cpu->instr_pc + in->imm;
+}
+
+static void exec_blt(riscv_t* cpu, const insn_t* in)
+{
+	if (cpu->r[in->rs1] < cpu->r[in->rs2])
+		cpu->pc = cpu->instr_pc + in->imm;
+}
+
+static void exec_bge(riscv_t* cpu, const insn_t* in)
+{
+	if (cpu->r[in->rs1] >= cpu->r[in->rs2])
+		cpu->pc = cpu->instr_pc + in->imm;
+}
+
+static void exec_bltu(riscv_t* cpu, const insn_t* in)
+{
+	if (((ui)cpu->r[in->rs1]) < ((ui)cpu->r[in->rs2]))
+		cpu->pc = cpu->instr_pc + in->imm;
+}
+
+static void exec_bgeu(riscv_t* cpu, const insn_t* in)
+{
+	if (((ui)cpu->r[in->rs1]) >= ((ui)cpu->r[in->rs2]))
+		cpu->pc = cpu->instr_pc + in->imm;
+}
+
+static void exec_jal(riscv_t* cpu, const insn_t* in)
+{
+	cpu->r[in->rd] = cpu->pc;
+	cpu->pc = cpu->instr_pc + in->imm;
+}
+
+static void exec_jalr(riscv_t* cpu, const insn_t* in)
+{
+	ui addr = cpu->r[in->rs1] + in->imm;
+	cpu->r[in->rd] = cpu->pc;
+	cpu->pc = addr;
+}
+
+static void exec_fence(riscv_t* cpu, const insn_t* in)
+{
+}
+
+// Инструкции, выполняемые функциями расширений. В imm находится полный код инструкции
+static void exec_muldiv(riscv_t* cpu, const insn_t* in)
+{
+	do_muldiv(cpu, in->imm, in->rs1, in->rs2, in->rd, bits(in->imm, 14, 12), bits(in->imm, 31, 25));
+}
+
+static void exec_muldivw(riscv_t* cpu, const insn_t* in)
+{
+	do_muldiv32(cpu, in->imm, in->rs1, in->rs2, in->rd, bits(in->imm, 14, 12), bits(in->imm, 31, 25));
+}
+
+static void exec_atomic(riscv_t* cpu, const insn_t* in)
+{
+	do_atomic(cpu, in->imm, in->rs1, in->rs2, in->rd, bits(in->imm, 14, 12), bits(in->imm, 31, 25));
+}
+
+static void exec_system(riscv_t* cpu, const insn_t* in)
+{
+	do_priv(cpu, in->imm, in->rs1, in->rs2, in->rd, bits(in->imm, 14, 12), bits(in->imm, 31, 25));
+}
+
+static void exec_illegal(riscv_t* cpu, const insn_t* in)
+{
+	trap(cpu, EX_INSTR_ILLEGAL, cpu->instr_pc);
+}
+
+// Ячейка кэша ещё не декодирована: прочитать инструкцию, декодировать и выполнить
+static void exec_decode(riscv_t* cpu, const insn_t* in)
+{
+	uint32_t instr;
+	insn_t tmp;
+	insn_t* slot = (insn_t*)in;
 
-	// Получить код инструкции
 	if (!fetch(cpu, &instr))
 		return;
 
-	// Если это 16-битная инструкция, то выполнить в step_compressed
+	// 32-битная инструкция на границе страниц зависит от соседней страницы,
+	// поэтому её нельзя сохранять в кэше - она декодируется каждый раз заново
+	if ((cpu->instr_pc & 0xFFF) == 0xFFE && (instr & 3) == 3)
+		slot = &tmp;
+
+	decode(instr, slot);
+	slot->exec(cpu, slot);
+}
+
+// Таблица обработчиков
+const insn_handler_t insn_handlers[OP_COUNT] =
+{
+	exec_decode, exec_illegal,
+	exec_lb, exec_lh, exec_lw, exec_ld, exec_lbu, exec_lhu, exec_lwu,
+	exec_sb, exec_sh, exec_sw, exec_sd,
+	exec_addi, exec_slli, exec_slti, exec_sltiu, exec_xori, exec_srli, exec_srai, exec_ori, exec_andi,
+	exec_addiw, exec_slliw, exec_srliw, exec_sraiw,
+	exec_add, exec_sub, exec_sll, exec_slt, exec_sltu, exec_xor, exec_srl, exec_sra, exec_or, exec_and,
+	exec_addw, exec_subw, exec_sllw, exec_srlw, exec_sraw,
+	exec_lui, exec_auipc,
+	exec_beq, exec_bne, exec_blt, exec_bge, exec_bltu, exec_bgeu, exec_jal, exec_jalr,
+	exec_fence,
+	exec_muldiv, exec_muldivw, exec_atomic, exec_system
+};
+
+// Декодирование инструкции
+void decode(uint32_t instr, insn_t* in)
+{
+	int func3, func7;
+	int op = OP_ILLEGAL;
+
+	in->len = 4;
+
+	// 16-битная инструкция заменяется равносильной 32-битной
+	// (недопустимый код заменяется нулём и будет декодирован как OP_ILLEGAL)
 	if ((instr & 3) != 3)
 	{
-		do_step_compressed(cpu, (uint16_t)instr);
-		return;
+		instr = rvc_table[instr & 0xFFFF];
+		in->len = 2;
 	}
 
 	// Декодировать поля инструкции
-	rd = bits(instr, 11, 7);
-	rs1 = bits(instr, 19, 15);
-	rs2 = bits(instr, 24, 20);
-	shamt = bits(instr, 25, 20);
+	in->rd = bits(instr, 11, 7);
+	in->rs1 = bits(instr, 19, 15);
+	in->rs2 = bits(instr, 24, 20);
+	in->imm = 0;
 	func3 = bits(instr, 14, 12);
 	func7 = bits(instr, 31, 25);
 
-	// Обнулить значение r0 (hardwired to zero)
-	cpu->r[0] = 0;
-	
 	// Декодировать код команды
 	switch (instr & 0x7F)
 	{
 		case 0x03:
-			addr = cpu->r[rs1] + I_imm(instr);
+			in->imm = I_imm(instr);
 			switch (func3)
 			{
-				case 0: // LB
-					if (!read8(cpu, addr, &value))
-						return;
-					cpu->r[rd] = (int8_t)value;
-					return;
-				case 1: // LH
-					if (!read16(cpu, addr, &value))
-						return;
-					cpu->r[rd] = (int16_t)value;
-					return;
-				case 2: // LW
-					if (!read32(cpu, addr, &value))
-						return;
-					cpu->r[rd] = (int32_t)value;
-					return;
-				case 3: // LD
-					if (!read64(cpu, addr, &value))
-						return;
-					cpu->r[rd] = value;
-					return;
-				case 4: // LBU
-					if (!read8(cpu, addr, &value))
-						return;
-					cpu->r[rd] = ((uint8_t)value) & 0xFF;
-					return;
-				case 5: // LHU
-					if (!read16(cpu, addr, &value))
-						return;
-					cpu->r[rd] = ((uint16_t)value) & 0xFFFF;
-					return;
-				case 6: // LWU
-					if (!read32(cpu, addr, &value))
-						return;
-					cpu->r[rd] = ((uint32_t)value) & 0xFFFFFFFFu;
-					return;
+				case 0: op = OP_LB; break;
+				case 1: op = OP_LH; break;
+				case 2: op = OP_LW; break;
+				case 3: op = OP_LD; break;
+				case 4: op = OP_LBU; break;
+				case 5: op = OP_LHU; break;
+				case 6: op = OP_LWU; break;
 			}
 			break;
 		case 0x0f:
-			// FENCE
-			return;
+			op = OP_FENCE;
+			if (func3 == 1)
+			{
+				// FENCE.I выполняется как системная инструкция: после неё
+				// декодированные инструкции нужно заново найти в кэше
+				op = OP_SYSTEM;
+				in->imm = instr;
+			}
+			break;
 		case 0x13:
-			imm = I_imm(instr);
+			in->imm = I_imm(instr);
 			switch (func3)
 			{
-				case 0: // ADDI
-					cpu->r[rd] = cpu->r[rs1] + imm;
-					return;
-				case 1: // SLLI
-					cpu->r[rd] = cpu->r[rs1] << shamt;
-					return;
-				case 2: // SLTI
-					cpu->r[rd] = cpu->r[rs1] < imm ? 1 : 0;
-					return;
-				case 3: // SLTIU
-					cpu->r[rd] = ((ui)cpu->r[rs1]) < ((ui)imm) ? 1 : 0;
-					return;
-				case 4: // XORI
-					cpu->r[rd] = cpu->r[rs1] ^ imm;
-					return;
+				case 0: op = OP_ADDI; break;
+				case 1: op = OP_SLLI; in->imm = bits(instr, 25, 20); break;
+				case 2: op = OP_SLTI; break;
+				case 3: op = OP_SLTIU; break;
+				case 4: op = OP_XORI; break;
 				case 5:
-					if (func7 & 0x20)
-					{
-						cpu->r[rd] = cpu->r[rs1] >> shamt; // SRAI
-					}
-					else
-					{
-						cpu->r[rd] = ((ui)cpu->r[rs1]) >> shamt; // SRLI
-					}
-					return;
-				case 6: // ORI
-					cpu->r[rd] = cpu->r[rs1] | imm;
-					return;
-				case 7: // ANDI
-					cpu->r[rd] = cpu->r[rs1] & imm;
-					return;
+					op = (func7 & 0x20) ? OP_SRAI : OP_SRLI;
+					in->imm = bits(instr, 25, 20);
+					break;
+				case 6: op = OP_ORI; break;
+				case 7: op = OP_ANDI; break;
 			}
 			break;
 		case 0x17:
-			// AUIPC
-			cpu->r[rd] = cpu->instr_pc + U_imm(instr);
-			return;
+			op = OP_AUIPC;
+			in->imm = U_imm(instr);
+			break;
 		case 0x1B:
-			imm = I_imm(instr);
-			a32 = (int32_t)cpu->r[rs1];
-			u32 = (uint32_t)cpu->r[rs1];
+			in->imm = I_imm(instr);
 			switch (func3)
 			{
-				case 0: // ADDIW
-					b32 = (int32_t)imm;
-					a32 += b32;
-					cpu->r[rd] = a32;
-					return;
-				case 1: // SLLIW
-					a32 <<= shamt & 0x1F;
-					cpu->r[rd] = a32;
-					return;
+				case 0: op = OP_ADDIW; break;
+				case 1: op = OP_SLLIW; in->imm = bits(instr, 24, 20); break;
 				case 5:
-					if (func7 & 0x20)
-					{
-						a32 >>= shamt & 0x1F;
-						cpu->r[rd] = a32; // SRAIW
-					}
-					else
-					{
-						u32 >>= shamt & 0x1F;
-						cpu->r[rd] = u32; // SRLIW
-					}
-					return;
+					op = (func7 & 0x20) ? OP_SRAIW : OP_SRLIW;
+					in->imm = bits(instr, 24, 20);
+					break;
 			}
 			break;
 		case 0x23:
-			// S-type
-			addr = cpu->r[rs1] + S_imm(instr);
+			in->imm = S_imm(instr);
 			switch (func3)
 			{
-				case 0:
-					// SB
-					write8(cpu, addr, (uint8_t)cpu->r[rs2]);
-					return;
-				case 1:
-					// SH
-					write16(cpu, addr, (uint16_t)cpu->r[rs2]);
-					return;
-				case 2:
-					// SW
-					write32(cpu, addr, (uint32_t)cpu->r[rs2]);
-					return;
-				case 3:
-					// SD
-					write64(cpu, addr, cpu->r[rs2]);
-					return;
+				case 0: op = OP_SB; break;
+				case 1: op = OP_SH; break;
+				case 2: op = OP_SW; break;
+				case 3: op = OP_SD; break;
 			}
 			break;
 		case 0x2F:
-			// Атомарные инструкции
-			do_atomic(cpu, instr, rs1, rs2, rd, func3, func7);
-			return;
+			op = OP_ATOMIC;
+			in->imm = instr;
+			break;
 		case 0x33:
 			if (func7 & 0x01)
 			{
-				do_muldiv(cpu, instr, rs1, rs2, rd, func3, func7);
-				return;
+				op = OP_MULDIV;
+				in->imm = instr;
+				break;
 			}
-			else
+			switch (func3)
 			{
-				switch (func3)
-				{
-					case 0:
-						if (func7 & 0x20)
-						{
-							cpu->r[rd] = cpu->r[rs1] - cpu->r[rs2]; // SUB
-						}
-						else
-						{
-							cpu->r[rd] = cpu->r[rs1] + cpu->r[rs2]; // ADD
-						}
-						return;
-					case 1: // SLL
-						cpu->r[rd] = cpu->r[rs1] << (cpu->r[rs2] & 0x3F);
-						return;
-					case 2: // SLT
-						cpu->r[rd] = cpu->r[rs1] < cpu->r[rs2] ? 1 : 0;
-						return;
-					case 3: // SLTU
-						cpu->r[rd] = ((ui)cpu->r[rs1]) < ((ui)cpu->r[rs2]) ? 1 : 0;
-						return;
-					case 4: // XOR
-						cpu->r[rd] = cpu->r[rs1] ^ cpu->r[rs2];
-						return;
-					case 5:
-						if (func7 & 0x20)
-						{
-							cpu->r[rd] = cpu->r[rs1] >> (cpu->r[rs2] & 0x3F); // SRA
-						}
-						else
-						{
-							cpu->r[rd] = ((ui)cpu->r[rs1]) >> (cpu->r[rs2] & 0x3F); // SRL
-						}
-						return;
-					case 6: // OR
-						cpu->r[rd] = cpu->r[rs1] | cpu->r[rs2];
-						return;
-					case 7: // AND
-						cpu->r[rd] = cpu->r[rs1] & cpu->r[rs2];
-						return;
-				}
+				case 0: op = (func7 & 0x20) ? OP_SUB : OP_ADD; break;
+				case 1: op = OP_SLL; break;
+				case 2: op = OP_SLT; break;
+				case 3: op = OP_SLTU; break;
+				case 4: op = OP_XOR; break;
+				case 5: op = (func7 & 0x20) ? OP_SRA : OP_SRL; break;
+				case 6: op = OP_OR; break;
+				case 7: op = OP_AND; break;
 			}
 			break;
-		case 0x37: // LUI
-			cpu->r[rd] = U_imm(instr);
-			return;
+		case 0x37:
+			op = OP_LUI;
+			in->imm = U_imm(instr);
+			break;
 		case 0x3B:
-			a32 = (int32_t)cpu->r[rs1];
-			b32 = (int32_t)cpu->r[rs2];
 			if (func7 & 0x01)
 			{
-				do_muldiv32(cpu, instr, rs1, rs2, rd, func3, func7);
-				return;
+				op = OP_MULDIVW;
+				in->imm = instr;
+				break;
 			}
-			else
+			switch (func3)
 			{
-				switch (func3)
-				{
-					case 0:
-						if (func7 & 0x20)
-						{
-							res32 = a32 - b32;
-							cpu->r[rd] = res32; // SUBW
-						}
-						else
-						{
-							res32 = a32 + b32;
-							cpu->r[rd] = res32; // ADDW
-						}
-						return;
-					case 1: // SLLW
-						res32 = a32 << (b32 & 0x1F);
-						cpu->r[rd] = res32;
-						return;
-					case 5:
-						if (func7 & 0x20)
-						{
-							res32 = a32 >> (b32 & 0x1F);
-							cpu->r[rd] = res32; // SRAW
-						}
-						else
-						{
-							u32 = ((uint32_t)a32) >> (b32 & 0x1F);
-							cpu->r[rd] = u32; // SRLW
-						}
-						return;
-				}
+				case 0: op = (func7 & 0x20) ? OP_SUBW : OP_ADDW; break;
+				case 1: op = OP_SLLW; break;
+				case 5: op = (func7 & 0x20) ? OP_SRAW : OP_SRLW; break;
 			}
 			break;
 		case 0x63:
-			addr = cpu->instr_pc + B_imm(instr);
+			in->imm = B_imm(instr);
 			switch (func3)
 			{
-				case 0:
-					// BEQ
-					if (cpu->r[rs1] == cpu->r[rs2])
-						cpu->pc = addr;
-					return;
-				case 1:
-					// BNE
-					if (cpu->r[rs1] != cpu->r[rs2])
-						cpu->pc = addr;
-					return;
-				case 4:
-					// BLT
-					if (cpu->r[rs1] < cpu->r[rs2])
-						cpu->pc = addr;
-					return;
-				case 5:
-					// BGE
-					if (cpu->r[rs1] >= cpu->r[rs2])
-						cpu->pc = addr;
-					return;
-				case 6:
-					// BLTU
-					if (((ui)cpu->r[rs1]) < ((ui)cpu->r[rs2]))
-						cpu->pc = addr;
-					return;
-				case 7:
-					// BGEU
-					if (((ui)cpu->r[rs1]) >= ((ui)cpu->r[rs2]))
-						cpu->pc = addr;
-					return;
+				case 0: op = OP_BEQ; break;
+				case 1: op = OP_BNE; break;
+				case 4: op = OP_BLT; break;
+				case 5: op = OP_BGE; break;
+				case 6: op = OP_BLTU; break;
+				case 7: op = OP_BGEU; break;
 			}
 			break;
 		case 0x67:
-			// JALR
-			addr = cpu->r[rs1] + I_imm(instr);
-			cpu->r[rd] = cpu->pc;
-			cpu->pc = addr;
-			return;
+			op = OP_JALR;
+			in->imm = I_imm(instr);
+			break;
 		case 0x6F:
-			// JAL
-			cpu->r[rd] = cpu->pc;
-			cpu->pc = cpu->instr_pc + J_imm(instr);
-			return;
+			op = OP_JAL;
+			in->imm = J_imm(instr);
+			break;
 		case 0x73:
-			do_priv(cpu, instr, rs1, rs2, rd, func3, func7);
-			return;
+			op = OP_SYSTEM;
+			in->imm = instr;
+			break;
 	}
-	trap(cpu, EX_INSTR_ILLEGAL, cpu->instr_pc);
+
+	in->op = op;
+	in->exec = insn_handlers[op];
 }
 
-// Выполнять код 1 микросекунду
-void step1us(riscv_t* cpu)
+// Найти декодированную инструкцию по адресу cpu->pc
+static insn_t* fetch_insn(riscv_t* cpu)
 {
-	int i, t = 0;
+	uint8_t* p;
+	ui offset;
+	dcache_page_t* page;
+
+	// Найти страницу в TLB, при промахе преобразовать виртуальный адрес инструкции
+	// в физический и проверить разрешение на выполнение (X) у страницы памяти
+	p = tlb_translate(cpu, cpu->pc, TLB_EXEC);
+	if (p == NULL)
+		return NULL;
 
-	if (cpu->wfi)
-		t = sleep1ms();
-	riscv_timer_tick(cpu, t * 1000 + 1);
+	// Найти декодированную страницу по физическому адресу
+	offset = (ui)(p - cpu->ram);
+	page = cpu->dcache[offset >> 12];
+	if (page == NULL)
+		page = dcache_get(cpu, RAM_START + offset);
+
+	return &page->insn[(offset & 0xFFF) >> 1];
+}
+
+// Выполнить 1 инструкцию
+void do_step(riscv_t* cpu)
+{
+	insn_t* in;
+
+	// Запомнить в instr_pc адрес текущей инструкции на случай исключения
+	cpu->instr_pc = cpu->pc;
+
+	in = fetch_insn(cpu);
+	if (in == NULL)
+		return;
 
-	plic_update(cpu);
+	// Передвинуть PC на начало следующей инструкции (+16 или +32 бит)
+	cpu->pc += in->len;
 
-	for (i = 0; i < INSTR_IN_1US && !cpu->wfi; i++)
+	// Обнулить значение r0 (hardwired to zero)
+	cpu->r[0] = 0;
+
+	in->exec(cpu, in);
+}
+
+// Выполнить до count инструкций, возвращает количество выполненных.
+// Выполнение прерывается раньше, если процессор уснул или нужно проверить прерывания
+int execute(riscv_t* cpu, int count)
+{
+	int i;
+
+	switch (cpu->core)
+	{
+		case CORE_THREADED:
+			return threaded_run(cpu, count);
+		case CORE_JIT:
+			return jit_run(cpu, count);
+	}
+
+	for (i = 0; i < count && !cpu->wfi && !cpu->irq_check && !cpu->mail && cpu->pc != cpu->break_pc; i++)
 		do_step(cpu);
+
+	return i;
 }
 
 // Сброс процессора
@@ -401,10 +625,19 @@ void reset(riscv_t* cpu)
 	cpu->s_mode = 1;
 	cpu->mmu_on = 0;
 	cpu->wfi = 0;
+	cpu->res_addr = ~(ui)0;
+	cpu->break_pc = ~(ui)0;
 
 	cpu->mtime = 0;
 	cpu->mtimecmp = -1;
+	clock_reset(cpu);
+
+	for (i = 0; i < EVENT_COUNT; i++)
+		cpu->events[i] = EVENT_NEVER;
+	cpu->irq_check = 0;
 
 	for (i = 0; i < 32; i++)
 		cpu->r[i] = 0;
+
+	tlb_flush(cpu);
 }
@@ -1,5 +1,6 @@
 #pragma once
 
+#include <stddef.h>
 #include <stdint.h>
 
 #include "config.h"
@@ -13,6 +14,11 @@ typedef int64_t si;
 // Биты включения MMU
 #define SATP_MODE_ENABLE			0x8000000000000000llu
 #define SATP_MODE_MASK				0xF000000000000000llu
+// Поле ASID (идентификатор адресного пространства) в регистре satp
+#define SATP_ASID_SHIFT				44
+#define SATP_ASID_MASK				0xFFFFu
+// Поле PPN (номер страницы главного каталога) в регистре satp
+#define SATP_PPN_MASK				0xFFFFFFFFFFFllu
 // Количество уровней в каталогах страниц
 #define MMU_LEVELS					3
 // Количество битов, определяющих номер страницы в каталоге
@@ -31,6 +37,9 @@ typedef uint32_t ui;
 typedef int32_t si;
 #define SATP_MODE_ENABLE			0x80000000u
 #define SATP_MODE_MASK				0x80000000u
+#define SATP_ASID_SHIFT				22
+#define SATP_ASID_MASK				0x1FFu
+#define SATP_PPN_MASK				0x3FFFFFu
 #define MMU_LEVELS					2
 #define MMU_LEVEL_BITS				10
 #define MMU_VPN_MASK				0x3FFu
@@ -84,24 +93,178 @@ typedef int32_t si;
 // DIRTY - индикатор, показывающий, что было изменение содержимого страницы
 #define MMU_DIRTY					0x0080
 
+// Флаг разрешения программного прерывания (от другого процессора)
+#define MIE_SSIE					(1 << 1)
 // Флаг разрешения прерывания таймера
 #define MIE_MTIE					(1 << 5)
+// Флаг разрешения внешнего прерывания (от контроллера прерываний PLIC)
+#define MIE_SEIE					(1 << 9)
 // Флаги регистра состояния
 #define SSTATUS_SIE					(1 << 1)
 #define SSTATUS_SPIE				(1 << 5)
 #define SSTATUS_SPP					(1 << 8)
 #define SSTATUS_SUM					(1 << 18)
 
-// Ядро RISC-V
+// Программный TLB - кэш трансляции виртуальных страниц в указатели на память хоста
+// Количество записей в каждом наборе (должно быть степенью двойки)
+#define TLB_SIZE					256
+// Наборы записей для разных типов доступа
+#define TLB_READ					0
+#define TLB_WRITE					1
+#define TLB_EXEC					2
+// Номер страницы пустой записи (не совпадает ни с одним реальным адресом)
+#define TLB_INVALID					((ui)-1)
+// ASID глобальной записи (страница с флагом G видна во всех адресных пространствах)
+#define TLB_ASID_GLOBAL				0xFFFFFFFFu
+
+// Запись TLB
 typedef struct
 {
+	// Номер виртуальной страницы (адрес >> 12)
+	ui vpn;
+	// Маска младших битов vpn, которые покрывает большая страница (0 для 4 КБ страниц).
+	// Нужна для выборочной очистки по адресу
+	ui vpn_span;
+	// ASID адресного пространства или TLB_ASID_GLOBAL
+	uint32_t asid;
+	// Указатель на начало страницы в памяти хоста
+	uint8_t* page;
+} tlb_entry_t;
+
+// Кэш декодированных инструкций (по физическим страницам)
+// Количество ячеек на странице: инструкции выровнены на 2 байта
+#define DCACHE_SLOTS				2048
+// Максимальное количество декодированных страниц, при переполнении кэш очищается целиком
+#define DCACHE_MAX_PAGES			1024
+
+// Коды декодированных операций
+enum
+{
+	// Ячейка ещё не декодирована
+	OP_DECODE,
+	OP_ILLEGAL,
+	// Загрузка из памяти
+	OP_LB, OP_LH, OP_LW, OP_LD, OP_LBU, OP_LHU, OP_LWU,
+	// Запись в память
+	OP_SB, OP_SH, OP_SW, OP_SD,
+	// Операции с константой
+	OP_ADDI, OP_SLLI, OP_SLTI, OP_SLTIU, OP_XORI, OP_SRLI, OP_SRAI, OP_ORI, OP_ANDI,
+	OP_ADDIW, OP_SLLIW, OP_SRLIW, OP_SRAIW,
+	// Операции с регистрами
+	OP_ADD, OP_SUB, OP_SLL, OP_SLT, OP_SLTU, OP_XOR, OP_SRL, OP_SRA, OP_OR, OP_AND,
+	OP_ADDW, OP_SUBW, OP_SLLW, OP_SRLW, OP_SRAW,
+	OP_LUI, OP_AUIPC,
+	// Переходы
+	OP_BEQ, OP_BNE, OP_BLT, OP_BGE, OP_BLTU, OP_BGEU, OP_JAL, OP_JALR,
+	OP_FENCE,
+	// Операции, которые выполняются функциями расширений (в imm - код инструкции)
+	OP_MULDIV, OP_MULDIVW, OP_ATOMIC, OP_SYSTEM,
+	OP_COUNT
+};
+
+typedef struct riscv_s riscv_t;
+typedef struct insn_s insn_t;
+
+// Обработчик декодированной инструкции
+typedef void (*insn_handler_t)(riscv_t* cpu, const insn_t* in);
+
+// Декодированная инструкция
+struct insn_s
+{
+	// Обработчик
+	insn_handler_t exec;
+	// Непосредственное значение, уже расширенное по знаку
+	int32_t imm;
+	// Код операции, номера регистров и длина инструкции в байтах
+	uint8_t op;
+	uint8_t rd;
+	uint8_t rs1;
+	uint8_t rs2;
+	uint8_t len;
+};
+
+// Декодированная страница кода
+typedef struct dcache_page_s
+{
+	insn_t insn[DCACHE_SLOTS];
+	// Следующая страница в списке свободных или декодированных, предыдущая - в списке
+	// декодированных
+	struct dcache_page_s* next;
+	struct dcache_page_s* prev;
+	// Номер физической страницы ОЗУ
+	ui index;
+	// Транслированные блоки этой страницы
+	struct jit_block_s* jit;
+} dcache_page_t;
+
+// События, наступающие в заданное время (по счётчику mtime)
+#define EVENT_TIMER					0 // Срабатывание таймера
+#define EVENT_PROFILE				1 // Выборка профилировщика
+#define EVENT_COUNT					2
+
+// Событие не запланировано
+#define EVENT_NEVER					INT64_MAX
+
+typedef void (*event_handler_t)(riscv_t* cpu);
+
+// Состояния процессора (ядра) для расширения SBI HSM
+#define HSM_STARTED					0 // Работает
+#define HSM_STOPPED					1 // Остановлен
+#define HSM_START_PENDING			2 // Запускается
+#define HSM_STARTING				-1 // Параметры запуска ещё записываются (для гостя - HSM_START_PENDING)
+
+// Запросы от других процессоров (SBI IPI и RFENCE)
+#define MAIL_IPI					1 // Программное прерывание
+#define MAIL_FENCE_I				2 // Синхронизация кэша инструкций
+#define MAIL_SFENCE					4 // Очистка TLB в диапазоне адресов
+#define MAIL_IRQ					8 // Изменилось состояние внешнего прерывания (PLIC)
+#define MAIL_PAUSE					16 // Остановиться до smp_resume
+#define MAIL_SNAPSHOT				32 // Сохранить снимок состояния машины
+#define MAIL_FORK					64 // Запустить сервер заданий (fork-server)
+#define MAIL_ROLLBACK				128 // Вернуть машину к последнему снимку
+// Запросы, которые выполняются только между отрезками выполнения, а не внутри вызова SBI
+#define MAIL_DEFERRED				(MAIL_PAUSE | MAIL_SNAPSHOT | MAIL_FORK | MAIL_ROLLBACK)
+
+// Способы выполнения инструкций
+#define CORE_THREADED				0 // Интерпретатор с шитым кодом (по умолчанию)
+#define CORE_STEP					1 // Вызов обработчика для каждой инструкции
+#define CORE_JIT					2 // Динамическая трансляция
+
+// Ядро RISC-V
+struct riscv_s
+{
+	// Номер процессора (ядра)
+	int hartid;
+	// Состояние процессора (HSM_*), изменяется из других потоков
+	volatile int hsm_state;
+	// Адрес и параметр запуска из SBI HSM
+	ui hsm_addr;
+	ui hsm_opaque;
+	// Объект ожидания прерывания (пробуждается другими процессорами)
+	struct host_wait_s* wait;
+
+	// Почтовый ящик: запросы от других процессоров (MAIL_*), выполняются между отрезками
+	volatile int mail;
+	// Блокировка для записи в ящик
+	volatile int mail_lock;
+	// Объединённый диапазон адресов [mail_start, mail_end] и ASID (-1 - все) для MAIL_SFENCE
+	ui mail_start;
+	ui mail_end;
+	int mail_asid;
+	// Номер последнего запроса и номер последнего выполненного запроса
+	volatile int mail_posted;
+	volatile int mail_done;
+	// Устройство записало данные в ОЗУ, FENCE.I должна сбросить декодированные инструкции
+	volatile int dma_write;
+
 	// Регистры общего назначения
 	si r[32];
 	// Счётчик команд и адрес текущей команды
 	ui pc;
 	ui instr_pc;
-	// Резерв адреса для атомарных операций
+	// Резерв адреса для атомарных операций и значение, прочитанное инструкцией LR
 	ui res_addr;
+	si res_value;
 	// Режим работы (0 - пользователь, 1 - супервизор)
 	int s_mode;
 	// Флаг сна до появления прерывания
@@ -109,6 +272,8 @@ typedef struct
 
 	// Указатель на начало блока физической памяти
 	uint8_t* ram;
+	// Физический адрес последнего обращения вне ОЗУ (MMIO_NONE - была ошибка трансляции)
+	ui mmio_addr;
 
 	// Управляющие регистры
 	ui sstatus;  // Регистр состояния
@@ -124,28 +289,140 @@ typedef struct
 	// Системный таймер
 	int64_t mtime;
 	int64_t mtimecmp;
+	// Инструкции, выполненные с момента последнего увеличения mtime
+	int64_t insn_frac;
+	// Режим счёта времени по количеству инструкций (воспроизводимые результаты)
+	int deterministic;
+	// Разница между mtime и временем хоста в тактах mtime
+	int64_t time_offset;
+	// Время хоста начала текущего отрезка выполнения, нс
+	int64_t slice_start;
+	// Измеренная скорость эмуляции, инструкций в секунду
+	int64_t ips;
+
+	// Время наступления событий
+	int64_t events[EVENT_COUNT];
+	// Флаг проверки прерываний: изменились sstatus.SIE, sie или sip
+	int irq_check;
 
 	// Указатель на главный каталог страниц виртуальной памяти
 	ui* atp;
 	// Флаг включения MMU
 	int mmu_on;
-} riscv_t;
+	// Текущий ASID из регистра satp
+	uint32_t asid;
+
+	// TLB: отдельные наборы для пользователя и супервизора,
+	// и в каждом - для чтения, записи и выполнения
+	tlb_entry_t tlb[2][3][TLB_SIZE];
+
+	// Кэш декодированных инструкций: указатель на страницу для каждой физической страницы ОЗУ
+	dcache_page_t** dcache;
+	// Список освободившихся страниц кэша
+	dcache_page_t* dcache_free;
+	// Список декодированных страниц: очистка всего кэша не перебирает все страницы ОЗУ
+	dcache_page_t* dcache_live;
+	// Количество декодированных страниц
+	int dcache_pages;
+
+	// Способ выполнения инструкций (CORE_*)
+	int core;
+	// Адрес, перед выполнением которого интерпретатор CORE_STEP останавливается
+	// (~0 - не останавливаться, см. forkserver.c)
+	ui break_pc;
+
+	// Динамический транслятор (NULL, если выключен)
+	struct jit_s* jit;
+	// Оставшееся количество инструкций для транслированного кода
+	int32_t jit_budget;
+	// Флаг удаления блоков во время выполнения транслированного кода
+	int32_t jit_stale;
+	// Адрес перехода, который можно связать со следующим блоком
+	uint8_t* jit_chain;
+};
 
 // Функции MMU
 ui set_atp(riscv_t* cpu, ui value);
-int virt2phys(riscv_t* cpu, ui* res, ui virt, ui test, ui set, ui cause1, ui cause2);
+int virt2phys(riscv_t* cpu, ui* res, ui virt, ui test, ui set, ui cause1, ui cause2, ui* flags, ui* pagemask);
+uint8_t* tlb_fill(riscv_t* cpu, ui virt, int type);
+void tlb_flush(riscv_t* cpu);
+void tlb_flush_vma(riscv_t* cpu, int use_addr, ui addr, int use_asid, uint32_t asid);
+void tlb_flush_range(riscv_t* cpu, ui start, ui end, int use_asid, uint32_t asid);
+void tlb_flush_page(riscv_t* cpu, int type, uint8_t* page);
 
 // Функции исключений/прерываний
 void trap(riscv_t* cpu, ui cause, ui value);
 void sret(riscv_t* cpu);
 void plic_update(riscv_t* cpu);
 
+// Контроллер внешних прерываний PLIC: источник 0 не используется,
+// контекст n - прерывание супервизора процессора n
+#define PLIC_BASE					0x0C000000u
+#define PLIC_SIZE					0x4000000u
+#define PLIC_SOURCES				32
+int plic_init(int harts);
+void plic_done(void);
+void plic_set(int irq, int level);
+void plic_sync(riscv_t* cpu);
+
 // Функции таймера
 void set_mtime(riscv_t* cpu, uint32_t high, uint32_t low);
 void set_mtimecmp(riscv_t* cpu, uint32_t high, uint32_t low);
 void set_mtime64(riscv_t* cpu, uint64_t value);
 void set_mtimecmp64(riscv_t* cpu, uint64_t value);
-void riscv_timer_tick(riscv_t* cpu, int useconds);
+void timer_event(riscv_t* cpu);
+
+// Функции источника времени
+void clock_init(void);
+void clock_reset(riscv_t* cpu);
+void clock_set(riscv_t* cpu);
+void clock_update(riscv_t* cpu);
+int64_t clock_budget(riscv_t* cpu, int64_t ticks);
+void clock_account(riscv_t* cpu, int executed);
+void clock_idle(riscv_t* cpu);
+
+// Функции планировщика событий
+void event_set(riscv_t* cpu, int event, int64_t time);
+int64_t event_next(riscv_t* cpu);
+int run_slice(riscv_t* cpu);
+
+// Многопроцессорная система: каждый процессор выполняется в своём потоке хоста
+extern riscv_t* harts[MAX_HARTS];
+extern int hart_count;
+int hart_start(ui hartid, ui addr, ui opaque);
+void hart_stop(riscv_t* cpu);
+int hart_status(ui hartid);
+int hart_send(riscv_t* cpu, ui mask, ui base, int mail, ui start, ui size, int asid);
+void hart_signal(riscv_t* cpu, int mail);
+void hart_mail(riscv_t* cpu);
+void hart_run(riscv_t* cpu);
+int smp_start(void);
+void smp_pause(riscv_t* cpu);
+void smp_resume(riscv_t* cpu);
+int smp_fork(riscv_t* cpu);
+
+// Описание оборудования для ядра Linux
+int devtree_build(uint8_t* buf, int size, int harts, const char* bootargs);
+
+// Физическая память, общая для всех процессоров
+extern uint8_t* ram;
+extern ui ram_size;
+
+// Страницы ОЗУ, изменённые после последнего полного снимка (байт на страницу). Отмечаются
+// при заполнении записи TLB для записи и при записи в ОЗУ устройствами (см. snapshot.h)
+extern uint8_t* ram_dirty;
+void ram_dirty_range(const void* p, size_t size);
+void ram_dirty_reset(void);
+
+// Устройства на системной шине (MMIO).
+// Обработчики вызываются из потоков процессоров, обращающихся к устройству, поэтому
+// должны сами защищать состояние устройства. offset - смещение от начала области,
+// size - 1, 2, 4 или 8 байт. Обработчик возвращает 0, если обращение не поддерживается
+typedef int (*mmio_read_t)(riscv_t* cpu, void* opaque, ui offset, int size, uint64_t* value);
+typedef int (*mmio_write_t)(riscv_t* cpu, void* opaque, ui offset, int size, uint64_t value);
+#define MMIO_NONE					(~(ui)0)
+int bus_map(ui base, ui size, mmio_read_t read, mmio_write_t write, void* opaque);
+void bus_reset(void);
 
 // Функции чтения/записи системной шины
 int read8(riscv_t* cpu, ui addr, si* result);
@@ -168,9 +445,28 @@ void do_muldiv(riscv_t* cpu, uint32_t instr, int rs1, int rs2, int rd, int func3
 void do_muldiv32(riscv_t* cpu, uint32_t instr, int rs1, int rs2, int rd, int func3, int func7);
 // Привелегированные инструкции
 void do_priv(riscv_t* cpu, uint32_t instr, int rs1, int rs2, int rd, int func3, int func7);
+// Расширение "C" - таблица соответствия 16-битных инструкций 32-битным
+extern uint32_t rvc_table[65536];
+void rvc_init(void);
+
+// Функции кэша декодированных инструкций
+int dcache_init(riscv_t* cpu);
+dcache_page_t* dcache_get(riscv_t* cpu, ui phys);
+void dcache_invalidate(riscv_t* cpu, ui phys);
+void dcache_flush(riscv_t* cpu);
+void dcache_dma_write(void);
+void dcache_done(riscv_t* cpu);
+void decode(uint32_t instr, insn_t* in);
+extern const insn_handler_t insn_handlers[OP_COUNT];
+
+// Функции динамического транслятора
+int jit_init(riscv_t* cpu);
+int jit_run(riscv_t* cpu, int count);
+void jit_invalidate(riscv_t* cpu, dcache_page_t* page);
 
 // Функции управления процессором
+int fetch(riscv_t* cpu, uint32_t* instr);
 void do_step(riscv_t* cpu);
-void do_step_compressed(riscv_t* cpu, uint16_t instr);
-void step1us(riscv_t* cpu);
+int threaded_run(riscv_t* cpu, int count);
+int execute(riscv_t* cpu, int count);
 void reset(riscv_t* cpu);
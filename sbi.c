@@ -4,15 +4,18 @@
 #include "riscv.h"
 #include "sbi.h"
 #include "platform.h"
+#include "console.h"
+#include "virtio.h"
+#include "forkserver.h"
 
 static void sbi_ecall_base(riscv_t* cpu)
 {
 	switch (cpu->r[16])
 	{
 		case 0:
-			// Номер спецификации SBI
+			// Номер спецификации SBI: 2.0 (с этой версии Linux использует DBCN)
 			cpu->r[10] = 0;
-			cpu->r[11] = 2;
+			cpu->r[11] = 2 << 24;
 			break;
 		case 1:
 			// Идентификатор SBI
@@ -30,6 +33,12 @@ static void sbi_ecall_base(riscv_t* cpu)
 			switch (cpu->r[10])
 			{
 				case 0x54494D45: // Таймер RISC-V
+				case 0x48534D: // Управление процессорами (HSM)
+				case 0x735049: // Межпроцессорные прерывания (IPI)
+				case 0x52464E43: // Удалённая очистка кэшей (RFENCE)
+				case 0x4442434E: // Отладочная консоль (DBCN)
+				case 0x53525354: // Сброс системы (SRST)
+				case SBI_EXT_DIMMU: // Расширение эмулятора
 					cpu->r[11] = 1; // Присутствует
 					break;
 			}
@@ -80,6 +89,227 @@ static void sbi_ecall_timer(riscv_t* cpu)
 	}
 }
 
+// Управление процессорами (Hart State Management)
+static void sbi_ecall_hsm(riscv_t* cpu)
+{
+	int status;
+
+	switch (cpu->r[16])
+	{
+		case 0:
+			// Запуск процессора a0 с адреса a1, параметр a2
+			cpu->r[10] = hart_start(cpu->r[10], cpu->r[11], cpu->r[12]);
+			cpu->r[11] = 0;
+			break;
+		case 1:
+			// Остановка текущего процессора, при успехе управление не возвращается
+			hart_stop(cpu);
+			break;
+		case 2:
+			// Состояние процессора a0
+			status = hart_status(cpu->r[10]);
+			cpu->r[10] = status < 0 ? status : 0;
+			cpu->r[11] = status < 0 ? 0 : status;
+			break;
+		case 3:
+			// Приостановка. Поддерживается только с сохранением состояния (тип 0),
+			// это то же самое, что WFI
+			if ((uint32_t)cpu->r[10] != 0)
+			{
+				cpu->r[10] = SBI_ERR_NOT_SUPPORTED;
+				cpu->r[11] = 0;
+				break;
+			}
+			cpu->wfi = 1;
+			cpu->irq_check = 1;
+			cpu->r[10] = 0;
+			cpu->r[11] = 0;
+			break;
+		default:
+			// Прочие функции не поддерживаются
+			cpu->r[10] = SBI_ERR_NOT_SUPPORTED;
+			cpu->r[11] = 0;
+			break;
+	}
+}
+
+// Межпроцессорные прерывания (IPI)
+static void sbi_ecall_ipi(riscv_t* cpu)
+{
+	switch (cpu->r[16])
+	{
+		case 0:
+			// Программное прерывание процессорам из маски a0 (номера начинаются с a1)
+			cpu->r[10] = hart_send(cpu, cpu->r[10], cpu->r[11], MAIL_IPI, 0, 0, -1);
+			cpu->r[11] = 0;
+			break;
+		default:
+			// Прочие функции не поддерживаются
+			cpu->r[10] = SBI_ERR_NOT_SUPPORTED;
+			cpu->r[11] = 0;
+			break;
+	}
+}
+
+// Удалённая очистка кэшей (RFENCE): маска процессоров a0, номер первого a1,
+// диапазон адресов a2, a3 (размер 0 или -1 - все адреса), ASID a4
+static void sbi_ecall_rfence(riscv_t* cpu)
+{
+	switch (cpu->r[16])
+	{
+		case 0:
+			// FENCE.I
+			cpu->r[10] = hart_send(cpu, cpu->r[10], cpu->r[11], MAIL_FENCE_I, 0, 0, -1);
+			cpu->r[11] = 0;
+			break;
+		case 1:
+			// SFENCE.VMA для всех адресных пространств
+			cpu->r[10] = hart_send(cpu, cpu->r[10], cpu->r[11], MAIL_SFENCE, cpu->r[12], cpu->r[13], -1);
+			cpu->r[11] = 0;
+			break;
+		case 2:
+			// SFENCE.VMA для одного адресного пространства
+			cpu->r[10] = hart_send(cpu, cpu->r[10], cpu->r[11], MAIL_SFENCE, cpu->r[12], cpu->r[13],
+				(int)(cpu->r[14] & SATP_ASID_MASK));
+			cpu->r[11] = 0;
+			break;
+		default:
+			// Гипервизор не поддерживается
+			cpu->r[10] = SBI_ERR_NOT_SUPPORTED;
+			cpu->r[11] = 0;
+			break;
+	}
+}
+
+// Область физической памяти для обмена с консолью (NULL, если она не в ОЗУ)
+static uint8_t* sbi_ram(uint64_t addr, ui size)
+{
+	if (addr < RAM_START || addr - RAM_START > ram_size || size > ram_size - (addr - RAM_START))
+		return NULL;
+
+	return &ram[addr - RAM_START];
+}
+
+// Отладочная консоль (DBCN): гость передаёт адрес и длину строки, и она выводится
+// целиком за один вызов вместо вызова на каждый символ
+static void sbi_ecall_dbcn(riscv_t* cpu)
+{
+	ui size = cpu->r[10];
+	uint64_t addr;
+	uint8_t* p;
+	int n;
+
+#if XLEN == 64
+	addr = cpu->r[11];
+#else
+	addr = cpu->r[11] | ((uint64_t)cpu->r[12] << 32);
+#endif
+	// Передаётся не больше SBI_DBCN_MAX байт, гость повторит вызов для остатка
+	if (size > SBI_DBCN_MAX)
+		size = SBI_DBCN_MAX;
+
+	switch (cpu->r[16])
+	{
+		case 0:
+			// Вывод строки
+			p = sbi_ram(addr, size);
+			if (p == NULL)
+			{
+				cpu->r[10] = SBI_ERR_INVALID_PARAM;
+				cpu->r[11] = 0;
+				break;
+			}
+			console_write(p, (int)size);
+			cpu->r[10] = SBI_SUCCESS;
+			cpu->r[11] = size;
+			break;
+		case 1:
+			// Чтение имеющихся символов без ожидания
+			p = sbi_ram(addr, size);
+			if (p == NULL)
+			{
+				cpu->r[10] = SBI_ERR_INVALID_PARAM;
+				cpu->r[11] = 0;
+				break;
+			}
+			n = console_read(p, (int)size);
+			if (n > 0)
+			{
+				ram_dirty_range(p, n);
+				dcache_dma_write();
+			}
+			cpu->r[10] = SBI_SUCCESS;
+			cpu->r[11] = n;
+			break;
+		case 2:
+			// Вывод одного байта
+			console_putchar(cpu->r[10] & 0xFF);
+			cpu->r[10] = SBI_SUCCESS;
+			cpu->r[11] = 0;
+			break;
+		default:
+			cpu->r[10] = SBI_ERR_NOT_SUPPORTED;
+			cpu->r[11] = 0;
+			break;
+	}
+}
+
+// Завершение эмулятора с кодом status. Устройства останавливаются, чтобы не прервать
+// выполняемый запрос к диску
+static void sbi_exit(int status)
+{
+	virtio_pause();
+	exit(status);
+}
+
+// Код завершения эмулятора при штатном выключении: код команды -run, если она задана
+static int sbi_exit_status(void)
+{
+	int status = console_status();
+	return status > 0 ? status : 0;
+}
+
+// Сброс системы (SRST). Перезагрузка, как и выключение, завершает эмулятор; код
+// завершения определяется причиной: 0 - штатно, 1 - сбой системы, для причин реализации
+// и производителя - младший байт причины
+static void sbi_ecall_srst(riscv_t* cpu)
+{
+	uint32_t type = (uint32_t)cpu->r[10];
+	uint32_t reason = (uint32_t)cpu->r[11];
+
+	if (cpu->r[16] != 0)
+	{
+		cpu->r[10] = SBI_ERR_NOT_SUPPORTED;
+		cpu->r[11] = 0;
+		return;
+	}
+	if (type > SBI_SRST_WARM_REBOOT || (reason > SBI_SRST_REASON_SYSFAIL && reason < SBI_SRST_REASON_SBI))
+	{
+		cpu->r[10] = SBI_ERR_INVALID_PARAM;
+		cpu->r[11] = 0;
+		return;
+	}
+
+	if (reason == SBI_SRST_REASON_NONE)
+		sbi_exit(sbi_exit_status());
+	sbi_exit(reason == SBI_SRST_REASON_SYSFAIL ? 1 : (int)(reason & 0xFF));
+}
+
+// Расширение эмулятора
+static void sbi_ecall_dimmu(riscv_t* cpu)
+{
+	switch (cpu->r[16])
+	{
+		case SBI_DIMMU_FORK:
+			fork_server_ecall(cpu);
+			break;
+		default:
+			cpu->r[10] = SBI_ERR_NOT_SUPPORTED;
+			cpu->r[11] = 0;
+			break;
+	}
+}
+
 int sbi_ecall(riscv_t* cpu)
 {
 	switch (cpu->r[17])
@@ -101,18 +331,38 @@ int sbi_ecall(riscv_t* cpu)
 			cpu->r[11] = 0;
 			return 1;
 		case 0x02:
-			// Чтение символа из консоли
-			cpu->r[10] = -1;
-			if (console_kbhit())
-				cpu->r[10] = console_getchar();
+			// Чтение символа из консоли (-1, если символов нет)
+			cpu->r[10] = console_getchar();
 			cpu->r[11] = 0;
 			return 1;
+		case 0x08:
+			// Выключение машины
+			sbi_exit(sbi_exit_status());
+			return 1;
 		case 0x10:
 			sbi_ecall_base(cpu);
 			return 1;
 		case 0x54494D45:
 			sbi_ecall_timer(cpu);
 			return 1;
+		case 0x48534D:
+			sbi_ecall_hsm(cpu);
+			return 1;
+		case 0x735049:
+			sbi_ecall_ipi(cpu);
+			return 1;
+		case 0x52464E43:
+			sbi_ecall_rfence(cpu);
+			return 1;
+		case 0x4442434E:
+			sbi_ecall_dbcn(cpu);
+			return 1;
+		case 0x53525354:
+			sbi_ecall_srst(cpu);
+			return 1;
+		case SBI_EXT_DIMMU:
+			sbi_ecall_dimmu(cpu);
+			return 1;
 	}
 	return 0;
 }
@@ -1,6 +1,31 @@
 #ifndef SBI_H
 #define SBI_H
 
+// Коды ошибок SBI
+#define SBI_SUCCESS					0
+#define SBI_ERR_FAILED				-1
+#define SBI_ERR_NOT_SUPPORTED		-2
+#define SBI_ERR_INVALID_PARAM		-3
+#define SBI_ERR_INVALID_ADDRESS		-5
+#define SBI_ERR_ALREADY_AVAILABLE	-6
+
+// Расширение эмулятора в области производителя (0x09000000 + идентификатор производителя)
+#define SBI_EXT_DIMMU				0x09012345
+// Точка запуска сервера заданий, a1 - номер задания (см. forkserver.h)
+#define SBI_DIMMU_FORK				0
+
+// Типы и причины сброса системы (SRST)
+#define SBI_SRST_SHUTDOWN			0
+#define SBI_SRST_COLD_REBOOT		1
+#define SBI_SRST_WARM_REBOOT		2
+#define SBI_SRST_REASON_NONE		0
+#define SBI_SRST_REASON_SYSFAIL		1
+// Начало причин, определяемых реализацией SBI и производителем
+#define SBI_SRST_REASON_SBI			0xE0000000u
+
+// Наибольшая длина строки, выводимой DBCN за один вызов
+#define SBI_DBCN_MAX				65536
+
 int sbi_ecall(riscv_t* cpu);
 
 #endif
@@ -0,0 +1,104 @@
+#include "riscv.h"
+#include "forkserver.h"
+#include "profile.h"
+
+// Планировщик событий
+//
+// Вместо проверки всех устройств после каждых INSTR_IN_1US инструкций процессор выполняет
+// код до ближайшего запланированного события (таймер, завершение операции устройства и т.п.).
+// Время mtime идёт по часам хоста или по количеству выполненных инструкций (см. clock.c).
+// Прерывания проверяются только после изменения sstatus.SIE, sie или sip (флаг irq_check).
+
+// Максимальная длительность одного отрезка выполнения в тактах mtime (1 мс)
+#define SLICE_MAX					(TIMEBASE_FREQ / 1000)
+
+// Обработчики событий (порядок совпадает с номерами EVENT_*)
+static const event_handler_t event_handlers[EVENT_COUNT] =
+{
+	timer_event,
+	profile_event
+};
+
+// Запланировать событие на время time (EVENT_NEVER - отменить событие)
+void event_set(riscv_t* cpu, int event, int64_t time)
+{
+	cpu->events[event] = time;
+}
+
+// Время ближайшего события
+int64_t event_next(riscv_t* cpu)
+{
+	int64_t next = EVENT_NEVER;
+	int i;
+
+	for (i = 0; i < EVENT_COUNT; i++)
+		if (cpu->events[i] < next)
+			next = cpu->events[i];
+
+	return next;
+}
+
+// Выполнить обработчики наступивших событий
+static void events_run(riscv_t* cpu)
+{
+	int i;
+
+	for (i = 0; i < EVENT_COUNT; i++)
+	{
+		if (cpu->events[i] <= cpu->mtime)
+		{
+			cpu->events[i] = EVENT_NEVER;
+			event_handlers[i](cpu);
+		}
+	}
+}
+
+// Выполнять код до ближайшего события, возвращает количество выполненных инструкций
+int run_slice(riscv_t* cpu)
+{
+	int64_t ticks;
+	int64_t budget;
+	int executed = 0;
+
+	// Выполнить запросы других процессоров (IPI, удалённые SFENCE.VMA и FENCE.I)
+	if (cpu->mail)
+		hart_mail(cpu);
+
+	// Проверить прерывания, если изменилось их состояние
+	if (cpu->irq_check)
+	{
+		cpu->irq_check = 0;
+		plic_update(cpu);
+	}
+
+	if (cpu->wfi)
+	{
+		// Процессор ждёт прерывания, время идёт без выполнения инструкций
+		clock_idle(cpu);
+	}
+	else
+	{
+		// Выполнить столько инструкций, сколько успеет пройти до ближайшего события
+		ticks = event_next(cpu) - cpu->mtime;
+		if (ticks > SLICE_MAX)
+			ticks = SLICE_MAX;
+		budget = clock_budget(cpu, ticks);
+		if (budget < 1)
+			budget = 1;
+		if (budget > INT32_MAX)
+			budget = INT32_MAX;
+
+		executed = execute(cpu, (int)budget);
+
+		// Достигнут адрес запуска сервера заданий
+		if (cpu->pc == cpu->break_pc)
+			fork_server_break(cpu);
+
+		// Перевести выполненные инструкции во время
+		clock_account(cpu, executed);
+	}
+
+	events_run(cpu);
+
+	return executed;
+}
@@ -0,0 +1,374 @@
+#include <stdio.h>
+#include "riscv.h"
+#include "sbi.h"
+#include "atomic.h"
+#include "platform.h"
+#include "snapshot.h"
+#include "forkserver.h"
+
+// Многопроцессорная система
+//
+// Каждый процессор (hart) - отдельная структура riscv_t со своими регистрами, таймером,
+// TLB и кэшем декодированных инструкций. Он выполняется в своём потоке хоста, общая у всех
+// только физическая память. Процессор 0 работает сразу после запуска, остальные ждут,
+// пока гость не запустит их вызовом SBI HSM hart_start.
+
+// Время, через которое остановленный процессор проверяет своё состояние, нс
+#define STOPPED_WAIT_NS				1000000000ll
+// Интервал проверки выполнения удалённого SFENCE.VMA/FENCE.I, нс
+#define FENCE_WAIT_NS				20000ll
+
+riscv_t* harts[MAX_HARTS];
+int hart_count;
+
+// Процессоры должны остановиться (smp_pause) и количество остановившихся
+static volatile int smp_hold;
+static volatile int32_t smp_paused;
+
+// Запуск процессора hartid с адреса addr (вызывается другим процессором)
+int hart_start(ui hartid, ui addr, ui opaque)
+{
+	riscv_t* cpu;
+
+	if (hartid >= (ui)hart_count)
+		return SBI_ERR_INVALID_PARAM;
+	if (addr < RAM_START || addr - RAM_START >= ram_size)
+		return SBI_ERR_INVALID_ADDRESS;
+
+	cpu = harts[hartid];
+
+	// Захватить процессор, чтобы одновременный запуск того же процессора вернул ошибку
+	if (!atomic_cas(&cpu->hsm_state, HSM_STOPPED, HSM_STARTING))
+		return SBI_ERR_ALREADY_AVAILABLE;
+
+	// Параметры станут видны процессору вместе с состоянием HSM_START_PENDING
+	cpu->hsm_addr = addr;
+	cpu->hsm_opaque = opaque;
+	atomic_set(&cpu->hsm_state, HSM_START_PENDING);
+	host_wake(cpu->wait);
+
+	return SBI_SUCCESS;
+}
+
+// Остановка текущего процессора
+void hart_stop(riscv_t* cpu)
+{
+	atomic_set(&cpu->hsm_state, HSM_STOPPED);
+
+	// Завершить текущий отрезок выполнения
+	cpu->wfi = 1;
+}
+
+// Состояние процессора hartid для гостя
+int hart_status(ui hartid)
+{
+	int state;
+
+	if (hartid >= (ui)hart_count)
+		return SBI_ERR_INVALID_PARAM;
+
+	state = atomic_get(&harts[hartid]->hsm_state);
+	return state == HSM_STARTING ? HSM_START_PENDING : state;
+}
+
+// Межпроцессорные запросы (SBI IPI и RFENCE)
+//
+// Запрос не останавливает другие процессоры: он кладётся в почтовый ящик получателя,
+// и получатель выполняет его сам между отрезками выполнения (см. run_slice).
+// Несколько запросов, пришедших до его выполнения, объединяются в один: флаги складываются,
+// диапазоны адресов SFENCE.VMA объединяются. Отправитель удалённой очистки ждёт
+// подтверждения только от тех процессоров, которым она адресована.
+
+// Положить запрос в ящик процессора cpu, возвращает его номер для ожидания выполнения
+static int hart_post(riscv_t* cpu, int mail, ui start, ui end, int asid)
+{
+	int seq;
+
+	while (!atomic_cas(&cpu->mail_lock, 0, 1))
+		;
+
+	if (mail & MAIL_SFENCE)
+	{
+		if (!(cpu->mail & MAIL_SFENCE))
+		{
+			cpu->mail_start = start;
+			cpu->mail_end = end;
+			cpu->mail_asid = asid;
+		}
+		else
+		{
+			// Объединить с ещё не выполненным запросом
+			if (start < cpu->mail_start)
+				cpu->mail_start = start;
+			if (end > cpu->mail_end)
+				cpu->mail_end = end;
+			if (asid != cpu->mail_asid)
+				cpu->mail_asid = -1;
+		}
+	}
+
+	seq = ++cpu->mail_posted;
+	atomic_set(&cpu->mail, cpu->mail | mail);
+	atomic_set(&cpu->mail_lock, 0);
+
+	host_wake(cpu->wait);
+
+	return seq;
+}
+
+static void hart_mail_mask(riscv_t* cpu, int mask);
+
+// Остановка процессора по запросу MAIL_PAUSE до вызова smp_resume. Остановленный процессор
+// выполняет только очистку кэшей: процессор, который ещё не остановился, может ждать её
+// подтверждения. Остальные запросы остаются в ящике и не меняют сохраняемое состояние
+static void hart_pause(riscv_t* cpu)
+{
+	atomic_add32(&smp_paused, 1);
+	while (atomic_get(&smp_hold))
+	{
+		if (cpu->mail & (MAIL_FENCE_I | MAIL_SFENCE))
+			hart_mail_mask(cpu, MAIL_FENCE_I | MAIL_SFENCE);
+		host_wait(cpu->wait, host_time_ns() + STOPPED_WAIT_NS, 0);
+	}
+	atomic_add32(&smp_paused, -1);
+}
+
+// Выполнить запросы из маски mask, остальные оставить в ящике
+static void hart_mail_mask(riscv_t* cpu, int mask)
+{
+	int mail, seq, asid;
+	ui start, end;
+
+	while (!atomic_cas(&cpu->mail_lock, 0, 1))
+		;
+	mail = cpu->mail & mask;
+	start = cpu->mail_start;
+	end = cpu->mail_end;
+	asid = cpu->mail_asid;
+	seq = cpu->mail_posted;
+	atomic_set(&cpu->mail, cpu->mail & ~mask);
+	atomic_set(&cpu->mail_lock, 0);
+
+	if (mail & MAIL_IPI)
+	{
+		// Программное прерывание супервизора
+		cpu->sip |= MIE_SSIE;
+		cpu->irq_check = 1;
+	}
+	if (mail & MAIL_FENCE_I)
+		dcache_flush(cpu);
+	if (mail & MAIL_SFENCE)
+		tlb_flush_range(cpu, start, end, asid >= 0, (uint32_t)asid);
+	if (mail & MAIL_IRQ)
+		plic_sync(cpu);
+
+	atomic_set(&cpu->mail_done, seq);
+
+	if (mail & MAIL_PAUSE)
+		hart_pause(cpu);
+	if (mail & MAIL_SNAPSHOT)
+		snapshot_take(cpu);
+	if (mail & MAIL_ROLLBACK)
+		snapshot_rollback(cpu);
+	if (mail & MAIL_FORK)
+		fork_server_run(cpu);
+}
+
+// Выполнить запросы из почтового ящика (вызывается самим процессором между отрезками
+// выполнения)
+void hart_mail(riscv_t* cpu)
+{
+	hart_mail_mask(cpu, ~0);
+}
+
+// Отправить процессору запрос, не требующий подтверждения (MAIL_IPI, MAIL_IRQ)
+void hart_signal(riscv_t* cpu, int mail)
+{
+	hart_post(cpu, mail, 0, 0, -1);
+}
+
+// Отправить запрос mail процессорам из маски mask (номера начинаются с base,
+// base = -1 - все процессоры). Для MAIL_SFENCE задаются диапазон адресов
+// и ASID (-1 - все адресные пространства). Возвращает код ошибки SBI
+int hart_send(riscv_t* cpu, ui mask, ui base, int mail, ui start, ui size, int asid)
+{
+	int seq[MAX_HARTS];
+	ui end;
+	int i;
+
+	// Проверить маску до отправки, чтобы при ошибке не выполнить запрос частично
+	if (base != ~(ui)0)
+	{
+		if (base >= (ui)hart_count && mask != 0)
+			return SBI_ERR_INVALID_PARAM;
+		for (i = 0; i < XLEN; i++)
+			if (((mask >> i) & 1) && base + i >= (ui)hart_count)
+				return SBI_ERR_INVALID_PARAM;
+	}
+
+	// Размер 0 или -1 означает все адреса
+	if (size == 0 || size == ~(ui)0 || start + size - 1 < start)
+	{
+		start = 0;
+		end = ~(ui)0;
+	}
+	else
+		end = start + size - 1;
+
+	for (i = 0; i < hart_count; i++)
+	{
+		seq[i] = 0;
+		if (base != ~(ui)0 && ((ui)i < base || (ui)i - base >= XLEN || !((mask >> (i - base)) & 1)))
+			continue;
+		// Остановленным процессорам запросы не нужны: после запуска TLB и так пуст
+		if (atomic_get(&harts[i]->hsm_state) != HSM_STARTED)
+			continue;
+		seq[i] = hart_post(harts[i], mail, start, end, asid);
+	}
+
+	// Свой запрос выполнить сразу. Остановка откладывается до конца вызова SBI,
+	// чтобы процессор не был сохранён в середине инструкции
+	if (cpu->mail)
+		hart_mail_mask(cpu, ~MAIL_DEFERRED);
+
+	// IPI не требует подтверждения, очистка должна завершиться до возврата из SBI
+	if (!(mail & (MAIL_FENCE_I | MAIL_SFENCE)))
+		return SBI_SUCCESS;
+
+	for (i = 0; i < hart_count; i++)
+	{
+		if (seq[i] == 0 || harts[i] == cpu)
+			continue;
+		while ((int)(atomic_get(&harts[i]->mail_done) - seq[i]) < 0 &&
+			atomic_get(&harts[i]->hsm_state) == HSM_STARTED)
+		{
+			// Выполнять запросы к себе, иначе два процессора могут ждать друг друга
+			if (cpu->mail & ~MAIL_DEFERRED)
+				hart_mail_mask(cpu, ~MAIL_DEFERRED);
+			host_wait(cpu->wait, host_time_ns() + FENCE_WAIT_NS, 0);
+		}
+	}
+
+	return SBI_SUCCESS;
+}
+
+// Начать выполнение после hart_start: состояние как после сброса,
+// a0 - номер процессора, a1 - параметр из hart_start
+static void hart_begin(riscv_t* cpu)
+{
+	cpu->s_mode = 1;
+	cpu->sstatus &= ~SSTATUS_SIE;
+	cpu->satp = set_atp(cpu, 0);
+	tlb_flush(cpu);
+	cpu->wfi = 0;
+	cpu->irq_check = 1;
+
+	cpu->r[10] = cpu->hartid;
+	cpu->r[11] = cpu->hsm_opaque;
+	cpu->pc = cpu->hsm_addr;
+
+	atomic_set(&cpu->hsm_state, HSM_STARTED);
+}
+
+// Основной цикл процессора
+void hart_run(riscv_t* cpu)
+{
+	int state;
+
+	for (;;)
+	{
+		state = atomic_get(&cpu->hsm_state);
+
+		// Остановленный процессор тоже выполняет запросы: его может остановить smp_pause
+		if (state != HSM_STARTED && cpu->mail)
+			hart_mail(cpu);
+
+		if (state == HSM_STARTED)
+			run_slice(cpu);
+		else if (state == HSM_START_PENDING)
+			hart_begin(cpu);
+		else
+			host_wait(cpu->wait, host_time_ns() + STOPPED_WAIT_NS, 0);
+	}
+}
+
+// Остановка всех процессоров, кроме cpu, между отрезками выполнения (для снимка
+// состояния). Пока остальные останавливаются, cpu выполняет адресованные ему запросы:
+// процессор, ждущий подтверждения очистки TLB от cpu, остановится только после него
+void smp_pause(riscv_t* cpu)
+{
+	int i;
+
+	atomic_set(&smp_hold, 1);
+	for (i = 0; i < hart_count; i++)
+		if (harts[i] != cpu)
+			hart_signal(harts[i], MAIL_PAUSE);
+
+	while (atomic_get(&smp_paused) < hart_count - 1)
+	{
+		if (cpu->mail & ~MAIL_DEFERRED)
+			hart_mail_mask(cpu, ~MAIL_DEFERRED);
+		host_wait(cpu->wait, host_time_ns() + FENCE_WAIT_NS, 0);
+	}
+}
+
+// Продолжение работы процессоров, остановленных smp_pause
+void smp_resume(riscv_t* cpu)
+{
+	int i;
+
+	atomic_set(&smp_hold, 0);
+	for (i = 0; i < hart_count; i++)
+		if (harts[i] != cpu)
+			host_wake(harts[i]->wait);
+
+	// Дождаться, пока все продолжат работу, чтобы следующая остановка их не пропустила
+	while (atomic_get(&smp_paused) > 0)
+		host_wait(cpu->wait, host_time_ns() + FENCE_WAIT_NS, 0);
+}
+
+static void hart_thread(void* arg);
+
+// Продолжение работы в процессе, порождённом fork, после smp_pause: остановленных потоков
+// процессоров в нём нет, они запускаются заново с начала отрезка выполнения, на котором
+// остановились. Процессор cpu продолжает работу в вызвавшем потоке
+int smp_fork(riscv_t* cpu)
+{
+	int i;
+
+	atomic_set(&smp_hold, 0);
+	atomic_set(&smp_paused, 0);
+
+	for (i = 0; i < hart_count; i++)
+	{
+		if (harts[i] != cpu && !host_thread_start(hart_thread, harts[i]))
+		{
+			printf("Hart %d: unable to create thread\n", i);
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+static void hart_thread(void* arg)
+{
+	hart_run((riscv_t*)arg);
+}
+
+// Создание потоков для всех процессоров, кроме 0 (он выполняется в основном потоке)
+int smp_start(void)
+{
+	int i;
+
+	for (i = 1; i < hart_count; i++)
+	{
+		if (!host_thread_start(hart_thread, harts[i]))
+		{
+			printf("Hart %d: unable to create thread\n", i);
+			return 0;
+		}
+	}
+
+	return 1;
+}
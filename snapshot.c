@@ -0,0 +1,736 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "config.h"
+#include "riscv.h"
+#include "atomic.h"
+#include "platform.h"
+#include "console.h"
+#include "virtio.h"
+#include "snapshot.h"
+
+#define SNAPSHOT_MAGIC				"DIMMUSNP"
+#define SNAPSHOT_VERSION			1
+// Размер заголовка, с него начинается состояние процессоров и устройств
+#define SNAPSHOT_HEADER_SIZE		4096
+// Выравнивание ОЗУ в файле (не меньше гранулярности отображения файлов в Windows)
+// и размер части ОЗУ, которая проверяется на нули перед записью
+#define SNAPSHOT_ALIGN				65536
+// Типы снимков
+#define SNAPSHOT_FULL				0
+#define SNAPSHOT_DELTA				1
+// Смещение идентификатора в заголовке: у полного снимка - свой, у разностного - базового
+#define SNAPSHOT_ID_OFFSET			56
+// Смещение пути к базовому снимку в заголовке разностного снимка
+#define SNAPSHOT_PATH_OFFSET		64
+// Размер страницы ОЗУ в разностном снимке
+#define SNAPSHOT_PAGE				4096
+
+// Клавиши после Ctrl-A: сохранение снимка и возврат к последнему снимку
+#define SNAPSHOT_KEY				's'
+#define SNAPSHOT_ROLLBACK_KEY		'r'
+
+// Файл, в который сохраняется снимок (NULL - сохранение не разрешено)
+static const char* snapshot_file;
+// Полный снимок, от которого ОЗУ отличается страницами из ram_dirty (NULL - машина
+// загружена без снимка и ещё не сохранялась)
+static char* snapshot_base;
+// Идентификатор базового снимка: файл по тому же пути, сохранённый заново, - другой снимок
+static uint64_t snapshot_base_id;
+// Снимок, к которому машина возвращается по Ctrl-A r: последний сохранённый или
+// восстановленный
+static char* snapshot_point;
+
+// Запоминание имени файла снимка
+static void snapshot_remember(char** name, const char* file)
+{
+	char* p = (char*)malloc(strlen(file) + 1);
+
+	if (p == NULL)
+		return;
+	strcpy(p, file);
+	free(*name);
+	*name = p;
+}
+
+// Новый идентификатор полного снимка
+static uint64_t snapshot_new_id(void)
+{
+	uint64_t x = (uint64_t)host_time_ns() ^ ((uint64_t)(size_t)&x << 16) ^ snapshot_base_id;
+
+	// Перемешивание splitmix64
+	x += 0x9E3779B97F4A7C15ull;
+	x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ull;
+	x = (x ^ (x >> 27)) * 0x94D049BB133111EBull;
+	return x ^ (x >> 31);
+}
+
+// Отметка изменённых страниц, в которые записывают устройства и SBI
+void ram_dirty_range(const void* p, size_t size)
+{
+	size_t offset = (size_t)((const uint8_t*)p - ram);
+
+	if (size > 0)
+		memset(&ram_dirty[offset >> 12], 1, ((offset + size - 1) >> 12) - (offset >> 12) + 1);
+}
+
+// Начало отслеживания изменений заново (процессоры остановлены). Записи TLB для записи
+// удаляются, чтобы первая запись в каждую страницу снова прошла через tlb_fill
+void ram_dirty_reset(void)
+{
+	int i, mode, n;
+
+	memset(ram_dirty, 0, ram_size >> 12);
+	for (i = 0; i < hart_count; i++)
+		for (mode = 0; mode < 2; mode++)
+			for (n = 0; n < TLB_SIZE; n++)
+				harts[i]->tlb[mode][TLB_WRITE][n].vpn = TLB_INVALID;
+}
+
+// Запись в буфер состояния
+void snap_put(snap_t* s, const void* p, size_t size)
+{
+	uint8_t* data;
+	size_t capacity;
+
+	if (s->error)
+		return;
+
+	if (s->size + size > s->capacity)
+	{
+		capacity = s->capacity > 0 ? s->capacity : 4096;
+		while (capacity < s->size + size)
+			capacity *= 2;
+		data = (uint8_t*)realloc(s->data, capacity);
+		if (data == NULL)
+		{
+			s->error = 1;
+			return;
+		}
+		s->data = data;
+		s->capacity = capacity;
+	}
+
+	memcpy(s->data + s->pos, p, size);
+	s->pos += size;
+	s->size = s->pos;
+}
+
+// Чтение из буфера состояния. За концом буфера читаются нули и устанавливается ошибка
+void snap_get(snap_t* s, void* p, size_t size)
+{
+	if (s->error || size > s->size - s->pos)
+	{
+		s->error = 1;
+		memset(p, 0, size);
+		return;
+	}
+
+	memcpy(p, s->data + s->pos, size);
+	s->pos += size;
+}
+
+// Сохранение состояния процессора. Процессор остановлен (smp_pause), поэтому его регистры
+// не меняются. Его TLB, кэш инструкций и время хоста не сохраняются
+static void hart_save(snap_t* s, riscv_t* cpu)
+{
+	ui sip = cpu->sip;
+
+	// IPI, который процессор ещё не забрал из почтового ящика
+	if (atomic_get(&cpu->mail) & MAIL_IPI)
+		sip |= MIE_SSIE;
+
+	snap_put(s, (const void*)&cpu->hsm_state, sizeof(cpu->hsm_state));
+	snap_put(s, &cpu->hsm_addr, sizeof(cpu->hsm_addr));
+	snap_put(s, &cpu->hsm_opaque, sizeof(cpu->hsm_opaque));
+	snap_put(s, cpu->r, sizeof(cpu->r));
+	snap_put(s, &cpu->pc, sizeof(cpu->pc));
+	snap_put(s, &cpu->s_mode, sizeof(cpu->s_mode));
+	snap_put(s, &cpu->wfi, sizeof(cpu->wfi));
+	snap_put(s, &cpu->sstatus, sizeof(cpu->sstatus));
+	snap_put(s, &cpu->sie, sizeof(cpu->sie));
+	snap_put(s, &cpu->stvec, sizeof(cpu->stvec));
+	snap_put(s, &cpu->sscratch, sizeof(cpu->sscratch));
+	snap_put(s, &cpu->sepc, sizeof(cpu->sepc));
+	snap_put(s, &cpu->scause, sizeof(cpu->scause));
+	snap_put(s, &cpu->stval, sizeof(cpu->stval));
+	snap_put(s, &sip, sizeof(sip));
+	snap_put(s, &cpu->satp, sizeof(cpu->satp));
+	snap_put(s, &cpu->mtime, sizeof(cpu->mtime));
+	snap_put(s, &cpu->mtimecmp, sizeof(cpu->mtimecmp));
+	snap_put(s, &cpu->insn_frac, sizeof(cpu->insn_frac));
+	snap_put(s, &cpu->events[EVENT_TIMER], sizeof(cpu->events[EVENT_TIMER]));
+}
+
+// Восстановление состояния процессора после сброса
+static void hart_load(snap_t* s, riscv_t* cpu)
+{
+	ui satp;
+	int64_t insn_frac;
+
+	snap_get(s, (void*)&cpu->hsm_state, sizeof(cpu->hsm_state));
+	snap_get(s, &cpu->hsm_addr, sizeof(cpu->hsm_addr));
+	snap_get(s, &cpu->hsm_opaque, sizeof(cpu->hsm_opaque));
+	snap_get(s, cpu->r, sizeof(cpu->r));
+	snap_get(s, &cpu->pc, sizeof(cpu->pc));
+	snap_get(s, &cpu->s_mode, sizeof(cpu->s_mode));
+	snap_get(s, &cpu->wfi, sizeof(cpu->wfi));
+	snap_get(s, &cpu->sstatus, sizeof(cpu->sstatus));
+	snap_get(s, &cpu->sie, sizeof(cpu->sie));
+	snap_get(s, &cpu->stvec, sizeof(cpu->stvec));
+	snap_get(s, &cpu->sscratch, sizeof(cpu->sscratch));
+	snap_get(s, &cpu->sepc, sizeof(cpu->sepc));
+	snap_get(s, &cpu->scause, sizeof(cpu->scause));
+	snap_get(s, &cpu->stval, sizeof(cpu->stval));
+	snap_get(s, &cpu->sip, sizeof(cpu->sip));
+	snap_get(s, &satp, sizeof(satp));
+	snap_get(s, &cpu->mtime, sizeof(cpu->mtime));
+	snap_get(s, &cpu->mtimecmp, sizeof(cpu->mtimecmp));
+	snap_get(s, &insn_frac, sizeof(insn_frac));
+	snap_get(s, &cpu->events[EVENT_TIMER], sizeof(cpu->events[EVENT_TIMER]));
+
+	// Режим MMU и таблица страниц - из satp, TLB пуст
+	cpu->satp = set_atp(cpu, satp);
+	tlb_flush(cpu);
+
+	// Время продолжается с сохранённого mtime
+	clock_reset(cpu);
+	cpu->insn_frac = insn_frac;
+	cpu->irq_check = 1;
+	// Профилировщик не входит в снимок, выборки продолжаются с нового времени
+	if (cpu->events[EVENT_PROFILE] != EVENT_NEVER)
+		cpu->events[EVENT_PROFILE] = cpu->mtime;
+}
+
+// Проверка, что часть ОЗУ заполнена нулями
+static int snapshot_zero(const uint8_t* p, size_t size)
+{
+	const uint64_t* w = (const uint64_t*)p;
+	size_t i;
+
+	for (i = 0; i < size / 8; i++)
+		if (w[i] != 0)
+			return 0;
+
+	return 1;
+}
+
+// Запись изменённых страниц ОЗУ подряд с позиции pos
+static int snapshot_write_pages(host_file_t* f, uint64_t pos)
+{
+	uint64_t pages = ram_size >> 12, p, first;
+	host_iov_t iov;
+
+	for (p = 0; p < pages; )
+	{
+		if (!ram_dirty[p])
+		{
+			p++;
+			continue;
+		}
+		for (first = p; p < pages && ram_dirty[p]; p++)
+			;
+		iov.base = &ram[first << 12];
+		iov.size = (size_t)((p - first) << 12);
+		if (!host_file_write(f, &iov, 1, pos))
+			return 0;
+		pos += iov.size;
+	}
+
+	return 1;
+}
+
+// Чтение в ОЗУ страниц, отмеченных в select. В разностном снимке (map не NULL) с позиции
+// offset подряд записаны страницы, отмеченные в map, в полном - все страницы на своих местах
+static int snapshot_read_pages(host_file_t* f, uint64_t offset, const uint8_t* map, const uint8_t* select)
+{
+	uint64_t pages = ram_size >> 12, p, first, start, k = 0;
+	host_iov_t iov;
+
+	for (p = 0; p < pages; )
+	{
+		if (!select[p] || (map != NULL && !map[p]))
+		{
+			if (map != NULL && map[p])
+				k++;
+			p++;
+			continue;
+		}
+		first = p;
+		start = map != NULL ? k : p;
+		for (; p < pages && select[p] && (map == NULL || map[p]); p++)
+			k++;
+		iov.base = &ram[first << 12];
+		iov.size = (size_t)((p - first) << 12);
+		if (!host_file_read(f, &iov, 1, offset + (start << 12)))
+			return 0;
+	}
+
+	return 1;
+}
+
+// Сохранение снимка работающей машины. Процессоры и устройства должны быть остановлены
+// (см. snapshot_take). Если известен базовый снимок и file - не он, сохраняется разностный
+// снимок: только страницы, изменённые после базового. Снимок записывается во временный
+// файл, который затем заменяет file: ОЗУ машины, восстановленной из file, может быть
+// отображено из него
+int snapshot_save(const char* file)
+{
+	uint8_t header[SNAPSHOT_HEADER_SIZE];
+	uint32_t version = SNAPSHOT_VERSION, xlen = XLEN, count = hart_count, type = SNAPSHOT_FULL;
+	uint64_t size = ram_size, state, offset, pos, n, map_size, id;
+	host_file_t* f;
+	host_iov_t iov;
+	snap_t s;
+	char* tmp;
+	int i, ok;
+
+	if (snapshot_base != NULL && strcmp(file, snapshot_base) != 0 &&
+		strlen(snapshot_base) < SNAPSHOT_HEADER_SIZE - SNAPSHOT_PATH_OFFSET)
+		type = SNAPSHOT_DELTA;
+	id = type == SNAPSHOT_DELTA ? snapshot_base_id : snapshot_new_id();
+	map_size = ((size >> 12) + SNAPSHOT_PAGE - 1) & ~(uint64_t)(SNAPSHOT_PAGE - 1);
+
+	memset(&s, 0, sizeof(s));
+	for (i = 0; i < hart_count; i++)
+		hart_save(&s, harts[i]);
+	plic_save(&s);
+	virtio_save(&s);
+
+	tmp = (char*)malloc(strlen(file) + 5);
+	if (s.error || tmp == NULL)
+	{
+		printf("Snapshot: out of memory\n");
+		free(s.data);
+		free(tmp);
+		return 0;
+	}
+	strcpy(tmp, file);
+	strcat(tmp, ".tmp");
+
+	state = s.size;
+	offset = (SNAPSHOT_HEADER_SIZE + state + SNAPSHOT_ALIGN - 1) & ~(uint64_t)(SNAPSHOT_ALIGN - 1);
+
+	memset(header, 0, sizeof(header));
+	memcpy(&header[0], SNAPSHOT_MAGIC, 8);
+	memcpy(&header[8], &version, 4);
+	memcpy(&header[12], &xlen, 4);
+	memcpy(&header[16], &count, 4);
+	memcpy(&header[24], &size, 8);
+	memcpy(&header[32], &state, 8);
+	memcpy(&header[40], &offset, 8);
+	memcpy(&header[48], &type, 4);
+	memcpy(&header[SNAPSHOT_ID_OFFSET], &id, 8);
+	if (type == SNAPSHOT_DELTA)
+		strcpy((char*)&header[SNAPSHOT_PATH_OFFSET], snapshot_base);
+
+	remove(tmp);
+	f = host_file_open(tmp, HOST_FILE_CREATE);
+	ok = f != NULL;
+
+	iov.base = header;
+	iov.size = sizeof(header);
+	ok = ok && host_file_write(f, &iov, 1, 0);
+	iov.base = s.data;
+	iov.size = (size_t)state;
+	ok = ok && host_file_write(f, &iov, 1, SNAPSHOT_HEADER_SIZE);
+
+	if (type == SNAPSHOT_DELTA)
+	{
+		// Разностный снимок: карта изменённых страниц, затем сами страницы подряд
+		iov.base = ram_dirty;
+		iov.size = (size_t)(size >> 12);
+		ok = ok && host_file_write(f, &iov, 1, offset);
+		ok = ok && snapshot_write_pages(f, offset + map_size);
+	}
+	else
+	{
+		// Нулевые части ОЗУ (в том числе страницы, к которым гость не обращался) остаются
+		// дырами в файле
+		for (pos = 0; ok && pos < size; pos += n)
+		{
+			n = size - pos < SNAPSHOT_ALIGN ? size - pos : SNAPSHOT_ALIGN;
+			if (snapshot_zero(&ram[pos], (size_t)n))
+				continue;
+			iov.base = &ram[pos];
+			iov.size = (size_t)n;
+			ok = host_file_write(f, &iov, 1, offset + pos);
+		}
+		ok = ok && host_file_resize(f, offset + size);
+	}
+
+	host_file_close(f);
+	free(s.data);
+
+	// Заменить старый снимок. Отображённый в память файл остаётся у машины, пока она работает
+	if (ok && rename(tmp, file) != 0)
+		ok = remove(file) == 0 && rename(tmp, file) == 0;
+	if (!ok)
+	{
+		printf("\"%s\": unable to write snapshot\n", file);
+		remove(tmp);
+	}
+	free(tmp);
+
+	// Полный снимок становится базовым для следующих разностных
+	if (ok && type == SNAPSHOT_FULL)
+	{
+		snapshot_remember(&snapshot_base, file);
+		snapshot_base_id = id;
+		ram_dirty_reset();
+	}
+	if (ok)
+		snapshot_remember(&snapshot_point, file);
+
+	return ok;
+}
+
+// Чтение и проверка заголовка снимка. base - буфер для пути к базовому снимку
+// (SNAPSHOT_HEADER_SIZE байт), если снимок разностный, id - идентификатор базового снимка
+static host_file_t* snapshot_open(const char* file, uint32_t* count, uint64_t* size, uint64_t* state, uint64_t* offset, uint32_t* type, uint64_t* id, char* base)
+{
+	uint8_t header[SNAPSHOT_HEADER_SIZE];
+	uint32_t version, xlen;
+	uint64_t ram_end;
+	int64_t file_size;
+	host_file_t* f;
+	host_iov_t iov;
+
+	f = host_file_open(file, HOST_FILE_READ);
+	if (f == NULL)
+	{
+		printf("\"%s\": unable to open snapshot\n", file);
+		return NULL;
+	}
+
+	iov.base = header;
+	iov.size = sizeof(header);
+	if (!host_file_read(f, &iov, 1, 0) || memcmp(header, SNAPSHOT_MAGIC, 8) != 0)
+	{
+		printf("\"%s\": not a snapshot\n", file);
+		host_file_close(f);
+		return NULL;
+	}
+
+	memcpy(&version, &header[8], 4);
+	memcpy(&xlen, &header[12], 4);
+	memcpy(count, &header[16], 4);
+	memcpy(size, &header[24], 8);
+	memcpy(state, &header[32], 8);
+	memcpy(offset, &header[40], 8);
+	memcpy(type, &header[48], 4);
+	memcpy(id, &header[SNAPSHOT_ID_OFFSET], 8);
+	header[SNAPSHOT_HEADER_SIZE - 1] = 0;
+	strcpy(base, (const char*)&header[SNAPSHOT_PATH_OFFSET]);
+
+	// Разностный снимок содержит карту страниц, страницы могут кончаться раньше ОЗУ
+	ram_end = *type == SNAPSHOT_DELTA ? *offset + (*size >> 12) : *offset + *size;
+	file_size = host_file_size(f);
+	if (version != SNAPSHOT_VERSION || xlen != XLEN || *count == 0 || *count > MAX_HARTS ||
+		*size == 0 || *size % 1048576 != 0 || *size / 1048576 > RAM_MAX_MB ||
+		*offset % SNAPSHOT_ALIGN != 0 || *offset < SNAPSHOT_HEADER_SIZE + *state ||
+		(*type != SNAPSHOT_FULL && *type != SNAPSHOT_DELTA) || (*type == SNAPSHOT_DELTA && base[0] == 0) ||
+		file_size < 0 || (uint64_t)file_size < ram_end)
+	{
+		printf("\"%s\": unsupported snapshot\n", file);
+		host_file_close(f);
+		return NULL;
+	}
+
+	return f;
+}
+
+// Открытие полного снимка с идентификатором id, от которого отличается разностный снимок file
+static host_file_t* snapshot_open_base(const char* file, const char* base, uint64_t id, uint32_t count, uint64_t size, uint64_t* offset)
+{
+	uint64_t base_size, state, base_id;
+	uint32_t base_count, type;
+	char path[SNAPSHOT_HEADER_SIZE];
+	host_file_t* f;
+
+	f = snapshot_open(base, &base_count, &base_size, &state, offset, &type, &base_id, path);
+	if (f != NULL && (type != SNAPSHOT_FULL || base_id != id || base_count != count || base_size != size))
+	{
+		printf("\"%s\": base snapshot \"%s\" does not match\n", file, base);
+		host_file_close(f);
+		return NULL;
+	}
+
+	return f;
+}
+
+// Отображение ОЗУ из снимка в память. Возвращает количество процессоров и размер ОЗУ
+// сохранённой машины. ОЗУ разностного снимка отображается из базового, изменённые
+// страницы читает snapshot_restore
+uint8_t* snapshot_ram(const char* file, int* harts, ui* size)
+{
+	uint64_t ram_bytes, state, offset, id;
+	uint32_t count, type;
+	char base[SNAPSHOT_HEADER_SIZE];
+	host_file_t* f;
+	uint8_t* p;
+
+	f = snapshot_open(file, &count, &ram_bytes, &state, &offset, &type, &id, base);
+	if (f != NULL && type == SNAPSHOT_DELTA)
+	{
+		host_file_close(f);
+		f = snapshot_open_base(file, base, id, count, ram_bytes, &offset);
+	}
+	if (f == NULL)
+		return NULL;
+
+	// Отображение остаётся действительным после закрытия файла
+	p = (uint8_t*)host_file_map_copy(f, offset, ram_bytes);
+	host_file_close(f);
+	if (p == NULL)
+	{
+		printf("\"%s\": unable to map snapshot RAM\n", file);
+		return NULL;
+	}
+
+	*harts = (int)count;
+	*size = (ui)ram_bytes;
+
+	return p;
+}
+
+// Восстановление состояния процессоров и устройств, записанного с SNAPSHOT_HEADER_SIZE
+static int snapshot_load(host_file_t* f, const char* file, uint64_t state)
+{
+	host_iov_t iov;
+	snap_t s;
+	int i, ok;
+
+	memset(&s, 0, sizeof(s));
+	s.size = (size_t)state;
+	s.data = (uint8_t*)malloc(s.size + 1);
+	iov.base = s.data;
+	iov.size = s.size;
+	if (s.data == NULL || !host_file_read(f, &iov, 1, SNAPSHOT_HEADER_SIZE))
+	{
+		printf("\"%s\": unable to read snapshot\n", file);
+		free(s.data);
+		return 0;
+	}
+
+	for (i = 0; i < hart_count; i++)
+		hart_load(&s, harts[i]);
+	ok = !s.error && plic_load(&s) && virtio_load(&s) && s.pos == s.size;
+	free(s.data);
+	if (!ok)
+	{
+		printf("\"%s\": snapshot does not match the machine\n", file);
+		return 0;
+	}
+
+	return 1;
+}
+
+// Восстановление процессоров и устройств из снимка (после snapshot_ram, сброса процессоров
+// и подключения устройств). Изменённые страницы разностного снимка читаются в ОЗУ
+int snapshot_restore(const char* file)
+{
+	uint64_t ram_bytes, state, offset, map_size, id;
+	uint32_t count, type;
+	char base[SNAPSHOT_HEADER_SIZE];
+	host_file_t* f;
+	host_iov_t iov;
+	int ok;
+
+	f = snapshot_open(file, &count, &ram_bytes, &state, &offset, &type, &id, base);
+	if (f == NULL)
+		return 0;
+	if (count != (uint32_t)hart_count || ram_bytes != ram_size)
+	{
+		printf("\"%s\": snapshot has changed\n", file);
+		host_file_close(f);
+		return 0;
+	}
+
+	ok = 1;
+	if (type == SNAPSHOT_DELTA)
+	{
+		// Страницы, которыми ОЗУ отличается от базового снимка, остаются отмеченными:
+		// следующий разностный снимок тоже их содержит
+		map_size = ((ram_bytes >> 12) + SNAPSHOT_PAGE - 1) & ~(uint64_t)(SNAPSHOT_PAGE - 1);
+		iov.base = ram_dirty;
+		iov.size = (size_t)(ram_bytes >> 12);
+		ok = host_file_read(f, &iov, 1, offset) && snapshot_read_pages(f, offset + map_size, ram_dirty, ram_dirty);
+		if (!ok)
+			printf("\"%s\": unable to read snapshot\n", file);
+	}
+	ok = ok && snapshot_load(f, file, state);
+	host_file_close(f);
+	if (!ok)
+		return 0;
+
+	snapshot_remember(&snapshot_base, type == SNAPSHOT_DELTA ? base : file);
+	snapshot_base_id = id;
+	snapshot_remember(&snapshot_point, file);
+
+	return 1;
+}
+
+// Возврат ОЗУ к снимку file: перечитываются только страницы, изменённые после него.
+// Возвращает открытый файл снимка и размер состояния для snapshot_load. changed - ОЗУ
+// уже изменено (при ошибке продолжать работу нельзя)
+static host_file_t* snapshot_rollback_ram(const char* file, uint64_t* state, int* changed)
+{
+	uint64_t ram_bytes, offset, base_offset, map_size, pages = ram_size >> 12, p, id;
+	uint32_t count, type;
+	char base[SNAPSHOT_HEADER_SIZE];
+	host_file_t* f;
+	host_file_t* fb = NULL;
+	host_iov_t iov;
+	uint8_t* map = NULL;
+	int ok;
+
+	*changed = 0;
+	f = snapshot_open(file, &count, &ram_bytes, state, &offset, &type, &id, base);
+	if (f == NULL)
+		return NULL;
+
+	// Снимок мог быть заменён другим, сохранённым по тому же пути: страницы, изменённые
+	// после него, по ram_dirty уже не восстановить
+	if (count != (uint32_t)hart_count || ram_bytes != ram_size || id != snapshot_base_id)
+	{
+		printf("\"%s\": snapshot has changed\n", file);
+		host_file_close(f);
+		return NULL;
+	}
+
+	ok = 1;
+	if (type == SNAPSHOT_DELTA)
+	{
+		// Страницы из разностного снимка - из него, остальные изменённые - из базового
+		fb = snapshot_open_base(file, base, id, count, ram_bytes, &base_offset);
+		if (fb == NULL)
+		{
+			host_file_close(f);
+			return NULL;
+		}
+		*changed = 1;
+		map_size = ((ram_bytes >> 12) + SNAPSHOT_PAGE - 1) & ~(uint64_t)(SNAPSHOT_PAGE - 1);
+		map = (uint8_t*)malloc((size_t)pages);
+		iov.base = map;
+		iov.size = (size_t)pages;
+		ok = map != NULL && host_file_read(f, &iov, 1, offset) &&
+			snapshot_read_pages(f, offset + map_size, map, ram_dirty);
+		for (p = 0; ok && p < pages; p++)
+			ram_dirty[p] = ram_dirty[p] && !map[p];
+		ok = ok && snapshot_read_pages(fb, base_offset, NULL, ram_dirty);
+		if (ok)
+			memcpy(ram_dirty, map, (size_t)pages);
+	}
+	else
+	{
+		*changed = 1;
+		ok = snapshot_read_pages(f, offset, NULL, ram_dirty);
+		if (ok)
+			memset(ram_dirty, 0, (size_t)pages);
+	}
+
+	host_file_close(fb);
+	free(map);
+	if (!ok)
+	{
+		printf("\"%s\": unable to read snapshot\n", file);
+		host_file_close(f);
+		return NULL;
+	}
+
+	return f;
+}
+
+// Возврат машины к последнему сохранённому или восстановленному снимку по запросу
+// MAIL_ROLLBACK (вызывается процессором между отрезками выполнения)
+void snapshot_rollback(riscv_t* cpu)
+{
+	uint64_t state;
+	host_file_t* f;
+	int64_t t;
+	int i, ok, changed;
+
+	if (snapshot_point == NULL)
+	{
+		console_flush();
+		printf("\nNo snapshot to roll back to\n");
+		return;
+	}
+
+	t = host_time_ns();
+	smp_pause(cpu);
+	virtio_pause();
+	f = snapshot_rollback_ram(snapshot_point, &state, &changed);
+	virtio_resume();
+
+	// Устройства восстанавливаются под своими блокировками
+	ok = f != NULL && snapshot_load(f, snapshot_point, state);
+	host_file_close(f);
+
+	// Код в ОЗУ изменился
+	for (i = 0; i < hart_count; i++)
+	{
+		dcache_flush(harts[i]);
+		harts[i]->res_addr = ~(ui)0;
+	}
+	smp_resume(cpu);
+
+	// Снимок не подошёл, машина работает дальше без изменений
+	if (f == NULL && !changed)
+		return;
+	// Состояние машины могло измениться частично, продолжать нельзя
+	if (!ok)
+		exit(1);
+
+	console_flush();
+	printf("\nRolled back to \"%s\" (%d ms)\n", snapshot_point, (int)((host_time_ns() - t) / 1000000));
+}
+
+// Сохранение снимка по запросу MAIL_SNAPSHOT (вызывается процессором между отрезками
+// выполнения). Остальные процессоры и потоки устройств ждут окончания записи
+void snapshot_take(riscv_t* cpu)
+{
+	int64_t t;
+	int ok;
+
+	if (snapshot_file == NULL)
+		return;
+
+	t = host_time_ns();
+	smp_pause(cpu);
+	virtio_pause();
+	ok = snapshot_save(snapshot_file);
+	virtio_resume();
+	smp_resume(cpu);
+
+	if (ok)
+	{
+		console_flush();
+		printf("\nSnapshot saved to \"%s\" (%d ms)\n", snapshot_file, (int)((host_time_ns() - t) / 1000000));
+	}
+}
+
+// Запрос сохранения снимка из любого потока: снимок сохранит процессор 0
+void snapshot_request(void)
+{
+	if (snapshot_file != NULL && hart_count > 0)
+		hart_signal(harts[0], MAIL_SNAPSHOT);
+}
+
+// Команда консоли после Ctrl-A
+static void snapshot_key(int ch)
+{
+	if (ch == SNAPSHOT_KEY)
+		snapshot_request();
+	else if (ch == SNAPSHOT_ROLLBACK_KEY && hart_count > 0)
+		hart_signal(harts[0], MAIL_ROLLBACK);
+}
+
+// Разрешение команд снимков на консоли: сохранения в file по Ctrl-A s (file = NULL -
+// сохранение не разрешено) и возврата к последнему снимку по Ctrl-A r
+void snapshot_enable(const char* file)
+{
+	snapshot_file = file;
+	console_set_escape(snapshot_key);
+}
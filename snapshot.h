@@ -0,0 +1,71 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include "riscv.h"
+
+// Снимок состояния машины
+//
+// Снимок сохраняет всё, что нужно, чтобы продолжить работу загруженной системы с того же
+// места: регистры процессоров, таймеры, состояние PLIC и устройств virtio, и ОЗУ.
+// Восстановление не копирует ОЗУ: файл снимка отображается в память (MAP_PRIVATE), страницы
+// читаются из страничного кеша хоста при первом обращении гостя, а при первой записи
+// копируются. Поэтому запуск из снимка занимает доли секунды независимо от размера ОЗУ,
+// а машины, запущенные из одного снимка, делят неизменённые страницы.
+//
+// Формат файла (числа в порядке байт хоста, снимок переносим только между одинаковыми
+// сборками эмулятора):
+//   0    "DIMMUSNP"
+//   8    версия (4 байта)
+//   12   разрядность XLEN (4 байта)
+//   16   количество процессоров (4 байта)
+//   24   размер ОЗУ (8 байт)
+//   32   размер состояния процессоров и устройств (8 байт)
+//   40   смещение ОЗУ (8 байт, кратно SNAPSHOT_ALIGN)
+//   48   тип: 0 - полный, 1 - разностный (4 байта)
+//   56   идентификатор полного снимка, у разностного - его базового (8 байт)
+//   64   путь к базовому снимку разностного снимка
+// С SNAPSHOT_HEADER_SIZE - состояние, с указанного смещения - ОЗУ. Страницы ОЗУ, заполненные
+// нулями, не записываются, поэтому файл снимка разрежённый.
+//
+// Разностный снимок содержит только страницы, изменённые после полного (базового) снимка:
+// с указанного смещения - карта страниц (байт на страницу, выровнена до 4 КБ), затем
+// отмеченные в ней страницы подряд. Изменённые страницы отслеживаются всё время работы
+// (ram_dirty): страница отмечается, когда для неё заполняется запись TLB для записи, так что
+// обычные записи не замедляются. Базовым становится снимок, из которого восстановлена
+// машина (для разностного - его базовый), или последний сохранённый полный. Сохранение в
+// другой файл записывает разностный снимок и занимает время, пропорциональное количеству
+// изменённых страниц, а не размеру ОЗУ. По Ctrl-A r машина возвращается к последнему
+// сохранённому или восстановленному снимку: из файлов перечитываются только страницы,
+// изменённые после него. Диск при этом не возвращается. Базовый снимок, сохранённый заново,
+// получает новый идентификатор, и прежние разностные снимки от него не восстанавливаются.
+//
+// Устройства при восстановлении подключаются заново по командной строке: диск и сеть
+// должны быть те же, что при сохранении, а диск - в том же состоянии.
+
+// Буфер, в который последовательно записывается и из которого читается состояние
+typedef struct
+{
+	uint8_t* data;
+	size_t size;
+	size_t capacity;
+	size_t pos;
+	int error;
+} snap_t;
+
+void snap_put(snap_t* s, const void* p, size_t size);
+void snap_get(snap_t* s, void* p, size_t size);
+
+void snapshot_enable(const char* file);
+void snapshot_request(void);
+void snapshot_take(riscv_t* cpu);
+int  snapshot_save(const char* file);
+uint8_t* snapshot_ram(const char* file, int* harts, ui* size);
+int  snapshot_restore(const char* file);
+void snapshot_rollback(riscv_t* cpu);
+
+// Сохранение состояния устройств
+void plic_save(snap_t* s);
+int  plic_load(snap_t* s);
+void virtio_save(snap_t* s);
+int  virtio_load(snap_t* s);
@@ -0,0 +1,331 @@
+#include "riscv.h"
+#include "tlb.h"
+
+// Интерпретатор с шитым кодом (threaded code)
+//
+// Инструкции берутся из кэша декодированных инструкций, как и в do_step(), но выполняются
+// не через вызов обработчика, а переходом на метку с его кодом. Каждая метка заканчивается
+// собственным переходом на следующую инструкцию, поэтому процессор хоста предсказывает
+// эти переходы отдельно для каждого типа инструкции.
+// В GCC/Clang используются адреса меток (computed goto), в остальных компиляторах - switch.
+//
+// Текущая декодированная страница запоминается и используется, пока PC не уйдёт с неё.
+// Её нужно заново найти через TLB, если она была сброшена записью в память, сменился режим
+// процессора или выполнена системная инструкция (могли измениться satp или TLB).
+
+#if defined(__GNUC__)
+#define THREADED_GOTO
+#endif
+
+#ifdef THREADED_GOTO
+#define CASE(name)					L_##name:
+#define DISPATCH()					goto *labels[in->op]
+#else
+#define CASE(name)					case OP_##name:
+#define DISPATCH()					goto dispatch
+#endif
+
+// Выборка следующей инструкции из текущей страницы
+#define FETCH() \
+	cpu->instr_pc = cpu->pc; \
+	if ((cpu->pc >> 12) != vpn) \
+		goto refill; \
+	in = &page->insn[(cpu->pc & 0xFFF) >> 1]; \
+	cpu->pc += in->len; \
+	cpu->r[0] = 0; \
+	DISPATCH()
+
+// Переход к следующей инструкции, если не исчерпан лимит
+#define NEXT() \
+	if (--left == 0) \
+		goto out; \
+	FETCH()
+
+// Проверка, что текущая страница ещё действительна
+#define CHECK_PAGE() \
+	if (cpu->dcache[n] != page || cpu->s_mode != mode) \
+		vpn = TLB_INVALID
+
+// Выполнить до count инструкций, возвращает количество выполненных
+int threaded_run(riscv_t* cpu, int count)
+{
+#ifdef THREADED_GOTO
+	// Порядок меток совпадает с порядком кодов операций
+	static const void* const labels[OP_COUNT] =
+	{
+		&&L_DECODE, &&L_ILLEGAL,
+		&&L_LB, &&L_LH, &&L_LW, &&L_LD, &&L_LBU, &&L_LHU, &&L_LWU,
+		&&L_SB, &&L_SH, &&L_SW, &&L_SD,
+		&&L_ADDI, &&L_SLLI, &&L_SLTI, &&L_SLTIU, &&L_XORI, &&L_SRLI, &&L_SRAI, &&L_ORI, &&L_ANDI,
+		&&L_ADDIW, &&L_SLLIW, &&L_SRLIW, &&L_SRAIW,
+		&&L_ADD, &&L_SUB, &&L_SLL, &&L_SLT, &&L_SLTU, &&L_XOR, &&L_SRL, &&L_SRA, &&L_OR, &&L_AND,
+		&&L_ADDW, &&L_SUBW, &&L_SLLW, &&L_SRLW, &&L_SRAW,
+		&&L_LUI, &&L_AUIPC,
+		&&L_BEQ, &&L_BNE, &&L_BLT, &&L_BGE, &&L_BLTU, &&L_BGEU, &&L_JAL, &&L_JALR,
+		&&L_FENCE,
+		&&L_MULDIV, &&L_MULDIVW, &&L_ATOMIC, &&L_SYSTEM
+	};
+#endif
+	dcache_page_t* page = NULL;
+	const insn_t* in;
+	uint8_t* p;
+	ui vpn = TLB_INVALID;
+	ui n = 0;
+	ui addr;
+	si value;
+	int mode = 0;
+	int left = count;
+
+	if (count <= 0 || cpu->wfi || cpu->irq_check)
+		return 0;
+
+	FETCH();
+
+#ifndef THREADED_GOTO
+dispatch:
+	switch (in->op)
+	{
+#endif
+
+	// Загрузка из памяти
+	CASE(LB)
+		if (read8(cpu, cpu->r[in->rs1] + in->imm, &value))
+			cpu->r[in->rd] = (int8_t)value;
+		CHECK_PAGE();
+		NEXT();
+	CASE(LH)
+		if (read16(cpu, cpu->r[in->rs1] + in->imm, &value))
+			cpu->r[in->rd] = (int16_t)value;
+		CHECK_PAGE();
+		NEXT();
+	CASE(LW)
+		if (read32(cpu, cpu->r[in->rs1] + in->imm, &value))
+			cpu->r[in->rd] = (int32_t)value;
+		CHECK_PAGE();
+		NEXT();
+	CASE(LD)
+		if (read64(cpu, cpu->r[in->rs1] + in->imm, &value))
+			cpu->r[in->rd] = value;
+		CHECK_PAGE();
+		NEXT();
+	CASE(LBU)
+		if (read8(cpu, cpu->r[in->rs1] + in->imm, &value))
+			cpu->r[in->rd] = ((uint8_t)value) & 0xFF;
+		CHECK_PAGE();
+		NEXT();
+	CASE(LHU)
+		if (read16(cpu, cpu->r[in->rs1] + in->imm, &value))
+			cpu->r[in->rd] = ((uint16_t)value) & 0xFFFF;
+		CHECK_PAGE();
+		NEXT();
+	CASE(LWU)
+		if (read32(cpu, cpu->r[in->rs1] + in->imm, &value))
+			cpu->r[in->rd] = ((uint32_t)value) & 0xFFFFFFFFu;
+		CHECK_PAGE();
+		NEXT();
+
+	// Запись в память (может сбросить текущую страницу)
+	CASE(SB)
+		write8(cpu, cpu->r[in->rs1] + in->imm, (uint8_t)cpu->r[in->rs2]);
+		CHECK_PAGE();
+		NEXT();
+	CASE(SH)
+		write16(cpu, cpu->r[in->rs1] + in->imm, (uint16_t)cpu->r[in->rs2]);
+		CHECK_PAGE();
+		NEXT();
+	CASE(SW)
+		write32(cpu, cpu->r[in->rs1] + in->imm, (uint32_t)cpu->r[in->rs2]);
+		CHECK_PAGE();
+		NEXT();
+	CASE(SD)
+		write64(cpu, cpu->r[in->rs1] + in->imm, cpu->r[in->rs2]);
+		CHECK_PAGE();
+		NEXT();
+
+	// Операции с константой
+	CASE(ADDI)
+		cpu->r[in->rd] = cpu->r[in->rs1] + in->imm;
+		NEXT();
+	CASE(SLLI)
+		cpu->r[in->rd] = cpu->r[in->rs1] << in->imm;
+		NEXT();
+	CASE(SLTI)
+		cpu->r[in->rd] = cpu->r[in->rs1] < (si)in->imm ? 1 : 0;
+		NEXT();
+	CASE(SLTIU)
+		cpu->r[in->rd] = ((ui)cpu->r[in->rs1]) < ((ui)(si)in->imm) ? 1 : 0;
+		NEXT();
+	CASE(XORI)
+		cpu->r[in->rd] = cpu->r[in->rs1] ^ in->imm;
+		NEXT();
+	CASE(SRLI)
+		cpu->r[in->rd] = ((ui)cpu->r[in->rs1]) >> in->imm;
+		NEXT();
+	CASE(SRAI)
+		cpu->r[in->rd] = cpu->r[in->rs1] >> in->imm;
+		NEXT();
+	CASE(ORI)
+		cpu->r[in->rd] = cpu->r[in->rs1] | in->imm;
+		NEXT();
+	CASE(ANDI)
+		cpu->r[in->rd] = cpu->r[in->rs1] & in->imm;
+		NEXT();
+	CASE(ADDIW)
+		cpu->r[in->rd] = (int32_t)((int32_t)cpu->r[in->rs1] + in->imm);
+		NEXT();
+	CASE(SLLIW)
+		cpu->r[in->rd] = (int32_t)((int32_t)cpu->r[in->rs1] << in->imm);
+		NEXT();
+	CASE(SRLIW)
+		cpu->r[in->rd] = ((uint32_t)cpu->r[in->rs1]) >> in->imm;
+		NEXT();
+	CASE(SRAIW)
+		cpu->r[in->rd] = ((int32_t)cpu->r[in->rs1]) >> in->imm;
+		NEXT();
+
+	// Операции с регистрами
+	CASE(ADD)
+		cpu->r[in->rd] = cpu->r[in->rs1] + cpu->r[in->rs2];
+		NEXT();
+	CASE(SUB)
+		cpu->r[in->rd] = cpu->r[in->rs1] - cpu->r[in->rs2];
+		NEXT();
+	CASE(SLL)
+		cpu->r[in->rd] = cpu->r[in->rs1] << (cpu->r[in->rs2] & 0x3F);
+		NEXT();
+	CASE(SLT)
+		cpu->r[in->rd] = cpu->r[in->rs1] < cpu->r[in->rs2] ? 1 : 0;
+		NEXT();
+	CASE(SLTU)
+		cpu->r[in->rd] = ((ui)cpu->r[in->rs1]) < ((ui)cpu->r[in->rs2]) ? 1 : 0;
+		NEXT();
+	CASE(XOR)
+		cpu->r[in->rd] = cpu->r[in->rs1] ^ cpu->r[in->rs2];
+		NEXT();
+	CASE(SRL)
+		cpu->r[in->rd] = ((ui)cpu->r[in->rs1]) >> (cpu->r[in->rs2] & 0x3F);
+		NEXT();
+	CASE(SRA)
+		cpu->r[in->rd] = cpu->r[in->rs1] >> (cpu->r[in->rs2] & 0x3F);
+		NEXT();
+	CASE(OR)
+		cpu->r[in->rd] = cpu->r[in->rs1] | cpu->r[in->rs2];
+		NEXT();
+	CASE(AND)
+		cpu->r[in->rd] = cpu->r[in->rs1] & cpu->r[in->rs2];
+		NEXT();
+	CASE(ADDW)
+		cpu->r[in->rd] = (int32_t)((int32_t)cpu->r[in->rs1] + (int32_t)cpu->r[in->rs2]);
+		NEXT();
+	CASE(SUBW)
+		cpu->r[in->rd] = (int32_t)((int32_t)cpu->r[in->rs1] - (int32_t)cpu->r[in->rs2]);
+		NEXT();
+	CASE(SLLW)
+		cpu->r[in->rd] = (int32_t)((int32_t)cpu->r[in->rs1] << (cpu->r[in->rs2] & 0x1F));
+		NEXT();
+	CASE(SRLW)
+		cpu->r[in->rd] = ((uint32_t)cpu->r[in->rs1]) >> (cpu->r[in->rs2] & 0x1F);
+		NEXT();
+	CASE(SRAW)
+		cpu->r[in->rd] = ((int32_t)cpu->r[in->rs1]) >> (cpu->r[in->rs2] & 0x1F);
+		NEXT();
+	CASE(LUI)
+		cpu->r[in->rd] = in->imm;
+		NEXT();
+	CASE(AUIPC)
+		cpu->r[in->rd] = cpu->instr_pc + in->imm;
+		NEXT();
+
+	// Переходы
+	CASE(BEQ)
+		if (cpu->r[in->rs1] == cpu->r[in->rs2])
+			cpu->pc = cpu->instr_pc + in->imm;
+		NEXT();
+	CASE(BNE)
+		if (cpu->r[in->rs1] != cpu->r[in->rs2])
+			cpu->pc = cpu->instr_pc + in->imm;
+		NEXT();
+	CASE(BLT)
+		if (cpu->r[in->rs1] < cpu->r[in->rs2])
+			cpu->pc = cpu->instr_pc + in->imm;
+		NEXT();
+	CASE(BGE)
+		if (cpu->r[in->rs1] >= cpu->r[in->rs2])
+			cpu->pc = cpu->instr_pc + in->imm;
+		NEXT();
+	CASE(BLTU)
+		if (((ui)cpu->r[in->rs1]) < ((ui)cpu->r[in->rs2]))
+			cpu->pc = cpu->instr_pc + in->imm;
+		NEXT();
+	CASE(BGEU)
+		if (((ui)cpu->r[in->rs1]) >= ((ui)cpu->r[in->rs2]))
+			cpu->pc = cpu->instr_pc + in->imm;
+		NEXT();
+	CASE(JAL)
+		cpu->r[in->rd] = cpu->pc;
+		cpu->pc = cpu->instr_pc + in->imm;
+		NEXT();
+	CASE(JALR)
+		addr = cpu->r[in->rs1] + in->imm;
+		cpu->r[in->rd] = cpu->pc;
+		cpu->pc = addr;
+		NEXT();
+	CASE(FENCE)
+		NEXT();
+
+	// Остальные инструкции выполняются обработчиками интерпретатора
+	CASE(DECODE)
+		in->exec(cpu, in);
+		// Только что декодированная системная инструкция завершает отрезок так же,
+		// как при следующих выполнениях
+		if (in->op == OP_SYSTEM)
+			goto system;
+		CHECK_PAGE();
+		NEXT();
+	CASE(ILLEGAL)
+	CASE(MULDIV)
+	CASE(MULDIVW)
+	CASE(ATOMIC)
+		in->exec(cpu, in);
+		CHECK_PAGE();
+		NEXT();
+	CASE(SYSTEM)
+		in->exec(cpu, in);
+	system:
+		vpn = TLB_INVALID;
+		if (cpu->wfi || cpu->irq_check)
+		{
+			left--;
+			goto out;
+		}
+		NEXT();
+
+#ifndef THREADED_GOTO
+	}
+#endif
+
+refill:
+	// Другой процессор ждёт выполнения запроса, завершить отрезок
+	if (cpu->mail)
+		goto out;
+
+	// Найти страницу через TLB. Если произошло исключение, то PC уже указывает на обработчик
+	p = tlb_translate(cpu, cpu->pc, TLB_EXEC);
+	if (p == NULL)
+	{
+		NEXT();
+	}
+	n = (ui)(p - cpu->ram) >> 12;
+	page = cpu->dcache[n];
+	if (page == NULL)
+		page = dcache_get(cpu, RAM_START + (n << 12));
+	vpn = cpu->pc >> 12;
+	mode = cpu->s_mode;
+	in = &page->insn[(cpu->pc & 0xFFF) >> 1];
+	cpu->pc += in->len;
+	cpu->r[0] = 0;
+	DISPATCH();
+
+out:
+	return count - left;
+}
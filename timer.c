@@ -1,17 +1,34 @@
 #include "riscv.h"
 
 // Обновление флага прерывания таймера
-// Вызывается после каждой записи в регистры time или timecmp
+// Вызывается после каждой записи в регистры time или timecmp (stimecmp) и при наступлении события таймера.
+// Регистр stimecmp расширения Sstc - это тот же регистр mtimecmp: гость может программировать
+// таймер записью в CSR вместо вызова SBI
 static void update_timer_irq(riscv_t* cpu)
 {
-	cpu->sip &= ~MIE_MTIE;
-	if (cpu->mtime > cpu->mtimecmp)
-		cpu->sip |= MIE_MTIE;
+	ui sip = cpu->sip & ~MIE_MTIE;
+
+	// Регистры сравниваются без знака: mtimecmp = -1 означает "никогда"
+	if ((uint64_t)cpu->mtime >= (uint64_t)cpu->mtimecmp)
+		sip |= MIE_MTIE;
+
+	if (sip != cpu->sip)
+	{
+		cpu->sip = sip;
+		cpu->irq_check = 1;
+	}
+
+	// Запланировать срабатывание таймера
+	if ((sip & MIE_MTIE) || (uint64_t)cpu->mtimecmp >= (uint64_t)EVENT_NEVER)
+		event_set(cpu, EVENT_TIMER, EVENT_NEVER);
+	else
+		event_set(cpu, EVENT_TIMER, cpu->mtimecmp);
 }
 
 void set_mtime(riscv_t* cpu, uint32_t high, uint32_t low)
 {
 	cpu->mtime = low | (((int64_t)high) << 32);
+	clock_set(cpu);
 	update_timer_irq(cpu);
 }
 
@@ -24,6 +41,7 @@ void set_mtimecmp(riscv_t* cpu, uint32_t high, uint32_t low)
 void set_mtime64(riscv_t* cpu, uint64_t value)
 {
 	cpu->mtime = value;
+	clock_set(cpu);
 	update_timer_irq(cpu);
 }
 
@@ -33,8 +51,8 @@ void set_mtimecmp64(riscv_t* cpu, uint64_t value)
 	update_timer_irq(cpu);
 }
 
-// Перевод таймера вперёд на указанное кол-во микросекунд
-void riscv_timer_tick(riscv_t* cpu, int useconds)
+// Наступило время срабатывания таймера
+void timer_event(riscv_t* cpu)
 {
-	set_mtime64(cpu, cpu->mtime + useconds);
+	update_timer_irq(cpu);
 }
@@ -0,0 +1,32 @@
+#pragma once
+
+#include <stddef.h>
+
+#include "riscv.h"
+
+// Быстрый поиск страницы в TLB
+// Возвращает указатель на байт в памяти хоста, соответствующий виртуальному адресу,
+// или NULL, если записи нет и нужно вызвать tlb_fill
+static uint8_t* tlb_lookup(riscv_t* cpu, ui virt, int type)
+{
+	ui vpn = virt >> 12;
+	tlb_entry_t* e = &cpu->tlb[cpu->s_mode][type][vpn & (TLB_SIZE - 1)];
+
+	// Запись должна относиться к текущему адресному пространству или быть глобальной
+	if (e->vpn != vpn || (e->asid != cpu->asid && e->asid != TLB_ASID_GLOBAL))
+		return NULL;
+
+	return e->page + (virt & 0xFFF);
+}
+
+// Получить указатель на память хоста для виртуального адреса,
+// при промахе заполнить запись TLB (с проверкой прав и исключениями)
+static uint8_t* tlb_translate(riscv_t* cpu, ui virt, int type)
+{
+	uint8_t* p = tlb_lookup(cpu, virt, type);
+
+	if (p != NULL)
+		return p;
+
+	return tlb_fill(cpu, virt, type);
+}
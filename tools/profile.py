@@ -0,0 +1,201 @@
+#!/usr/bin/env python3
+# Свёртка выборок профилировщика эмулятора (параметр -profile) в стеки для flamegraph.pl
+#
+# Каждая строка вывода - стек от внешней функции к текущей через ';' и количество выборок:
+#   python3 tools/profile.py -k System.map -u 0x8000000000081234=app riscv.prof > out.folded
+#   flamegraph.pl out.folded > out.svg
+# Символы ядра берутся из System.map или vmlinux, символы пользовательских программ - из
+# ELF-файлов; программы различаются по значению satp (список выводит параметр -l).
+
+import argparse
+import bisect
+import collections
+import struct
+import sys
+
+PROFILE_MAGIC = b"DIMMUPRF"
+PROFILE_VERSION = 1
+PROFILE_S_MODE = 1
+PROFILE_WFI = 2
+
+HEADER = struct.Struct("=8sIIQQ")
+SAMPLE = struct.Struct("=QQHBBI")
+
+SHT_SYMTAB = 2
+SHT_DYNSYM = 11
+SHF_EXECINSTR = 4
+STT_NOTYPE = 0
+STT_FUNC = 2
+
+
+# Таблица символов: поиск функции по адресу
+class Symbols:
+	def __init__(self):
+		self.items = []
+		self.addrs = None
+
+	def add(self, addr, size, name):
+		self.items.append((addr, size, name))
+
+	def lookup(self, addr):
+		if self.addrs is None:
+			self.items.sort()
+			self.addrs = [s[0] for s in self.items]
+		i = bisect.bisect_right(self.addrs, addr) - 1
+		if i < 0:
+			return None
+		start, size, name = self.items[i]
+		# Без размера (System.map) функция продолжается до следующего символа
+		if size != 0 and addr >= start + size:
+			return None
+		return name
+
+	def load(self, path, bias=0):
+		with open(path, "rb") as f:
+			data = f.read()
+		if data[:4] == b"\x7fELF":
+			self.load_elf(data, bias)
+		else:
+			self.load_map(data.decode(errors="replace"), bias)
+
+	# System.map: "адрес тип имя", берутся символы кода
+	def load_map(self, text, bias):
+		for line in text.splitlines():
+			parts = line.split()
+			if len(parts) >= 3 and parts[1] in "tTwW":
+				self.add(int(parts[0], 16) + bias, 0, parts[2])
+
+	# ELF: функции из .symtab и .dynsym (и метки без типа в коде, как у ассемблера)
+	def load_elf(self, data, bias):
+		is64 = data[4] == 2
+		end = "<" if data[5] == 1 else ">"
+		if is64:
+			shoff, = struct.unpack_from(end + "Q", data, 0x28)
+			shentsize, shnum = struct.unpack_from(end + "HH", data, 0x3A)
+			shdr = struct.Struct(end + "IIQQQQIIQQ")
+			sym = struct.Struct(end + "IBBHQQ")
+		else:
+			shoff, = struct.unpack_from(end + "I", data, 0x20)
+			shentsize, shnum = struct.unpack_from(end + "HH", data, 0x2E)
+			shdr = struct.Struct(end + "IIIIIIIIII")
+			sym = struct.Struct(end + "IIIBBH")
+		sections = [shdr.unpack_from(data, shoff + i * shentsize) for i in range(shnum)]
+		for s in sections:
+			if s[1] not in (SHT_SYMTAB, SHT_DYNSYM):
+				continue
+			offset, size, link, entsize = s[4], s[5], s[6], s[9]
+			strtab = sections[link]
+			for pos in range(offset, offset + size, entsize):
+				if is64:
+					name, info, other, shndx, value, symsize = sym.unpack_from(data, pos)
+				else:
+					name, value, symsize, info, other, shndx = sym.unpack_from(data, pos)
+				if shndx == 0 or shndx >= len(sections) or value == 0:
+					continue
+				if info & 0xF != STT_FUNC and (info & 0xF != STT_NOTYPE or not sections[shndx][2] & SHF_EXECINSTR):
+					continue
+				start = strtab[4] + name
+				name = data[start:data.index(b"\0", start)].decode(errors="replace")
+				# Служебные метки ассемблера
+				if name.startswith("$") or name.startswith(".L"):
+					continue
+				self.add(value + bias, symsize, name)
+
+
+# Чтение выборок: (заголовок, список (pc, satp, hart, flags, стек))
+def read_profile(path):
+	with open(path, "rb") as f:
+		data = f.read()
+	if len(data) < 32 or data[:8] != PROFILE_MAGIC:
+		sys.exit("%s: not a profile" % path)
+	magic, version, xlen, freq, interval = HEADER.unpack_from(data, 0)
+	if version != PROFILE_VERSION:
+		sys.exit("%s: unsupported profile version %d" % (path, version))
+	samples = []
+	pos = 32
+	while pos + SAMPLE.size <= len(data):
+		pc, satp, hart, flags, depth, _ = SAMPLE.unpack_from(data, pos)
+		pos += SAMPLE.size
+		if pos + depth * 8 > len(data):
+			break
+		stack = struct.unpack_from("=%dQ" % depth, data, pos)
+		pos += depth * 8
+		samples.append((pc, satp, hart, flags, stack))
+	return (xlen, freq, interval), samples
+
+
+def main():
+	parser = argparse.ArgumentParser(description="Fold emulator profile samples into flamegraph stacks")
+	parser.add_argument("profile", help="file written by -profile")
+	parser.add_argument("-k", "--kernel", action="append", default=[], metavar="FILE",
+		help="System.map or vmlinux for supervisor mode samples")
+	parser.add_argument("-u", "--user", action="append", default=[], metavar="[SATP=]ELF[@BASE]",
+		help="ELF for user mode samples of the address space SATP (all if omitted), "
+			"symbols are moved by BASE for PIE and shared libraries")
+	parser.add_argument("-l", "--list", action="store_true",
+		help="list address spaces (satp) with sample counts instead of folding")
+	parser.add_argument("--hart", action="store_true", help="start each stack with the processor number")
+	parser.add_argument("--idle", action="store_true", help="include samples of processors waiting for interrupt")
+	parser.add_argument("--addr", action="store_true", help="show unknown addresses instead of [unknown]")
+	args = parser.parse_args()
+
+	(xlen, freq, interval), samples = read_profile(args.profile)
+
+	if args.list:
+		counts = collections.Counter((s[1], s[3] & PROFILE_S_MODE) for s in samples)
+		print("%-18s %10s %10s" % ("satp", "user", "kernel"))
+		for satp in sorted(set(k[0] for k in counts)):
+			print("0x%016x %10d %10d" % (satp, counts[(satp, 0)], counts[(satp, PROFILE_S_MODE)]))
+		sys.stderr.write("%d samples, %d Hz, RV%d\n" % (len(samples), freq // interval if interval else 0, xlen))
+		return
+
+	kernel = Symbols()
+	for path in args.kernel:
+		kernel.load(path)
+	# Программы пользователя по satp (None - для всех адресных пространств)
+	user = collections.defaultdict(Symbols)
+	names = {}
+	for spec in args.user:
+		satp = None
+		if "=" in spec:
+			key, spec = spec.split("=", 1)
+			satp = int(key, 0)
+		bias = 0
+		if "@" in spec:
+			spec, base = spec.rsplit("@", 1)
+			bias = int(base, 0)
+		user[satp].load(spec, bias)
+		names.setdefault(satp, spec.rsplit("/", 1)[-1])
+
+	def symbol(table, addr):
+		name = table.lookup(addr) if table is not None else None
+		if name is None:
+			return "0x%x" % addr if args.addr else "[unknown]"
+		return name
+
+	folded = collections.Counter()
+	for pc, satp, hart, flags, stack in samples:
+		frames = ["hart%d" % hart] if args.hart else []
+		if flags & PROFILE_WFI:
+			if not args.idle:
+				continue
+			frames.append("[idle]")
+		elif flags & PROFILE_S_MODE:
+			frames.append("[kernel]")
+			table = kernel
+		else:
+			key = satp if satp in user else None
+			frames.append("[user %s]" % names[key] if key in names else "[user 0x%x]" % satp)
+			table = user.get(key)
+		if not flags & PROFILE_WFI:
+			# Адрес возврата указывает за инструкцию вызова, символ ищется по предыдущему байту
+			frames += [symbol(table, ra - 1) for ra in reversed(stack)]
+			frames.append(symbol(table, pc))
+		folded[";".join(frames)] += 1
+
+	for stack, count in sorted(folded.items()):
+		print("%s %d" % (stack, count))
+
+
+if __name__ == "__main__":
+	main()
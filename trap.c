@@ -24,6 +24,9 @@ void trap(riscv_t* cpu, ui cause, ui value)
 	// Продолжаем в режиме супервизора
 	cpu->s_mode = 1;
 
+	// Транслированный блок не должен продолжаться после исключения
+	cpu->jit_stale = 1;
+
 	// Если это прерывание, то записать в SEPC адрес следующей инструкции
 	// Если это исключение, то записать в SEPC адрес текущей инструкции
 	if (cause & CAUSE_IRQ)
@@ -55,7 +58,12 @@ void sret(riscv_t* cpu)
 	// При возврате SPIE копируется в SIE, так восстанавливается
 	// флаг прерываний до trap
 	if (cpu->sstatus & SSTATUS_SPIE)
+	{
+		// Прерывания снова разрешены, отложенные нужно обработать
+		if (!(cpu->sstatus & SSTATUS_SIE))
+			cpu->irq_check = 1;
 		cpu->sstatus |= SSTATUS_SIE;
+	}
 	else
 		cpu->sstatus &= ~SSTATUS_SIE;
 	// И SPIE устанавливается в 1
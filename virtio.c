@@ -0,0 +1,661 @@
+#include <stdio.h>
+#include <string.h>
+#include "virtio.h"
+#include "atomic.h"
+#include "snapshot.h"
+
+// Транспорт virtio-mmio и очереди virtqueue
+//
+// Регистры устройства читаются и пишутся процессорами, а запросы из очередей
+// обрабатывает поток устройства. Регистры и очереди защищены блокировкой устройства,
+// кроме уведомления (QueueNotify) и подтверждения прерывания (InterruptACK):
+// они не должны ждать, пока поток устройства выполняет медленную операцию.
+
+// Регистры
+#define VIRTIO_MAGIC				0x000
+#define VIRTIO_VERSION				0x004
+#define VIRTIO_DEVICE_ID			0x008
+#define VIRTIO_VENDOR_ID			0x00C
+#define VIRTIO_DEVICE_FEATURES		0x010
+#define VIRTIO_DEVICE_FEATURES_SEL	0x014
+#define VIRTIO_DRIVER_FEATURES		0x020
+#define VIRTIO_DRIVER_FEATURES_SEL	0x024
+#define VIRTIO_QUEUE_SEL			0x030
+#define VIRTIO_QUEUE_NUM_MAX		0x034
+#define VIRTIO_QUEUE_NUM			0x038
+#define VIRTIO_QUEUE_READY			0x044
+#define VIRTIO_QUEUE_NOTIFY			0x050
+#define VIRTIO_INTERRUPT_STATUS		0x060
+#define VIRTIO_INTERRUPT_ACK		0x064
+#define VIRTIO_STATUS				0x070
+#define VIRTIO_QUEUE_DESC_LOW		0x080
+#define VIRTIO_QUEUE_DESC_HIGH		0x084
+#define VIRTIO_QUEUE_DRIVER_LOW		0x090
+#define VIRTIO_QUEUE_DRIVER_HIGH	0x094
+#define VIRTIO_QUEUE_DEVICE_LOW		0x0A0
+#define VIRTIO_QUEUE_DEVICE_HIGH	0x0A4
+#define VIRTIO_CONFIG_GENERATION	0x0FC
+#define VIRTIO_CONFIG				0x100
+
+#define VIRTIO_MAGIC_VALUE			0x74726976 // "virt"
+#define VIRTIO_VENDOR_VALUE			0x12345
+
+// Биты регистра состояния
+#define VIRTIO_STATUS_FEATURES_OK	8
+
+// Флаги дескриптора и кольца avail
+#define VIRTQ_DESC_F_NEXT			1
+#define VIRTQ_DESC_F_WRITE			2
+#define VIRTQ_AVAIL_F_NO_INTERRUPT	1
+
+// Причина прерывания: обновлено кольцо used
+#define VIRTIO_INT_USED				1
+
+// Подключённые устройства по номерам окон
+static virtio_t* devices[VIRTIO_SLOTS];
+
+// Указатель на область памяти гостя или NULL, если она не целиком в ОЗУ
+static uint8_t* virtio_ram(uint64_t addr, uint64_t size)
+{
+	uint64_t offset = addr - RAM_START;
+
+	if (addr < RAM_START || offset > ram_size || size > ram_size - offset)
+		return NULL;
+
+	return ram + offset;
+}
+
+// Установка причин прерывания и сигнала PLIC
+static void virtio_irq(virtio_t* dev, int set, int clear)
+{
+	while (!atomic_cas(&dev->irq_lock, 0, 1))
+		;
+	dev->irq_status = (dev->irq_status | set) & ~clear;
+	plic_set(VIRTIO_IRQ + dev->slot, dev->irq_status != 0);
+	atomic_set(&dev->irq_lock, 0);
+}
+
+// Сброс устройства (вызывается под блокировкой)
+static void virtio_reset(virtio_t* dev)
+{
+	dev->driver_features = 0;
+	dev->features_sel = 0;
+	dev->driver_features_sel = 0;
+	dev->queue_sel = 0;
+	dev->status = 0;
+	memset(dev->queues, 0, sizeof(dev->queues));
+	virtio_irq(dev, 0, ~0);
+
+	if (dev->reset != NULL)
+		dev->reset(dev);
+}
+
+// Включение очереди: области очереди должны быть в ОЗУ
+static void virtio_queue_ready(virtq_t* vq)
+{
+	vq->desc_ptr = virtio_ram(vq->desc, 16ull * vq->num);
+	vq->avail_ptr = (volatile uint16_t*)virtio_ram(vq->avail, 6 + 2ull * vq->num);
+	vq->used_ptr = virtio_ram(vq->used, 6 + 8ull * vq->num);
+	vq->ready = vq->num > 0 && vq->desc_ptr != NULL && vq->avail_ptr != NULL && vq->used_ptr != NULL;
+}
+
+static int virtio_read(riscv_t* cpu, void* opaque, ui offset, int size, uint64_t* value)
+{
+	virtio_t* dev = (virtio_t*)opaque;
+	virtq_t* vq;
+
+	// Область конфигурации читается любыми порциями
+	if (offset >= VIRTIO_CONFIG)
+	{
+		offset -= VIRTIO_CONFIG;
+		*value = 0;
+		if (offset >= (ui)dev->config_size || size > dev->config_size - (int)offset)
+			return 1;
+		host_mutex_lock(dev->lock);
+		memcpy(value, &dev->config[offset], size);
+		host_mutex_unlock(dev->lock);
+		return 1;
+	}
+
+	if (size != 4 || (offset & 3))
+		return 0;
+
+	if (offset == VIRTIO_INTERRUPT_STATUS)
+	{
+		*value = (uint32_t)atomic_get(&dev->irq_status);
+		return 1;
+	}
+
+	host_mutex_lock(dev->lock);
+	vq = dev->queue_sel < (uint32_t)dev->num_queues ? &dev->queues[dev->queue_sel] : NULL;
+
+	switch (offset)
+	{
+		case VIRTIO_MAGIC: *value = VIRTIO_MAGIC_VALUE; break;
+		case VIRTIO_VERSION: *value = 2; break;
+		case VIRTIO_DEVICE_ID: *value = dev->device_id; break;
+		case VIRTIO_VENDOR_ID: *value = VIRTIO_VENDOR_VALUE; break;
+		case VIRTIO_DEVICE_FEATURES:
+			*value = dev->features_sel < 2 ? (uint32_t)(dev->features >> (dev->features_sel * 32)) : 0;
+			break;
+		case VIRTIO_QUEUE_NUM_MAX: *value = vq != NULL ? VIRTQ_MAX_SIZE : 0; break;
+		case VIRTIO_QUEUE_NUM: *value = vq != NULL ? vq->num : 0; break;
+		case VIRTIO_QUEUE_READY: *value = vq != NULL ? vq->ready : 0; break;
+		case VIRTIO_STATUS: *value = dev->status; break;
+		case VIRTIO_CONFIG_GENERATION: *value = dev->config_generation; break;
+		default: *value = 0; break;
+	}
+
+	host_mutex_unlock(dev->lock);
+
+	return 1;
+}
+
+static int virtio_write(riscv_t* cpu, void* opaque, ui offset, int size, uint64_t value)
+{
+	virtio_t* dev = (virtio_t*)opaque;
+	virtq_t* vq;
+	uint32_t v = (uint32_t)value;
+
+	// Запись в область конфигурации не поддерживается
+	if (offset >= VIRTIO_CONFIG)
+		return 1;
+
+	if (size != 4 || (offset & 3))
+		return 0;
+
+	if (offset == VIRTIO_QUEUE_NOTIFY)
+	{
+		if (v < (uint32_t)dev->num_queues && dev->notify != NULL)
+			dev->notify(dev, v);
+		return 1;
+	}
+	if (offset == VIRTIO_INTERRUPT_ACK)
+	{
+		virtio_irq(dev, 0, v);
+		return 1;
+	}
+
+	host_mutex_lock(dev->lock);
+	vq = dev->queue_sel < (uint32_t)dev->num_queues ? &dev->queues[dev->queue_sel] : NULL;
+
+	switch (offset)
+	{
+		case VIRTIO_DEVICE_FEATURES_SEL: dev->features_sel = v; break;
+		case VIRTIO_DRIVER_FEATURES_SEL: dev->driver_features_sel = v; break;
+		case VIRTIO_DRIVER_FEATURES:
+			if (dev->driver_features_sel < 2)
+			{
+				dev->driver_features &= ~(0xFFFFFFFFull << (dev->driver_features_sel * 32));
+				dev->driver_features |= (uint64_t)v << (dev->driver_features_sel * 32);
+			}
+			break;
+		case VIRTIO_QUEUE_SEL: dev->queue_sel = v; break;
+		case VIRTIO_QUEUE_NUM:
+			if (vq != NULL && !vq->ready && v <= VIRTQ_MAX_SIZE)
+				vq->num = v;
+			break;
+		case VIRTIO_QUEUE_READY:
+			if (vq != NULL)
+			{
+				if (v & 1)
+					virtio_queue_ready(vq);
+				else
+					vq->ready = 0;
+			}
+			break;
+		case VIRTIO_QUEUE_DESC_LOW:
+			if (vq != NULL) vq->desc = (vq->desc & ~0xFFFFFFFFull) | v;
+			break;
+		case VIRTIO_QUEUE_DESC_HIGH:
+			if (vq != NULL) vq->desc = (vq->desc & 0xFFFFFFFFull) | ((uint64_t)v << 32);
+			break;
+		case VIRTIO_QUEUE_DRIVER_LOW:
+			if (vq != NULL) vq->avail = (vq->avail & ~0xFFFFFFFFull) | v;
+			break;
+		case VIRTIO_QUEUE_DRIVER_HIGH:
+			if (vq != NULL) vq->avail = (vq->avail & 0xFFFFFFFFull) | ((uint64_t)v << 32);
+			break;
+		case VIRTIO_QUEUE_DEVICE_LOW:
+			if (vq != NULL) vq->used = (vq->used & ~0xFFFFFFFFull) | v;
+			break;
+		case VIRTIO_QUEUE_DEVICE_HIGH:
+			if (vq != NULL) vq->used = (vq->used & 0xFFFFFFFFull) | ((uint64_t)v << 32);
+			break;
+		case VIRTIO_STATUS:
+			if (v == 0)
+			{
+				virtio_reset(dev);
+				break;
+			}
+			// Драйвер может принять только предложенные возможности
+			if ((v & VIRTIO_STATUS_FEATURES_OK) && (dev->driver_features & ~dev->features))
+				v &= ~VIRTIO_STATUS_FEATURES_OK;
+			dev->status = v;
+			break;
+	}
+
+	host_mutex_unlock(dev->lock);
+
+	return 1;
+}
+
+// Незанятое окно: код устройства 0
+static int virtio_empty_read(riscv_t* cpu, void* opaque, ui offset, int size, uint64_t* value)
+{
+	switch (offset)
+	{
+		case VIRTIO_MAGIC: *value = VIRTIO_MAGIC_VALUE; break;
+		case VIRTIO_VERSION: *value = 2; break;
+		case VIRTIO_VENDOR_ID: *value = VIRTIO_VENDOR_VALUE; break;
+		default: *value = 0; break;
+	}
+
+	return 1;
+}
+
+static int virtio_empty_write(riscv_t* cpu, void* opaque, ui offset, int size, uint64_t value)
+{
+	return 1;
+}
+
+// Подключение устройства к окну slot. Устройство само создаёт поток обработки запросов.
+// config - область конфигурации устройства (читается гостем под блокировкой устройства)
+int virtio_init(virtio_t* dev, int slot, uint32_t device_id, uint64_t features, int num_queues, void* config, int config_size)
+{
+	dev->slot = slot;
+	dev->device_id = device_id;
+	dev->features = features | (1ull << VIRTIO_F_VERSION_1) | (1ull << VIRTIO_F_EVENT_IDX);
+	dev->num_queues = num_queues;
+	dev->config = (uint8_t*)config;
+	dev->config_size = config_size;
+
+	dev->lock = host_mutex_create();
+	if (dev->lock == NULL)
+	{
+		printf("virtio: unable to create lock\n");
+		return 0;
+	}
+
+	if (!bus_map(VIRTIO_BASE + slot * VIRTIO_SIZE, VIRTIO_SIZE, virtio_read, virtio_write, dev))
+		return 0;
+
+	devices[slot] = dev;
+
+	return 1;
+}
+
+// Подключение незанятых окон (после подключения всех устройств)
+int virtio_map_empty(void)
+{
+	int i;
+
+	for (i = 0; i < VIRTIO_SLOTS; i++)
+		if (devices[i] == NULL && !bus_map(VIRTIO_BASE + i * VIRTIO_SIZE, VIRTIO_SIZE, virtio_empty_read, virtio_empty_write, NULL))
+			return 0;
+
+	return 1;
+}
+
+// Отключение всех устройств. Устройства с потоками остаются в памяти до выхода
+void virtio_done(void)
+{
+	memset(devices, 0, sizeof(devices));
+}
+
+// Подключено ли устройство к окну slot
+int virtio_present(int slot)
+{
+	return devices[slot] != NULL;
+}
+
+// Остановка обработки запросов всеми устройствами на время снимка: поток устройства
+// обрабатывает пачку запросов под блокировкой, поэтому после её захвата очереди и
+// память гостя не меняются
+void virtio_pause(void)
+{
+	int i;
+
+	for (i = 0; i < VIRTIO_SLOTS; i++)
+		if (devices[i] != NULL)
+			host_mutex_lock(devices[i]->lock);
+}
+
+void virtio_resume(void)
+{
+	int i;
+
+	for (i = VIRTIO_SLOTS - 1; i >= 0; i--)
+		if (devices[i] != NULL)
+			host_mutex_unlock(devices[i]->lock);
+}
+
+// Продолжение работы в процессе, порождённом fork, после virtio_pause: потоков устройств
+// в нём нет, они запускаются заново
+int virtio_fork(void)
+{
+	int i;
+
+	for (i = 0; i < VIRTIO_SLOTS; i++)
+	{
+		if (devices[i] != NULL && devices[i]->fork != NULL && !devices[i]->fork(devices[i]))
+		{
+			printf("virtio: unable to restart device thread\n");
+			return 0;
+		}
+	}
+	virtio_resume();
+
+	return 1;
+}
+
+// Сохранение состояния транспорта и очередей (между virtio_pause и virtio_resume)
+void virtio_save(snap_t* s)
+{
+	virtio_t* dev;
+	virtq_t* vq;
+	uint32_t id;
+	int i, q;
+
+	for (i = 0; i < VIRTIO_SLOTS; i++)
+	{
+		dev = devices[i];
+		id = dev != NULL ? dev->device_id : 0;
+		snap_put(s, &id, sizeof(id));
+		if (dev == NULL)
+			continue;
+
+		snap_put(s, &dev->driver_features, sizeof(dev->driver_features));
+		snap_put(s, &dev->features_sel, sizeof(dev->features_sel));
+		snap_put(s, &dev->driver_features_sel, sizeof(dev->driver_features_sel));
+		snap_put(s, &dev->queue_sel, sizeof(dev->queue_sel));
+		snap_put(s, &dev->status, sizeof(dev->status));
+		snap_put(s, &dev->config_generation, sizeof(dev->config_generation));
+		snap_put(s, &dev->irq_status, sizeof(dev->irq_status));
+		for (q = 0; q < dev->num_queues; q++)
+		{
+			vq = &dev->queues[q];
+			snap_put(s, &vq->num, sizeof(vq->num));
+			snap_put(s, &vq->ready, sizeof(vq->ready));
+			snap_put(s, &vq->desc, sizeof(vq->desc));
+			snap_put(s, &vq->avail, sizeof(vq->avail));
+			snap_put(s, &vq->used, sizeof(vq->used));
+			snap_put(s, &vq->last_avail, sizeof(vq->last_avail));
+			snap_put(s, &vq->used_idx, sizeof(vq->used_idx));
+			snap_put(s, &vq->signalled_used, sizeof(vq->signalled_used));
+		}
+	}
+}
+
+// Восстановление состояния (до запуска процессоров). Устройство, которое было у сохранённой
+// машины, должно быть подключено и сейчас. Лишнее устройство допустимо: гость его не видел
+int virtio_load(snap_t* s)
+{
+	virtio_t* dev;
+	virtq_t* vq;
+	uint32_t id;
+	int i, q;
+
+	for (i = 0; i < VIRTIO_SLOTS; i++)
+	{
+		snap_get(s, &id, sizeof(id));
+		if (s->error)
+			return 0;
+		if (id == 0)
+			continue;
+		dev = devices[i];
+		if (dev == NULL || dev->device_id != id)
+		{
+			printf("Snapshot: virtio device %u is not attached\n", id);
+			return 0;
+		}
+
+		host_mutex_lock(dev->lock);
+		snap_get(s, &dev->driver_features, sizeof(dev->driver_features));
+		snap_get(s, &dev->features_sel, sizeof(dev->features_sel));
+		snap_get(s, &dev->driver_features_sel, sizeof(dev->driver_features_sel));
+		snap_get(s, &dev->queue_sel, sizeof(dev->queue_sel));
+		snap_get(s, &dev->status, sizeof(dev->status));
+		snap_get(s, &dev->config_generation, sizeof(dev->config_generation));
+		snap_get(s, &dev->irq_status, sizeof(dev->irq_status));
+		for (q = 0; q < dev->num_queues; q++)
+		{
+			vq = &dev->queues[q];
+			snap_get(s, &vq->num, sizeof(vq->num));
+			snap_get(s, &vq->ready, sizeof(vq->ready));
+			snap_get(s, &vq->desc, sizeof(vq->desc));
+			snap_get(s, &vq->avail, sizeof(vq->avail));
+			snap_get(s, &vq->used, sizeof(vq->used));
+			snap_get(s, &vq->last_avail, sizeof(vq->last_avail));
+			snap_get(s, &vq->used_idx, sizeof(vq->used_idx));
+			snap_get(s, &vq->signalled_used, sizeof(vq->signalled_used));
+			if (vq->num > VIRTQ_MAX_SIZE)
+				s->error = 1;
+			else if (vq->ready)
+				virtio_queue_ready(vq);
+		}
+		host_mutex_unlock(dev->lock);
+		if (s->error)
+			return 0;
+
+		// Запросы, пришедшие до сохранения, но ещё не обработанные
+		for (q = 0; q < dev->num_queues; q++)
+			if (dev->queues[q].ready && dev->notify != NULL)
+				dev->notify(dev, q);
+	}
+
+	return 1;
+}
+
+// Получить следующий запрос из очереди (вызывается под блокировкой).
+// Возвращает 0, если очередь пуста
+int virtio_pop(virtio_t* dev, int queue, virtq_req_t* req)
+{
+	virtq_t* vq = &dev->queues[queue];
+	uint8_t* d;
+	uint8_t* p;
+	uint64_t addr;
+	uint32_t len;
+	uint16_t flags, i;
+	int n;
+
+	if (!vq->ready)
+		return 0;
+
+	for (;;)
+	{
+		if (vq->last_avail == vq->avail_ptr[1])
+		{
+			if (!(dev->driver_features & (1ull << VIRTIO_F_EVENT_IDX)))
+				return 0;
+
+			// Попросить драйвер уведомить о следующем запросе и проверить,
+			// не успел ли он добавить запрос до этого
+			*(volatile uint16_t*)&vq->used_ptr[4 + 8 * vq->num] = vq->last_avail;
+			ram_dirty_range(&vq->used_ptr[4 + 8 * vq->num], 2);
+			atomic_fence();
+			if (vq->last_avail == vq->avail_ptr[1])
+				return 0;
+		}
+
+		// Элементы кольца читаются после его счётчика
+		atomic_fence();
+		req->head = vq->avail_ptr[2 + vq->last_avail % vq->num];
+		vq->last_avail++;
+
+		req->out_count = 0;
+		req->in_count = 0;
+		req->out_size = 0;
+		req->in_size = 0;
+
+		// Разобрать цепочку дескрипторов
+		i = req->head;
+		for (n = 0; n < (int)vq->num && i < vq->num; n++)
+		{
+			d = &vq->desc_ptr[16 * i];
+			addr = *(uint64_t*)&d[0];
+			len = *(uint32_t*)&d[8];
+			flags = *(uint16_t*)&d[12];
+
+			p = virtio_ram(addr, len);
+			if (p == NULL)
+				break;
+
+			if (flags & VIRTQ_DESC_F_WRITE)
+			{
+				if (req->in_count >= VIRTQ_MAX_IOV)
+					break;
+				req->in[req->in_count].base = p;
+				req->in[req->in_count].size = len;
+				req->in_count++;
+				req->in_size += len;
+			}
+			else
+			{
+				// Буферы для чтения устройством идут перед буферами для записи
+				if (req->in_count > 0 || req->out_count >= VIRTQ_MAX_IOV)
+					break;
+				req->out[req->out_count].base = p;
+				req->out[req->out_count].size = len;
+				req->out_count++;
+				req->out_size += len;
+			}
+
+			if (!(flags & VIRTQ_DESC_F_NEXT))
+				return 1;
+			i = *(uint16_t*)&d[14];
+		}
+
+		// Ошибка в цепочке: вернуть её драйверу без данных и взять следующую
+		printf("virtio: bad descriptor chain in queue %d\n", queue);
+		virtio_push(dev, queue, req, 0);
+	}
+}
+
+// Вернуть обработанный запрос драйверу, len - количество записанных устройством байт
+void virtio_push(virtio_t* dev, int queue, const virtq_req_t* req, uint32_t len)
+{
+	virtq_t* vq = &dev->queues[queue];
+	uint8_t* e = &vq->used_ptr[4 + 8 * (vq->used_idx % vq->num)];
+	int i;
+
+	// Буферы для записи отмечаются изменёнными целиком, независимо от len
+	for (i = 0; i < req->in_count; i++)
+		ram_dirty_range(req->in[i].base, req->in[i].size);
+	ram_dirty_range(vq->used_ptr, 4);
+	ram_dirty_range(e, 8);
+
+	*(uint32_t*)&e[0] = req->head;
+	*(uint32_t*)&e[4] = len;
+
+	// Данные и элемент кольца должны быть видны до нового значения счётчика
+	atomic_fence();
+	vq->used_idx++;
+	*(volatile uint16_t*)&vq->used_ptr[2] = vq->used_idx;
+
+	if (req->in_size > 0)
+		dcache_dma_write();
+}
+
+// Прерывание после обработки пачки запросов, если драйвер его ждёт.
+// С VIRTIO_F_EVENT_IDX драйвер указывает, после какого запроса нужно прерывание
+void virtio_interrupt(virtio_t* dev, int queue)
+{
+	virtq_t* vq = &dev->queues[queue];
+	uint16_t old = vq->signalled_used;
+	uint16_t event;
+
+	if (!vq->ready || old == vq->used_idx)
+		return;
+	vq->signalled_used = vq->used_idx;
+
+	// Счётчик used должен быть записан до чтения условия прерывания
+	atomic_fence();
+	if (dev->driver_features & (1ull << VIRTIO_F_EVENT_IDX))
+	{
+		event = vq->avail_ptr[2 + vq->num];
+		if ((uint16_t)(vq->used_idx - event - 1) >= (uint16_t)(vq->used_idx - old))
+			return;
+	}
+	else if (vq->avail_ptr[0] & VIRTQ_AVAIL_F_NO_INTERRUPT)
+		return;
+
+	virtio_irq(dev, VIRTIO_INT_USED, 0);
+}
+
+// Копирование size байт с позиции offset из буферов запроса для чтения устройством.
+// Возвращает количество скопированных байт
+uint32_t virtio_copy_out(const virtq_req_t* req, uint32_t offset, void* buf, uint32_t size)
+{
+	uint32_t done = 0, n;
+	int i;
+
+	for (i = 0; i < req->out_count && done < size; i++)
+	{
+		if (offset >= req->out[i].size)
+		{
+			offset -= (uint32_t)req->out[i].size;
+			continue;
+		}
+		n = (uint32_t)req->out[i].size - offset;
+		if (n > size - done)
+			n = size - done;
+		memcpy((uint8_t*)buf + done, (uint8_t*)req->out[i].base + offset, n);
+		done += n;
+		offset = 0;
+	}
+
+	return done;
+}
+
+// Копирование size байт в буферы запроса для записи устройством с позиции offset.
+// Возвращает количество скопированных байт
+uint32_t virtio_copy_in(const virtq_req_t* req, uint32_t offset, const void* buf, uint32_t size)
+{
+	uint32_t done = 0, n;
+	int i;
+
+	for (i = 0; i < req->in_count && done < size; i++)
+	{
+		if (offset >= req->in[i].size)
+		{
+			offset -= (uint32_t)req->in[i].size;
+			continue;
+		}
+		n = (uint32_t)req->in[i].size - offset;
+		if (n > size - done)
+			n = size - done;
+		memcpy((uint8_t*)req->in[i].base + offset, (const uint8_t*)buf + done, n);
+		done += n;
+		offset = 0;
+	}
+
+	return done;
+}
+
+// Часть [offset, offset + size) списка буферов iov в виде нового списка out.
+// Возвращает количество буферов в out
+int virtio_slice(const host_iov_t* iov, int count, uint32_t offset, uint32_t size, host_iov_t* out)
+{
+	size_t n;
+	int i, k = 0;
+
+	for (i = 0; i < count && size > 0; i++)
+	{
+		if (offset >= iov[i].size)
+		{
+			offset -= (uint32_t)iov[i].size;
+			continue;
+		}
+		n = iov[i].size - offset;
+		if (n > size)
+			n = size;
+		out[k].base = (uint8_t*)iov[i].base + offset;
+		out[k].size = n;
+		k++;
+		size -= (uint32_t)n;
+		offset = 0;
+	}
+
+	return k;
+}
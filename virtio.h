@@ -0,0 +1,128 @@
+#pragma once
+
+#include "riscv.h"
+#include "platform.h"
+
+// Устройства virtio-mmio (версия 2)
+//
+// Каждое устройство занимает окно VIRTIO_SIZE байт на шине и прерывание PLIC.
+// Окна закреплены за типами устройств, чтобы описание оборудования в linux/*.dts
+// не зависело от того, какие устройства подключены. Незанятое окно отвечает
+// кодом устройства 0, и Linux его пропускает.
+
+#define VIRTIO_BASE					0x10001000u
+#define VIRTIO_SIZE					0x1000
+// Прерывание окна n - VIRTIO_IRQ + n
+#define VIRTIO_IRQ					1
+
+// Окна устройств
+#define VIRTIO_SLOT_BLK				0
+#define VIRTIO_SLOT_NET				1
+#define VIRTIO_SLOT_CONSOLE			2
+#define VIRTIO_SLOTS				3
+
+// Коды устройств
+#define VIRTIO_ID_NET				1
+#define VIRTIO_ID_BLOCK				2
+#define VIRTIO_ID_CONSOLE			3
+
+// Биты возможностей, общие для всех устройств
+#define VIRTIO_F_EVENT_IDX			29
+#define VIRTIO_F_VERSION_1			32
+
+// Максимальное количество очередей у устройства и их размер
+#define VIRTIO_MAX_QUEUES			2
+#define VIRTQ_MAX_SIZE				256
+// Максимальное количество дескрипторов в одном запросе
+#define VIRTQ_MAX_IOV				130
+
+// Очередь (split virtqueue) в памяти гостя
+typedef struct
+{
+	uint32_t num;
+	uint32_t ready;
+	// Физические адреса таблицы дескрипторов и колец драйвера (avail) и устройства (used)
+	uint64_t desc;
+	uint64_t avail;
+	uint64_t used;
+	// Те же области в памяти хоста (после включения очереди)
+	uint8_t* desc_ptr;
+	volatile uint16_t* avail_ptr;
+	uint8_t* used_ptr;
+	// Следующий необработанный элемент кольца avail
+	uint16_t last_avail;
+	// Счётчик кольца used и его значение при последнем прерывании
+	uint16_t used_idx;
+	uint16_t signalled_used;
+} virtq_t;
+
+// Запрос драйвера: цепочка дескрипторов, разобранная на буферы для чтения устройством
+// (out) и для записи устройством (in), указатели - в памяти хоста
+typedef struct
+{
+	uint16_t head;
+	int out_count;
+	int in_count;
+	uint32_t out_size;
+	uint32_t in_size;
+	host_iov_t out[VIRTQ_MAX_IOV];
+	host_iov_t in[VIRTQ_MAX_IOV];
+} virtq_req_t;
+
+typedef struct virtio_s virtio_t;
+
+struct virtio_s
+{
+	int slot;
+	uint32_t device_id;
+	// Возможности устройства и принятые драйвером
+	uint64_t features;
+	uint64_t driver_features;
+	uint32_t features_sel;
+	uint32_t driver_features_sel;
+	uint32_t queue_sel;
+	uint32_t status;
+	uint32_t config_generation;
+	// Причины прерывания (1 - обновлена очередь, 2 - изменена конфигурация)
+	// и блокировка для их изменения вместе с сигналом PLIC
+	int irq_status;
+	volatile int irq_lock;
+
+	int num_queues;
+	virtq_t queues[VIRTIO_MAX_QUEUES];
+
+	// Область конфигурации, специфичная для устройства
+	uint8_t* config;
+	int config_size;
+
+	// Блокировка регистров и очередей (обращения процессоров и поток устройства)
+	host_mutex_t* lock;
+
+	// Драйвер сообщил о новых запросах в очереди (вызывается без блокировки)
+	void (*notify)(virtio_t* dev, int queue);
+	// Сброс устройства драйвером (вызывается под блокировкой)
+	void (*reset)(virtio_t* dev);
+	// Запуск потока устройства заново в процессе, порождённом fork (см. forkserver.c)
+	int (*fork)(virtio_t* dev);
+};
+
+int virtio_init(virtio_t* dev, int slot, uint32_t device_id, uint64_t features, int num_queues, void* config, int config_size);
+int virtio_map_empty(void);
+void virtio_done(void);
+int virtio_present(int slot);
+void virtio_pause(void);
+void virtio_resume(void);
+int virtio_fork(void);
+int virtio_pop(virtio_t* dev, int queue, virtq_req_t* req);
+void virtio_push(virtio_t* dev, int queue, const virtq_req_t* req, uint32_t len);
+void virtio_interrupt(virtio_t* dev, int queue);
+uint32_t virtio_copy_out(const virtq_req_t* req, uint32_t offset, void* buf, uint32_t size);
+uint32_t virtio_copy_in(const virtq_req_t* req, uint32_t offset, const void* buf, uint32_t size);
+int virtio_slice(const host_iov_t* iov, int count, uint32_t offset, uint32_t size, host_iov_t* out);
+
+// Блочное устройство
+int virtio_blk_init(const char* file, const char* base, int readonly);
+// Сетевой адаптер
+int virtio_net_init(const char* spec);
+// Консоль
+int virtio_console_init(void);
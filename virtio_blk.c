@@ -0,0 +1,195 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "virtio.h"
+#include "disk.h"
+
+// Блочное устройство virtio-blk
+//
+// Диск - файл образа на хосте или оверлей над общим образом (см. disk.h). Запросы обрабатывает отдельный поток: процессор
+// только будит его (QueueNotify) и продолжает работу, а поток переносит данные между
+// файлом и памятью гостя одним вызовом preadv/pwritev на запрос. Все запросы,
+// накопившиеся в очереди, обрабатываются за одно пробуждение, и по окончании
+// пачки выдаётся одно прерывание.
+
+// Возможности
+#define VIRTIO_BLK_F_SEG_MAX		2
+#define VIRTIO_BLK_F_RO				5
+#define VIRTIO_BLK_F_FLUSH			9
+
+// Типы запросов
+#define VIRTIO_BLK_T_IN				0
+#define VIRTIO_BLK_T_OUT			1
+#define VIRTIO_BLK_T_FLUSH			4
+#define VIRTIO_BLK_T_GET_ID			8
+
+// Результат запроса
+#define VIRTIO_BLK_S_OK				0
+#define VIRTIO_BLK_S_IOERR			1
+#define VIRTIO_BLK_S_UNSUPP			2
+
+#define SECTOR_SIZE					512
+// Заголовок запроса: тип, резерв, номер сектора
+#define BLK_HEADER_SIZE				16
+// Длина строки идентификатора диска
+#define BLK_ID_SIZE					20
+
+// Интервал, через который поток проверяет очередь без уведомления, нс
+#define BLK_WAIT_NS					1000000000ll
+
+typedef struct
+{
+	virtio_t dev;
+	disk_t* disk;
+	int readonly;
+	uint64_t size;
+	host_wait_t* wait;
+	// Конфигурация: количество секторов (8 байт), size_max (4), seg_max (4)
+	uint8_t config[16];
+	virtq_req_t req;
+	host_iov_t data[VIRTQ_MAX_IOV];
+} blk_t;
+
+// Выполнение одного запроса, возвращает количество байт, записанных в память гостя
+static uint32_t blk_request(blk_t* b, virtq_req_t* req)
+{
+	uint8_t header[BLK_HEADER_SIZE];
+	uint8_t status = VIRTIO_BLK_S_OK;
+	uint8_t* status_ptr;
+	uint32_t type, length, written = 0;
+	uint64_t sector;
+	int count;
+
+	// Последний байт буферов для записи - результат
+	if (virtio_copy_out(req, 0, header, BLK_HEADER_SIZE) != BLK_HEADER_SIZE || req->in_size < 1)
+		return 0;
+	status_ptr = (uint8_t*)req->in[req->in_count - 1].base + req->in[req->in_count - 1].size - 1;
+
+	memcpy(&type, &header[0], 4);
+	memcpy(&sector, &header[8], 8);
+
+	switch (type)
+	{
+		case VIRTIO_BLK_T_IN:
+			length = req->in_size - 1;
+			count = virtio_slice(req->in, req->in_count, 0, length, b->data);
+			if (sector > b->size / SECTOR_SIZE || length > b->size - sector * SECTOR_SIZE)
+				status = VIRTIO_BLK_S_IOERR;
+			else if (!disk_read(b->disk, b->data, count, sector * SECTOR_SIZE))
+				status = VIRTIO_BLK_S_IOERR;
+			else
+				written = length;
+			break;
+		case VIRTIO_BLK_T_OUT:
+			length = req->out_size - BLK_HEADER_SIZE;
+			count = virtio_slice(req->out, req->out_count, BLK_HEADER_SIZE, length, b->data);
+			if (b->readonly)
+				status = VIRTIO_BLK_S_IOERR;
+			else if (sector > b->size / SECTOR_SIZE || length > b->size - sector * SECTOR_SIZE)
+				status = VIRTIO_BLK_S_IOERR;
+			else if (!disk_write(b->disk, b->data, count, sector * SECTOR_SIZE))
+				status = VIRTIO_BLK_S_IOERR;
+			break;
+		case VIRTIO_BLK_T_FLUSH:
+			if (!b->readonly && !disk_flush(b->disk))
+				status = VIRTIO_BLK_S_IOERR;
+			break;
+		case VIRTIO_BLK_T_GET_ID:
+			length = req->in_size - 1;
+			if (length > BLK_ID_SIZE)
+				length = BLK_ID_SIZE;
+			count = virtio_slice(req->in, req->in_count, 0, length, b->data);
+			if (count > 0)
+			{
+				// Строка помещается в первый буфер (драйвер выделяет 20 байт)
+				memset(b->data[0].base, 0, b->data[0].size);
+				strncpy((char*)b->data[0].base, "dimmu-riscv", b->data[0].size);
+				written = length;
+			}
+			break;
+		default:
+			status = VIRTIO_BLK_S_UNSUPP;
+			break;
+	}
+
+	*status_ptr = status;
+
+	return written + 1;
+}
+
+// Поток обработки запросов
+static void blk_thread(void* arg)
+{
+	blk_t* b = (blk_t*)arg;
+
+	for (;;)
+	{
+		host_wait(b->wait, host_time_ns() + BLK_WAIT_NS, 0);
+
+		host_mutex_lock(b->dev.lock);
+		while (virtio_pop(&b->dev, 0, &b->req))
+			virtio_push(&b->dev, 0, &b->req, blk_request(b, &b->req));
+		virtio_interrupt(&b->dev, 0);
+		host_mutex_unlock(b->dev.lock);
+	}
+}
+
+// Уведомление от драйвера: разбудить поток
+static void blk_notify(virtio_t* dev, int queue)
+{
+	host_wake(((blk_t*)dev)->wait);
+}
+
+// Запуск потока в процессе, порождённом fork
+static int blk_fork(virtio_t* dev)
+{
+	return host_thread_start(blk_thread, dev);
+}
+
+// Подключение диска из файла образа. Если задан base, то file - оверлей над образом base
+int virtio_blk_init(const char* file, const char* base, int readonly)
+{
+	blk_t* b = (blk_t*)calloc(1, sizeof(blk_t));
+	uint64_t size;
+	uint32_t seg_max = VIRTQ_MAX_IOV - 2;
+
+	if (b == NULL)
+	{
+		printf("Disk: out of memory\n");
+		return 0;
+	}
+
+	b->readonly = readonly;
+	b->disk = disk_open(file, base, readonly);
+	if (b->disk == NULL)
+		return 0;
+
+	size = disk_size(b->disk);
+	if (size < SECTOR_SIZE)
+	{
+		printf("\"%s\": disk image is too small\n", file);
+		return 0;
+	}
+	b->size = size & ~(uint64_t)(SECTOR_SIZE - 1);
+
+	// Конфигурация: размер в секторах и максимальное количество буферов данных в запросе
+	size = b->size / SECTOR_SIZE;
+	memcpy(&b->config[0], &size, 8);
+	memcpy(&b->config[12], &seg_max, 4);
+
+	b->dev.notify = blk_notify;
+	b->dev.fork = blk_fork;
+	if (!virtio_init(&b->dev, VIRTIO_SLOT_BLK, VIRTIO_ID_BLOCK,
+		(1ull << VIRTIO_BLK_F_SEG_MAX) | (1ull << VIRTIO_BLK_F_FLUSH) | (readonly ? 1ull << VIRTIO_BLK_F_RO : 0),
+		1, b->config, sizeof(b->config)))
+		return 0;
+
+	b->wait = host_wait_create();
+	if (b->wait == NULL || !host_thread_start(blk_thread, b))
+	{
+		printf("Disk: unable to create I/O thread\n");
+		return 0;
+	}
+
+	return 1;
+}
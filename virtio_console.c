@@ -0,0 +1,98 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include "virtio.h"
+#include "console.h"
+
+// Консоль virtio-console (hvc)
+//
+// В отличие от SBI, где каждый символ - отдельный выход из гостя, драйвер передаёт
+// через очередь целые буферы. Вывод обрабатывается сразу при уведомлении (копирование
+// в буфер консоли, без системных вызовов), а ввод поток консоли передаёт в буферы
+// очереди приёма по мере поступления.
+
+// Очереди
+#define VCON_RX						0
+#define VCON_TX						1
+
+typedef struct
+{
+	virtio_t dev;
+	virtq_req_t req;
+} vcon_t;
+
+// Передача накопленного ввода в буферы очереди приёма (вызывается под блокировкой)
+static void vcon_rx(vcon_t* c)
+{
+	uint32_t len;
+	int i, n;
+
+	while (console_pending() > 0 && virtio_pop(&c->dev, VCON_RX, &c->req))
+	{
+		len = 0;
+		for (i = 0; i < c->req.in_count; i++)
+		{
+			n = console_read(c->req.in[i].base, (int)c->req.in[i].size);
+			len += n;
+			if (n < (int)c->req.in[i].size)
+				break;
+		}
+		virtio_push(&c->dev, VCON_RX, &c->req, len);
+	}
+	virtio_interrupt(&c->dev, VCON_RX);
+}
+
+// Вывод всех буферов очереди передачи (вызывается под блокировкой)
+static void vcon_tx(vcon_t* c)
+{
+	int i;
+
+	while (virtio_pop(&c->dev, VCON_TX, &c->req))
+	{
+		for (i = 0; i < c->req.out_count; i++)
+			console_write(c->req.out[i].base, (int)c->req.out[i].size);
+		virtio_push(&c->dev, VCON_TX, &c->req, 0);
+	}
+	virtio_interrupt(&c->dev, VCON_TX);
+}
+
+// Уведомление от драйвера: вывод или новые буферы для ввода
+static void vcon_notify(virtio_t* dev, int queue)
+{
+	vcon_t* c = (vcon_t*)dev;
+
+	host_mutex_lock(dev->lock);
+	if (queue == VCON_TX)
+		vcon_tx(c);
+	else
+		vcon_rx(c);
+	host_mutex_unlock(dev->lock);
+}
+
+// Появился ввод с консоли (вызывается потоком консоли)
+static void vcon_input(void* arg)
+{
+	vcon_t* c = (vcon_t*)arg;
+
+	host_mutex_lock(c->dev.lock);
+	vcon_rx(c);
+	host_mutex_unlock(c->dev.lock);
+}
+
+int virtio_console_init(void)
+{
+	vcon_t* c = (vcon_t*)calloc(1, sizeof(vcon_t));
+
+	if (c == NULL)
+	{
+		printf("Console: out of memory\n");
+		return 0;
+	}
+
+	c->dev.notify = vcon_notify;
+	if (!virtio_init(&c->dev, VIRTIO_SLOT_CONSOLE, VIRTIO_ID_CONSOLE, 0, 2, NULL, 0))
+		return 0;
+
+	console_set_input(vcon_input, c);
+
+	return 1;
+}
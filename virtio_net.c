@@ -0,0 +1,155 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "virtio.h"
+
+// Сетевой адаптер virtio-net
+//
+// Кадры Ethernet передаются через интерфейс tap хоста или дейтаграммный сокет, которым
+// можно соединить две машины без внешних программ (см. host_net_open). Очереди
+// обслуживает отдельный поток: за одно пробуждение он отправляет все кадры из очереди
+// передачи и принимает все кадры, для которых есть буферы, и выдаёт не больше одного
+// прерывания на очередь. С VIRTIO_F_EVENT_IDX драйвер и устройство сообщают друг другу
+// только о первом запросе пачки, так что скорость не ограничена одним выходом из
+// гостя на кадр.
+
+// Возможности
+#define VIRTIO_NET_F_MAC			5
+
+// Очереди
+#define NET_RX						0
+#define NET_TX						1
+
+// Заголовок virtio_net_hdr перед каждым кадром (с VIRTIO_F_VERSION_1 - 12 байт)
+#define NET_HDR_SIZE				12
+// Наибольший кадр, который можно принять (предел дейтаграммы)
+#define NET_MAX_PACKET				65536
+
+typedef struct
+{
+	virtio_t dev;
+	host_net_t* net;
+	// Конфигурация: MAC-адрес
+	uint8_t config[6];
+	virtq_req_t req;
+	host_iov_t frame[VIRTQ_MAX_IOV];
+	// Принятый кадр, для которого ещё нет буфера в очереди приёма
+	int pending;
+	uint8_t packet[NET_MAX_PACKET];
+} net_t;
+
+// Отправка всех кадров из очереди передачи
+static void net_tx(net_t* n)
+{
+	int count;
+
+	while (virtio_pop(&n->dev, NET_TX, &n->req))
+	{
+		if (n->req.out_size > NET_HDR_SIZE)
+		{
+			count = virtio_slice(n->req.out, n->req.out_count, NET_HDR_SIZE, n->req.out_size - NET_HDR_SIZE, n->frame);
+			host_net_send(n->net, n->frame, count);
+		}
+		virtio_push(&n->dev, NET_TX, &n->req, 0);
+	}
+	virtio_interrupt(&n->dev, NET_TX);
+}
+
+// Приём кадров, пока они есть и есть буферы в очереди приёма
+static void net_rx(net_t* n)
+{
+	uint8_t header[NET_HDR_SIZE];
+	uint16_t buffers = 1;
+	uint32_t len;
+
+	memset(header, 0, sizeof(header));
+	memcpy(&header[10], &buffers, 2);
+
+	for (;;)
+	{
+		if (n->pending == 0)
+			n->pending = host_net_recv(n->net, n->packet, sizeof(n->packet));
+		if (n->pending == 0 || !virtio_pop(&n->dev, NET_RX, &n->req))
+			break;
+
+		// Кадр, не помещающийся в буфер, теряется
+		len = 0;
+		if (n->req.in_size >= NET_HDR_SIZE + (uint32_t)n->pending)
+		{
+			virtio_copy_in(&n->req, 0, header, NET_HDR_SIZE);
+			virtio_copy_in(&n->req, NET_HDR_SIZE, n->packet, n->pending);
+			len = NET_HDR_SIZE + n->pending;
+		}
+		virtio_push(&n->dev, NET_RX, &n->req, len);
+		n->pending = 0;
+	}
+	virtio_interrupt(&n->dev, NET_RX);
+}
+
+// Поток обработки очередей
+static void net_thread(void* arg)
+{
+	net_t* n = (net_t*)arg;
+
+	for (;;)
+	{
+		// Пока принятый кадр некуда положить, новые кадры не ждать: поток разбудит
+		// уведомление драйвера о новых буферах
+		host_net_wait(n->net, n->pending == 0);
+
+		host_mutex_lock(n->dev.lock);
+		net_tx(n);
+		net_rx(n);
+		host_mutex_unlock(n->dev.lock);
+	}
+}
+
+// Уведомление от драйвера: разбудить поток
+static void net_notify(virtio_t* dev, int queue)
+{
+	host_net_wake(((net_t*)dev)->net);
+}
+
+// Подключение сетевого адаптера. spec - "tap:имя" или "unix:свой_путь:путь_другой_стороны"
+int virtio_net_init(const char* spec)
+{
+	net_t* n = (net_t*)calloc(1, sizeof(net_t));
+	uint32_t hash = 2166136261u;
+	const char* p;
+
+	if (n == NULL)
+	{
+		printf("Network: out of memory\n");
+		return 0;
+	}
+
+	n->net = host_net_open(spec);
+	if (n->net == NULL)
+	{
+		printf("\"%s\": unable to open network interface\n", spec);
+		return 0;
+	}
+
+	// Локально администрируемый MAC-адрес, зависящий от интерфейса, чтобы у машин,
+	// соединённых сокетами, адреса различались
+	for (p = spec; *p; p++)
+		hash = (hash ^ (uint8_t)*p) * 16777619u;
+	n->config[0] = 0x52;
+	n->config[1] = 0x54;
+	n->config[2] = 0x00;
+	n->config[3] = (uint8_t)(hash >> 16);
+	n->config[4] = (uint8_t)(hash >> 8);
+	n->config[5] = (uint8_t)hash;
+
+	n->dev.notify = net_notify;
+	if (!virtio_init(&n->dev, VIRTIO_SLOT_NET, VIRTIO_ID_NET, 1ull << VIRTIO_NET_F_MAC, 2, n->config, sizeof(n->config)))
+		return 0;
+
+	if (!host_thread_start(net_thread, n))
+	{
+		printf("Network: unable to create thread\n");
+		return 0;
+	}
+
+	return 1;
+}